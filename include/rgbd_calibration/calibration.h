@@ -29,18 +29,71 @@
 #ifndef RGBD_CALIBRATION_CALIBRATION_H_
 #define RGBD_CALIBRATION_CALIBRATION_H_
 
+#include <omp.h>
+
+#include <ceres/types.h>
+
 #include <calibration_common/pinhole/sensor.h>
 
 #include <kinect/depth/sensor.h>
 
 #include <rgbd_calibration/depth_undistortion_estimation.h>
 #include <rgbd_calibration/publisher.h>
+#include <rgbd_calibration/debug_capture.h>
 #include <rgbd_calibration/checkerboard_views.h>
+#include <rgbd_calibration/checkerboard_cache.h>
+#include <rgbd_calibration/cloud_downsampler.h>
 #include <rgbd_calibration/plane_based_extrinsic_calibration.h>
 
 namespace calibration
 {
 
+class CheckerboardViewsExtraction;
+
+/*
+ * Ceres settings of the joint optimization (optimizeAll()). With eliminate_views and a Schur solver the checkerboard
+ * poses are eliminated first, so the reduced system only has the shared blocks: color pose, global model and delta.
+ * num_threads defaults to the OpenMP thread count, i.e. OMP_NUM_THREADS when set.
+ */
+struct OptimizationOptions
+{
+  OptimizationOptions ()
+    : linear_solver(ceres::SPARSE_SCHUR),
+      preconditioner(ceres::SCHUR_JACOBI),
+      num_threads(omp_get_max_threads()),
+      max_iterations(20),
+      eliminate_views(true)
+  {
+    // Do nothing
+  }
+
+  ceres::LinearSolverType linear_solver;
+  ceres::PreconditionerType preconditioner; // Only used by ITERATIVE_SCHUR and CGNR
+  int num_threads;
+  int max_iterations;
+  bool eliminate_views;
+};
+
+/*
+ * Coarse-to-fine schedule of perform() and optimize(). The first level runs the whole calibration on frames downsampled
+ * by ratios[0], with the bin size of the local model in level pixels, i.e. few large bins. Every following level starts
+ * from the models of the previous one, upsampled to its resolution: it refines the local model on its planes
+ * (DepthUndistortionEstimation::refineLocalModel()) and runs the joint optimization, both for refine_iterations. Ratios
+ * are w.r.t. the frames given to addData(), decreasing, each one a multiple of the next, down to 1. Less than two
+ * ratios means a single level.
+ */
+struct PyramidOptions
+{
+  PyramidOptions ()
+    : refine_iterations(5)
+  {
+    // Do nothing
+  }
+
+  std::vector<int> ratios;
+  int refine_iterations;
+};
+
 class Calibration
 {
 public:
@@ -48,6 +101,18 @@ public:
   typedef boost::shared_ptr<Calibration> Ptr;
   typedef boost::shared_ptr<const Calibration> ConstPtr;
 
+  Calibration ()
+    : estimate_depth_und_model_(false),
+      estimate_initial_trasform_(false),
+      warm_start_(false),
+      global_sample_budget_(0),
+      num_threads_(omp_get_max_threads()),
+      streaming_pose_views_needed_(10),
+      streaming_views_(0)
+  {
+    // Do nothing
+  }
+
   inline void
   setColorSensor (const PinholeSensor::Ptr & color_sensor)
   {
@@ -58,12 +123,7 @@ public:
   setDepthSensor (const KinectDepthSensor<UndistortionModel>::Ptr & depth_sensor)
   {
     depth_sensor_ = depth_sensor;
-
-    depth_intrinsics_.resize(4);
-    depth_intrinsics_[0] = depth_sensor->cameraModel()->intrinsicMatrix()(0, 0);
-    depth_intrinsics_[1] = depth_sensor->cameraModel()->intrinsicMatrix()(1, 1);
-    depth_intrinsics_[2] = depth_sensor->cameraModel()->intrinsicMatrix()(0, 2);
-    depth_intrinsics_[3] = depth_sensor->cameraModel()->intrinsicMatrix()(1, 2);
+    updateDepthIntrinsics_();
   }
 
   const std::vector<double> &
@@ -84,17 +144,78 @@ public:
     publisher_ = publisher;
   }
 
+  // Intermediate clouds and samples of perform() and optimize(), none if debug_capture is null.
+  // Set before initDepthUndistortionModel().
+  inline void
+  setDebugCapture (const DebugCapture::Ptr & debug_capture)
+  {
+    debug_capture_ = debug_capture;
+  }
+
+  inline void
+  setCheckerboardCache (const CheckerboardCache::Ptr & cb_cache)
+  {
+    cb_cache_ = cb_cache;
+  }
+
   inline void
   setDownSampleRatio (int ratio)
   {
-    assert(ratio > 0);
-    ratio_ = ratio;
+    downsampler_.setRatio(ratio);
+  }
+
+  inline void
+  setOptimizationOptions (const OptimizationOptions & optimization_options)
+  {
+    optimization_options_ = optimization_options;
+  }
+
+  // Set before perform(). Needs in-memory frames (no frame store) and a cold start.
+  inline void
+  setPyramidOptions (const PyramidOptions & pyramid_options)
+  {
+    pyramid_options_ = pyramid_options;
+  }
+
+  inline void
+  setDownSampleMode (CloudDownsampler::Mode mode)
+  {
+    downsampler_.setMode(mode);
+  }
+
+  // See DepthUndistortionEstimation::setGlobalSampleBudget(). Set before initDepthUndistortionModel().
+  inline void
+  setGlobalSampleBudget (Size1 global_sample_budget)
+  {
+    global_sample_budget_ = global_sample_budget;
+  }
+
+  // Threads of the depth undistortion estimation, OpenMP loops and Ceres solves alike. Defaults to the OpenMP thread
+  // count. Set before initDepthUndistortionModel().
+  inline void
+  setNumThreads (Size1 num_threads)
+  {
+    assert(num_threads > 0);
+    num_threads_ = num_threads;
   }
 
   void
   addData (const cv::Mat & image,
            const PCLCloud3::ConstPtr & cloud);
 
+  // Out-of-core mode: the (downsampled) frames are spooled to frame_store instead of being kept in memory and every
+  // pass reads them again. Only compact views (corners, plane inliers and planes) stay resident. Set before addData().
+  inline void
+  setFrameStore (const FrameStore::Ptr & frame_store)
+  {
+    frame_store_ = frame_store;
+  }
+
+  // Same as calling addData() for every frame, in order, but the clouds are downsampled in parallel.
+  void
+  addData (const std::vector<cv::Mat> & images,
+           const std::vector<PCLCloud3::ConstPtr> & clouds);
+
 //  void
 //  addTestData (const cv::Mat & image,
 //               const PCLCloud3::ConstPtr & cloud);
@@ -110,13 +231,50 @@ public:
   {
     assert(local_matrix_ and global_matrix_);
     estimate_depth_und_model_ = true;
+    depth_undistortion_estimation_ = createDepthUndistortionEstimation_();
+  }
+
+  // Streaming mode: the frame is kept as with addData(), its checkerboard views are extracted right away and their
+  // planes are folded into the running local and inverse global fits, which also update the local model. Without a
+  // known color sensor pose the first views only serve to estimate it. perform() and optimize() then run on all the
+  // frames as usual, starting from the streamed local model. Frames must be added from one thread at a time.
+  // Returns the number of views found in the frame.
+  Size1
+  addStreamingData (const cv::Mat & image,
+                    const PCLCloud3::ConstPtr & cloud);
+
+  inline Size1
+  streamingViews () const
+  {
+    return streaming_views_;
+  }
 
-    depth_undistortion_estimation_ = boost::make_shared<DepthUndistortionEstimation>();
-    depth_undistortion_estimation_->setDepthErrorFunction(depth_sensor_->depthErrorFunction());
-    //depth_undistortion_estimation_->setDepthErrorFunction(Polynomial<Scalar, 2, 0>(Vector3(0.000, 0.000, 0.0035)));
-    depth_undistortion_estimation_->setLocalModel(local_model_);
-    depth_undistortion_estimation_->setGlobalModel(global_model_);
-    depth_undistortion_estimation_->setMaxThreads(8);
+  // Fits of addStreamingData(), null before the first frame with a known pose.
+  inline const DepthUndistortionEstimation::ConstPtr
+  streamingEstimation () const
+  {
+    return streaming_estimation_;
+  }
+
+  // The local, global and inverse global models and the color sensor pose are those of a previous calibration:
+  // perform() only extracts the planes with the fixed local model, optimize() refines everything from there.
+  inline void
+  setWarmStart (bool warm_start)
+  {
+    warm_start_ = warm_start;
+  }
+
+  inline void
+  setInverseGlobalMatrix (const InverseGlobalModel::Data::Ptr & matrix)
+  {
+    assert(depth_undistortion_estimation_);
+    depth_undistortion_estimation_->setInverseGlobalMatrix(matrix);
+  }
+
+  const InverseGlobalModel::Ptr &
+  inverseGlobalModel () const
+  {
+    return depth_undistortion_estimation_->inverseGlobalModel();
   }
 
   inline void
@@ -172,12 +330,71 @@ protected:
   optimizeTransform (const std::vector<CheckerboardViews::Ptr> & rgbd_cb_vec);
 
   void
-  optimizeAll (const std::vector<CheckerboardViews::Ptr> & rgbd_cb_vec);
+  optimizeAll (const std::vector<CheckerboardViews::Ptr> & rgbd_cb_vec,
+               int max_iterations);
 
+  // Plane extraction, with (extract_only) or without the estimation of the local and global models. With extract_only
+  // and refine_iterations > 0 the current local model is refined first.
   void
-  addData_ (const cv::Mat & image,
-            const PCLCloud3::ConstPtr & cloud,
-            std::vector<RGBDData::ConstPtr> & vec);
+  estimateDepthUndistortion_ (bool extract_only,
+                              int refine_iterations = 0);
+
+  // Joint optimization of the views of the current undistortion estimation.
+  void
+  optimizeDepthUndistortion_ (int max_iterations);
+
+  // All the levels but the last one are calibrated completely, the last one up to the plane extraction.
+  void
+  performPyramid_ ();
+
+  inline bool
+  usePyramid_ () const
+  {
+    return estimate_depth_und_model_ and pyramid_options_.ratios.size() > 1 and not warm_start_ and not frame_store_;
+  }
+
+  inline void
+  updateDepthIntrinsics_ ()
+  {
+    depth_intrinsics_.resize(4);
+    depth_intrinsics_[0] = depth_sensor_->cameraModel()->intrinsicMatrix()(0, 0);
+    depth_intrinsics_[1] = depth_sensor_->cameraModel()->intrinsicMatrix()(1, 1);
+    depth_intrinsics_[2] = depth_sensor_->cameraModel()->intrinsicMatrix()(0, 2);
+    depth_intrinsics_[3] = depth_sensor_->cameraModel()->intrinsicMatrix()(1, 2);
+  }
+
+  RGBDData::Ptr
+  createData_ (int id,
+               const cv::Mat & image,
+               const PCLCloud3::ConstPtr & cloud) const;
+
+  DepthUndistortionEstimation::Ptr
+  createDepthUndistortionEstimation_ () const
+  {
+    DepthUndistortionEstimation::Ptr estimation = boost::make_shared<DepthUndistortionEstimation>();
+    estimation->setDepthErrorFunction(depth_sensor_->depthErrorFunction());
+    //estimation->setDepthErrorFunction(Polynomial<Scalar, 2, 0>(Vector3(0.000, 0.000, 0.0035)));
+    estimation->setLocalModel(local_model_);
+    estimation->setGlobalModel(global_model_);
+    estimation->setDepthIntrinsics(depth_intrinsics_[0], depth_intrinsics_[1], depth_intrinsics_[2], depth_intrinsics_[3]);
+    estimation->setMaxThreads(num_threads_);
+    estimation->setGlobalSampleBudget(global_sample_budget_);
+    estimation->setDebugCapture(debug_capture_);
+    return estimation;
+  }
+
+  inline Size1
+  frameCount_ () const
+  {
+    return frame_store_ ? frame_store_->size() : data_vec_.size();
+  }
+
+  // The index-th frame, read from the frame store in out-of-core mode.
+  RGBDData::ConstPtr
+  loadFrame_ (Size1 index) const;
+
+  void
+  extractViews_ (CheckerboardViewsExtraction & cb_extractor);
 
   PinholeSensor::Ptr color_sensor_;
   KinectDepthSensor<UndistortionModel>::Ptr depth_sensor_;
@@ -185,10 +402,17 @@ protected:
   std::vector<Checkerboard::ConstPtr> cb_vec_;
 
   Publisher::Ptr publisher_;
+  DebugCapture::Ptr debug_capture_;
 
   bool estimate_depth_und_model_;
   bool estimate_initial_trasform_;
-  int ratio_;
+  bool warm_start_;
+  Size1 global_sample_budget_;
+  Size1 num_threads_;
+
+  CloudDownsampler downsampler_;
+  OptimizationOptions optimization_options_;
+  PyramidOptions pyramid_options_;
 
   LocalModel::Ptr local_model_;
   GlobalModel::Ptr global_model_;
@@ -198,7 +422,14 @@ protected:
 
   DepthUndistortionEstimation::Ptr depth_undistortion_estimation_;
 
+  // State of addStreamingData()
+  DepthUndistortionEstimation::Ptr streaming_estimation_;
+  std::vector<CheckerboardViews::Ptr> streaming_pose_views_;
+  Size1 streaming_pose_views_needed_;
+  Size1 streaming_views_;
+
   std::vector<RGBDData::ConstPtr> data_vec_;
+  FrameStore::Ptr frame_store_;
   std::vector<RGBDData::ConstPtr> test_vec_;
 
   std::vector<CheckerboardViews::Ptr> cb_views_vec_;
@@ -206,6 +437,8 @@ protected:
 
   std::vector<double> depth_intrinsics_;
 
+  CheckerboardCache::Ptr cb_cache_;
+
 };
 
 } /* namespace calibration */
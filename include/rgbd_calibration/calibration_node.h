@@ -29,6 +29,7 @@
 #ifndef RGBD_CALIBRATION_CALIBRATION_NODE_H_
 #define RGBD_CALIBRATION_CALIBRATION_NODE_H_
 
+#include <map>
 #include <ros/ros.h>
 
 #include <calibration_msgs/CheckerboardArray.h>
@@ -78,6 +79,19 @@ protected:
   bool
   waitForMessages () const;
 
+  // Loads the matrices, the camera pose and the depth intrinsics saved by a previous run from warm_start_path_.
+  bool
+  readWarmStart ();
+
+  // Writes the global matrix, the binary model, the camera pose and the depth intrinsics after optimize() to path.
+  void
+  saveOptimizedResults (const std::string & path) const;
+
+  // Flattens a two-level YAML file of numbers into "section/key" -> value.
+  static bool
+  readYAMLValues (const std::string & file_name,
+                  std::map<std::string, double> & values);
+
   ros::NodeHandle node_handle_;
 
   // TODO find another way to get checkerboards
@@ -95,18 +109,30 @@ protected:
   Transform initial_transform_;
 
   int downsample_ratio_;
+  CloudDownsampler::Mode downsample_mode_;
+  OptimizationOptions optimization_options_;
+  PyramidOptions pyramid_options_;
+  int global_sample_budget_;
+  int num_threads_;
 
   Size2 undistortion_matrix_cell_size_;
   Size2 images_size_;
 
   Calibration::Ptr calibration_;
   Publisher::Ptr publisher_;
+  DebugCapture::Ptr debug_capture_;
 
   PinholeSensor::Ptr color_sensor_;
   KinectDepthSensor<UndistortionModel>::Ptr depth_sensor_;
 
   std::vector<double> depth_error_coeffs_;
 
+  std::string warm_start_path_;
+  std::vector<double> warm_start_intrinsics_;
+  LocalModel::Data::Ptr warm_start_local_matrix_;
+  GlobalModel::Data::Ptr warm_start_global_matrix_;
+  InverseGlobalModel::Data::Ptr warm_start_inverse_global_matrix_;
+
 };
 
 } /* namespace calibration */
@@ -24,6 +24,8 @@
 #include <rgbd_calibration/globals.h>
 #include <rgbd_calibration/publisher.h>
 #include <rgbd_calibration/checkerboard_views.h>
+#include <rgbd_calibration/checkerboard_cache.h>
+#include <rgbd_calibration/cloud_downsampler.h>
 
 //#define HERRERA
 //#define UNCALIBRATED
@@ -39,6 +41,8 @@ public:
   typedef boost::shared_ptr<CalibrationTest> Ptr;
   typedef boost::shared_ptr<const CalibrationTest> ConstPtr;
 
+  CalibrationTest();
+
   void setColorSensor(const PinholeSensor::Ptr & color_sensor)
   {
     color_sensor_ = color_sensor;
@@ -59,10 +63,21 @@ public:
     publisher_ = publisher;
   }
 
+  void setCheckerboardCache(const CheckerboardCache::Ptr & cb_cache)
+  {
+    cb_cache_ = cb_cache;
+  }
+
   void setDownSampleRatio(int ratio)
   {
     assert(ratio > 0);
     ratio_ = ratio;
+    downsampler_.setRatio(ratio);
+  }
+
+  void setDownSampleMode(CloudDownsampler::Mode mode)
+  {
+    downsampler_.setMode(mode);
   }
 
   PCLCloudRGB::Ptr addData(const cv::Mat & image,
@@ -88,6 +103,11 @@ public:
 
   void testCube() const;
 
+  // Checkerboard views of the undistorted test frames. They are extracted on the first call and shared by the tests,
+  // addData() invalidates them.
+  const std::vector<CheckerboardViews::Ptr> &
+  checkerboardViews() const;
+
 protected:
 
   boost::shared_ptr<std::vector<int> >
@@ -102,10 +122,16 @@ protected:
   Publisher::Ptr publisher_;
 
   int ratio_;
+  CloudDownsampler downsampler_;
 
   LocalMatrixPCL::Ptr local_matrix_;
   GlobalMatrixPCL::Ptr global_matrix_;
 
+  CheckerboardCache::Ptr cb_cache_;
+
+  mutable std::vector<CheckerboardViews::Ptr> cb_views_vec_;
+  mutable bool has_cb_views_;
+
 public:
 
   std::vector<RGBDData::ConstPtr> data_vec_;
@@ -0,0 +1,164 @@
+/*
+ *  Copyright (c) 2013-2014, Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *     3. Neither the name of the copyright holder(s) nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RGBD_CALIBRATION_CHECKERBOARD_CACHE_H_
+#define RGBD_CALIBRATION_CHECKERBOARD_CACHE_H_
+
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <opencv2/core/core.hpp>
+
+#include <calibration_common/objects/checkerboard.h>
+
+#include <rgbd_calibration/globals.h>
+
+namespace calibration
+{
+
+/*
+ * Content-addressed cache of the checkerboard extraction results. Corners are keyed on the image content, the
+ * checkerboard geometry and the detector settings, plane inliers on the corners key, the cloud content and the color sensor pose. Failed
+ * extractions are cached too. All the methods are thread-safe.
+ *
+ * File layout (native endianness): magic, version, number of corner and plane entries, then the entries as
+ * key, found flag, size and data (corners as x, y floats; plane inliers as int32 indices followed by std_dev).
+ */
+class CheckerboardCache
+{
+public:
+
+  typedef boost::shared_ptr<CheckerboardCache> Ptr;
+  typedef boost::shared_ptr<const CheckerboardCache> ConstPtr;
+
+  static const char MAGIC[8];
+  static const boost::uint32_t VERSION = 5; // 2: planes extracted with OrganizedPlaneExtraction, 3: detector settings in the corners key
+                                            // 4: previous corners taken in data order, 5: plane candidates bounded in depth
+
+  struct CornersEntry
+  {
+    CornersEntry()
+      : found_(false)
+    {
+      // Do nothing
+    }
+
+    bool found_;
+    std::vector<float> corners_; // x0, y0, x1, y1, ...
+  };
+
+  struct PlaneEntry
+  {
+    PlaneEntry()
+      : found_(false),
+        std_dev_(0.0)
+    {
+      // Do nothing
+    }
+
+    bool found_;
+    std::vector<int> indices_;
+    Scalar std_dev_;
+  };
+
+  CheckerboardCache();
+
+  // 64-bit FNV-1a
+  static boost::uint64_t
+  hash(const void * data,
+       size_t size,
+       boost::uint64_t seed = 14695981039346656037ULL);
+
+  static boost::uint64_t
+  imageHash(const cv::Mat & image);
+
+  static boost::uint64_t
+  cloudHash(const PCLCloud3 & cloud);
+
+  // detection_max_size and use_last_corners as in CheckerboardViewsExtraction: both change what is detected.
+  static boost::uint64_t
+  cornersKey(boost::uint64_t image_hash,
+             const Checkerboard & checkerboard,
+             int detection_max_size,
+             bool use_last_corners);
+
+  static boost::uint64_t
+  planeKey(boost::uint64_t corners_key,
+           boost::uint64_t cloud_hash,
+           const Pose & color_sensor_pose);
+
+  bool
+  findCorners(boost::uint64_t key,
+              CornersEntry & entry) const;
+
+  void
+  addCorners(boost::uint64_t key,
+             const CornersEntry & entry);
+
+  bool
+  findPlane(boost::uint64_t key,
+            PlaneEntry & entry) const;
+
+  void
+  addPlane(boost::uint64_t key,
+           const PlaneEntry & entry);
+
+  // A missing file, or one of an older version, is an empty cache. A corrupt file leaves the cache empty and returns
+  // false.
+  bool
+  load(const std::string & file_name);
+
+  // Does nothing if no entry has been added since the last load() or save().
+  bool
+  save(const std::string & file_name);
+
+  inline size_t
+  size() const
+  {
+    return corners_map_.size() + plane_map_.size();
+  }
+
+private:
+
+  bool
+  read(std::ifstream & file,
+       boost::uint64_t file_size);
+
+  std::map<boost::uint64_t, CornersEntry> corners_map_;
+  std::map<boost::uint64_t, PlaneEntry> plane_map_;
+  bool modified_;
+
+};
+
+} /* namespace calibration */
+#endif /* RGBD_CALIBRATION_CHECKERBOARD_CACHE_H_ */
@@ -30,7 +30,9 @@
 #define RGBD_CALIBRATION_CHECKERBOARD_VIEWS_EXTRACTOR_H_
 
 #include <vector>
+#include <opencv2/core/core.hpp>
 #include <rgbd_calibration/checkerboard_views.h>
+#include <rgbd_calibration/checkerboard_cache.h>
 
 namespace calibration
 {
@@ -45,6 +47,9 @@ public:
   CheckerboardViewsExtraction()
     : force_(false),
       only_images_(false),
+      detection_max_size_(1000),
+      use_last_corners_(true),
+      has_depth_intrinsics_(false),
       color_sensor_pose_(Pose::Identity()),
       cb_constraint_(boost::make_shared<NoConstraint<Checkerboard> >()),
       plane_constraint_(boost::make_shared<NoConstraint<PlanarObject> >())
@@ -96,6 +101,39 @@ public:
     color_sensor_pose_ = color_sensor_pose;
   }
 
+  // Intrinsics of the depth clouds. Automatic plane extraction then visits only the pixels around the checkerboard.
+  inline void setDepthIntrinsics(Scalar fx,
+                                 Scalar fy,
+                                 Scalar cx,
+                                 Scalar cy)
+  {
+    depth_intrinsics_[0] = fx;
+    depth_intrinsics_[1] = fy;
+    depth_intrinsics_[2] = cx;
+    depth_intrinsics_[3] = cy;
+    has_depth_intrinsics_ = true;
+  }
+
+  // Corners are detected on the first pyramid level whose size is <= max_size and then refined at full resolution.
+  inline void setDetectionMaxSize(int max_size)
+  {
+    assert(max_size > 0);
+    detection_max_size_ = max_size;
+  }
+
+  // Corners and plane inliers are looked up in (and added to) cache. Not used in interactive mode.
+  inline void setCache(const CheckerboardCache::Ptr & cache)
+  {
+    cache_ = cache;
+  }
+
+  // In extractAll(), search each checkerboard around its corners in the previous frame first. Frames are taken in
+  // fixed chunks of consecutive frames, the first frame of a chunk is searched without previous corners.
+  inline void setUseLastCorners(bool use_last_corners)
+  {
+    use_last_corners_ = use_last_corners;
+  }
+
   Size1 extract(std::vector<CheckerboardViews::Ptr> & cb_views_vec,
                 bool interactive = false) const;
 
@@ -104,10 +142,24 @@ public:
 
 private:
 
+  // last_rois contains, for each checkerboard, the bounding box of its corners in the previous frame (empty if not
+  // found) and is updated with the current ones.
   Size1 extract(const RGBDData::ConstPtr & data,
                 std::vector<CheckerboardViews::Ptr> & cb_views_vec,
                 bool interactive,
-                bool force) const;
+                bool force,
+                std::vector<cv::Rect> & last_rois) const;
+
+  bool findCorners(const std::vector<cv::Mat> & pyramid,
+                   const cv::Mat & gray,
+                   const Checkerboard & checkerboard,
+                   const cv::Rect & roi,
+                   Cloud2 & image_corners) const;
+
+  bool extractPlane(const PCLCloud3::ConstPtr & cloud,
+                    const Checkerboard & checkerboard,
+                    const Point3 & center,
+                    PlaneInfo & plane_info) const;
 
   std::vector<Checkerboard::ConstPtr> cb_vec_;
 
@@ -116,11 +168,17 @@ private:
 
   bool force_;
   bool only_images_;
+  int detection_max_size_;
+  bool use_last_corners_;
+  bool has_depth_intrinsics_;
+  Scalar depth_intrinsics_[4];
   Pose color_sensor_pose_;
 
   Constraint<Checkerboard>::ConstPtr cb_constraint_;
   Constraint<PlanarObject>::ConstPtr plane_constraint_;
 
+  CheckerboardCache::Ptr cache_;
+
 };
 
 } /* namespace calibration */
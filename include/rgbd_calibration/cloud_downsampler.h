@@ -0,0 +1,117 @@
+/*
+ *  Copyright (c) 2013-2014, Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *     3. Neither the name of the copyright holder(s) nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RGBD_CALIBRATION_CLOUD_DOWNSAMPLER_H_
+#define RGBD_CALIBRATION_CLOUD_DOWNSAMPLER_H_
+
+#include <string>
+#include <vector>
+
+#include <rgbd_calibration/globals.h>
+
+namespace calibration
+{
+
+/*
+ * Block downsampling of organized clouds: every ratio x ratio block becomes one point, the mean or the median (by depth)
+ * of its valid points, or NaN when the block has none. Rows are split into x, y, z arrays with a 0/1 validity mask, so
+ * the mean is a few multiply-adds per point in loops the compiler can vectorize. The output is an organized PCLCloud3,
+ * i.e. what the undistortion fitters already consume.
+ */
+class CloudDownsampler
+{
+public:
+
+  typedef boost::shared_ptr<CloudDownsampler> Ptr;
+  typedef boost::shared_ptr<const CloudDownsampler> ConstPtr;
+
+  enum Mode
+  {
+    MEAN,
+    MEDIAN
+  };
+
+  CloudDownsampler();
+
+  inline void
+  setRatio(int ratio)
+  {
+    assert(ratio > 0);
+    ratio_ = ratio;
+  }
+
+  inline int
+  ratio() const
+  {
+    return ratio_;
+  }
+
+  inline void
+  setMode(Mode mode)
+  {
+    mode_ = mode;
+  }
+
+  inline Mode
+  mode() const
+  {
+    return mode_;
+  }
+
+  // "mean" or "median". Returns false (and leaves mode unchanged) for any other string.
+  static bool
+  parseMode(const std::string & name,
+            Mode & mode);
+
+  // Can be called from several threads at once. cloud and sampled cannot be the same cloud.
+  void
+  apply(const PCLCloud3 & cloud,
+        PCLCloud3 & sampled) const;
+
+private:
+
+  // Both return true if every block of the row has a valid point.
+  bool
+  meanRow(const PCLCloud3 & cloud,
+          int row,
+          std::vector<float> & buffer,
+          PCLPoint3 * sampled_row) const;
+
+  bool
+  medianRow(const PCLCloud3 & cloud,
+            int row,
+            std::vector<std::pair<float, int> > & buffer,
+            PCLPoint3 * sampled_row) const;
+
+  int ratio_;
+  Mode mode_;
+
+};
+
+} /* namespace calibration */
+#endif /* RGBD_CALIBRATION_CLOUD_DOWNSAMPLER_H_ */
@@ -0,0 +1,249 @@
+/*
+ *  Copyright (c) 2013-2014, Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *     3. Neither the name of the copyright holder(s) nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RGBD_CALIBRATION_DATASET_IO_H_
+#define RGBD_CALIBRATION_DATASET_IO_H_
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <opencv2/core/core.hpp>
+
+#include <rgbd_calibration/globals.h>
+
+namespace calibration
+{
+
+/*
+ * Single-file dataset. The file is a sequence of chunks, each one made of a ChunkHeader followed by its payload:
+ *  - one CAMERA_INFO chunk per sensor, holding the camera info as YAML text;
+ *  - one FRAME chunk per acquisition: FrameHeader, raw depth (row-major) and encoded color image;
+ *  - one INDEX chunk, written on close, holding the offsets of all the FRAME chunks.
+ * The file starts with a FileHeader and ends with a FileFooter pointing to the INDEX chunk. Files without
+ * a valid footer (e.g. the collector was killed) are read by scanning the chunks.
+ */
+struct Dataset
+{
+  static const char MAGIC[8];
+  static const boost::uint32_t VERSION = 1;
+
+  enum ChunkType
+  {
+    CAMERA_INFO = 1,
+    FRAME = 2,
+    INDEX = 3
+  };
+
+  enum Sensor
+  {
+    COLOR_SENSOR = 0,
+    DEPTH_SENSOR = 1
+  };
+
+  enum DepthType
+  {
+    DEPTH_UINT16 = 0, // Millimeters
+    DEPTH_FLOAT32 = 1 // Meters
+  };
+
+#pragma pack(push, 1)
+  struct FileHeader
+  {
+    char magic_[8];
+    boost::uint32_t version_;
+  };
+
+  struct ChunkHeader
+  {
+    boost::uint32_t type_;
+    boost::uint64_t size_; // Payload size
+  };
+
+  struct FrameHeader
+  {
+    boost::int32_t id_;
+    double image_timestamp_;
+    double depth_timestamp_;
+    boost::uint32_t depth_type_;
+    boost::uint32_t depth_cols_;
+    boost::uint32_t depth_rows_;
+    boost::uint64_t depth_size_;
+    boost::uint64_t image_size_;
+  };
+
+  struct FileFooter
+  {
+    boost::uint64_t index_offset_;
+    char magic_[8];
+  };
+#pragma pack(pop)
+
+  struct FrameInfo
+  {
+    int id_;
+    double image_timestamp_;
+    double depth_timestamp_;
+  };
+
+};
+
+class DatasetWriter
+{
+public:
+
+  typedef boost::shared_ptr<DatasetWriter> Ptr;
+  typedef boost::shared_ptr<const DatasetWriter> ConstPtr;
+
+  DatasetWriter();
+
+  virtual
+  ~DatasetWriter();
+
+  bool
+  open(const std::string & file_name);
+
+  bool
+  writeCameraInfo(Dataset::Sensor sensor,
+                  const std::string & camera_info);
+
+  // depth must be CV_16UC1 (millimeters) or CV_32FC1 (meters). The color image is encoded with image_extension.
+  bool
+  writeFrame(int id,
+             double image_timestamp,
+             double depth_timestamp,
+             const cv::Mat & image,
+             const cv::Mat & depth,
+             const std::string & image_extension = "png");
+
+  // Same as above with an image already encoded (e.g. by cv::imencode in another thread), empty if there is none.
+  bool
+  writeFrame(int id,
+             double image_timestamp,
+             double depth_timestamp,
+             const std::vector<uchar> & encoded_image,
+             const cv::Mat & depth);
+
+  void
+  close();
+
+  inline bool
+  isOpen() const
+  {
+    return file_.is_open();
+  }
+
+private:
+
+  bool
+  writeChunk(Dataset::ChunkType type,
+             const std::vector<const char *> & data,
+             const std::vector<size_t> & sizes);
+
+  std::ofstream file_;
+  std::vector<boost::uint64_t> index_;
+
+};
+
+class DatasetReader
+{
+public:
+
+  typedef boost::shared_ptr<DatasetReader> Ptr;
+  typedef boost::shared_ptr<const DatasetReader> ConstPtr;
+
+  DatasetReader();
+
+  bool
+  open(const std::string & file_name);
+
+  inline size_t
+  size() const
+  {
+    return frames_.size();
+  }
+
+  inline const Dataset::FrameInfo &
+  frameInfo(size_t index) const
+  {
+    return frame_info_vec_[index];
+  }
+
+  // Returns -1 if there is no frame with the given id
+  int
+  find(int id) const;
+
+  inline const std::string &
+  cameraInfo(Dataset::Sensor sensor) const
+  {
+    return camera_info_[sensor];
+  }
+
+  // Reading methods are const: they can be called from multiple threads at the same time.
+  bool
+  readImage(size_t index,
+            cv::Mat & image) const;
+
+  // depth is CV_16UC1 (millimeters) or CV_32FC1 (meters), as it was written. It is a copy of the mapped data.
+  bool
+  readDepth(size_t index,
+            cv::Mat & depth) const;
+
+  // Organized cloud with the depth in meters as z. Invalid points are NaN, x and y of valid points are 0:
+  // they have to be computed with the depth camera model.
+  bool
+  readDepthCloud(size_t index,
+                 PCLCloud3 & cloud) const;
+
+private:
+
+  bool
+  readIndex(boost::uint64_t index_offset);
+
+  bool
+  scanChunks();
+
+  bool
+  addChunk(boost::uint64_t offset);
+
+  boost::interprocess::file_mapping file_mapping_;
+  boost::interprocess::mapped_region region_;
+
+  std::vector<const char *> frames_;
+  std::vector<Dataset::FrameInfo> frame_info_vec_;
+  std::string camera_info_[2];
+
+};
+
+} /* namespace calibration */
+#endif /* RGBD_CALIBRATION_DATASET_IO_H_ */
@@ -0,0 +1,115 @@
+/*
+ *  Copyright (c) 2013-2014, Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *     3. Neither the name of the copyright holder(s) nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RGBD_CALIBRATION_DEBUG_CAPTURE_H_
+#define RGBD_CALIBRATION_DEBUG_CAPTURE_H_
+
+#include <deque>
+#include <string>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <pcl/pcl_base.h>
+
+#include <rgbd_calibration/globals.h>
+
+namespace calibration
+{
+
+/*
+ * Sink for the intermediate clouds and samples of a calibration, e.g. to inspect the extracted planes. Nothing is
+ * captured unless an instance is set. Files are written by a background thread, so capture() only queues shared
+ * pointers: the captured clouds must not be modified afterwards. When the queue is full new items are dropped.
+ */
+class DebugCapture
+{
+public:
+
+  typedef boost::shared_ptr<DebugCapture> Ptr;
+  typedef boost::shared_ptr<const DebugCapture> ConstPtr;
+
+  // Files go to directory (created if needed), one frame every sampling_rate is captured.
+  DebugCapture(const std::string & directory,
+               Size1 sampling_rate,
+               Size1 max_queued = 32);
+
+  // Waits until every queued item has been written.
+  ~DebugCapture();
+
+  inline bool sample(Size1 index) const
+  {
+    return index % sampling_rate_ == 0;
+  }
+
+  // Written as a binary PCD, file_name is relative to the capture directory.
+  void capture(const std::string & file_name,
+               const PCLCloud3::ConstPtr & cloud);
+
+  // Only the points of cloud in indices. They are extracted by the writer thread.
+  void capture(const std::string & file_name,
+               const PCLCloud3::ConstPtr & cloud,
+               const pcl::IndicesConstPtr & indices);
+
+  void captureText(const std::string & file_name,
+                   const std::string & text);
+
+private:
+
+  struct Item
+  {
+    std::string file_name_;
+    PCLCloud3::ConstPtr cloud_;
+    pcl::IndicesConstPtr indices_;
+    std::string text_;
+  };
+
+  void push(const Item & item);
+
+  void writeLoop();
+
+  void write(const Item & item) const;
+
+  std::string directory_;
+  Size1 sampling_rate_;
+  Size1 max_queued_;
+  Size1 dropped_;
+
+  std::deque<Item> queue_;
+  bool stop_;
+
+  boost::mutex mutex_;
+  boost::condition_variable condition_;
+  boost::thread thread_;
+
+};
+
+} /* namespace calibration */
+#endif /* RGBD_CALIBRATION_DEBUG_CAPTURE_H_ */
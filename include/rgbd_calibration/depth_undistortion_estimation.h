@@ -29,12 +29,19 @@
 #ifndef RGBD_CALIBRATION_DEPTH_UNDISTORTION_ESTIMATION_H_
 #define RGBD_CALIBRATION_DEPTH_UNDISTORTION_ESTIMATION_H_
 
+#include <deque>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
 #include <pcl/pcl_base.h>
 #include <calibration_common/objects/checkerboard.h>
 #include <calibration_common/algorithms/plane_extraction.h>
 #include <calibration_common/depth/undistortion_model_fit.h>
 #include <rgbd_calibration/globals.h>
 #include <rgbd_calibration/publisher.h>
+#include <rgbd_calibration/frame_store.h>
+#include <rgbd_calibration/debug_capture.h>
 
 namespace calibration
 {
@@ -43,6 +50,38 @@ class DepthUndistortionEstimation
 {
 public:
 
+  // Crop of an organized width_ x height_ cloud: point (x, y) of cloud_ is point (x_ + x, y_ + y) of the full cloud.
+  struct CloudRegion
+  {
+    CloudRegion()
+      : x_(0),
+        y_(0),
+        width_(0),
+        height_(0)
+    {
+      // Do nothing
+    }
+
+    // Index in the full cloud of a point of cloud_.
+    inline int fullIndex(int index) const
+    {
+      const int region_width = cloud_->width;
+      return (y_ + index / region_width) * width_ + x_ + index % region_width;
+    }
+
+    // Point of cloud_ at an index of the full cloud, which must lie in the region.
+    inline const PCLPoint3 & atFullIndex(int full_index) const
+    {
+      return cloud_->at(full_index % width_ - x_, full_index / width_ - y_);
+    }
+
+    PCLCloud3::ConstPtr cloud_;
+    int x_;
+    int y_;
+    int width_;
+    int height_;
+  };
+
   struct DepthData
   {
     typedef boost::shared_ptr<DepthData> Ptr;
@@ -50,16 +89,31 @@ public:
 
     DepthData(int id)
       : id_(id),
+        frame_index_(-1),
         plane_extracted_(false)
     {
     }
 
+    // cloud_ if resident, otherwise the cloud is read from frame_store_ (every time).
+    inline PCLCloud3::ConstPtr cloud() const
+    {
+      if (cloud_ or not frame_store_)
+        return cloud_;
+      PCLCloud3::Ptr cloud = boost::make_shared<PCLCloud3>();
+      frame_store_->readCloud(frame_index_, *cloud);
+      return cloud;
+    }
+
     int id_;
 
     PCLCloud3::ConstPtr cloud_;
+    FrameStore::ConstPtr frame_store_;
+    int frame_index_;
     Checkerboard::ConstPtr checkerboard_; // Attention: in depth coordinates!!
 
-    PCLCloud3::ConstPtr undistorted_cloud_;
+    // Region around the checkerboard undistorted with the local model of the last extractPlanes(), it contains every
+    // inlier of estimated_plane_. Not kept with setEvictClouds(true). See undistortedCloud() for the whole cloud.
+    CloudRegion undistorted_region_;
     PlaneInfo estimated_plane_;
 
     bool plane_extracted_;
@@ -80,7 +134,17 @@ public:
   typedef boost::shared_ptr<const DepthUndistortionEstimation> ConstPtr;
 
   DepthUndistortionEstimation()
-    : max_threads_(1)
+    : max_threads_(1),
+      local_update_samples_(0),
+      pipeline_depth_(8),
+      has_depth_intrinsics_(false),
+      evict_clouds_(false),
+      global_sample_budget_(0),
+      sampling_seed_(0),
+      streaming_frames_(0),
+      streaming_new_samples_(0),
+      streaming_updates_(0),
+      last_streaming_change_(-1.0)
   {
     // Do nothing
   }
@@ -103,6 +167,59 @@ public:
     inverse_global_fit_ = boost::make_shared<InverseGlobalMatrixFitEigen>(inverse_global_model_);
   }
 
+  // Replaces the inverse global matrix, e.g. with the one of a previous calibration.
+  inline void setInverseGlobalMatrix(const InverseGlobalModel::Data::Ptr & matrix)
+  {
+    inverse_global_model_->setMatrix(matrix);
+  }
+
+  inline const InverseGlobalModel::Ptr & inverseGlobalModel() const
+  {
+    return inverse_global_model_;
+  }
+
+  // Intrinsics of the depth clouds, used to visit only the pixels around each checkerboard.
+  inline void setDepthIntrinsics(Scalar fx,
+                                 Scalar fy,
+                                 Scalar cx,
+                                 Scalar cy)
+  {
+    depth_intrinsics_[0] = fx;
+    depth_intrinsics_[1] = fy;
+    depth_intrinsics_[2] = cx;
+    depth_intrinsics_[3] = cy;
+    has_depth_intrinsics_ = true;
+  }
+
+  // Out-of-core mode: the undistorted clouds are dropped as soon as they have been used.
+  inline void setEvictClouds(bool evict_clouds)
+  {
+    evict_clouds_ = evict_clouds;
+  }
+
+  // Inliers per frame used by estimateGlobalModel(), 0 to use all of them. They are drawn stratified over a grid of
+  // image cells with the same number of samples per cell where possible, and the samples of a cell are weighted by the
+  // number of inliers each of them stands for.
+  inline void setGlobalSampleBudget(Size1 global_sample_budget)
+  {
+    global_sample_budget_ = global_sample_budget;
+  }
+
+  // The samples of a frame only depend on this seed and on the frame id.
+  inline void setSamplingSeed(unsigned int sampling_seed)
+  {
+    sampling_seed_ = sampling_seed;
+  }
+
+  // Sampled frames of estimateLocalModel() are sent to debug_capture, none if it is null.
+  inline void setDebugCapture(const DebugCapture::Ptr & debug_capture)
+  {
+    debug_capture_ = debug_capture;
+  }
+
+  // The whole cloud of data undistorted as in extractPlanes(), computed on demand. Null if no plane was extracted.
+  PCLCloud3::ConstPtr undistortedCloud(const DepthData & data) const;
+
   inline void addDepthData(const DepthData::Ptr & data)
   {
     data_vec_.push_back(data);
@@ -127,16 +244,71 @@ public:
 
   void estimateLocalModelReverse();
 
-  void optimizeLocalModel(const Polynomial<double, 2> & depth_error_function);
+  // Ceres refinement of the current local model from the planes in the plane info map (frames without one are skipped).
+  void optimizeLocalModel(const Polynomial<double, 2> & depth_error_function,
+                          int max_iterations = 10);
+
+  // Refines the current (e.g. upsampled) local model where the planes are: extracts the planes with it, refits them
+  // on the raw points as estimateLocalModel() does, runs max_iterations of optimizeLocalModel() and extracts the
+  // planes again with the refined model. The inverse global model is not changed.
+  void refineLocalModel(int max_iterations);
 
   void estimateGlobalModel();
 
+  // Extracts the plane of every frame from the cloud undistorted with the current local model, without updating any
+  // model. Sets undistorted_region_, estimated_plane_ and plane_extracted_ of each DepthData.
+  void extractPlanes();
+
+  // Streaming counterpart of estimateLocalModel(): extracts the plane of data with the current models and folds its
+  // samples into the local and inverse global fits right away. The local model is updated every
+  // setLocalUpdateSamples() new samples, or at every frame if 0. data is added as with addDepthData(). Frames must be
+  // added from one thread at a time. Returns false if the plane is not found.
+  bool addStreamingData(const DepthData::Ptr & data);
+
+  // Planes folded in by addStreamingData().
+  inline Size1 streamingPlanes() const
+  {
+    return streaming_frames_;
+  }
+
+  // Local model updates done by addStreamingData().
+  inline Size1 streamingUpdates() const
+  {
+    return streaming_updates_;
+  }
+
+  // Fraction of the local model bins seen by at least min_frames planes of addStreamingData().
+  Scalar streamingCoverage(Size1 min_frames) const;
+
+  // Largest change of the depth correction of the local model in the last update of addStreamingData(), in meters,
+  // over the nodes and the depths 1 ... 4 m. Negative before the first update.
+  inline Scalar lastStreamingChange() const
+  {
+    return last_streaming_change_;
+  }
+
+
   inline void setMaxThreads(size_t max_threads)
   {
     assert(max_threads > 0);
     max_threads_ = max_threads;
   }
 
+  // Number of new samples that triggers a local model update in estimateLocalModel().
+  // 0 means about one frame per pipeline slot (see setPipelineDepth()).
+  inline void setLocalUpdateSamples(Size1 local_update_samples)
+  {
+    local_update_samples_ = local_update_samples;
+  }
+
+  // In estimateLocalModel() frame i uses the models as of the frames before i - pipeline_depth, merged in data order,
+  // so the result depends on the data and on pipeline_depth only, not on the threads. Up to pipeline_depth + 1 frames
+  // are processed at once by setMaxThreads() workers: 0 is the serial estimation.
+  inline void setPipelineDepth(Size1 pipeline_depth)
+  {
+    pipeline_depth_ = pipeline_depth;
+  }
+
   Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> getLocalSamples(Size1 x_index,
                                                                         Size1 y_index) const
   {
@@ -174,12 +346,141 @@ public:
 
 private:
 
+  struct LocalFitResult
+  {
+    LocalFitResult()
+      : plane_extracted_(false)
+    {
+      // Do nothing
+    }
+
+    bool plane_extracted_;
+    PlaneInfo plane_info_; // plane_ is the plane fitted to the central inliers
+    std::vector<std::pair<Size1, LocalMatrixFitPCL::Data> > samples_; // By matrix node, kept until merged
+
+  };
+
+  // Samples of a frame drawn from one image cell, each one standing for weight_ inliers of the cell.
+  struct CellSamples
+  {
+    Indices indices_;
+    Scalar weight_;
+  };
+
+  // Models of estimateLocalModel() after an update, with the number of frames merged before it.
+  struct ModelSnapshot
+  {
+    Size1 merged_;
+    LocalModel::Ptr local_model_;
+    InverseGlobalModel::Ptr inverse_global_model_;
+  };
+
+  // State shared by the workers of estimateLocalModel(), guarded by mutex_ except for the fits and the results:
+  // results_[i] belongs to the worker of frame i until processed_[i] is set, then to the merging worker.
+  struct LocalModelPipeline
+  {
+    boost::mutex mutex_;
+    boost::condition_variable condition_;
+    std::vector<LocalFitResult> results_;
+    std::vector<bool> processed_;
+    std::vector<bool> taken_; // Frames whose snapshot has been taken
+    std::deque<ModelSnapshot> snapshots_; // One per update still needed, oldest first
+    Size1 next_; // Next frame to hand out
+    Size1 first_waiting_; // Lowest frame without its snapshot
+    Size1 published_; // Frames merged, with their snapshots in snapshots_
+    bool merging_;
+    Size1 new_samples_;
+    Size1 total_samples_;
+  };
+
+  static void centralIndices(const std::vector<int> & indices,
+                             int width,
+                             int height,
+                             std::vector<int> & central_indices);
+
+  static Scalar searchRadius(const Checkerboard & color_cb);
+
+  // Undistorts the points of cloud within radius from center. Only the bounding box of the projection of the sphere
+  // is visited (the whole cloud without depth intrinsics), region_cloud becomes that box, with NaN outside the sphere.
+  // region_cloud is reused as a buffer, region refers to it.
+  void undistortRegion(const PCLCloud3 & cloud,
+                       const LocalModel::Ptr & local_model,
+                       const Point3 & center,
+                       Scalar radius,
+                       const PCLCloud3::Ptr & region_cloud,
+                       CloudRegion & region) const;
+
+  // Undistorts every point of cloud, see undistortedCloud().
+  static void undistortCloud(const PCLCloud3 & cloud,
+                             const LocalModel::Ptr & local_model,
+                             PCLCloud3 & und_cloud);
+
+  // Accumulates the inliers of plane_info into shard, a fit owned by the calling thread, and moves the samples to
+  // result. shard is left empty.
+  static void accumulateLocalSamples(LocalMatrixFitPCL & shard,
+                                     const PCLCloud3 & cloud,
+                                     const PlaneInfo & plane_info,
+                                     LocalFitResult & result);
+
+  // Adds the samples of result to the bins of local_fit_.
+  void mergeLocalSamples(LocalFitResult & result);
+
+  LocalMatrixFitPCL::Ptr createLocalShard() const;
+
+  // Worker of estimateLocalModel(): takes the frames in data order until none is left.
+  void localModelWorker(LocalModelPipeline & pipeline);
+
+  // Merges the results ready in data order and publishes the models, called with lock held on pipeline.mutex_.
+  // The lock is released while merging.
+  void mergeLocalResults(LocalModelPipeline & pipeline,
+                         boost::mutex::scoped_lock & lock);
+
+  LocalModel::Ptr localModelSnapshot() const;
+
+  InverseGlobalModel::Ptr inverseGlobalModelSnapshot() const;
+
+  bool extractLocalPlane(const DepthData & data,
+                         const PCLCloud3 & cloud,
+                         const LocalModel::Ptr & local_model,
+                         const InverseGlobalModel::Ptr & inverse_global_model,
+                         const PCLCloud3::Ptr & region_cloud,
+                         CloudRegion & region,
+                         PlaneInfo & plane_info,
+                         Plane & fitted_plane);
+
+  // extractPlanes() for the frames in [begin, end) only, undistorted regions are always kept.
+  void extractPlanes(Size1 begin,
+                     Size1 end);
+
+  // Stratified subset of at most global_sample_budget_ plane inliers of data, by cell.
+  void sampleInliers(const DepthData & data,
+                     std::vector<CellSamples> & samples) const;
+
+  // The inliers are indices of the full cloud of region.
   bool extractPlane(const Checkerboard & color_cb,
-                    const PCLCloud3::ConstPtr & cloud,
+                    const CloudRegion & region,
                     const Point3 & color_cb_center,
                     PlaneInfo & plane_info);
 
   Size1 max_threads_;
+  Size1 local_update_samples_;
+  Size1 pipeline_depth_;
+
+  bool has_depth_intrinsics_;
+  Scalar depth_intrinsics_[4];
+  bool evict_clouds_;
+  Size1 global_sample_budget_;
+  unsigned int sampling_seed_;
+  DebugCapture::Ptr debug_capture_;
+
+  // State of addStreamingData()
+  Size1 streaming_frames_;
+  Size1 streaming_new_samples_;
+  Size1 streaming_updates_;
+  Scalar last_streaming_change_;
+  PCLCloud3::Ptr streaming_region_cloud_;
+  Size2 streaming_bins_;
+  std::vector<Size1> streaming_bin_frames_;
 
   LocalModel::Ptr local_model_;
   LocalMatrixFitPCL::Ptr local_fit_;
@@ -0,0 +1,118 @@
+/*
+ *  Copyright (c) 2013-2014, Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *     3. Neither the name of the copyright holder(s) nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RGBD_CALIBRATION_DEPTH_UNDISTORTION_NODELET_H_
+#define RGBD_CALIBRATION_DEPTH_UNDISTORTION_NODELET_H_
+
+#include <ros/ros.h>
+#include <nodelet/nodelet.h>
+#include <image_transport/image_transport.h>
+#include <sensor_msgs/Image.h>
+#include <sensor_msgs/CameraInfo.h>
+
+#include <kinect/depth/sensor.h>
+
+#include <rgbd_calibration/globals.h>
+#include <rgbd_calibration/ray_table.h>
+#include <rgbd_calibration/undistortion_kernel.h>
+
+namespace calibration
+{
+
+/*
+ * Applies the calibrated depth undistortion to a live depth stream. Subscribes to depth/image_raw (and its camera info)
+ * and publishes depth_und/image_raw, with the same encoding, and depth_und/points. Messages are published as shared
+ * pointers, so nodelets in the same manager receive them without any copy.
+ *
+ * Parameters:
+ *   ~model_file          binary undistortion model (see model_file.h), replaces the two matrices
+ *   ~local_matrix_file   local undistortion matrix (required without model_file)
+ *   ~global_matrix_file  global undistortion matrix (optional)
+ *   ~publish_cloud       publish the undistorted point cloud (default true)
+ *   ~stats_period        seconds between two latency reports (default 10, 0 to disable)
+ */
+class DepthUndistortionNodelet : public nodelet::Nodelet
+{
+public:
+
+  DepthUndistortionNodelet();
+
+  virtual
+  ~DepthUndistortionNodelet()
+  {
+    // Do nothing
+  }
+
+  virtual void
+  onInit();
+
+private:
+
+  void
+  depthCallback(const sensor_msgs::Image::ConstPtr & depth_msg,
+                const sensor_msgs::CameraInfo::ConstPtr & info_msg);
+
+  bool
+  updateKernel(const sensor_msgs::CameraInfo::ConstPtr & info_msg,
+               int cols,
+               int rows);
+
+  void
+  updateStats(double processing_time,
+              double latency);
+
+  boost::shared_ptr<image_transport::ImageTransport> image_transport_;
+  image_transport::CameraSubscriber depth_sub_;
+  image_transport::Publisher depth_pub_;
+  ros::Publisher cloud_pub_;
+
+  std::string local_matrix_file_;
+  std::string global_matrix_file_;
+  bool publish_cloud_;
+  double stats_period_;
+
+  ModelFile::ConstPtr model_file_;
+  LocalModel::Data::Ptr local_data_;
+  GlobalModel::Data::Ptr global_data_;
+
+  sensor_msgs::CameraInfo::ConstPtr camera_info_msg_;
+  KinectDepthCameraModel::ConstPtr camera_model_;
+  UndistortionKernel kernel_;
+  RayTable ray_table_;
+
+  ros::WallTime stats_start_;
+  int stats_frames_;
+  double stats_processing_sum_;
+  double stats_processing_max_;
+  double stats_latency_sum_;
+  double stats_latency_max_;
+
+};
+
+} /* namespace calibration */
+#endif /* RGBD_CALIBRATION_DEPTH_UNDISTORTION_NODELET_H_ */
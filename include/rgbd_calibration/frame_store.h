@@ -0,0 +1,117 @@
+/*
+ *  Copyright (c) 2013-2014, Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *     3. Neither the name of the copyright holder(s) nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RGBD_CALIBRATION_FRAME_STORE_H_
+#define RGBD_CALIBRATION_FRAME_STORE_H_
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+
+#include <opencv2/core/core.hpp>
+
+#include <rgbd_calibration/globals.h>
+
+namespace calibration
+{
+
+/*
+ * Spool file for the frames of an out-of-core calibration. Frames are appended as a FrameHeader, the raw color image
+ * and the x, y, z floats of the (already downsampled) organized cloud. Reads map only the requested frame, so a frame
+ * costs memory only while it is used. The file is temporary: it is truncated by open() and removed by close().
+ */
+class FrameStore
+{
+public:
+
+  typedef boost::shared_ptr<FrameStore> Ptr;
+  typedef boost::shared_ptr<const FrameStore> ConstPtr;
+
+#pragma pack(push, 1)
+  struct FrameHeader
+  {
+    boost::uint32_t image_rows_;
+    boost::uint32_t image_cols_;
+    boost::uint32_t image_type_;
+    boost::uint32_t cloud_width_;
+    boost::uint32_t cloud_height_;
+  };
+#pragma pack(pop)
+
+  FrameStore();
+
+  virtual
+  ~FrameStore();
+
+  bool
+  open(const std::string & file_name);
+
+  void
+  close();
+
+  // Can be called from several threads at once. Returns the index of the frame, -1 on error.
+  int
+  add(const cv::Mat & image,
+      const PCLCloud3 & cloud);
+
+  // Can be called from several threads at once, also while frames are added.
+  bool
+  readImage(size_t index,
+            cv::Mat & image) const;
+
+  bool
+  readCloud(size_t index,
+            PCLCloud3 & cloud) const;
+
+  inline size_t
+  size() const
+  {
+    return offsets_.size();
+  }
+
+private:
+
+  const char *
+  map(size_t index,
+      boost::interprocess::mapped_region & region) const;
+
+  std::string file_name_;
+  std::ofstream file_;
+  boost::interprocess::file_mapping file_mapping_;
+
+  std::vector<boost::uint64_t> offsets_; // Of the FrameHeaders
+  std::vector<boost::uint64_t> sizes_;   // FrameHeader included
+
+};
+
+} /* namespace calibration */
+#endif /* RGBD_CALIBRATION_FRAME_STORE_H_ */
@@ -0,0 +1,159 @@
+/*
+ *  Copyright (c) 2013-2014, Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *     3. Neither the name of the copyright holder(s) nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RGBD_CALIBRATION_MODEL_FILE_H_
+#define RGBD_CALIBRATION_MODEL_FILE_H_
+
+#include <string>
+
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <rgbd_calibration/globals.h>
+
+namespace calibration
+{
+
+/*
+ * Binary undistortion model, loaded in a few milliseconds instead of parsing the matrices written by
+ * PolynomialUndistortionMatrixIO (which are still written for debugging). The file is a FileHeader followed by
+ * sections, each one starting at a multiple of ALIGNMENT bytes:
+ *  - LOCAL and GLOBAL: a MatrixHeader and the double coefficients of the matrix, node after node, row-major;
+ *  - KERNEL (optional): a KernelHeader and the float coefficient planes of UndistortionKernel for the sensor
+ *    resolution, each plane aligned too.
+ * Readers map the whole file: UndistortionKernel::load() uses the kernel planes in place, without any copy.
+ * Degrees are checked against the ones the package is built with (see globals.h).
+ */
+class ModelFile
+{
+public:
+
+  typedef boost::shared_ptr<ModelFile> Ptr;
+  typedef boost::shared_ptr<const ModelFile> ConstPtr;
+
+  static const char MAGIC[8];
+  static const boost::uint32_t VERSION = 1;
+  static const boost::uint64_t ALIGNMENT = 64;
+
+#pragma pack(push, 1)
+  struct FileHeader
+  {
+    char magic_[8];
+    boost::uint32_t version_;
+    boost::uint32_t cols_; // Sensor resolution
+    boost::uint32_t rows_;
+    boost::uint32_t local_degree_;
+    boost::uint32_t local_min_degree_;
+    boost::uint32_t global_degree_;
+    boost::uint32_t global_min_degree_;
+    boost::uint64_t local_offset_;
+    boost::uint64_t global_offset_;
+    boost::uint64_t kernel_offset_; // 0 if there is no kernel
+  };
+
+  struct MatrixHeader
+  {
+    boost::uint32_t matrix_cols_; // Nodes
+    boost::uint32_t matrix_rows_;
+    boost::uint32_t bin_cols_;    // Pixels, at the sensor resolution
+    boost::uint32_t bin_rows_;
+    boost::uint64_t data_offset_; // Of the coefficients
+  };
+
+  struct KernelHeader
+  {
+    boost::uint32_t local_size_;  // Planes
+    boost::uint32_t global_size_;
+    boost::uint64_t data_offset_; // Of the first plane
+    boost::uint64_t plane_stride_;
+  };
+#pragma pack(pop)
+
+  ModelFile();
+
+  // The models are written for the resolution cols x rows, global_model can be NULL (identity). With write_kernel
+  // the undistortion kernel for that resolution is baked and written too.
+  static bool
+  write(const std::string & file_name,
+        const LocalModel::ConstPtr & local_model,
+        const GlobalModel::ConstPtr & global_model,
+        int cols,
+        int rows,
+        bool write_kernel = true);
+
+  bool
+  open(const std::string & file_name);
+
+  inline const FileHeader &
+  header() const
+  {
+    return *reinterpret_cast<const FileHeader *>(region_.get_address());
+  }
+
+  inline bool
+  hasKernel() const
+  {
+    return header().kernel_offset_ != 0;
+  }
+
+  // Copies of the matrices, for a model of any resolution.
+  LocalModel::Data::Ptr
+  localMatrix() const;
+
+  GlobalModel::Data::Ptr
+  globalMatrix() const;
+
+  // The index-th plane of the local / global coefficients of the kernel, cols() * rows() floats.
+  const float *
+  localPlane(int index) const;
+
+  const float *
+  globalPlane(int index) const;
+
+private:
+
+  template <typename MatrixT>
+    typename MatrixT::Ptr
+    readMatrix(boost::uint64_t offset,
+               int size) const;
+
+  const char *
+  at(boost::uint64_t offset) const
+  {
+    return static_cast<const char *>(region_.get_address()) + offset;
+  }
+
+  boost::interprocess::file_mapping file_mapping_;
+  boost::interprocess::mapped_region region_;
+
+};
+
+} /* namespace calibration */
+#endif /* RGBD_CALIBRATION_MODEL_FILE_H_ */
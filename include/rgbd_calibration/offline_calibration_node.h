@@ -18,7 +18,14 @@
 #ifndef RGBD_CALIBRATION_OFFLINE_CALIBRATION_NODE_H_
 #define RGBD_CALIBRATION_OFFLINE_CALIBRATION_NODE_H_
 
+#include <map>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
 #include <rgbd_calibration/calibration_node.h>
+#include <rgbd_calibration/dataset_io.h>
+#include <rgbd_calibration/ray_table.h>
 
 namespace calibration
 {
@@ -46,6 +53,49 @@ public:
 
 protected:
 
+  // Ray table for frames of cols x rows. A frame of another size replaces the table with a new one, the frames still
+  // using the previous one keep their own reference.
+  RayTable::ConstPtr
+  rayTable (int cols,
+            int rows) const;
+
+  bool
+  loadData (size_t index,
+            cv::Mat & image,
+            PCLCloud3::Ptr & cloud) const;
+
+  bool
+  loadData (const std::string & image_file,
+            const std::string & cloud_file,
+            cv::Mat & image,
+            PCLCloud3::Ptr & cloud) const;
+
+  typedef std::vector<std::pair<std::string, std::string> > FileVector;
+
+  struct LoadedFrame
+  {
+    bool loaded_;
+    cv::Mat image_;
+    PCLCloud3::Ptr cloud_;
+  };
+
+  /* Frames loaded ahead of the one to be added next, at most loader_queue_size_ of them. */
+  struct FrameLoader
+  {
+    boost::mutex mutex_;
+    boost::condition_variable ready_condition_;
+    boost::condition_variable space_condition_;
+    std::map<Size1, LoadedFrame> frames_;
+    Size1 size_;
+    Size1 next_;
+    Size1 consumed_;
+    bool stop_;
+  };
+
+  void
+  loaderLoop (FrameLoader & loader,
+              const FileVector & file_vec) const;
+
   int instances_;
   int starting_index_;
 
@@ -56,6 +106,17 @@ protected:
 
   DepthType depth_type_;
 
+  int loader_threads_;
+  int loader_queue_size_;
+
+  DatasetReader::Ptr dataset_reader_;
+  mutable boost::mutex ray_table_mutex_;
+  mutable RayTable::ConstPtr ray_table_;
+
+  std::string profile_file_;
+  std::string cb_cache_file_;
+  std::string frame_store_file_;
+
 };
 
 } /* namespace calibration */
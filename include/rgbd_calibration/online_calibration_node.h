@@ -0,0 +1,127 @@
+/*
+ *  Copyright (C) 2013 - Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RGBD_CALIBRATION_ONLINE_CALIBRATION_NODE_H_
+#define RGBD_CALIBRATION_ONLINE_CALIBRATION_NODE_H_
+
+#include <deque>
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <image_transport/image_transport.h>
+#include <sensor_msgs/PointCloud2.h>
+
+#include <rgbd_calibration/Acquisition.h>
+#include <rgbd_calibration/calibration_node.h>
+#include <rgbd_calibration/ray_table.h>
+
+namespace calibration
+{
+
+/*
+ * Calibration while the data is collected. Every Acquisition message takes the last image and point cloud, as
+ * DataCollectionNode does, and queues them in memory. A worker thread extracts the checkerboard views and folds their
+ * planes into the running undistortion fits (see Calibration::addStreamingData()), then publishes the coverage and
+ * the convergence of the local model on "progress". Once capturing is over (shutdown, or convergence with
+ * "finish_on_convergence"), the whole calibration runs on the collected frames and the results are written to "path".
+ */
+class OnlineCalibrationNode : public CalibrationNode
+{
+public:
+
+  OnlineCalibrationNode (ros::NodeHandle & node_handle);
+
+  virtual
+  ~OnlineCalibrationNode ();
+
+  virtual bool
+  initialize ();
+
+  virtual void
+  spin ();
+
+protected:
+
+  struct Frame
+  {
+    sensor_msgs::Image::ConstPtr image_msg_;
+    sensor_msgs::PointCloud2::ConstPtr cloud_msg_;
+  };
+
+  void
+  imageCallback (const sensor_msgs::Image::ConstPtr & msg);
+
+  void
+  pointCloudCallback (const sensor_msgs::PointCloud2::ConstPtr & msg);
+
+  void
+  actionCallback (const rgbd_calibration::Acquisition::ConstPtr & msg);
+
+  void
+  workerLoop ();
+
+  void
+  process (const Frame & frame);
+
+  void
+  stopWorker ();
+
+  std::string path_;
+  bool reproject_cloud_;
+  bool finish_on_convergence_;
+
+  // Convergence: at least min_coverage_ of the bins seen by coverage_frames_ planes, and the local model changed by
+  // less than max_change_ meters in the last converged_updates_ updates
+  int coverage_frames_;
+  double min_coverage_;
+  double max_change_;
+  int converged_updates_;
+
+  image_transport::ImageTransport image_transport_;
+  image_transport::Subscriber image_sub_;
+  ros::Subscriber cloud_sub_;
+  ros::Subscriber action_sub_;
+  ros::Publisher progress_pub_;
+
+  sensor_msgs::Image::ConstPtr image_msg_;
+  sensor_msgs::PointCloud2::ConstPtr cloud_msg_;
+
+  RayTable ray_table_;
+
+  // Worker thread and its bounded queue
+  boost::thread worker_thread_;
+  boost::mutex queue_mutex_;
+  boost::condition_variable queue_condition_;
+  std::deque<Frame> queue_;
+  int queue_size_;
+  bool stop_;
+
+  // Protected by queue_mutex_
+  int acquisitions_;
+  int dropped_;
+  bool converged_;
+
+  // Used by the worker thread only
+  Size1 last_updates_;
+  int stable_updates_;
+
+};
+
+} /* namespace calibration */
+#endif /* RGBD_CALIBRATION_ONLINE_CALIBRATION_NODE_H_ */
@@ -0,0 +1,177 @@
+/*
+ *  Copyright (c) 2013-2014, Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *     3. Neither the name of the copyright holder(s) nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RGBD_CALIBRATION_ORGANIZED_PLANE_EXTRACTION_H_
+#define RGBD_CALIBRATION_ORGANIZED_PLANE_EXTRACTION_H_
+
+#include <vector>
+
+#include <calibration_common/algorithms/plane_extraction.h>
+
+#include <rgbd_calibration/globals.h>
+
+namespace calibration
+{
+
+/*
+ * Plane extraction around a point of an organized cloud. The search sphere is projected into the depth image, so only
+ * the pixels of its bounding box are visited, and only the points whose ray passes within radius of the point are
+ * kept: the depth of the point can be wrong (e.g. a distorted cloud), its direction cannot. The points must also lie
+ * within the search sphere grown by a tolerance from the depth error model, so that the background seen through the
+ * sphere and the objects in front of it are not candidates. A RANSAC with an adaptive
+ * number of hypotheses, each dropped as soon as it cannot beat the best one, finds the plane that is then refined by
+ * least squares. The inliers are found in a single pass over the candidates.
+ */
+class OrganizedPlaneExtraction
+{
+public:
+
+  typedef boost::shared_ptr<OrganizedPlaneExtraction> Ptr;
+  typedef boost::shared_ptr<const OrganizedPlaneExtraction> ConstPtr;
+
+  OrganizedPlaneExtraction();
+
+  inline void
+  setInputCloud(const PCLCloud3::ConstPtr & cloud)
+  {
+    cloud_ = cloud;
+  }
+
+  // Intrinsics of the cloud (binned if the cloud is downsampled). Without them the whole cloud is visited.
+  inline void
+  setIntrinsics(Scalar fx,
+                Scalar fy,
+                Scalar cx,
+                Scalar cy)
+  {
+    fx_ = fx;
+    fy_ = fy;
+    cx_ = cx;
+    cy_ = cy;
+    has_intrinsics_ = true;
+  }
+
+  inline void
+  setPoint(const Point3 & point)
+  {
+    point_ = point;
+  }
+
+  inline void
+  setRadius(Scalar radius)
+  {
+    radius_ = radius;
+  }
+
+  // The inlier threshold is threshold_factor times the depth error at the depth of the point.
+  inline void
+  setDepthErrorFunction(const Polynomial<Scalar, 2> & depth_error_function)
+  {
+    depth_error_function_ = depth_error_function;
+  }
+
+  inline void
+  setThresholdFactor(Scalar threshold_factor)
+  {
+    threshold_factor_ = threshold_factor;
+  }
+
+  // The candidates are at most radius plus depth_tolerance_factor times the depth error at the depth of the point from
+  // the point.
+  inline void
+  setDepthToleranceFactor(Scalar depth_tolerance_factor)
+  {
+    depth_tolerance_factor_ = depth_tolerance_factor;
+  }
+
+  inline void
+  setMaxIterations(int max_iterations)
+  {
+    max_iterations_ = max_iterations;
+  }
+
+  inline void
+  setMinInliers(int min_inliers)
+  {
+    min_inliers_ = min_inliers;
+  }
+
+  bool
+  extract(PlaneInfo & plane_info);
+
+  // Bounding box [min_x, max_x) x [min_y, max_y) of the pixels of a width x height image whose ray passes within
+  // radius of point, for the given intrinsics. The whole image if point is not farther than radius.
+  static void
+  boundingBox(Scalar fx,
+              Scalar fy,
+              Scalar cx,
+              Scalar cy,
+              const Point3 & point,
+              Scalar radius,
+              int width,
+              int height,
+              int & min_x,
+              int & max_x,
+              int & min_y,
+              int & max_y);
+
+  // RANSAC hypotheses of the last extract().
+  inline int
+  iterations() const
+  {
+    return iterations_;
+  }
+
+private:
+
+  void
+  collectCandidates(std::vector<int> & candidates) const;
+
+  PCLCloud3::ConstPtr cloud_;
+
+  bool has_intrinsics_;
+  Scalar fx_;
+  Scalar fy_;
+  Scalar cx_;
+  Scalar cy_;
+
+  Point3 point_;
+  Scalar radius_;
+
+  Polynomial<Scalar, 2> depth_error_function_;
+  Scalar threshold_factor_;
+  Scalar depth_tolerance_factor_;
+
+  int max_iterations_;
+  int min_inliers_;
+  int iterations_;
+
+};
+
+} /* namespace calibration */
+#endif /* RGBD_CALIBRATION_ORGANIZED_PLANE_EXTRACTION_H_ */
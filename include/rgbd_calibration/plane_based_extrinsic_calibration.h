@@ -25,6 +25,12 @@
 namespace calibration
 {
 
+/*
+ * Extrinsic calibration of several sensors observing the same planes. Planes are stored in a contiguous 4 x (views *
+ * sensors) coefficient array, view-major, with a validity mask: sensors are indexed once when first seen. perform()
+ * estimates the closed-form transform of every sensor w.r.t. the main one, concurrently; optimize() then refines all
+ * of them jointly, with one plane per view shared by all the sensors that observe it.
+ */
 class PlaneBasedExtrinsicCalibration
 {
 public:
@@ -32,78 +38,60 @@ public:
   typedef boost::shared_ptr<PlaneBasedExtrinsicCalibration> Ptr;
   typedef boost::shared_ptr<const PlaneBasedExtrinsicCalibration> ConstPtr;
 
+  PlaneBasedExtrinsicCalibration();
+
   void addData(size_t index,
                const Sensor::Ptr & sensor,
-               const PlanarObject::ConstPtr & data)
-  {
-    assert(index < data_map_.size());
-    data_map_[index][sensor] = data;
-  }
+               const PlanarObject::ConstPtr & data);
 
-  void setSize(size_t size)
-  {
-    data_map_.resize(size);
-  }
+  void setSize(size_t size);
 
   size_t size() const
   {
-    return data_map_.size();
+    return views_;
   }
 
-  size_t appendData(const std::map<Sensor::Ptr, PlanarObject::ConstPtr> & data)
-  {
-    data_map_.push_back(data);
-    return data_map_.size();
-  }
+  size_t appendData(const std::map<Sensor::Ptr, PlanarObject::ConstPtr> & data);
 
-  void setMainSensor(const Sensor::Ptr & world)
+  void setMainSensor(const Sensor::Ptr & world);
+
+  void setNumThreads(int num_threads)
   {
-    world_ = world;
+    assert(num_threads > 0);
+    num_threads_ = num_threads;
   }
 
-  void perform()
-  {
-    std::map<Sensor::Ptr, PlaneToPlaneCalibration> calib_map;
-    for (size_t i = 0; i < data_map_.size(); ++i)
-    {
-      std::map<Sensor::Ptr, PlanarObject::ConstPtr> & data_map = data_map_[i];
-      if (data_map.find(world_) == data_map.end())
-        continue;
-      const PlanarObject::ConstPtr & world_data = data_map_[i][world_];
-      for (std::map<Sensor::Ptr, PlanarObject::ConstPtr>::const_iterator it = data_map.begin(); it != data_map.end(); ++it)
-      {
-        const Sensor::Ptr & sensor = it->first;
-        const PlanarObject::ConstPtr & sensor_data = it->second;
-        if (sensor != world_)
-          calib_map[sensor].addPair(world_data->plane(), sensor_data->plane());
-      }
-
-    }
-
-    for (std::map<Sensor::Ptr, PlaneToPlaneCalibration>::iterator it = calib_map.begin(); it != calib_map.end(); ++it)
-    {
-      const Sensor::Ptr & sensor = it->first;
-
-      if (calib_map[sensor].getPairNumber() > 5)
-      {
-        sensor->setParent(world_);
-        sensor->setPose(calib_map[sensor].estimateTransform());
-      }
-      else
-        sensor->setParent(Sensor::ConstPtr());
-    }
+  // Sensors with less than 6 planes in common with the main one get no parent.
+  void perform();
 
-  }
+  // Joint refinement of the poses of the sensors calibrated by perform().
+  void optimize();
+
+protected:
 
-  void optimize()
+  int sensorIndex(const Sensor::Ptr & sensor);
+
+  inline size_t offset(size_t view,
+                       int sensor) const
   {
-    // TODO implement!!
+    return view * sensors_.size() + sensor;
   }
 
-protected:
+  inline Plane plane(size_t view,
+                     int sensor) const
+  {
+    return Plane(planes_.col(offset(view, sensor)).head<3>(), planes_(3, offset(view, sensor)));
+  }
 
   Sensor::Ptr world_;
-  std::vector<std::map<Sensor::Ptr, PlanarObject::ConstPtr> > data_map_;
+
+  std::vector<Sensor::Ptr> sensors_;
+  size_t views_;
+
+  Eigen::Matrix<Scalar, 4, Eigen::Dynamic> planes_; // Column offset(view, sensor), normalized coefficients
+  std::vector<unsigned char> valid_;
+
+  int num_threads_;
 
 };
 
@@ -0,0 +1,146 @@
+/*
+ *  Copyright (c) 2013-2014, Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *     3. Neither the name of the copyright holder(s) nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RGBD_CALIBRATION_PROFILER_H_
+#define RGBD_CALIBRATION_PROFILER_H_
+
+#include <map>
+#include <string>
+#include <ros/time.h>
+
+namespace calibration
+{
+
+/*
+ * Process-wide registry of stage timers, counters, values and histograms. All the methods are thread-safe.
+ * Names use '/' to group entries, e.g. "extract_plane/failed". writeJSON() dumps everything for the current run.
+ */
+class Profiler
+{
+public:
+
+  struct Timer
+  {
+    Timer()
+      : count_(0),
+        total_(0.0),
+        min_(0.0),
+        max_(0.0)
+    {
+      // Do nothing
+    }
+
+    int count_;
+    double total_;
+    double min_;
+    double max_;
+  };
+
+  // Adds the time elapsed between construction and destruction to the timer with the given name.
+  class ScopedTimer
+  {
+  public:
+
+    explicit
+    ScopedTimer(const std::string & name)
+      : name_(name),
+        start_(ros::WallTime::now())
+    {
+      // Do nothing
+    }
+
+    ~ScopedTimer()
+    {
+      Profiler::instance().addTime(name_, (ros::WallTime::now() - start_).toSec());
+    }
+
+  private:
+
+    const std::string name_;
+    const ros::WallTime start_;
+
+  };
+
+  static Profiler &
+  instance();
+
+  void
+  addTime(const std::string & name,
+          double seconds);
+
+  void
+  increment(const std::string & name,
+            long count = 1);
+
+  void
+  setValue(const std::string & name,
+           double value);
+
+  void
+  addToHistogram(const std::string & name,
+                 int bin,
+                 long count = 1);
+
+  // Records iterations, costs and times of a ceres::Solver::Summary under prefix.
+  template <typename SummaryT>
+    void
+    addSolverSummary(const std::string & prefix,
+                     const SummaryT & summary)
+    {
+      const int iterations = summary.num_successful_steps + summary.num_unsuccessful_steps;
+      setValue(prefix + "/iterations", iterations);
+      setValue(prefix + "/residuals", summary.num_residuals);
+      setValue(prefix + "/initial_cost", summary.initial_cost);
+      setValue(prefix + "/final_cost", summary.final_cost);
+      setValue(prefix + "/solver_time_s", summary.total_time_in_seconds);
+      if (iterations > 0)
+        setValue(prefix + "/time_per_iteration_s", summary.minimizer_time_in_seconds / iterations);
+    }
+
+  void
+  reset();
+
+  bool
+  writeJSON(const std::string & file_name) const;
+
+private:
+
+  Profiler()
+  {
+    // Do nothing
+  }
+
+  std::map<std::string, Timer> timers_;
+  std::map<std::string, long> counters_;
+  std::map<std::string, double> values_;
+  std::map<std::string, std::map<int, long> > histograms_;
+
+};
+
+} /* namespace calibration */
+#endif /* RGBD_CALIBRATION_PROFILER_H_ */
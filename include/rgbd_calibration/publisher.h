@@ -18,8 +18,15 @@
 #ifndef RGBD_CALIBRATION_PUBLISHER_H_
 #define RGBD_CALIBRATION_PUBLISHER_H_
 
+#include <map>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/weak_ptr.hpp>
+
 #include <ros/ros.h>
 #include <tf/transform_broadcaster.h>
+#include <visualization_msgs/MarkerArray.h>
 #include <rgbd_calibration/checkerboard_views.h>
 
 namespace calibration
@@ -40,6 +47,33 @@ private:
     ros::Publisher rgbd_pub_;
   };
 
+  struct BatchedView
+  {
+    BatchedView()
+      : changed_(false)
+    {
+      // Do nothing
+    }
+
+    Checkerboard::ConstPtr checkerboard_;
+    Eigen::Matrix<Scalar, 4, 4, Eigen::DontAlign> pose_;
+    visualization_msgs::Marker marker_;
+    bool changed_;
+  };
+
+  struct BatchedData
+  {
+    BatchedData()
+      : changed_(false)
+    {
+      // Do nothing
+    }
+
+    boost::weak_ptr<const PCLCloud3> published_; // Only to detect changes: the cloud is not kept alive
+    PCLCloud3::ConstPtr pending_; // Released as soon as it is decimated
+    bool changed_;
+  };
+
 public:
 
   typedef boost::shared_ptr<Publisher> Ptr;
@@ -47,6 +81,16 @@ public:
 
   Publisher(const ros::NodeHandle & node_handle);
 
+  ~Publisher();
+
+  // Batched mode: publish() only records what changed and a background thread sends, at most rate times per second,
+  // one MarkerArray with all the checkerboards ("batch/markers") and one cloud with every decimation-th row and
+  // column of all the data ("batch/cloud"), both latched and sent only if something changed. Only the data whose cloud
+  // changed is decimated again, and only the decimated copies are kept. The fused RGB clouds are not published.
+  // publishTF() is not batched.
+  void startBatching(double rate,
+                     int decimation);
+
   void publish(const CheckerboardViews & rgbd,
                const std::string & prefix = "");
 
@@ -59,6 +103,11 @@ public:
 
 private:
 
+  void batchLoop();
+
+  void publishBatch(const visualization_msgs::MarkerArray & markers,
+                    const std::map<int, PCLCloud3::ConstPtr> & changed_clouds);
+
   ros::NodeHandle node_handle_;
   ros::Publisher marker_pub_;
   tf::TransformBroadcaster tf_pub_;
@@ -66,6 +115,24 @@ private:
   std::map<int, DataPublisherSet> d_pub_map_;
   std::map<std::string, CheckerboardPublisherSet> c_pub_map_;
 
+  bool batched_;
+  double batch_rate_;
+  int decimation_;
+
+  ros::Publisher batch_marker_pub_;
+  ros::Publisher batch_cloud_pub_;
+
+  boost::thread batch_thread_;
+  boost::mutex batch_mutex_;
+  boost::condition_variable batch_condition_;
+  bool stop_;
+  bool batch_changed_;
+
+  std::map<std::string, BatchedView> batched_views_;
+  std::map<int, BatchedData> batched_data_;
+  std::map<int, PCLCloud3> decimated_clouds_; // Only used by the batch thread
+
+
 };
 
 } /* namespace calibration */
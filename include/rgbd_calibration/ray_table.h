@@ -0,0 +1,114 @@
+/*
+ *  Copyright (c) 2013-2014, Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *     3. Neither the name of the copyright holder(s) nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RGBD_CALIBRATION_RAY_TABLE_H_
+#define RGBD_CALIBRATION_RAY_TABLE_H_
+
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+#include <kinect/depth/sensor.h>
+
+#include <rgbd_calibration/globals.h>
+
+namespace calibration
+{
+
+/*
+ * Per-pixel rays (x / z, y / z) of a depth camera, stored as two float arrays. A point of the cloud is z * (x_, y_, 1),
+ * so clouds are built from the depth only. The table is rebuilt only when the intrinsics, delta or the size change.
+ */
+class RayTable
+{
+public:
+
+  typedef boost::shared_ptr<RayTable> Ptr;
+  typedef boost::shared_ptr<const RayTable> ConstPtr;
+
+  RayTable();
+
+  // delta = {fx scale, fy scale, cx offset, cy offset}, as optimized by Calibration::optimizeAll().
+  // Returns true if the table has been rebuilt.
+  bool
+  update(const KinectDepthCameraModel & camera_model,
+         int cols,
+         int rows,
+         const double * delta = NULL);
+
+  // z is a row-major buffer of cols() * rows() depths in meters. Non-positive depths are set to NaN.
+  void
+  toCloud(const float * z,
+          PCLCloud3 & cloud) const;
+
+  // depth is CV_16UC1 (millimeters) or CV_32FC1 (meters).
+  void
+  toCloud(const cv::Mat & depth,
+          PCLCloud3 & cloud) const;
+
+  // Recomputes x and y of every point from z.
+  void
+  reproject(PCLCloud3 & cloud) const;
+
+  inline int
+  cols() const
+  {
+    return cols_;
+  }
+
+  inline int
+  rows() const
+  {
+    return rows_;
+  }
+
+  inline const std::vector<float> &
+  x() const
+  {
+    return x_;
+  }
+
+  inline const std::vector<float> &
+  y() const
+  {
+    return y_;
+  }
+
+private:
+
+  cv::Matx33d K_;
+  double delta_[4];
+  int cols_;
+  int rows_;
+
+  std::vector<float> x_;
+  std::vector<float> y_;
+
+};
+
+} /* namespace calibration */
+#endif /* RGBD_CALIBRATION_RAY_TABLE_H_ */
@@ -0,0 +1,88 @@
+/*
+ *  Copyright (c) 2013-2014, Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *     3. Neither the name of the copyright holder(s) nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RGBD_CALIBRATION_RESIDUAL_ARENA_H_
+#define RGBD_CALIBRATION_RESIDUAL_ARENA_H_
+
+#include <cassert>
+#include <Eigen/Core>
+
+#include <rgbd_calibration/globals.h>
+
+namespace calibration
+{
+
+/*
+ * Contiguous storage for the per-sample data of the residual blocks of a Ceres problem. Every block gets a span of
+ * columns from allocate() and keeps only a pointer to its first column and the number of columns. The storage is
+ * allocated once with the total capacity and freed at once with the arena, which must outlive the problem.
+ */
+template <typename ScalarT, int Rows>
+  class ResidualArena
+  {
+  public:
+
+    typedef Eigen::Matrix<ScalarT, Rows, Eigen::Dynamic> Storage;
+    typedef Eigen::Map<Storage> Span;
+    typedef Eigen::Map<const Storage> ConstSpan;
+
+    explicit ResidualArena(Size1 capacity)
+      : storage_(Rows, capacity),
+        size_(0)
+    {
+      // Do nothing
+    }
+
+    // Columns are never moved: spans stay valid as long as the arena.
+    inline Span allocate(Size1 columns)
+    {
+      assert(size_ + columns <= capacity());
+      Span span(storage_.data() + Rows * size_, Rows, columns);
+      size_ += columns;
+      return span;
+    }
+
+    inline Size1 size() const
+    {
+      return size_;
+    }
+
+    inline Size1 capacity() const
+    {
+      return storage_.cols();
+    }
+
+  private:
+
+    Storage storage_;
+    Size1 size_;
+
+  };
+
+} /* namespace calibration */
+#endif /* RGBD_CALIBRATION_RESIDUAL_ARENA_H_ */
@@ -0,0 +1,77 @@
+/*
+ *  Copyright (c) 2013-2014, Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *     3. Neither the name of the copyright holder(s) nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RGBD_CALIBRATION_SENSOR_PROFILE_H_
+#define RGBD_CALIBRATION_SENSOR_PROFILE_H_
+
+#include <string>
+
+#include <rgbd_calibration/globals.h>
+
+/*
+ * Supported depth sensors: name, depth image columns and rows. Every entry also gets a fixed-size instantiation of the
+ * undistortion kernel (see undistortion_kernel.cpp), so adding a sensor here is all that is needed to support it.
+ */
+#define RGBD_CALIBRATION_SENSOR_PROFILES(PROFILE) \
+  PROFILE(kinect,  640, 480)                      \
+  PROFILE(kinect2, 512, 424)                      \
+  PROFILE(pepper,  320, 240)
+
+namespace calibration
+{
+
+/*
+ * Registry entry of a supported depth sensor. The polynomial degrees are not part of it: they are those of the models
+ * in globals.h, shared by all the profiles of a build.
+ */
+struct SensorProfile
+{
+  static const char * const DEFAULT_NAME;
+
+  std::string name_;
+  int cols_;
+  int rows_;
+
+  // Returns false if no profile has that name.
+  static bool
+  find(const std::string & name,
+       SensorProfile & profile);
+
+  // As find(), but falls back to the DEFAULT_NAME profile (with a warning) if no profile has that name.
+  static void
+  findOrDefault(const std::string & name,
+                SensorProfile & profile);
+
+  // Comma separated, for the messages.
+  static std::string
+  names();
+
+};
+
+} /* namespace calibration */
+#endif /* RGBD_CALIBRATION_SENSOR_PROFILE_H_ */
@@ -19,26 +19,76 @@
 #define RGBD_CALIBRATION_SIMULATION_NODE_H_
 
 #include <rgbd_calibration/calibration_node.h>
+#include <rgbd_calibration/ray_table.h>
 
 namespace calibration
 {
 
+/*
+ * Benchmark on synthetic data. Generates checkerboard views with a known distortion, depth noise and image noise, runs
+ * the whole calibration on them and writes the stage timings, the undistortion kernel throughput and the accuracy of
+ * the result to a JSON report. Every frame has its own seed, so runs are reproducible whatever the number of threads.
+ */
 class SimulationNode : public CalibrationNode
 {
 public:
 
-  SimulationNode(ros::NodeHandle & node_handle);
+  SimulationNode (ros::NodeHandle & node_handle);
+
+  virtual bool
+  initialize ();
 
-  virtual void spin();
+  virtual void
+  spin ();
 
 protected:
 
+  struct Frame
+  {
+    cv::Mat image_;      // CV_8UC3
+    cv::Mat depth_;      // CV_32FC1, distorted and noisy, meters
+    cv::Mat true_depth_; // CV_32FC1, meters
+    cv::Mat board_mask_; // CV_8UC1, 255 where the checkerboard is seen by the depth sensor
+  };
+
+  void
+  generateFrame (unsigned int seed,
+                 Frame & frame) const;
+
+  // Coordinates of point on the checkerboard plane in cells, the first corner being (0, 0).
+  // Returns true if the point is on the board.
+  static bool
+  boardCoordinates (const Checkerboard & checkerboard,
+                    const Point3 & point,
+                    Scalar & a,
+                    Scalar & b);
+
+  void
+  evaluate ();
+
+  int frames_;
+  int eval_frames_;
+  int kernel_runs_;
+  int seed_;
+
   double depth_error_;
-  double image_error_;
+  double image_noise_;
+  double local_distortion_;
 
   double min_distance_;
   double max_distance_;
-  double step_;
+  double max_angle_;
+  double max_offset_;
+  double pose_noise_;
+
+  std::string report_file_;
+
+  Transform true_pose_;
+  Size2 full_size_;
+
+  std::vector<Vector3> color_rays_;
+  cv::Size color_size_;
+  RayTable depth_ray_table_;
 
 };
 
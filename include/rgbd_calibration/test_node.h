@@ -29,6 +29,7 @@
 
 #include <rgbd_calibration/globals.h>
 #include <rgbd_calibration/calibration_test.h>
+#include <rgbd_calibration/dataset_io.h>
 
 namespace calibration
 {
@@ -85,8 +86,10 @@ protected:
 
   std::string local_matrix_file_;
   std::string global_matrix_file_;
+  std::string model_file_;
 
   int downsample_ratio_;
+  CloudDownsampler::Mode downsample_mode_;
 
   PinholeSensor::Ptr color_sensor_;
   KinectDepthSensor<UndistortionModel>::Ptr depth_sensor_;
@@ -104,6 +107,11 @@ protected:
 
   bool only_show_;
 
+  DatasetReader::Ptr dataset_reader_;
+
+  std::string cb_cache_file_;
+  CheckerboardCache::Ptr cb_cache_;
+
   CalibrationTest::Ptr test_;
 
   Size2 images_size_;
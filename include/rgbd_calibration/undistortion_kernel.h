@@ -0,0 +1,147 @@
+/*
+ *  Copyright (c) 2013-2014, Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *     3. Neither the name of the copyright holder(s) nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RGBD_CALIBRATION_UNDISTORTION_KERNEL_H_
+#define RGBD_CALIBRATION_UNDISTORTION_KERNEL_H_
+
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+#include <rgbd_calibration/globals.h>
+#include <rgbd_calibration/sensor_profile.h>
+#include <rgbd_calibration/model_file.h>
+
+namespace calibration
+{
+
+/*
+ * Whole-image depth undistortion with the local and global models. For every pixel the weighted local and global
+ * polynomials are baked into a single polynomial of the same degree, stored coefficient by coefficient in contiguous
+ * float arrays. Undistorting an image is then two polynomial evaluations per pixel in a loop the compiler can vectorize.
+ * The row loop is a template on the polynomial sizes and on the image width: build() picks the instantiation of the
+ * matching sensor profile (see sensor_profile.h), or the one with a runtime width for the other sizes.
+ */
+class UndistortionKernel
+{
+public:
+
+  typedef boost::shared_ptr<UndistortionKernel> Ptr;
+  typedef boost::shared_ptr<const UndistortionKernel> ConstPtr;
+
+  static const int LOCAL_SIZE = MathTraits<LocalPolynomial>::Size;
+  static const int LOCAL_MIN_DEGREE = MathTraits<LocalPolynomial>::MinDegree;
+  static const int GLOBAL_SIZE = MathTraits<GlobalPolynomial>::Size;
+  static const int GLOBAL_MIN_DEGREE = MathTraits<GlobalPolynomial>::MinDegree;
+
+  UndistortionKernel();
+
+  // Has to be called again every time the models change. global_model can be NULL.
+  void
+  build(const LocalModel::ConstPtr & local_model,
+        const GlobalModel::ConstPtr & global_model,
+        int cols,
+        int rows);
+
+  // Uses the kernel baked in file in place: the file is kept open (mapped) as long as the kernel uses it. Returns false
+  // if file has no kernel or it was baked for polynomials of other degrees.
+  bool
+  load(const ModelFile::ConstPtr & file);
+
+  // depth is CV_16UC1 (millimeters) or CV_32FC1 (meters), und_depth has the same type. Invalid depths are not modified.
+  // depth and und_depth can be the same image.
+  void
+  apply(const cv::Mat & depth,
+        cv::Mat & und_depth) const;
+
+  inline int
+  cols() const
+  {
+    return cols_;
+  }
+
+  inline int
+  rows() const
+  {
+    return rows_;
+  }
+
+  // Name of the sensor profile whose kernel is used, "generic" if none matches the image size.
+  inline const std::string &
+  profile() const
+  {
+    return profile_;
+  }
+
+  // The index-th plane of the local / global coefficients, cols() * rows() floats.
+  inline const float *
+  localPlane(int index) const
+  {
+    return local_planes_[index];
+  }
+
+  inline const float *
+  globalPlane(int index) const
+  {
+    return global_planes_[index];
+  }
+
+private:
+
+  typedef void (*RowFunction)(const UndistortionKernel & kernel,
+                              const float * z,
+                              int row,
+                              float * und_z);
+
+  // Cols == 0 means kernel.cols_.
+  template <int LocalSize, int LocalMinDegree, int GlobalSize, int GlobalMinDegree, int Cols>
+    static void
+    undistortRow(const UndistortionKernel & kernel,
+                 const float * z,
+                 int row,
+                 float * und_z);
+
+  void
+  selectRowFunction();
+
+  int cols_;
+  int rows_;
+
+  std::string profile_;
+  RowFunction row_function_;
+
+  // The planes point either to the coefficients built here or into file_
+  std::vector<float> local_coeffs_[LOCAL_SIZE];
+  std::vector<float> global_coeffs_[GLOBAL_SIZE];
+  const float * local_planes_[LOCAL_SIZE];
+  const float * global_planes_[GLOBAL_SIZE];
+  ModelFile::ConstPtr file_;
+
+};
+
+} /* namespace calibration */
+#endif /* RGBD_CALIBRATION_UNDISTORTION_KERNEL_H_ */
@@ -0,0 +1,543 @@
+/*
+ *  Copyright (C) 2013 - Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+
+#include <ros/ros.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace fs = boost::filesystem;
+
+namespace calibration
+{
+
+/*
+ * Runs the calibration of many datasets, one roslaunch process per dataset, under a shared thread budget.
+ *
+ * Every worker is a machine with its own budget ("threads"). Jobs are started in manifest order on the first worker
+ * with enough free threads, with OMP_NUM_THREADS set to the threads of the job, so the calibration and its Ceres solves
+ * use exactly their share. Remote workers are reached through their "command" prefix, e.g. "ssh lab-2": the dataset
+ * paths must be visible to this machine too (e.g. NFS) for their results to be collected. The report lists, for every
+ * job, its run time, exit status, model files and the profile written by the calibration.
+ */
+class BatchCalibrationNode
+{
+public:
+
+  BatchCalibrationNode (ros::NodeHandle & node_handle);
+
+  bool
+  initialize ();
+
+  void
+  spin ();
+
+protected:
+
+  struct Worker
+  {
+    std::string name_;
+    std::string command_;   // Prefix of the launch command, empty for this machine
+    std::string setup_;     // Script sourced before roslaunch, may be empty
+    int threads_;
+    int free_threads_;
+    int jobs_;
+  };
+
+  struct Job
+  {
+    enum Status
+    {
+      PENDING,
+      RUNNING,
+      DONE,
+      FAILED
+    };
+
+    std::string name_;
+    std::string launch_;
+    std::string path_;
+    std::vector<std::pair<std::string, std::string> > args_;
+    int threads_;
+
+    Status status_;
+    int worker_;
+    pid_t pid_;
+    int exit_status_;
+    std::time_t start_time_;
+    ros::WallTime start_;
+    double wall_time_;
+  };
+
+  static std::string
+  toString (XmlRpc::XmlRpcValue & value);
+
+  static std::string
+  quote (const std::string & text);
+
+  static std::string
+  escapeJSON (const std::string & text);
+
+  bool
+  readWorkers ();
+
+  bool
+  readJobs ();
+
+  // Starts the job on the first worker with enough free threads. False if none.
+  bool
+  start (Job & job);
+
+  void
+  finish (Job & job,
+          int status);
+
+  // Model files of the job written after it started.
+  std::vector<std::string>
+  models (const Job & job) const;
+
+  bool
+  writeReport () const;
+
+  ros::NodeHandle node_handle_;
+
+  std::string launch_package_;
+  std::string log_directory_;
+  std::string report_file_;
+
+  std::vector<Worker> workers_;
+  std::vector<Job> jobs_;
+
+  ros::WallTime start_;
+
+};
+
+BatchCalibrationNode::BatchCalibrationNode (ros::NodeHandle & node_handle)
+  : node_handle_(node_handle)
+{
+  // Do nothing
+}
+
+std::string
+BatchCalibrationNode::toString (XmlRpc::XmlRpcValue & value)
+{
+  switch (value.getType())
+  {
+    case XmlRpc::XmlRpcValue::TypeString:
+      return static_cast<std::string>(value);
+    case XmlRpc::XmlRpcValue::TypeInt:
+      return boost::lexical_cast<std::string>(static_cast<int>(value));
+    case XmlRpc::XmlRpcValue::TypeDouble:
+      return boost::lexical_cast<std::string>(static_cast<double>(value));
+    case XmlRpc::XmlRpcValue::TypeBoolean:
+      return static_cast<bool>(value) ? "true" : "false";
+    default:
+      return std::string();
+  }
+}
+
+std::string
+BatchCalibrationNode::quote (const std::string & text)
+{
+  std::string quoted = "'";
+  for (size_t i = 0; i < text.size(); ++i)
+    quoted += text[i] == '\'' ? std::string("'\\''") : std::string(1, text[i]);
+  return quoted + "'";
+}
+
+std::string
+BatchCalibrationNode::escapeJSON (const std::string & text)
+{
+  std::string escaped;
+  for (size_t i = 0; i < text.size(); ++i)
+  {
+    if (text[i] == '"' or text[i] == '\\')
+      escaped += '\\';
+    escaped += text[i];
+  }
+  return escaped;
+}
+
+bool
+BatchCalibrationNode::readWorkers ()
+{
+  const int local_threads = std::max(1, static_cast<int>(boost::thread::hardware_concurrency()));
+
+  XmlRpc::XmlRpcValue workers;
+  if (not node_handle_.getParam("workers", workers))
+  {
+    Worker worker;
+    worker.name_ = "localhost";
+    worker.threads_ = local_threads;
+    worker.free_threads_ = worker.threads_;
+    worker.jobs_ = 0;
+    workers_.push_back(worker);
+    return true;
+  }
+
+  if (workers.getType() != XmlRpc::XmlRpcValue::TypeArray)
+  {
+    ROS_FATAL("\"workers\" must be a list!!");
+    return false;
+  }
+
+  for (int i = 0; i < workers.size(); ++i)
+  {
+    XmlRpc::XmlRpcValue & value = workers[i];
+    if (value.getType() != XmlRpc::XmlRpcValue::TypeStruct or not value.hasMember("name"))
+    {
+      ROS_FATAL_STREAM("Worker " << i << " has no \"name\"!!");
+      return false;
+    }
+
+    Worker worker;
+    worker.name_ = toString(value["name"]);
+    worker.command_ = value.hasMember("command") ? toString(value["command"]) : std::string();
+    worker.setup_ = value.hasMember("setup") ? toString(value["setup"]) : std::string();
+    worker.threads_ = value.hasMember("threads") ? static_cast<int>(value["threads"])
+                                                 : (worker.command_.empty() ? local_threads : 1);
+    if (worker.threads_ < 1)
+    {
+      worker.threads_ = 1;
+      ROS_WARN_STREAM("\"threads\" of worker " << worker.name_ << " cannot be < 1. Using 1.");
+    }
+    worker.free_threads_ = worker.threads_;
+    worker.jobs_ = 0;
+    workers_.push_back(worker);
+  }
+
+  return not workers_.empty();
+}
+
+bool
+BatchCalibrationNode::readJobs ()
+{
+  int max_threads = 1;
+  for (size_t w = 0; w < workers_.size(); ++w)
+    max_threads = std::max(max_threads, workers_[w].threads_);
+
+  std::string default_launch;
+  int default_threads;
+  node_handle_.param("launch", default_launch, std::string("kinect_47A_tro.launch"));
+  node_handle_.param("job_threads", default_threads, max_threads);
+
+  XmlRpc::XmlRpcValue jobs;
+  if (not node_handle_.getParam("jobs", jobs) or jobs.getType() != XmlRpc::XmlRpcValue::TypeArray)
+  {
+    ROS_FATAL("Missing \"jobs\" list!!");
+    return false;
+  }
+
+  for (int i = 0; i < jobs.size(); ++i)
+  {
+    XmlRpc::XmlRpcValue & value = jobs[i];
+    if (value.getType() != XmlRpc::XmlRpcValue::TypeStruct or not value.hasMember("path"))
+    {
+      ROS_FATAL_STREAM("Job " << i << " has no \"path\"!!");
+      return false;
+    }
+
+    Job job;
+    job.path_ = toString(value["path"]);
+    if (not job.path_.empty() and job.path_[job.path_.size() - 1] != '/')
+      job.path_ += "/";
+    job.name_ = value.hasMember("name") ? toString(value["name"]) : "job_" + boost::lexical_cast<std::string>(i);
+    job.launch_ = value.hasMember("launch") ? toString(value["launch"]) : default_launch;
+    job.threads_ = value.hasMember("threads") ? static_cast<int>(value["threads"]) : default_threads;
+
+    if (value.hasMember("args"))
+    {
+      XmlRpc::XmlRpcValue & args = value["args"];
+      if (args.getType() == XmlRpc::XmlRpcValue::TypeStruct)
+        for (XmlRpc::XmlRpcValue::iterator it = args.begin(); it != args.end(); ++it)
+          job.args_.push_back(std::make_pair(it->first, toString(it->second)));
+      else
+        ROS_WARN_STREAM("\"args\" of job " << job.name_ << " must be a map. Skipping.");
+    }
+
+    if (job.threads_ < 1 or job.threads_ > max_threads)
+    {
+      job.threads_ = std::max(1, std::min(job.threads_, max_threads));
+      ROS_WARN_STREAM("\"threads\" of job " << job.name_ << " must be in [1, " << max_threads << "]. Using "
+                      << job.threads_ << ".");
+    }
+
+    job.status_ = Job::PENDING;
+    job.worker_ = -1;
+    job.pid_ = 0;
+    job.exit_status_ = -1;
+    job.start_time_ = 0;
+    job.wall_time_ = 0.0;
+    jobs_.push_back(job);
+  }
+
+  return true;
+}
+
+bool
+BatchCalibrationNode::initialize ()
+{
+  node_handle_.param("launch_package", launch_package_, std::string("rgbd_calibration"));
+  node_handle_.param("log_directory", log_directory_, std::string("/tmp/"));
+  node_handle_.param("report_file", report_file_, std::string("/tmp/rgbd_batch_calibration.json"));
+  if (not log_directory_.empty() and log_directory_[log_directory_.size() - 1] != '/')
+    log_directory_ += "/";
+
+  if (not readWorkers() or not readJobs())
+    return false;
+
+  ROS_INFO_STREAM(jobs_.size() << " jobs on " << workers_.size() << " workers.");
+  return true;
+}
+
+bool
+BatchCalibrationNode::start (Job & job)
+{
+  int w = 0;
+  while (w < static_cast<int>(workers_.size()) and workers_[w].free_threads_ < job.threads_)
+    ++w;
+  if (w == static_cast<int>(workers_.size()))
+    return false;
+
+  Worker & worker = workers_[w];
+
+  // Remote jobs share the master of this node, so that concurrent launches do not race to start their own
+  std::stringstream command;
+  if (not worker.setup_.empty())
+    command << ". " << worker.setup_ << " && ";
+  command << "env OMP_NUM_THREADS=" << job.threads_ << " ROS_MASTER_URI=" << ros::master::getURI()
+          << " roslaunch " << launch_package_ << " " << job.launch_ << " ns:=" << job.name_
+          << " path:=" << quote(job.path_);
+  for (size_t i = 0; i < job.args_.size(); ++i)
+    command << " " << job.args_[i].first << ":=" << quote(job.args_[i].second);
+
+  std::string shell_command = worker.command_.empty() ? command.str() : worker.command_ + " " + quote(command.str());
+  if (not log_directory_.empty())
+    shell_command += " > " + quote(log_directory_ + job.name_ + ".log") + " 2>&1";
+
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    ROS_ERROR_STREAM("Cannot start job " << job.name_ << ": fork failed.");
+    return false;
+  }
+  if (pid == 0)
+  {
+    // Own process group: Ctrl-C reaches the jobs only through spin(), which stops them cleanly
+    setpgid(0, 0);
+    execl("/bin/sh", "sh", "-c", shell_command.c_str(), static_cast<char *>(NULL));
+    _exit(127);
+  }
+  setpgid(pid, pid);
+
+  worker.free_threads_ -= job.threads_;
+  worker.jobs_++;
+
+  job.status_ = Job::RUNNING;
+  job.worker_ = w;
+  job.pid_ = pid;
+  job.start_time_ = std::time(NULL);
+  job.start_ = ros::WallTime::now();
+
+  ROS_INFO_STREAM("Job " << job.name_ << " started on " << worker.name_ << " with " << job.threads_ << " threads.");
+  return true;
+}
+
+void
+BatchCalibrationNode::finish (Job & job,
+                              int status)
+{
+  workers_[job.worker_].free_threads_ += job.threads_;
+
+  job.wall_time_ = (ros::WallTime::now() - job.start_).toSec();
+  job.exit_status_ = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+
+  // roslaunch exits with 0 even when the calibration fails: no fresh global matrix means no calibration
+  bool has_model = false;
+  std::vector<std::string> files = models(job);
+  for (size_t i = 0; i < files.size(); ++i)
+    has_model = has_model or fs::path(files[i]).filename() == "global_matrix.txt";
+
+  job.status_ = job.exit_status_ == 0 and has_model ? Job::DONE : Job::FAILED;
+
+  if (job.status_ == Job::DONE)
+    ROS_INFO_STREAM("Job " << job.name_ << " done in " << job.wall_time_ << " s.");
+  else
+    ROS_WARN_STREAM("Job " << job.name_ << " failed (exit status " << job.exit_status_ << ").");
+}
+
+std::vector<std::string>
+BatchCalibrationNode::models (const Job & job) const
+{
+  static const char * const names[] = {"global_matrix.txt", "undistortion_model.bin", "inverse_global_matrix.txt",
+                                       "camera_pose.yaml", "depth_intrinsics.yaml"};
+
+  std::vector<std::string> files;
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+  {
+    boost::system::error_code error;
+    const std::string file = job.path_ + names[i];
+    if (fs::exists(file, error) and fs::last_write_time(file, error) >= job.start_time_)
+      files.push_back(file);
+  }
+  return files;
+}
+
+bool
+BatchCalibrationNode::writeReport () const
+{
+  std::ofstream file(report_file_.c_str());
+  if (not file.is_open())
+    return false;
+
+  file.precision(9);
+
+  static const char * const status_names[] = {"pending", "running", "done", "failed"};
+
+  file << "{" << std::endl;
+  file << "  \"wall_s\": " << (ros::WallTime::now() - start_).toSec() << "," << std::endl;
+
+  file << "  \"workers\": [";
+  for (size_t w = 0; w < workers_.size(); ++w)
+    file << (w == 0 ? "" : ",") << std::endl << "    {\"name\": \"" << escapeJSON(workers_[w].name_)
+         << "\", \"threads\": " << workers_[w].threads_ << ", \"jobs\": " << workers_[w].jobs_ << "}";
+  file << std::endl << "  ]," << std::endl;
+
+  file << "  \"jobs\": [";
+  for (size_t j = 0; j < jobs_.size(); ++j)
+  {
+    const Job & job = jobs_[j];
+    file << (j == 0 ? "" : ",") << std::endl << "    {" << std::endl;
+    file << "      \"name\": \"" << escapeJSON(job.name_) << "\"," << std::endl;
+    file << "      \"path\": \"" << escapeJSON(job.path_) << "\"," << std::endl;
+    file << "      \"worker\": \"" << (job.worker_ < 0 ? "" : escapeJSON(workers_[job.worker_].name_)) << "\","
+         << std::endl;
+    file << "      \"threads\": " << job.threads_ << "," << std::endl;
+    file << "      \"status\": \"" << status_names[job.status_] << "\"," << std::endl;
+    file << "      \"exit_status\": " << job.exit_status_ << "," << std::endl;
+    file << "      \"wall_s\": " << job.wall_time_ << "," << std::endl;
+
+    std::vector<std::string> files;
+    if (job.status_ == Job::DONE or job.status_ == Job::FAILED)
+      files = models(job);
+    file << "      \"models\": [";
+    for (size_t i = 0; i < files.size(); ++i)
+      file << (i == 0 ? "" : ", ") << "\"" << escapeJSON(files[i]) << "\"";
+    file << "]," << std::endl;
+
+    // The profile is already JSON, see Profiler::writeJSON()
+    std::ifstream profile_file((job.path_ + "profile.json").c_str());
+    std::stringstream profile;
+    if (files.empty() or not profile_file.is_open() or not (profile << profile_file.rdbuf()))
+      file << "      \"profile\": null" << std::endl;
+    else
+      file << "      \"profile\": " << profile.str() << std::endl;
+    file << "    }";
+  }
+  file << std::endl << "  ]" << std::endl;
+  file << "}" << std::endl;
+
+  return true;
+}
+
+void
+BatchCalibrationNode::spin ()
+{
+  start_ = ros::WallTime::now();
+
+  size_t next = 0;
+  size_t running = 0;
+  ros::WallRate rate(2.0);
+
+  while (ros::ok() and (next < jobs_.size() or running > 0))
+  {
+    // In manifest order: a large job is not overtaken by the smaller ones behind it
+    while (next < jobs_.size() and start(jobs_[next]))
+    {
+      ++next;
+      ++running;
+    }
+
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+      for (size_t j = 0; j < jobs_.size(); ++j)
+      {
+        if (jobs_[j].status_ == Job::RUNNING and jobs_[j].pid_ == pid)
+        {
+          finish(jobs_[j], status);
+          --running;
+          if (not writeReport())
+            ROS_WARN_STREAM("Cannot write report to " << report_file_);
+        }
+      }
+    }
+
+    rate.sleep();
+  }
+
+  if (running > 0)
+  {
+    ROS_WARN_STREAM("Stopping " << running << " running jobs.");
+    for (size_t j = 0; j < jobs_.size(); ++j)
+      if (jobs_[j].status_ == Job::RUNNING)
+        killpg(jobs_[j].pid_, SIGINT);
+
+    for (size_t j = 0; j < jobs_.size(); ++j)
+    {
+      if (jobs_[j].status_ == Job::RUNNING)
+      {
+        int status;
+        waitpid(jobs_[j].pid_, &status, 0);
+        finish(jobs_[j], status);
+      }
+    }
+  }
+
+  if (writeReport())
+    ROS_INFO_STREAM("Report written to " << report_file_);
+  else
+    ROS_WARN_STREAM("Cannot write report to " << report_file_);
+}
+
+} /* namespace calibration */
+
+int
+main (int argc,
+      char ** argv)
+{
+  ros::init(argc, argv, "batch_calibration");
+  ros::NodeHandle node_handle("~");
+
+  calibration::BatchCalibrationNode batch_node(node_handle);
+  if (not batch_node.initialize())
+    return 1;
+  batch_node.spin();
+
+  return 0;
+}
@@ -26,6 +26,8 @@
  *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sstream>
+
 #include <ros/ros.h>
 #include <omp.h>
 #include <ceres/ceres.h>
@@ -44,6 +46,8 @@
 #include <rgbd_calibration/checkerboard_views_extractor.h>
 #include <rgbd_calibration/plane_based_extrinsic_calibration.h>
 #include <rgbd_calibration/depth_undistortion_estimation.h>
+#include <rgbd_calibration/profiler.h>
+#include <rgbd_calibration/residual_arena.h>
 
 #include <rgbd_calibration/calibration.h>
 
@@ -103,12 +107,12 @@ Calibration::publishData () const
 
 }
 
-void
-Calibration::addData_ (const cv::Mat & image,
-                       const PCLCloud3::ConstPtr & cloud,
-                       std::vector<RGBDData::ConstPtr> & vec)
+RGBDData::Ptr
+Calibration::createData_ (int id,
+                          const cv::Mat & image,
+                          const PCLCloud3::ConstPtr & cloud) const
 {
-  RGBDData::Ptr data(boost::make_shared<RGBDData>(data_vec_.size() + 1));
+  RGBDData::Ptr data(boost::make_shared<RGBDData>(id));
   data->setColorSensor(color_sensor_);
   data->setDepthSensor(depth_sensor_);
 
@@ -116,180 +120,505 @@ Calibration::addData_ (const cv::Mat & image,
   //color_sensor_->cameraModel()->rectifyImage(image, rectified);
   data->setColorData(image);
 
-  if (ratio_ > 1)
+  if (downsampler_.ratio() > 1)
+  {
+    PCLCloud3 sampled_cloud;
+    downsampler_.apply(*cloud, sampled_cloud);
+    data->setDepthData(sampled_cloud);
+  }
+  else
+  {
+    data->setDepthData(*cloud);
+  }
+
+  return data;
+}
+
+void
+Calibration::addData (const cv::Mat & image,
+                      const PCLCloud3::ConstPtr & cloud)
+{
+  Profiler::ScopedTimer timer("calibration/add_data");
+
+  if (frame_store_)
+  {
+    const RGBDData::Ptr data = createData_(frame_store_->size() + 1, image, cloud);
+    frame_store_->add(data->colorData(), *data->depthData());
+  }
+  else
+  {
+    data_vec_.push_back(createData_(data_vec_.size() + 1, image, cloud));
+  }
+}
+
+void
+Calibration::addData (const std::vector<cv::Mat> & images,
+                      const std::vector<PCLCloud3::ConstPtr> & clouds)
+{
+  assert(images.size() == clouds.size());
+  Profiler::ScopedTimer timer("calibration/add_data");
+
+  const int size = images.size();
+
+  if (frame_store_)
+  {
+    // Frame indices are assigned by the store: add in order
+    const int first = frame_store_->size();
+#pragma omp parallel for ordered schedule(dynamic, 1)
+    for (int i = 0; i < size; ++i)
+    {
+      const RGBDData::Ptr data = createData_(first + i + 1, images[i], clouds[i]);
+#pragma omp ordered
+      frame_store_->add(data->colorData(), *data->depthData());
+    }
+    return;
+  }
+
+  const int first = data_vec_.size();
+  data_vec_.resize(first + size);
+
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int i = 0; i < size; ++i)
+    data_vec_[first + i] = createData_(first + i + 1, images[i], clouds[i]);
+}
+
+Size1
+Calibration::addStreamingData (const cv::Mat & image,
+                               const PCLCloud3::ConstPtr & cloud)
+{
+  Profiler::ScopedTimer timer("calibration/add_streaming_data");
+
+  addData(image, cloud);
+  const RGBDData::ConstPtr data = loadFrame_(frameCount_() - 1);
+
+  const bool pose_known = estimate_depth_und_model_ and color_sensor_->parent() and not estimate_initial_trasform_;
+
+  CheckerboardViewsExtraction cb_extractor;
+  cb_extractor.setCheckerboardVector(cb_vec_);
+  cb_extractor.setInputData(data);
+  if (pose_known)
   {
-    PCLCloud3::Ptr new_cloud(boost::make_shared<PCLCloud3>());
-    new_cloud->resize(cloud->size() / (ratio_ * ratio_));
-    new_cloud->header = cloud->header;
-    new_cloud->width = cloud->width / ratio_;
-    new_cloud->height = cloud->height / ratio_;
-    new_cloud->is_dense = cloud->is_dense;
+    cb_extractor.setColorSensorPose(color_sensor_->pose());
+    cb_extractor.setOnlyImages(true);
+  }
+  else
+  {
+    // As in estimateInitialTransform()
+    cb_extractor.setCheckerboardConstraint(boost::make_shared<CheckerboardDistanceConstraint>(2.0));
+    cb_extractor.setDepthIntrinsics(depth_intrinsics_[0], depth_intrinsics_[1], depth_intrinsics_[2], depth_intrinsics_[3]);
+  }
+
+  std::vector<CheckerboardViews::Ptr> cb_views_vec;
+  cb_extractor.extract(cb_views_vec);
+  streaming_views_ += cb_views_vec.size();
 
-    PCLPoint3 zero(0, 0, 0);
-    float nan = std::numeric_limits<float>::quiet_NaN();
-    PCLPoint3 bad_point(nan, nan, nan);
+  if (publisher_)
+    for (Size1 i = 0; i < cb_views_vec.size(); ++i)
+      publisher_->publish(*cb_views_vec[i]);
 
-    for (Size1 i = 0; i < new_cloud->height; ++i)
+  if (not pose_known)
+  {
+    streaming_pose_views_.insert(streaming_pose_views_.end(), cb_views_vec.begin(), cb_views_vec.end());
+    if (streaming_pose_views_.size() >= streaming_pose_views_needed_ and estimate_depth_und_model_)
     {
-      for (Size1 j = 0; j < new_cloud->width; ++j)
+      ROS_INFO_STREAM("Estimating the initial transform from " << streaming_pose_views_.size() << " views...");
+      estimateTransform(streaming_pose_views_);
+      if (color_sensor_->parent())
+      {
+        streaming_pose_views_.clear();
+        estimate_initial_trasform_ = false;
+      }
+      else
       {
-        new_cloud->at(j, i) = zero;
-        int count = 0;
-        for (Size1 di = 0; di < ratio_; ++di)
-        {
-          for (Size1 dj = 0; dj < ratio_; ++dj)
-          {
-            const PCLPoint3 & p = cloud->at(j * ratio_ + dj, i * ratio_ + di);
-            if (pcl::isFinite(p))
-            {
-              ++count;
-              new_cloud->at(j, i).x += p.x;
-              new_cloud->at(j, i).y += p.y;
-              new_cloud->at(j, i).z += p.z;
-            }
-          }
-        }
-        if (count > 0)
-        {
-          new_cloud->at(j, i).x /= count;
-          new_cloud->at(j, i).y /= count;
-          new_cloud->at(j, i).z /= count;
-        }
-        else
-        {
-          new_cloud->at(j, i) = bad_point;
-          new_cloud->is_dense = false;
-        }
+        streaming_pose_views_needed_ += 10;
+        ROS_WARN_STREAM("Initial transform not estimated. Trying again with " << streaming_pose_views_needed_ << " views.");
       }
     }
-    data->setDepthData(*new_cloud);
+    return cb_views_vec.size();
   }
-  else
+
+  if (not streaming_estimation_)
+    streaming_estimation_ = createDepthUndistortionEstimation_();
+
+  for (Size1 i = 0; i < cb_views_vec.size(); ++i)
   {
-    data->setDepthData(*cloud);
+    Checkerboard::Ptr cb = boost::make_shared<Checkerboard>(*cb_views_vec[i]->colorCheckerboard());
+    cb->transform(color_sensor_->pose());
+
+    DepthUndistortionEstimation::DepthData::Ptr depth_data =
+        boost::make_shared<DepthUndistortionEstimation::DepthData>(data->id());
+    depth_data->cloud_ = data->depthData();
+    depth_data->checkerboard_ = cb;
+    streaming_estimation_->addStreamingData(depth_data);
   }
 
-  vec.push_back(data);
+  return cb_views_vec.size();
+}
+
+RGBDData::ConstPtr
+Calibration::loadFrame_ (Size1 index) const
+{
+  if (not frame_store_)
+    return data_vec_[index];
+
+  RGBDData::Ptr data(boost::make_shared<RGBDData>(index + 1));
+  data->setColorSensor(color_sensor_);
+  data->setDepthSensor(depth_sensor_);
+
+  cv::Mat image;
+  PCLCloud3 cloud;
+  if (not frame_store_->readImage(index, image) or not frame_store_->readCloud(index, cloud))
+    ROS_WARN_STREAM("Cannot read frame " << index << " from the frame store!");
+  data->setColorData(image);
+  data->setDepthData(cloud);
+
+  return data;
 }
 
 void
-Calibration::addData (const cv::Mat & image,
-                      const PCLCloud3::ConstPtr & cloud)
+Calibration::extractViews_ (CheckerboardViewsExtraction & cb_extractor)
 {
-  addData_(image, cloud, data_vec_);
+  if (not frame_store_)
+  {
+    cb_extractor.setInputData(data_vec_);
+    cb_extractor.extractAll(cb_views_vec_);
+    return;
+  }
+
+  // Frames are streamed through in blocks. The views keep a payload-free copy of their data: the depth data of the
+  // undistortion estimation reads the clouds from the store again.
+  const Size1 size = frame_store_->size();
+  const Size1 block_size = 4 * omp_get_max_threads();
+  for (Size1 begin = 0; begin < size; begin += block_size)
+  {
+    const Size1 end = std::min(begin + block_size, size);
+    std::vector<RGBDData::ConstPtr> block(end - begin);
+
+#pragma omp parallel for
+    for (Size1 i = begin; i < end; ++i)
+      block[i - begin] = loadFrame_(i);
+
+    std::vector<CheckerboardViews::Ptr> block_views;
+    cb_extractor.setInputData(block);
+    cb_extractor.extractAll(block_views);
+
+    for (Size1 i = 0; i < block_views.size(); ++i)
+    {
+      const RGBDData & data = *block_views[i]->data();
+      RGBDData::Ptr compact_data(boost::make_shared<RGBDData>(data.id()));
+      compact_data->setColorSensor(color_sensor_);
+      compact_data->setDepthSensor(depth_sensor_);
+      compact_data->setDepthData(PCLCloud3());
+      block_views[i]->setData(compact_data);
+      cb_views_vec_.push_back(block_views[i]);
+    }
+  }
 }
 
 //void
 //Calibration::addTestData (const cv::Mat & image,
 //                          const PCLCloud3::ConstPtr & cloud)
 //{
-//  addData_(image, cloud, test_vec_);
+//  test_vec_.push_back(createData_(test_vec_.size() + 1, image, cloud));
 //}
 
+// Samples coarse_model, whose resolution is factor times lower, at the nodes of fine_model and recovers the coefficients
+// of every node from the samples at depths 1 ... size, as for the fourth global polynomial in optimizeAll().
+static void
+upsampleLocalModel (const LocalModel & coarse_model,
+                    int factor,
+                    LocalModel & fine_model)
+{
+  const int SIZE = MathTraits<LocalPolynomial>::Size;
+  const int MIN_DEGREE = MathTraits<LocalPolynomial>::MinDegree;
+
+  Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> A(SIZE, SIZE);
+  for (int i = 0; i < SIZE; ++i)
+  {
+    Scalar x(i + 1);
+    Scalar tmp(1.0);
+    for (int j = 0; j < MIN_DEGREE; ++j)
+      tmp *= x;
+    for (int j = 0; j < SIZE; ++j)
+    {
+      A(i, j) = tmp;
+      tmp *= x;
+    }
+  }
+  const Eigen::ColPivHouseholderQR<Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> > qr(A);
+
+  const Size2 matrix_size = fine_model.matrix()->size();
+  const Size2 bin_size = fine_model.binSize();
+  const Size2 coarse_size = coarse_model.imageSize();
+
+#pragma omp parallel for
+  for (int y_index = 0; y_index < matrix_size.y(); ++y_index)
+  {
+    Eigen::Matrix<Scalar, Eigen::Dynamic, 1> b(SIZE, 1);
+    for (int x_index = 0; x_index < matrix_size.x(); ++x_index)
+    {
+      // Node (x_index, y_index) is at the top left corner of bin (x_index, y_index)
+      const int x = std::min<int>(x_index * bin_size.x() / factor, coarse_size.x() - 1);
+      const int y = std::min<int>(y_index * bin_size.y() / factor, coarse_size.y() - 1);
+      for (int i = 0; i < SIZE; ++i)
+      {
+        Scalar z(i + 1);
+        coarse_model.undistort(x, y, z);
+        b[i] = z;
+      }
+      fine_model.polynomial(x_index, y_index) = qr.solve(b);
+    }
+  }
+}
+
 void
 Calibration::perform ()
 {
+  Profiler::ScopedTimer timer("calibration/perform");
+
   if (estimate_initial_trasform_ or not color_sensor_->parent())
     estimateInitialTransform();
 
+  if (pyramid_options_.ratios.size() > 1 and not usePyramid_())
+    ROS_WARN("The pyramid schedule needs the frames in memory and a cold start. Using a single level.");
+
   if (estimate_depth_und_model_)
   {
     CheckerboardViewsExtraction cb_extractor;
     cb_extractor.setColorSensorPose(color_sensor_->pose());
     cb_extractor.setCheckerboardVector(cb_vec_);
-    cb_extractor.setInputData(data_vec_);
     cb_extractor.setOnlyImages(true);
-    cb_extractor.extractAll(cb_views_vec_);
+    cb_extractor.setCache(cb_cache_);
+    {
+      Profiler::ScopedTimer extraction_timer("checkerboard_views/extract_all");
+      extractViews_(cb_extractor);
+    }
 
     ROS_INFO_STREAM(cb_views_vec_.size());
+    Profiler::instance().increment("checkerboard_views/extracted", cb_views_vec_.size());
+
+    if (usePyramid_())
+    {
+      // The pose comes from the coarser levels
+      performPyramid_();
+      return;
+    }
+
+    estimateDepthUndistortion_(warm_start_);
+  }
+
+  // The previous pose is already a better starting point for optimize()
+  if (not warm_start_)
+    estimateTransform(cb_views_vec_);
 
-    for (Size1 i = 0; i < cb_views_vec_.size(); ++i)
+}
+
+void
+Calibration::estimateDepthUndistortion_ (bool extract_only,
+                                         int refine_iterations)
+{
+  depth_undistortion_estimation_->setEvictClouds(frame_store_.get() != NULL);
+  depth_data_vec_.clear();
+
+  for (Size1 i = 0; i < cb_views_vec_.size(); ++i)
+  {
+    CheckerboardViews & cb_views = *cb_views_vec_[i];
+    Checkerboard::Ptr cb = boost::make_shared<Checkerboard>(*cb_views.colorCheckerboard());
+    cb->transform(color_sensor_->pose());
+    if (frame_store_)
+    {
+      const DepthUndistortionEstimation::DepthData::Ptr & depth_data =
+          depth_undistortion_estimation_->addDepthData(PCLCloud3::ConstPtr(), cb);
+      depth_data->frame_store_ = frame_store_;
+      depth_data->frame_index_ = cb_views.data()->id() - 1;
+      depth_data_vec_.push_back(depth_data);
+    }
+    else
     {
-      CheckerboardViews & cb_views = *cb_views_vec_[i];
-      Checkerboard::Ptr cb = boost::make_shared<Checkerboard>(*cb_views.colorCheckerboard());
-      cb->transform(color_sensor_->pose());
       depth_data_vec_.push_back(depth_undistortion_estimation_->addDepthData(cb_views.data()->depthData(), cb));
     }
+  }
 
+  if (extract_only and refine_iterations > 0)
+  {
+    ROS_INFO_STREAM("Refining the previous undistortion map...");
+    depth_undistortion_estimation_->refineLocalModel(refine_iterations);
+  }
+  else if (extract_only)
+  {
+    ROS_INFO_STREAM("Extracting planes with the previous undistortion map...");
+    depth_undistortion_estimation_->extractPlanes();
+  }
+  else
+  {
     ROS_INFO_STREAM("Estimating undistortion map...");
     depth_undistortion_estimation_->estimateLocalModel();
     ROS_INFO_STREAM("Recomputing undistortion map...");
     depth_undistortion_estimation_->estimateLocalModelReverse();
     ROS_INFO_STREAM("Estimating global error correction map...");
     depth_undistortion_estimation_->estimateGlobalModel();
+  }
 
-    for (Size1 i = 0; i < cb_views_vec_.size(); ++i)
-    {
-      CheckerboardViews & cb_views = *cb_views_vec_[i];
-      if (depth_data_vec_[i]->plane_extracted_)
-        cb_views.setPlaneInliers(depth_data_vec_[i]->estimated_plane_);
-      else
-        cb_views_vec_[i].reset();
-    }
+  for (Size1 i = 0; i < cb_views_vec_.size(); ++i)
+  {
+    CheckerboardViews & cb_views = *cb_views_vec_[i];
+    if (depth_data_vec_[i]->plane_extracted_)
+      cb_views.setPlaneInliers(depth_data_vec_[i]->estimated_plane_);
+    else
+      cb_views_vec_[i].reset();
+  }
 
-//    PolynomialUndistortionMatrixIO<LocalPolynomial> io;
+//  PolynomialUndistortionMatrixIO<LocalPolynomial> io;
 ////    io.write(*local_matrix_->model(), "/tmp/local_matrix.txt");
-//    int index = 0;
-//    for (Scalar i = 1.0; i < 5.5; i += 0.125, ++index)
-//    {
-//      Scalar max;
-//      std::stringstream ss;
-//      ss << "/tmp/matrix_"<< index << ".png";
-//      io.writeImageAuto(*local_matrix_->model(), i, ss.str(), max);
-//      ROS_INFO_STREAM("Max " << i << ": " << max);
-//    }
-
-//    std::vector<std::pair<int, int> > pixels;
-//    pixels.push_back(std::make_pair(0, 0));
-//    pixels.push_back(std::make_pair(40/ratio_/local_model_->binSize().x(), 480/ratio_/local_model_->binSize().y()));
-//    pixels.push_back(std::make_pair(320/ratio_/local_model_->binSize().x(), 240/ratio_/local_model_->binSize().y()));
-//    pixels.push_back(std::make_pair(560/ratio_/local_model_->binSize().x(), 400/ratio_/local_model_->binSize().y()));
-//
-//    for (int i = 0; i < pixels.size(); ++i)
-//    {
-//      std::cout << "Local Polynomial at (" << pixels[i].first << ", " << pixels[i].second << "): " << local_model_->polynomial(pixels[i].first, pixels[i].second).transpose() << std::endl;
-//
-//      std::stringstream ss;
-//      ss << "/tmp/local_samples_" << pixels[i].first << "_" << pixels[i].second << ".txt";
-//
-//      std::fstream fs;
-//      fs.open(ss.str().c_str(), std::fstream::out);
-//      fs << depth_undistortion_estimation_->getLocalSamples(pixels[i].first, pixels[i].second) << std::endl;
-//      fs.close();
-//    }
-//
-//    for (int i = 0; i < 4; ++i)
-//    {
-//      std::cout << "Global Polynomial at (" << i / 2 << ", " << i % 2 << "): " << global_model_->polynomial(i / 2, i % 2).transpose() << std::endl;
-//
-//      std::stringstream ss;
-//      ss << "/tmp/global_samples_" << i / 2 << "_" << i % 2 << ".txt";
-//
-//      std::fstream fs;
-//      fs.open(ss.str().c_str(), std::fstream::out);
-//      fs << depth_undistortion_estimation_->getGlobalSamples(i / 2, i % 2) << std::endl;
-//      fs.close();
-//    }
+//  int index = 0;
+//  for (Scalar i = 1.0; i < 5.5; i += 0.125, ++index)
+//  {
+//    Scalar max;
+//    std::stringstream ss;
+//    ss << "/tmp/matrix_"<< index << ".png";
+//    io.writeImageAuto(*local_matrix_->model(), i, ss.str(), max);
+//    ROS_INFO_STREAM("Max " << i << ": " << max);
+//  }
 
+  if (debug_capture_ and not extract_only)
+  {
+    // Samples of two corner bins and of the central bin of the local matrix, and of every bin of the global one
+    const Size2 local_size = local_model_->matrix()->size();
+    std::vector<std::pair<Size1, Size1> > bins;
+    bins.push_back(std::make_pair(0, 0));
+    bins.push_back(std::make_pair(local_size.x() / 2, local_size.y() / 2));
+    bins.push_back(std::make_pair(local_size.x() - 1, local_size.y() - 1));
+
+    for (Size1 i = 0; i < bins.size(); ++i)
+    {
+      std::stringstream name, text;
+      name << "local_samples_" << bins[i].first << "_" << bins[i].second << ".txt";
+      text << depth_undistortion_estimation_->getLocalSamples(bins[i].first, bins[i].second) << std::endl;
+      debug_capture_->captureText(name.str(), text.str());
+    }
+
+    const Size2 global_size = global_model_->matrix()->size();
+    for (Size1 y = 0; y < global_size.y(); ++y)
+    {
+      for (Size1 x = 0; x < global_size.x(); ++x)
+      {
+        std::stringstream name, text;
+        name << "global_samples_" << x << "_" << y << ".txt";
+        text << depth_undistortion_estimation_->getGlobalSamples(x, y) << std::endl;
+        debug_capture_->captureText(name.str(), text.str());
+      }
+    }
   }
+}
+
+void
+Calibration::performPyramid_ ()
+{
+  const std::vector<int> & ratios = pyramid_options_.ratios;
+
+  // The levels work on copies of the views: the color checkerboards are extracted only once
+  const std::vector<CheckerboardViews::Ptr> cb_views_vec = cb_views_vec_;
+
+  // The last level works on the sensor and the models of the caller
+  const KinectDepthCameraModel::ConstPtr camera_model = depth_sensor_->cameraModel();
+  const LocalModel::Ptr local_model = local_model_;
+  const GlobalModel::Ptr global_model = global_model_;
+
+  for (Size1 level = 0; level < ratios.size(); ++level)
+  {
+    const int ratio = ratios[level];
+    const bool last = level + 1 == ratios.size();
+
+    std::stringstream ss;
+    ss << "calibration/pyramid/level_" << level;
+    Profiler::ScopedTimer timer(ss.str());
+    ROS_INFO_STREAM("Pyramid level " << level << ", downsample ratio " << ratio << "...");
+
+    LocalModel::Ptr level_local_model = local_model;
+    GlobalModel::Ptr level_global_model = global_model;
+    if (last)
+    {
+      depth_sensor_->setCameraModel(camera_model);
+    }
+    else
+    {
+      sensor_msgs::CameraInfo camera_info = camera_model->cameraInfo();
+      camera_info.binning_x = camera_model->binningX() * ratio;
+      camera_info.binning_y = camera_model->binningY() * ratio;
+      depth_sensor_->setCameraModel(boost::make_shared<KinectDepthCameraModel>(camera_info));
+
+      // Same bin size in level pixels: coarser levels have fewer, larger bins
+      level_local_model = boost::make_shared<LocalModel>(Size2(local_model->imageSize() / ratio));
+      level_local_model->setMatrix(level_local_model->createMatrix(local_model->binSize(),
+                                                                   LocalPolynomial::IdentityCoefficients()));
+      level_global_model = boost::make_shared<GlobalModel>(Size2(global_model->imageSize() / ratio));
+    }
+    updateDepthIntrinsics_();
+
+    // The global models do not depend on the resolution, the local one is upsampled from the previous level
+    InverseGlobalModel::Data::Ptr inverse_global_matrix;
+    if (level > 0)
+    {
+      upsampleLocalModel(*local_model_, ratios[level - 1] / ratio, *level_local_model);
+      inverse_global_matrix = boost::make_shared<InverseGlobalModel::Data>(*inverseGlobalModel()->matrix());
+    }
+    level_global_model->setMatrix(boost::make_shared<GlobalModel::Data>(*global_model_->matrix()));
+
+    setLocalModel(level_local_model);
+    setGlobalModel(level_global_model);
+    initDepthUndistortionModel();
+    if (inverse_global_matrix)
+      depth_undistortion_estimation_->setInverseGlobalMatrix(inverse_global_matrix);
+
+    CloudDownsampler level_downsampler;
+    level_downsampler.setRatio(ratio);
+    level_downsampler.setMode(downsampler_.mode());
+
+    const int size = cb_views_vec.size();
+    cb_views_vec_.resize(size);
+
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < size; ++i)
+    {
+      const CheckerboardViews & cb_views = *cb_views_vec[i];
+      cb_views_vec_[i] = boost::make_shared<CheckerboardViews>(cb_views);
+      if (ratio > 1)
+      {
+        RGBDData::Ptr level_data = boost::make_shared<RGBDData>(*cb_views.data());
+        PCLCloud3 sampled_cloud;
+        level_downsampler.apply(*cb_views.data()->depthData(), sampled_cloud);
+        level_data->setDepthData(sampled_cloud);
+        cb_views_vec_[i]->setData(level_data);
+      }
+    }
 
-  estimateTransform(cb_views_vec_);
+    // Only the first level estimates the models from scratch, the others refine the upsampled local model
+    estimateDepthUndistortion_(level > 0, pyramid_options_.refine_iterations);
+    if (level == 0)
+      estimateTransform(cb_views_vec_);
 
+    if (not last)
+      optimizeDepthUndistortion_(level == 0 ? optimization_options_.max_iterations : pyramid_options_.refine_iterations);
+  }
 }
 
 void
 Calibration::estimateInitialTransform ()
 {
+  Profiler::ScopedTimer timer("calibration/estimate_initial_transform");
+
   CheckerboardViewsExtraction cb_extractor;
   cb_extractor.setCheckerboardVector(cb_vec_);
   cb_extractor.setCheckerboardConstraint(boost::make_shared<CheckerboardDistanceConstraint>(2.0));
+  cb_extractor.setDepthIntrinsics(depth_intrinsics_[0], depth_intrinsics_[1], depth_intrinsics_[2], depth_intrinsics_[3]);
 
   std::vector<CheckerboardViews::Ptr> cb_views_vec;
 
-  for (Size1 i = 0; i < data_vec_.size() and cb_views_vec.size() < 10; ++i)
+  const Size1 size = frameCount_();
+  for (Size1 i = 0; i < size and cb_views_vec.size() < 10; ++i)
   {
-    Size1 index = rand() % data_vec_.size();
-    cb_extractor.setInputData(data_vec_[index]);
+    Size1 index = rand() % size;
+    cb_extractor.setInputData(loadFrame_(index));
     cb_extractor.extract(cb_views_vec, true);
   }
 
@@ -299,6 +628,8 @@ Calibration::estimateInitialTransform ()
 void
 Calibration::estimateTransform (const std::vector<CheckerboardViews::Ptr> & cb_views_vec)
 {
+  Profiler::ScopedTimer timer("calibration/estimate_transform");
+
   PlaneBasedExtrinsicCalibration calib;
   calib.setMainSensor(depth_sensor_);
   calib.setSize(cb_views_vec.size());
@@ -315,7 +646,9 @@ Calibration::estimateTransform (const std::vector<CheckerboardViews::Ptr> & cb_v
   }
 
   calib.setSize(index);
+  calib.setNumThreads(optimization_options_.num_threads);
   calib.perform();
+  calib.optimize();
 }
 
 class TransformError
@@ -384,7 +717,13 @@ private:
 
 void Calibration::optimizeTransform(const std::vector<CheckerboardViews::Ptr> & cb_views_vec)
 {
-  ceres::Problem problem;
+  Profiler::ScopedTimer timer("calibration/optimize_transform");
+
+  // One loss for all the views, not owned by the problem
+  ceres::CauchyLoss loss(1.0);
+  ceres::Problem::Options problem_options;
+  problem_options.loss_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+  ceres::Problem problem(problem_options);
   Eigen::Matrix<Scalar, Eigen::Dynamic, 6, Eigen::DontAlign | Eigen::RowMajor> data(cb_views_vec.size(), 6);
 
   AngleAxis rotation(color_sensor_->pose().linear());
@@ -411,17 +750,18 @@ void Calibration::optimizeTransform(const std::vector<CheckerboardViews::Ptr> &
     typedef ceres::AutoDiffCostFunction<TransformError, ceres::DYNAMIC, 6, 6> TransformCostFunction;
 
     ceres::CostFunction * cost_function = new TransformCostFunction(error, 2 * cb_views.checkerboard()->size());
-    problem.AddResidualBlock(cost_function, new ceres::CauchyLoss(1.0), transform.data(), data.row(i).data());
+    problem.AddResidualBlock(cost_function, &loss, transform.data(), data.row(i).data());
   }
 
   ceres::Solver::Options options;
   options.linear_solver_type = ceres::SPARSE_SCHUR;
   options.max_num_iterations = 100;
   options.minimizer_progress_to_stdout = true;
-  options.num_threads = 8;
+  options.num_threads = optimization_options_.num_threads;
 
   ceres::Solver::Summary summary;
   ceres::Solve(options, &problem, &summary);
+  Profiler::instance().addSolverSummary("calibration/optimize_transform", summary);
 
   rotation.angle() = transform.head<3>().norm();
   rotation.axis() = transform.head<3>().normalized();
@@ -455,11 +795,10 @@ public:
 
   template <typename T>
     bool
-	operator () (const T * const checkerboard_pose_q,
-               const T * const checkerboard_pose_t,
+	operator () (const T * const checkerboard_pose,
                T * residuals) const
     {
-      typename Types<T>::Pose checkerboard_pose_eigen = toEigen<T>(checkerboard_pose_q, checkerboard_pose_t);
+      typename Types<T>::Pose checkerboard_pose_eigen = toEigen<T>(checkerboard_pose, checkerboard_pose + 4);
 
       typename Types<T>::Cloud3 cb_corners(checkerboard_->corners().size());
       cb_corners.container() = checkerboard_pose_eigen * checkerboard_->corners().container().cast<T>();
@@ -478,29 +817,52 @@ private:
 
   const PinholeCameraModel::ConstPtr & camera_model_;
   const Checkerboard::ConstPtr & checkerboard_;
-  Cloud2 image_corners_;
+  const Cloud2 & image_corners_;
 };
 
 class TransformDistortionError
 {
 public:
 
+  // Samples are columns of an Arena: x index, y index, depth and the weights of the three global polynomials.
+  enum
+  {
+    SAMPLE = 0,
+    WEIGHTS = 3,
+    ROWS = 6
+  };
+
+  typedef ResidualArena<Scalar, ROWS> Arena;
+
   TransformDistortionError(const PinholeCameraModel::ConstPtr & camera_model,
 		  	  	  	  	   const KinectDepthCameraModel::ConstPtr & depth_camera_model,
                            const Checkerboard::ConstPtr & checkerboard,
-                           const Cloud3 & depth_points,
+                           const PCLCloud3 & depth_cloud,
                            const Indices & plane_indices,
                            const Polynomial<Scalar, 2> & depth_error_function,
-                           const Size2 & images_size)
+                           const GlobalModel & global_model,
+                           Arena & arena)
     : camera_model_(camera_model),
       depth_camera_model_(depth_camera_model),
       checkerboard_(checkerboard),
-      depth_points_(depth_points),
-      plane_indices_(plane_indices),
-      depth_error_function_(depth_error_function),
-      images_size_(images_size)
+      size_(plane_indices.size()),
+      depth_error_function_(depth_error_function)
   {
-    // Do nothing
+    Arena::Span samples = arena.allocate(size_);
+    samples_ = samples.data();
+
+    for (Size1 i = 0; i < plane_indices.size(); ++i)
+    {
+      const int x_index = plane_indices[i] % depth_cloud.width;
+      const int y_index = plane_indices[i] / depth_cloud.width;
+
+      // The fourth polynomial is p2 + p3 - p1 (see optimizeAll()): fold it into the weights of the other three.
+      std::vector<GlobalModel::LookupTableData> lt_data = global_model.lookupTable(x_index, y_index);
+      Scalar w[4] = {0.0, 0.0, 0.0, 0.0};
+      for (Size1 j = 0; j < lt_data.size() and j < 4; ++j)
+        w[j] = lt_data[j].weight_;
+      samples.col(i) << x_index, y_index, depth_cloud.points[plane_indices[i]].z, w[0] - w[3], w[1] + w[3], w[2] + w[3];
+    }
   }
 
   template <typename T>
@@ -515,98 +877,54 @@ public:
     bool operator ()(const T * const color_sensor_pose_q,
                      const T * const color_sensor_pose_t,
                      const T * const global_undistortion,
-                     const T * const checkerboard_pose_q,
-                     const T * const checkerboard_pose_t,
+                     const T * const checkerboard_pose,
                      const T * const delta,
                      T * residuals) const
     {
       typename Types<T>::Pose color_sensor_pose_eigen = toEigen<T>(color_sensor_pose_q, color_sensor_pose_t);
-      typename Types<T>::Pose checkerboard_pose_eigen = toEigen<T>(checkerboard_pose_q, checkerboard_pose_t);
+      typename Types<T>::Pose checkerboard_pose_eigen = toEigen<T>(checkerboard_pose, checkerboard_pose + 4);
 
-      const int DEGREE = MathTraits<GlobalPolynomial>::Degree;
       const int MIN_DEGREE = MathTraits<GlobalPolynomial>::MinDegree;
-      const int SIZE = MathTraits<GlobalPolynomial>::Size;//DEGREE - MIN_DEGREE + 1;
-      typedef MathTraits<GlobalPolynomial>::Coefficients Coefficients;
+      const int SIZE = MathTraits<GlobalPolynomial>::Size;
+      const int ERROR_SIZE = MathTraits<Polynomial<Scalar, 2> >::Size;
 
-      Size1 index = 0;
+      const cv::Matx33d & K = depth_camera_model_->intrinsicMatrix();
 
-      Coefficients c1, c2, c3;
-      for (Size1 i = 0 ; i < DEGREE - MIN_DEGREE + 1; ++i)
-        c1[i] = global_undistortion[index++];
-      for (Size1 i = 0 ; i < DEGREE - MIN_DEGREE + 1; ++i)
-        c2[i] = global_undistortion[index++];
-      for (Size1 i = 0 ; i < DEGREE - MIN_DEGREE + 1; ++i)
-        c3[i] = global_undistortion[index++];
+      typename Types<T>::Cloud3 cb_corners(checkerboard_->corners().size());
+      cb_corners.container() = color_sensor_pose_eigen * checkerboard_pose_eigen * checkerboard_->corners().container().cast<T>();
+      typename Types<T>::Vector3 cb_normal = (cb_corners(0, 1) - cb_corners(0, 0)).cross(cb_corners(1, 0) - cb_corners(0, 0)).normalized();
+      T cb_offset = -cb_normal.dot(cb_corners(0, 0));
 
-      Polynomial<T, DEGREE, MIN_DEGREE> p1(c1);
-      Polynomial<T, DEGREE, MIN_DEGREE> p2(c2);
-      Polynomial<T, DEGREE, MIN_DEGREE> p3(c3);
+      const Scalar sqrt_size = std::sqrt(Scalar(size_));
 
-      Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> A(SIZE, SIZE);
-      Eigen::Matrix<T, Eigen::Dynamic, 1> b(SIZE, 1);
-      for (int i = 0; i < SIZE; ++i)
+      Arena::ConstSpan samples(samples_, ROWS, size_);
+      Eigen::Map<Eigen::Matrix<T, 3, Eigen::Dynamic> > residual_map_dist(residuals, 3, size_);
+      for (int i = 0; i < size_; ++i)
       {
-        T x(i + 1);
-        T y = p2.evaluate(x) + p3.evaluate(x) - p1.evaluate(x);
-        T tmp(1.0);
-        for (int j = 0; j < MIN_DEGREE; ++j)
-          tmp *= x;
-        for (int j = 0; j < SIZE; ++j)
-        {
-          A(i, j) = tmp;
-          tmp *= x;
-        }
-        b[i] = y;
-      }
-
-      Eigen::Matrix<T, Eigen::Dynamic, 1> x = A.colPivHouseholderQr().solve(b);
-
-      GlobalModel::Data::Ptr global_data = boost::make_shared<GlobalModel::Data>(Size2(2, 2));
-      for (int i = 0; i < 3 * MathTraits<GlobalPolynomial>::Size; ++i)
-        global_data->container().data()[0 * MathTraits<GlobalPolynomial>::Size + i] = global_undistortion[i];
-      for (int i = 0; i < SIZE; ++i)
-        global_data->container().data()[3 * MathTraits<GlobalPolynomial>::Size + i] = x[i];
-
-      GlobalModel::Ptr global_model = boost::make_shared<GlobalModel>(images_size_);
-      global_model->setMatrix(global_data);
+        const Scalar z = samples(SAMPLE + 2, i);
 
-      GlobalMatrixEigen global(global_model);
-
-      typename Types<T>::Cloud3 depth_points(depth_points_.size());
-      depth_points.container() = depth_points_.container().cast<T>();
-
-      const cv::Matx33d & K = depth_camera_model_->intrinsicMatrix();
-
-      for (int j = 0; j < depth_points.size().y(); ++j)
-      {
-        for (int i = 0; i < depth_points.size().x(); ++i)
-        {
-          T z = depth_points(i, j).z();
-          typename Types<T>::Point2 normalized_pixel((i - (K(0, 2) + delta[2])) / (K(0, 0) * delta[0]),
-                                                     (j - (K(1, 2) + delta[3])) / (K(1, 1) * delta[1]));
-
-          depth_points(i, j) = z * depth_camera_model_->undistort2d_<T>(normalized_pixel).homogeneous();
-
-          /*T z = depth_points(i, j).z();
-          depth_points(i, j).x() = (i - (depth_camera_model_->cx() + depth_camera_model_->Tx() + delta[2])) * depth_points(i, j).z() / (depth_camera_model_->fx() * delta[0]);
-          depth_points(i, j).y() = (j - (depth_camera_model_->cy() + depth_camera_model_->Ty() + delta[3])) * depth_points(i, j).z() / (depth_camera_model_->fy() * delta[1]);*/
-        }
-      }
+        // Global undistortion of the depth
+        T und_z(0.0);
+        Scalar z_pow = 1.0;
+        for (int j = 0; j < MIN_DEGREE; ++j)
+          z_pow *= z;
+        for (int j = 0; j < SIZE; ++j, z_pow *= z)
+          und_z += (samples(WEIGHTS, i) * global_undistortion[j] +
+                    samples(WEIGHTS + 1, i) * global_undistortion[SIZE + j] +
+                    samples(WEIGHTS + 2, i) * global_undistortion[2 * SIZE + j]) * z_pow;
 
-      global.undistort(depth_points);
+        typename Types<T>::Point2 normalized_pixel((samples(SAMPLE, i) - (K(0, 2) + delta[2])) / (K(0, 0) * delta[0]),
+                                                   (samples(SAMPLE + 1, i) - (K(1, 2) + delta[3])) / (K(1, 1) * delta[1]));
+        typename Types<T>::Point3 point = und_z * depth_camera_model_->undistort2d_<T>(normalized_pixel).homogeneous();
 
-      typename Types<T>::Cloud3 cb_corners(checkerboard_->corners().size());
-      cb_corners.container() = color_sensor_pose_eigen * checkerboard_pose_eigen * checkerboard_->corners().container().cast<T>();
+        // Intersection of the ray through point with the checkerboard plane
+        typename Types<T>::Point3 intersection = point * (-cb_offset / cb_normal.dot(point));
 
-      Polynomial<T, 2> depth_error_function(depth_error_function_.coefficients().cast<T>());
-      typename Types<T>::Plane cb_plane = Types<T>::Plane::Through(cb_corners(0, 0), cb_corners(0, 1), cb_corners(1, 0));
+        T depth_error(0.0);
+        for (int j = ERROR_SIZE - 1; j >= 0; --j)
+          depth_error = depth_error * point.z() + depth_error_function_.coefficients()[j];
 
-      Eigen::Map<Eigen::Matrix<T, 3, Eigen::Dynamic> > residual_map_dist(residuals, 3, plane_indices_.size());
-      for (Size1 i = 0; i < plane_indices_.size(); ++i)
-      {
-        Line line(Point3::Zero(), depth_points[plane_indices_[i]].normalized());
-        residual_map_dist.col(i) = (line.intersectionPoint(cb_plane) - depth_points[plane_indices_[i]]) /
-            (std::sqrt(T(plane_indices_.size())) * ceres::poly_eval(depth_error_function.coefficients(), depth_points[plane_indices_[i]].z()));
+        residual_map_dist.col(i) = (intersection - point) / (sqrt_size * depth_error);
       }
 
 //      Scalar alpha = std::acos(depth_plane.normal().dot(cb_plane.normal()));
@@ -623,22 +941,34 @@ private:
   const KinectDepthCameraModel::ConstPtr & depth_camera_model_;
   const Checkerboard::ConstPtr & checkerboard_;
 
-  const Cloud3 depth_points_;
-  const Indices plane_indices_;
+  const Scalar * samples_;
+  int size_;
 
   const Polynomial<Scalar, 2> depth_error_function_;
-  const Size2 images_size_;
 
 };
 
-typedef ceres::NumericDiffCostFunction<ReprojectionError, ceres::CENTRAL, ceres::DYNAMIC, 4, 3> ReprojectionCostFunction;
+typedef ceres::NumericDiffCostFunction<ReprojectionError, ceres::CENTRAL, ceres::DYNAMIC, 7> ReprojectionCostFunction;
 
-typedef ceres::NumericDiffCostFunction<TransformDistortionError, ceres::CENTRAL, ceres::DYNAMIC, 4, 3,
-    3 * MathTraits<GlobalPolynomial>::Size, 4, 3, 4> TransformDistortionCostFunction;
+typedef ceres::AutoDiffCostFunction<TransformDistortionError, ceres::DYNAMIC, 4, 3,
+    3 * MathTraits<GlobalPolynomial>::Size, 7, 4> TransformDistortionCostFunction;
 
 void
-Calibration::optimizeAll (const std::vector<CheckerboardViews::Ptr> & cb_views_vec)
+Calibration::optimizeAll (const std::vector<CheckerboardViews::Ptr> & cb_views_vec,
+                          int max_iterations)
 {
+  Profiler::ScopedTimer timer("calibration/optimize_all");
+
+  // The samples of every view in a single allocation, the errors only point into it
+  Size1 capacity = 0;
+  for (size_t i = 0; i < cb_views_vec.size(); ++i)
+    capacity += cb_views_vec[i]->depthView()->points().size();
+  TransformDistortionError::Arena arena(capacity);
+
+  // Only the lookup table of the model is used: coefficients are not needed
+  GlobalModel lookup_model(global_model_->imageSize());
+  lookup_model.setMatrix(boost::make_shared<GlobalModel::Data>(Size2(2, 2)));
+
   ceres::Problem problem;
   Eigen::Matrix<Scalar, Eigen::Dynamic, 7, Eigen::DontAlign | Eigen::RowMajor> data(cb_views_vec.size(), 7);
 
@@ -676,14 +1006,13 @@ Calibration::optimizeAll (const std::vector<CheckerboardViews::Ptr> & cb_views_v
     error = new TransformDistortionError(color_sensor_->cameraModel(),
 									     depth_sensor_->cameraModel(),
 									     cb_views.checkerboard(),
-									     PCLConversion<Scalar>::toPointMatrix(*cb_views.depthView()->data()),
+									     *cb_views.depthView()->data(),
 									     cb_views.depthView()->points(),
 									     depth_sensor_->depthErrorFunction(),
-									     global_model_->imageSize());
+									     lookup_model,
+									     arena);
 
-    cost_function = new TransformDistortionCostFunction(error,
-    		                                            ceres::DO_NOT_TAKE_OWNERSHIP,
-														3 * cb_views.depthView()->points().size());
+    cost_function = new TransformDistortionCostFunction(error, 3 * cb_views.depthView()->points().size());
 
     problem.AddResidualBlock(cost_function,
                              NULL,//new ceres::CauchyLoss(1.0),
@@ -691,36 +1020,61 @@ Calibration::optimizeAll (const std::vector<CheckerboardViews::Ptr> & cb_views_v
                              transform.data() + 4,
                              global_matrix_->model()->dataPtr(),
                              data.row(i).data(),
-                             data.row(i).data() + 4,
                              delta);
 
     ReprojectionError * repr_error = new ReprojectionError(color_sensor_->cameraModel(),
                                                            cb_views.checkerboard(),
                                                            cb_views.colorView()->points());
     ceres::CostFunction * repr_cost_function = new ReprojectionCostFunction(repr_error,
-                                                                            ceres::DO_NOT_TAKE_OWNERSHIP,
+                                                                            ceres::TAKE_OWNERSHIP,
                                                                             2 * cb_views.checkerboard()->size());
 
     problem.AddResidualBlock(repr_cost_function,
                              NULL,//new ceres::CauchyLoss(1.0),
-                             data.row(i).data(),
-                             data.row(i).data() + 4);
+                             data.row(i).data());
 
-    problem.SetParameterization(data.row(i).data(), new ceres::QuaternionParameterization());
+    // One block per view pose (w, x, y, z, tx, ty, tz)
+    problem.SetParameterization(data.row(i).data(),
+                                new ceres::ProductParameterization(new ceres::QuaternionParameterization(),
+                                                                   new ceres::IdentityParameterization(3)));
   }
 
   problem.SetParameterization(transform.data(), new ceres::QuaternionParameterization());
 
   ceres::Solver::Options options;
-  options.linear_solver_type = ceres::SPARSE_NORMAL_CHOLESKY;
-  options.max_num_iterations = 20;
+  options.linear_solver_type = optimization_options_.linear_solver;
+  options.preconditioner_type = optimization_options_.preconditioner;
+  options.max_num_iterations = max_iterations;
   options.minimizer_progress_to_stdout = true;
-  options.num_threads = 8;
+  options.num_threads = optimization_options_.num_threads;
+
+  const bool schur = options.linear_solver_type == ceres::SPARSE_SCHUR or
+                     options.linear_solver_type == ceres::DENSE_SCHUR or
+                     options.linear_solver_type == ceres::ITERATIVE_SCHUR;
+  if (schur and optimization_options_.eliminate_views)
+  {
+    // The view poses only interact through the shared blocks: eliminate them first (group 0), as in bundle adjustment.
+    ceres::ParameterBlockOrdering * ordering = new ceres::ParameterBlockOrdering();
+    for (size_t i = 0; i < cb_views_vec.size(); ++i)
+      ordering->AddElementToGroup(data.row(i).data(), 0);
+    ordering->AddElementToGroup(transform.data(), 1);
+    ordering->AddElementToGroup(transform.data() + 4, 1);
+    ordering->AddElementToGroup(global_matrix_->model()->dataPtr(), 1);
+    ordering->AddElementToGroup(delta, 1);
+    options.linear_solver_ordering.reset(ordering);
+  }
 
 //  problem.SetParameterBlockConstant(delta);
 
   ceres::Solver::Summary summary;
   ceres::Solve(options, &problem, &summary);
+  Profiler::instance().addSolverSummary("calibration/optimize_all", summary);
+
+  if (not summary.IsSolutionUsable())
+  {
+    ROS_ERROR_STREAM("Joint optimization failed: " << summary.message << ". Keeping the previous estimate.");
+    return;
+  }
 
   rotation = Quaternion(transform[0], transform[1], transform[2], transform[3]);
   translation.vector() = transform.tail<3>();
@@ -766,52 +1120,60 @@ Calibration::optimizeAll (const std::vector<CheckerboardViews::Ptr> & cb_views_v
 }
 
 void
-Calibration::optimize ()
+Calibration::optimizeDepthUndistortion_ (int max_iterations)
 {
-  ROS_INFO("Optimizing...\n");
+  std::vector<CheckerboardViews::Ptr> und_cb_views_vec;
 
-  if (estimate_depth_und_model_)
+  // Create locally undistorted clouds and views
+#pragma omp parallel for
+  for (Size1 i = 0; i < cb_views_vec_.size(); ++i)
   {
-    std::vector<CheckerboardViews::Ptr> und_cb_views_vec;
+    if (not cb_views_vec_[i])
+      continue;
 
-    // Create locally undistorted clouds and views
-#pragma omp parallel for
-    for (Size1 i = 0; i < cb_views_vec_.size(); ++i)
-    {
-      if (not cb_views_vec_[i])
-        continue;
+    const CheckerboardViews & cb_views = *cb_views_vec_[i];
+    const DepthUndistortionEstimation::DepthData & depth_data = *depth_data_vec_[i];
 
-      const CheckerboardViews & cb_views = *cb_views_vec_[i];
-      const DepthUndistortionEstimation::DepthData & depth_data = *depth_data_vec_[i];
+    // Undistorted on demand, only the region around the checkerboard is kept by the estimation
+    const PCLCloud3::ConstPtr und_cloud = depth_undistortion_estimation_->undistortedCloud(depth_data);
+    if (not und_cloud)
+      continue;
 
-      CheckerboardViews::Ptr und_cb_views = boost::make_shared<CheckerboardViews>(cb_views);
+    CheckerboardViews::Ptr und_cb_views = boost::make_shared<CheckerboardViews>(cb_views);
 
-      RGBDData::Ptr und_data = boost::make_shared<RGBDData>(*cb_views.data());
-      und_data->setDepthData(*depth_data.undistorted_cloud_);
+    RGBDData::Ptr und_data = boost::make_shared<RGBDData>(*cb_views.data());
+    und_data->setDepthData(*und_cloud);
 
-//      std::stringstream ss;
-//      ss <<  "/tmp/und_cloud_" << i <<  ".pcd";
-//      pcl::PCDWriter writer;
-//      writer.write(ss.str(), *depth_data.undistorted_cloud_);
-//
-//      ss.str("");
-//      ss <<  "/tmp/cloud_" << i <<  ".pcd";
-//      writer.write(ss.str(), *depth_data.cloud_);
+    if (debug_capture_ and debug_capture_->sample(i))
+    {
+      std::stringstream ss;
+      ss << "optimize_" << depth_data.id_;
+      debug_capture_->capture(ss.str() + "_und_cloud.pcd", und_data->depthData());
+      debug_capture_->capture(ss.str() + "_cloud.pcd", depth_data.cloud());
+    }
 
-      und_cb_views->setId(cb_views.id() + "_undistorted");
-      und_cb_views->setData(und_data);
-      und_cb_views->setPlaneInliers(depth_data.estimated_plane_.indices_, depth_data.estimated_plane_.std_dev_);
+    und_cb_views->setId(cb_views.id() + "_undistorted");
+    und_cb_views->setData(und_data);
+    und_cb_views->setPlaneInliers(depth_data.estimated_plane_.indices_, depth_data.estimated_plane_.std_dev_);
 
 #pragma omp critical
-      und_cb_views_vec.push_back(und_cb_views);
-    }
-
-    optimizeAll(und_cb_views_vec);
+    und_cb_views_vec.push_back(und_cb_views);
   }
+
+  optimizeAll(und_cb_views_vec, max_iterations);
+}
+
+void
+Calibration::optimize ()
+{
+  Profiler::ScopedTimer timer("calibration/optimize");
+
+  ROS_INFO("Optimizing...\n");
+
+  if (estimate_depth_und_model_)
+    optimizeDepthUndistortion_(usePyramid_() ? pyramid_options_.refine_iterations : optimization_options_.max_iterations);
   else
-  {
     optimizeTransform(cb_views_vec_);
-  }
 
 //  PolynomialUndistortionMatrixIO<GlobalPolynomial> io;
 //  //io.write(*global_matrix_->model(), "/tmp/opt_global_matrix.txt");
@@ -843,13 +1205,14 @@ Calibration::optimize ()
 //
 //  }
 
-//  std::ofstream transform_file;
-//  transform_file.open("/tmp/camera_pose.yaml");
-//  geometry_msgs::Pose pose_msg;
-//  tf::poseEigenToMsg(color_sensor_->pose(), pose_msg);
-//  transform_file << pose_msg;
-//  transform_file.close();
-
+  if (debug_capture_)
+  {
+    geometry_msgs::Pose pose_msg;
+    tf::poseEigenToMsg(color_sensor_->pose(), pose_msg);
+    std::stringstream ss;
+    ss << pose_msg;
+    debug_capture_->captureText("camera_pose.yaml", ss.str());
+  }
 }
 
 } /* namespace calibration */
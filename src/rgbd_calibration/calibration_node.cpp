@@ -1,3 +1,7 @@
+#include <fstream>
+
+#include <omp.h>
+
 #include <ros/ros.h>
 
 #include <pcl/io/pcd_io.h>
@@ -8,8 +12,11 @@
 #include <camera_info_manager/camera_info_manager.h>
 
 #include <kinect/depth/camera_model.h>
+#include <kinect/depth/polynomial_matrix_io.h>
 
 #include <rgbd_calibration/calibration_node.h>
+#include <rgbd_calibration/sensor_profile.h>
+#include <rgbd_calibration/model_file.h>
 
 using namespace camera_info_manager;
 using namespace calibration_msgs;
@@ -33,15 +40,61 @@ CalibrationNode::CalibrationNode (ros::NodeHandle & node_handle)
   node_handle_.param("camera_name", camera_name_, std::string("camera"));
   node_handle_.param("depth_camera_name", depth_camera_name_, std::string("depth_camera"));
 
+  // Visualization merged and sent by a background thread, at most "publisher/rate" times per second
+  bool batch_publishing;
+  node_handle_.param("publisher/batched", batch_publishing, false);
+  if (batch_publishing)
+  {
+    double rate;
+    int decimation;
+    node_handle_.param("publisher/rate", rate, 1.0);
+    node_handle_.param("publisher/decimation", decimation, 4);
+    if (rate <= 0.0 or decimation < 1)
+      ROS_WARN("\"publisher/rate\" must be > 0 and \"publisher/decimation\" >= 1. Publishing every view.");
+    else
+      publisher_->startBatching(rate, decimation);
+  }
+
+  // Intermediate clouds and samples are written to "debug_capture/directory", if set, by a background thread
+  std::string debug_capture_directory;
+  node_handle_.param("debug_capture/directory", debug_capture_directory, std::string());
+  if (not debug_capture_directory.empty())
+  {
+    int sampling_rate;
+    node_handle_.param("debug_capture/sampling_rate", sampling_rate, 10);
+    if (sampling_rate < 1)
+    {
+      sampling_rate = 1;
+      ROS_WARN("\"debug_capture/sampling_rate\" cannot be < 1. Using 1.");
+    }
+    debug_capture_ = boost::make_shared<DebugCapture>(debug_capture_directory, sampling_rate);
+  }
+
+  // Thread budget of the whole calibration, e.g. the share given by rgbd_batch_calibration. Defaults to the OpenMP
+  // thread count, i.e. OMP_NUM_THREADS when set
+  node_handle_.param("num_threads", num_threads_, omp_get_max_threads());
+  if (num_threads_ < 1)
+  {
+    num_threads_ = 1;
+    ROS_WARN("\"num_threads\" cannot be < 1. Using 1.");
+  }
+  omp_set_num_threads(num_threads_);
+
   int undistortion_matrix_cell_size_x, undistortion_matrix_cell_size_y;
   node_handle_.param("undistortion_matrix/cell_size_x", undistortion_matrix_cell_size_x, 8);
   node_handle_.param("undistortion_matrix/cell_size_y", undistortion_matrix_cell_size_y, 8);
   undistortion_matrix_cell_size_.x() = undistortion_matrix_cell_size_x;
   undistortion_matrix_cell_size_.y() = undistortion_matrix_cell_size_y;
 
+  // The sensor profile gives the default depth image size, "depth_image/cols" and "depth_image/rows" override it
+  SensorProfile profile;
+  std::string sensor_profile;
+  node_handle_.param("sensor_profile", sensor_profile, std::string(SensorProfile::DEFAULT_NAME));
+  SensorProfile::findOrDefault(sensor_profile, profile);
+
   int images_size_x, images_size_y;
-  node_handle_.param("depth_image/cols", images_size_x, 640);
-  node_handle_.param("depth_image/rows", images_size_y, 480);
+  node_handle_.param("depth_image/cols", images_size_x, profile.cols_);
+  node_handle_.param("depth_image/rows", images_size_y, profile.rows_);
   images_size_.x() = images_size_x;
   images_size_.y() = images_size_y;
 
@@ -56,6 +109,54 @@ CalibrationNode::CalibrationNode (ros::NodeHandle & node_handle)
     images_size_ /= downsample_ratio_;
   }
 
+  std::string downsample_mode;
+  downsample_mode_ = CloudDownsampler::MEAN;
+  node_handle_.param("downsample_mode", downsample_mode, std::string("mean"));
+  if (not CloudDownsampler::parseMode(downsample_mode, downsample_mode_))
+    ROS_WARN("\"downsample_mode\" must be \"mean\" or \"median\". Using \"mean\".");
+
+  // Inliers per frame used by the global model fit, 0 to use all of them
+  node_handle_.param("global_sample_budget", global_sample_budget_, 0);
+  if (global_sample_budget_ < 0)
+  {
+    global_sample_budget_ = 0;
+    ROS_WARN("\"global_sample_budget\" cannot be < 0. Using all the inliers.");
+  }
+
+  std::string linear_solver, preconditioner;
+  node_handle_.param("optimization/linear_solver", linear_solver, std::string("SPARSE_SCHUR"));
+  node_handle_.param("optimization/preconditioner", preconditioner, std::string("SCHUR_JACOBI"));
+  node_handle_.param("optimization/num_threads", optimization_options_.num_threads, num_threads_);
+  node_handle_.param("optimization/max_iterations", optimization_options_.max_iterations, 20);
+  node_handle_.param("optimization/eliminate_views", optimization_options_.eliminate_views, true);
+  if (not ceres::StringToLinearSolverType(linear_solver, &optimization_options_.linear_solver))
+    ROS_WARN_STREAM("Unknown \"optimization/linear_solver\" " << linear_solver << ". Using SPARSE_SCHUR.");
+  if (not ceres::StringToPreconditionerType(preconditioner, &optimization_options_.preconditioner))
+    ROS_WARN_STREAM("Unknown \"optimization/preconditioner\" " << preconditioner << ". Using SCHUR_JACOBI.");
+  if (optimization_options_.num_threads < 1)
+  {
+    optimization_options_.num_threads = 1;
+    ROS_WARN("\"optimization/num_threads\" cannot be < 1. Using 1.");
+  }
+
+  // Coarse-to-fine schedule, e.g. [4, 2, 1]. Ratios are w.r.t. "downsample_ratio"
+  node_handle_.getParam("pyramid/ratios", pyramid_options_.ratios);
+  node_handle_.param("pyramid/refine_iterations", pyramid_options_.refine_iterations, 5);
+  const std::vector<int> & ratios = pyramid_options_.ratios;
+  bool valid_pyramid = ratios.empty() or ratios.back() == 1;
+  for (size_t i = 1; i < ratios.size(); ++i)
+    valid_pyramid = valid_pyramid and ratios[i] > 0 and ratios[i - 1] > ratios[i] and ratios[i - 1] % ratios[i] == 0;
+  if (not valid_pyramid)
+  {
+    pyramid_options_.ratios.clear();
+    ROS_WARN("\"pyramid/ratios\" must be decreasing, each one a multiple of the next, down to 1. Using a single level.");
+  }
+  if (pyramid_options_.refine_iterations < 1)
+  {
+    pyramid_options_.refine_iterations = 1;
+    ROS_WARN("\"pyramid/refine_iterations\" cannot be < 1. Using 1.");
+  }
+
   if (not node_handle_.getParam("depth_error_function", depth_error_coeffs_))
     ROS_FATAL("Missing \"depth_error_function\" parameter!!");
   else if (depth_error_coeffs_.size() != 3)
@@ -79,6 +180,8 @@ CalibrationNode::CalibrationNode (ros::NodeHandle & node_handle)
     has_initial_transform_ = true;
   }
 
+  node_handle_.param("warm_start_path", warm_start_path_, std::string());
+
 }
 
 bool
@@ -87,6 +190,9 @@ CalibrationNode::initialize ()
   if (not waitForMessages())
     return false;
 
+  if (not warm_start_path_.empty() and not readWarmStart())
+    return false;
+
   calibration_ = boost::make_shared<Calibration>();
 
   for (size_t i = 0; i < checkerboard_array_msg_->checkerboards.size(); ++i)
@@ -99,6 +205,13 @@ CalibrationNode::initialize ()
   sensor_msgs::CameraInfo depth_camera_info = manager_depth.getCameraInfo();
   depth_camera_info.binning_x = downsample_ratio_;
   depth_camera_info.binning_y = downsample_ratio_;
+  if (not warm_start_intrinsics_.empty())
+  {
+    depth_camera_info.K[0] = depth_camera_info.P[0] = warm_start_intrinsics_[0];
+    depth_camera_info.K[4] = depth_camera_info.P[5] = warm_start_intrinsics_[1];
+    depth_camera_info.K[2] = depth_camera_info.P[2] = warm_start_intrinsics_[2];
+    depth_camera_info.K[5] = depth_camera_info.P[6] = warm_start_intrinsics_[3];
+  }
   KinectDepthCameraModel::Ptr depth_pinhole_model = boost::make_shared<KinectDepthCameraModel>(depth_camera_info);
 
   std::cout << depth_pinhole_model->projectionMatrix() << std::endl;
@@ -131,12 +244,16 @@ CalibrationNode::initialize ()
     calibration_->setEstimateInitialTransform(true);
 
   LocalModel::Ptr local_model = boost::make_shared<LocalModel>(images_size_);
-  LocalModel::Data::Ptr local_matrix = local_model->createMatrix(undistortion_matrix_cell_size_, LocalPolynomial::IdentityCoefficients());
-  local_model->setMatrix(local_matrix);
+  if (warm_start_local_matrix_)
+    local_model->setMatrix(warm_start_local_matrix_);
+  else
+    local_model->setMatrix(local_model->createMatrix(undistortion_matrix_cell_size_, LocalPolynomial::IdentityCoefficients()));
 
   GlobalModel::Ptr global_model = boost::make_shared<GlobalModel>(images_size_);
-  GlobalModel::Data::Ptr global_data = boost::make_shared<GlobalModel::Data>(Size2(2, 2), GlobalPolynomial::IdentityCoefficients());
-  global_model->setMatrix(global_data);
+  if (warm_start_global_matrix_)
+    global_model->setMatrix(warm_start_global_matrix_);
+  else
+    global_model->setMatrix(boost::make_shared<GlobalModel::Data>(Size2(2, 2), GlobalPolynomial::IdentityCoefficients()));
 
   UndistortionModel::Ptr model = boost::make_shared<UndistortionModel>();
   model->setLocalModel(local_model);
@@ -146,13 +263,61 @@ CalibrationNode::initialize ()
 
   calibration_->setLocalModel(local_model);
   calibration_->setGlobalModel(global_model);
+  calibration_->setGlobalSampleBudget(global_sample_budget_);
+  calibration_->setNumThreads(num_threads_);
+  calibration_->setDebugCapture(debug_capture_);
   calibration_->initDepthUndistortionModel();
+  if (warm_start_inverse_global_matrix_)
+  {
+    calibration_->setInverseGlobalMatrix(warm_start_inverse_global_matrix_);
+    calibration_->setWarmStart(true);
+  }
   calibration_->setPublisher(publisher_);
   calibration_->setDownSampleRatio(downsample_ratio_);
+  calibration_->setDownSampleMode(downsample_mode_);
+  calibration_->setOptimizationOptions(optimization_options_);
+  calibration_->setPyramidOptions(pyramid_options_);
 
   return true;
 }
 
+void
+CalibrationNode::saveOptimizedResults (const std::string & path) const
+{
+  PolynomialUndistortionMatrixIO<GlobalPolynomial> global_io;
+  global_io.write(*calibration_->globalModel(), path + "global_matrix.txt");
+
+  // Binary model for the runtime consumers, at the sensor resolution and with the undistortion kernel already baked
+  if (not ModelFile::write(path + "undistortion_model.bin", calibration_->localModel(), calibration_->globalModel(),
+                           images_size_.x() * downsample_ratio_, images_size_.y() * downsample_ratio_))
+    ROS_WARN_STREAM("Cannot write " << path << "undistortion_model.bin");
+
+  geometry_msgs::Pose pose_msg;
+  tf::poseEigenToMsg(color_sensor_->pose(), pose_msg);
+  ROS_INFO_STREAM("Optimized transform:\n" << pose_msg);
+
+  std::ofstream transform_file;
+  transform_file.open((path + "camera_pose.yaml").c_str());
+  transform_file << pose_msg;
+  transform_file.close();
+
+  const std::vector<double> & depth_intrinsics = calibration_->optimizedIntrinsics();
+
+  ROS_INFO_STREAM("fx = " << depth_sensor_->cameraModel()->binningX() * depth_intrinsics[0]);
+  ROS_INFO_STREAM("fy = " << depth_sensor_->cameraModel()->binningY() * depth_intrinsics[1]);
+  ROS_INFO_STREAM("cx = " << depth_sensor_->cameraModel()->binningX() * depth_intrinsics[2]);
+  ROS_INFO_STREAM("cy = " << depth_sensor_->cameraModel()->binningY() * depth_intrinsics[3]);
+
+  std::ofstream intrinsics_file;
+  intrinsics_file.open((path + "depth_intrinsics.yaml").c_str());
+  intrinsics_file << "intrinsics:" << std::endl;
+  intrinsics_file << "  fx: " << depth_sensor_->cameraModel()->binningX() * depth_intrinsics[0] << std::endl;
+  intrinsics_file << "  fy: " << depth_sensor_->cameraModel()->binningY() * depth_intrinsics[1] << std::endl;
+  intrinsics_file << "  cx: " << depth_sensor_->cameraModel()->binningX() * depth_intrinsics[2] << std::endl;
+  intrinsics_file << "  cy: " << depth_sensor_->cameraModel()->binningY() * depth_intrinsics[3] << std::endl;
+  intrinsics_file.close();
+}
+
 void
 CalibrationNode::checkerboardArrayCallback (const CheckerboardArray::ConstPtr & msg)
 {
@@ -173,6 +338,82 @@ CalibrationNode::waitForMessages () const
   return checkerboard_array_msg_;
 }
 
+bool
+CalibrationNode::readYAMLValues (const std::string & file_name,
+                                 std::map<std::string, double> & values)
+{
+  std::ifstream file(file_name.c_str());
+  if (not file.is_open())
+    return false;
+
+  std::string line, section;
+  while (std::getline(file, line))
+  {
+    size_t colon = line.find(':');
+    size_t begin = line.find_first_not_of(' ');
+    if (colon == std::string::npos or begin >= colon)
+      continue;
+
+    std::string key = line.substr(begin, colon - begin);
+    std::stringstream value_ss(line.substr(colon + 1));
+    double value;
+    if (not (value_ss >> value))
+      section = key;
+    else
+      values[begin > 0 ? section + "/" + key : key] = value;
+  }
+
+  return true;
+}
+
+bool
+CalibrationNode::readWarmStart ()
+{
+  if (warm_start_path_[warm_start_path_.size() - 1] != '/')
+    warm_start_path_ += "/";
+
+  PolynomialUndistortionMatrixIO<LocalPolynomial> local_io;
+  PolynomialUndistortionMatrixIO<GlobalPolynomial> global_io;
+  PolynomialUndistortionMatrixIO<InverseGlobalPolynomial> inverse_global_io;
+
+  if (not local_io.read(warm_start_local_matrix_, warm_start_path_ + "local_matrix.txt")
+      or not global_io.read(warm_start_global_matrix_, warm_start_path_ + "global_matrix.txt")
+      or not inverse_global_io.read(warm_start_inverse_global_matrix_, warm_start_path_ + "inverse_global_matrix.txt"))
+  {
+    ROS_FATAL_STREAM("Undistortion matrices not found in " << warm_start_path_ << "!!");
+    return false;
+  }
+
+  std::map<std::string, double> pose;
+  if (not readYAMLValues(warm_start_path_ + "camera_pose.yaml", pose))
+  {
+    ROS_FATAL_STREAM("File " << warm_start_path_ << "camera_pose.yaml not found!!");
+    return false;
+  }
+
+  Translation3 translation(pose["position/x"], pose["position/y"], pose["position/z"]);
+  Quaternion rotation(pose["orientation/w"], pose["orientation/x"], pose["orientation/y"], pose["orientation/z"]);
+  initial_transform_ = translation * rotation.normalized();
+  has_initial_transform_ = true;
+
+  std::map<std::string, double> intrinsics;
+  if (readYAMLValues(warm_start_path_ + "depth_intrinsics.yaml", intrinsics))
+  {
+    warm_start_intrinsics_.resize(4);
+    warm_start_intrinsics_[0] = intrinsics["intrinsics/fx"];
+    warm_start_intrinsics_[1] = intrinsics["intrinsics/fy"];
+    warm_start_intrinsics_[2] = intrinsics["intrinsics/cx"];
+    warm_start_intrinsics_[3] = intrinsics["intrinsics/cy"];
+  }
+  else
+  {
+    ROS_WARN_STREAM("File " << warm_start_path_ << "depth_intrinsics.yaml not found. Using the calibration file ones.");
+  }
+
+  ROS_INFO_STREAM("Warm start from " << warm_start_path_);
+  return true;
+}
+
 Checkerboard::Ptr
 CalibrationNode::createCheckerboard (const CheckerboardMsg::ConstPtr & msg,
                                      int id)
@@ -15,8 +15,11 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <omp.h>
+
 #include <rgbd_calibration/calibration_test.h>
 #include <rgbd_calibration/checkerboard_views_extractor.h>
+#include <rgbd_calibration/profiler.h>
 
 #include <calibration_common/ceres/plane_fit.h>
 
@@ -41,6 +44,38 @@
 namespace calibration
 {
 
+CalibrationTest::CalibrationTest()
+  : ratio_(1),
+    has_cb_views_(false)
+{
+  // Do nothing
+}
+
+const std::vector<CheckerboardViews::Ptr> &
+CalibrationTest::checkerboardViews() const
+{
+  if (has_cb_views_)
+    return cb_views_vec_;
+
+  Profiler::ScopedTimer timer("test/extract_views");
+
+  cb_views_vec_.clear();
+
+  CheckerboardViewsExtraction cb_extractor;
+  cb_extractor.setColorSensorPose(color_sensor_->pose());
+  cb_extractor.setCheckerboardVector(cb_vec_);
+  cb_extractor.setInputData(und_data_vec_);
+  cb_extractor.setCache(cb_cache_);
+  cb_extractor.setDepthIntrinsics(depth_sensor_->cameraModel()->intrinsicMatrix()(0, 0),
+                                  depth_sensor_->cameraModel()->intrinsicMatrix()(1, 1),
+                                  depth_sensor_->cameraModel()->intrinsicMatrix()(0, 2),
+                                  depth_sensor_->cameraModel()->intrinsicMatrix()(1, 2));
+  cb_extractor.extractAll(cb_views_vec_);
+
+  has_cb_views_ = true;
+  return cb_views_vec_;
+}
+
 void CalibrationTest::publishData() const
 {
   if (not publisher_)
@@ -64,55 +99,8 @@ PCLCloudRGB::Ptr CalibrationTest::addData(const cv::Mat & image,
 //  std::vector<int> remapping;
 //  pcl::removeNaNFromPointCloud(*cloud, *new_cloud, remapping);
 
-  PCLCloud3::Ptr new_cloud = boost::make_shared<PCLCloud3>(*cloud);
-
-  if (ratio_ > 1)
-  {
-    new_cloud = boost::make_shared<PCLCloud3>();
-    new_cloud->resize(cloud->size() / (ratio_ * ratio_));
-    new_cloud->header = cloud->header;
-    new_cloud->width = cloud->width / ratio_;
-    new_cloud->height = cloud->height / ratio_;
-    new_cloud->is_dense = cloud->is_dense;
-
-    PCLPoint3 zero(0, 0, 0);
-    float nan = std::numeric_limits<float>::quiet_NaN();
-    PCLPoint3 bad_point(nan, nan, nan);
-
-    for (Size1 i = 0; i < new_cloud->height; ++i)
-    {
-      for (Size1 j = 0; j < new_cloud->width; ++j)
-      {
-        new_cloud->at(j, i) = zero;
-        int count = 0;
-        for (Size1 di = 0; di < ratio_; ++di)
-        {
-          for (Size1 dj = 0; dj < ratio_; ++dj)
-          {
-            const PCLPoint3 & p = cloud->at(j * ratio_ + dj, i * ratio_ + di);
-            if (pcl::isFinite(p))
-            {
-              ++count;
-              new_cloud->at(j, i).x += p.x;
-              new_cloud->at(j, i).y += p.y;
-              new_cloud->at(j, i).z += p.z;
-            }
-          }
-        }
-        if (count > 0)
-        {
-          new_cloud->at(j, i).x /= count;
-          new_cloud->at(j, i).y /= count;
-          new_cloud->at(j, i).z /= count;
-        }
-        else
-        {
-          new_cloud->at(j, i) = bad_point;
-          new_cloud->is_dense = false;
-        }
-      }
-    }
-  }
+  PCLCloud3::Ptr new_cloud = boost::make_shared<PCLCloud3>();
+  downsampler_.apply(*cloud, *new_cloud);
 
   int index = data_vec_.size() + 1;
 
@@ -156,6 +144,8 @@ PCLCloudRGB::Ptr CalibrationTest::addData(const cv::Mat & image,
   part_data_map_[und_data] = part_und_data;
   data_map_[und_data] = data;
 
+  has_cb_views_ = false;
+
   und_data->fuseData();
   return und_data->fusedData();
 
@@ -538,18 +528,15 @@ void CalibrationTest::testPlanarityError() const
 
 
 
-  std::vector<CheckerboardViews::Ptr> cb_views_vec;
-
-  CheckerboardViewsExtraction cb_extractor;
-  cb_extractor.setColorSensorPose(color_sensor_->pose());
-  cb_extractor.setCheckerboardVector(cb_vec_);
-  cb_extractor.setInputData(und_data_vec_);
-  cb_extractor.extractAll(cb_views_vec);
+  const std::vector<CheckerboardViews::Ptr> & cb_views_vec = checkerboardViews();
 
-  std::map<Scalar, std::vector<Scalar> > data_map;
+  Profiler::ScopedTimer timer("test/planarity_error");
 
+  // Views are evaluated in parallel, their values are merged in order at the end
+  std::vector<std::pair<Scalar, std::vector<Scalar> > > view_values(cb_views_vec.size());
 
-  for (size_t i = 0; i < cb_views_vec.size(); ++i)
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int i = 0; i < static_cast<int>(cb_views_vec.size()); ++i)
   {
     const CheckerboardViews & cb_views = *cb_views_vec[i];
     RGBDData::ConstPtr und_data = cb_views.data();
@@ -602,14 +589,22 @@ void CalibrationTest::testPlanarityError() const
     var /= count;
     //var -= mean * mean;
 
-    data_map[d_mean].push_back(mean);
-    data_map[d_mean].push_back(std::sqrt(var));
-    data_map[d_mean].push_back(max);
-    data_map[d_mean].push_back(und_mean);
-    data_map[d_mean].push_back(std::sqrt(und_var));
-    data_map[d_mean].push_back(und_max);
-    data_map[d_mean].push_back(count);
+    view_values[i].first = d_mean;
+    std::vector<Scalar> & values = view_values[i].second;
+    values.push_back(mean);
+    values.push_back(std::sqrt(var));
+    values.push_back(max);
+    values.push_back(und_mean);
+    values.push_back(std::sqrt(und_var));
+    values.push_back(und_max);
+    values.push_back(count);
+  }
 
+  std::map<Scalar, std::vector<Scalar> > data_map;
+  for (Size1 i = 0; i < view_values.size(); ++i)
+  {
+    std::vector<Scalar> & values = data_map[view_values[i].first];
+    values.insert(values.end(), view_values[i].second.begin(), view_values[i].second.end());
   }
 
 //  std::stringstream ss;
@@ -686,13 +681,9 @@ private:
 
 void CalibrationTest::testCheckerboardError() const
 {
-  std::vector<CheckerboardViews::Ptr> cb_views_vec;
+  const std::vector<CheckerboardViews::Ptr> & cb_views_vec = checkerboardViews();
 
-  CheckerboardViewsExtraction cb_extractor;
-  cb_extractor.setColorSensorPose(color_sensor_->pose());
-  cb_extractor.setCheckerboardVector(cb_vec_);
-  cb_extractor.setInputData(und_data_vec_);
-  cb_extractor.extractAll(cb_views_vec);
+  Profiler::ScopedTimer timer("test/checkerboard_error");
 
   ceres::Problem problem;
   Eigen::Matrix<Scalar, Eigen::Dynamic, 4, Eigen::DontAlign | Eigen::RowMajor> data(cb_views_vec.size(), 4);
@@ -729,7 +720,7 @@ void CalibrationTest::testCheckerboardError() const
   options.linear_solver_type = ceres::DENSE_QR;
   options.max_num_iterations = 50;
   options.minimizer_progress_to_stdout = true;
-  options.num_threads = 8;
+  options.num_threads = omp_get_max_threads();
 
   ceres::Solver::Summary summary;
   ceres::Solve(options, &problem, &summary);
@@ -764,8 +755,11 @@ void CalibrationTest::testCheckerboardError() const
   Vector3 n_x = (Vector3::UnitX() - Vector3::UnitX().dot(n_z) * n_z).normalized();
   Vector3 n_y = n_z.cross(n_x);
 
+  // Views are evaluated in parallel, their lines are printed in order at the end
+  std::vector<std::string> lines(cb_views_vec.size());
 
-  for (size_t i = 0; i < cb_views_vec.size(); ++i)
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int i = 0; i < static_cast<int>(cb_views_vec.size()); ++i)
   {
     const CheckerboardViews & cb_views = *cb_views_vec[i];
     RGBDData::ConstPtr und_data = cb_views.data();
@@ -935,12 +929,14 @@ void CalibrationTest::testCheckerboardError() const
     Scalar part_angle_x = std::acos(part_fitted_plane.normal().dot(n_x));
     Scalar part_angle_y = std::acos(part_fitted_plane.normal().dot(n_y));
 
-    std::cout << "Original: " << plane.normal().dot(d_mean) << ", " << mean << ", " << std_dev << ", "
+    std::stringstream line;
+    line << "Original: " << plane.normal().dot(d_mean) << ", " << mean << ", " << std_dev << ", "
               << 180 * angle_x / M_PI << ", " << 180 * angle_y / M_PI << "; "
               << "Final: " << plane.normal().dot(und_d_mean) << ", "<< und_mean << ", " << und_std_dev << ", "
               << 180 * und_angle_x / M_PI << ", " << 180 * und_angle_y / M_PI << "; "
               << "Undistorted: " << plane.normal().dot(part_d_mean) << ", "<< part_mean << ", " << part_std_dev << ", "
               << 180 * part_angle_x / M_PI << ", " << 180 * part_angle_y / M_PI << "; " << std::endl;
+    lines[i] = line.str();
 
 
 
@@ -967,12 +963,11 @@ void CalibrationTest::testCheckerboardError() const
       fs << tmp_und_cloud->points[j].x << " " << tmp_und_cloud->points[j].z << std::endl;
     fs.close();
 
-
-
-
-
   }
 
+  for (size_t i = 0; i < lines.size(); ++i)
+    std::cout << lines[i];
+
 }
 
 boost::shared_ptr<std::vector<int> >
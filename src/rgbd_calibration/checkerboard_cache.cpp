@@ -0,0 +1,320 @@
+/*
+ *  Copyright (c) 2013-2014, Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *     3. Neither the name of the copyright holder(s) nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstring>
+#include <fstream>
+
+#include <rgbd_calibration/checkerboard_cache.h>
+
+namespace calibration
+{
+
+const char CheckerboardCache::MAGIC[8] = {'R', 'G', 'B', 'D', 'C', 'B', 'C', '\0'};
+
+CheckerboardCache::CheckerboardCache()
+  : modified_(false)
+{
+  // Do nothing
+}
+
+boost::uint64_t CheckerboardCache::hash(const void * data,
+                                        size_t size,
+                                        boost::uint64_t seed)
+{
+  const unsigned char * bytes = static_cast<const unsigned char *>(data);
+  boost::uint64_t h = seed;
+  for (size_t i = 0; i < size; ++i)
+  {
+    h ^= bytes[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+boost::uint64_t CheckerboardCache::imageHash(const cv::Mat & image)
+{
+  const boost::int32_t header[3] = {image.cols, image.rows, image.type()};
+  boost::uint64_t h = hash(header, sizeof(header));
+  for (int i = 0; i < image.rows; ++i)
+    h = hash(image.ptr(i), image.cols * image.elemSize(), h);
+  return h;
+}
+
+boost::uint64_t CheckerboardCache::cloudHash(const PCLCloud3 & cloud)
+{
+  const boost::uint32_t header[2] = {cloud.width, cloud.height};
+  boost::uint64_t h = hash(header, sizeof(header));
+  for (size_t i = 0; i < cloud.points.size(); ++i)
+  {
+    const PCLPoint3 & p = cloud.points[i];
+    const float xyz[3] = {p.x, p.y, p.z};
+    h = hash(xyz, sizeof(xyz), h);
+  }
+  return h;
+}
+
+boost::uint64_t CheckerboardCache::cornersKey(boost::uint64_t image_hash,
+                                              const Checkerboard & checkerboard,
+                                              int detection_max_size,
+                                              bool use_last_corners)
+{
+  const boost::int32_t size[2] = {checkerboard.corners().size().x(), checkerboard.corners().size().y()};
+  const double cell[2] = {checkerboard.width(), checkerboard.height()};
+  const boost::int32_t settings[2] = {detection_max_size, use_last_corners};
+  boost::uint64_t h = hash(&image_hash, sizeof(image_hash));
+  h = hash(size, sizeof(size), h);
+  h = hash(cell, sizeof(cell), h);
+  return hash(settings, sizeof(settings), h);
+}
+
+boost::uint64_t CheckerboardCache::planeKey(boost::uint64_t corners_key,
+                                            boost::uint64_t cloud_hash,
+                                            const Pose & color_sensor_pose)
+{
+  boost::uint64_t h = hash(&corners_key, sizeof(corners_key));
+  h = hash(&cloud_hash, sizeof(cloud_hash), h);
+  for (int i = 0; i < 3; ++i)
+  {
+    for (int j = 0; j < 4; ++j)
+    {
+      const double value = color_sensor_pose.matrix()(i, j);
+      h = hash(&value, sizeof(value), h);
+    }
+  }
+  return h;
+}
+
+bool CheckerboardCache::findCorners(boost::uint64_t key,
+                                    CornersEntry & entry) const
+{
+  bool found = false;
+#pragma omp critical (checkerboard_cache)
+  {
+    std::map<boost::uint64_t, CornersEntry>::const_iterator it = corners_map_.find(key);
+    if (it != corners_map_.end())
+    {
+      entry = it->second;
+      found = true;
+    }
+  }
+  return found;
+}
+
+void CheckerboardCache::addCorners(boost::uint64_t key,
+                                   const CornersEntry & entry)
+{
+#pragma omp critical (checkerboard_cache)
+  {
+    corners_map_[key] = entry;
+    modified_ = true;
+  }
+}
+
+bool CheckerboardCache::findPlane(boost::uint64_t key,
+                                  PlaneEntry & entry) const
+{
+  bool found = false;
+#pragma omp critical (checkerboard_cache)
+  {
+    std::map<boost::uint64_t, PlaneEntry>::const_iterator it = plane_map_.find(key);
+    if (it != plane_map_.end())
+    {
+      entry = it->second;
+      found = true;
+    }
+  }
+  return found;
+}
+
+void CheckerboardCache::addPlane(boost::uint64_t key,
+                                 const PlaneEntry & entry)
+{
+#pragma omp critical (checkerboard_cache)
+  {
+    plane_map_[key] = entry;
+    modified_ = true;
+  }
+}
+
+template <typename T>
+  static inline bool
+  readValue(std::ifstream & file,
+            T & value)
+  {
+    return not file.read(reinterpret_cast<char *>(&value), sizeof(T)).fail();
+  }
+
+// Whether bytes more bytes are left in file, whose size is file_size.
+static inline bool
+bytesLeft(std::ifstream & file,
+          boost::uint64_t file_size,
+          boost::uint64_t bytes)
+{
+  const std::streamoff position = file.tellg();
+  return position >= 0 and static_cast<boost::uint64_t>(position) <= file_size
+      and bytes <= file_size - static_cast<boost::uint64_t>(position);
+}
+
+template <typename T>
+  static inline void
+  writeValue(std::ofstream & file,
+             const T & value)
+  {
+    file.write(reinterpret_cast<const char *>(&value), sizeof(T));
+  }
+
+bool CheckerboardCache::load(const std::string & file_name)
+{
+  corners_map_.clear();
+  plane_map_.clear();
+  modified_ = false;
+
+  std::ifstream file(file_name.c_str(), std::ios::binary | std::ios::ate);
+  if (not file.is_open())
+    return true;
+
+  const std::streamoff file_size = file.tellg();
+  file.seekg(0, std::ios::beg);
+
+  // Entries read before an error are not trusted: a truncated entry has its data zeroed
+  if (file_size < 0 or not read(file, file_size))
+  {
+    corners_map_.clear();
+    plane_map_.clear();
+    return false;
+  }
+
+  return true;
+}
+
+bool CheckerboardCache::read(std::ifstream & file,
+                             boost::uint64_t file_size)
+{
+  char magic[8];
+  boost::uint32_t version, corners_size, plane_size;
+  if (not file.read(magic, sizeof(magic)) or std::memcmp(magic, MAGIC, sizeof(magic)) != 0
+      or not readValue(file, version))
+    return false;
+
+  // Older entries are keyed or computed differently: start from an empty cache, rewritten by save()
+  if (version < VERSION)
+  {
+    modified_ = true;
+    return true;
+  }
+
+  if (version != VERSION or not readValue(file, corners_size) or not readValue(file, plane_size))
+    return false;
+
+  for (boost::uint32_t i = 0; i < corners_size; ++i)
+  {
+    boost::uint64_t key;
+    boost::uint8_t found;
+    boost::uint32_t size;
+    if (not readValue(file, key) or not readValue(file, found) or not readValue(file, size))
+      return false;
+
+    // The sizes of a corrupt file can be anything: never allocate more than what is left to read
+    if (not bytesLeft(file, file_size, static_cast<boost::uint64_t>(size) * sizeof(float)))
+      return false;
+
+    CornersEntry & entry = corners_map_[key];
+    entry.found_ = found != 0;
+    entry.corners_.resize(size);
+    if (size > 0 and not file.read(reinterpret_cast<char *>(&entry.corners_[0]), size * sizeof(float)))
+      return false;
+  }
+
+  for (boost::uint32_t i = 0; i < plane_size; ++i)
+  {
+    boost::uint64_t key;
+    boost::uint8_t found;
+    boost::uint32_t size;
+    if (not readValue(file, key) or not readValue(file, found) or not readValue(file, size))
+      return false;
+
+    if (not bytesLeft(file, file_size, static_cast<boost::uint64_t>(size) * sizeof(int)))
+      return false;
+
+    PlaneEntry & entry = plane_map_[key];
+    entry.found_ = found != 0;
+    entry.indices_.resize(size);
+    if (size > 0 and not file.read(reinterpret_cast<char *>(&entry.indices_[0]), size * sizeof(int)))
+      return false;
+
+    double std_dev;
+    if (not readValue(file, std_dev))
+      return false;
+    entry.std_dev_ = std_dev;
+  }
+
+  return true;
+}
+
+bool CheckerboardCache::save(const std::string & file_name)
+{
+  if (not modified_)
+    return true;
+
+  std::ofstream file(file_name.c_str(), std::ios::binary | std::ios::trunc);
+  if (not file.is_open())
+    return false;
+
+  file.write(MAGIC, sizeof(MAGIC));
+  writeValue(file, static_cast<boost::uint32_t>(VERSION));
+  writeValue(file, static_cast<boost::uint32_t>(corners_map_.size()));
+  writeValue(file, static_cast<boost::uint32_t>(plane_map_.size()));
+
+  typedef std::map<boost::uint64_t, CornersEntry>::const_iterator CornersIterator;
+  for (CornersIterator it = corners_map_.begin(); it != corners_map_.end(); ++it)
+  {
+    const CornersEntry & entry = it->second;
+    writeValue(file, it->first);
+    writeValue(file, static_cast<boost::uint8_t>(entry.found_));
+    writeValue(file, static_cast<boost::uint32_t>(entry.corners_.size()));
+    if (not entry.corners_.empty())
+      file.write(reinterpret_cast<const char *>(&entry.corners_[0]), entry.corners_.size() * sizeof(float));
+  }
+
+  typedef std::map<boost::uint64_t, PlaneEntry>::const_iterator PlaneIterator;
+  for (PlaneIterator it = plane_map_.begin(); it != plane_map_.end(); ++it)
+  {
+    const PlaneEntry & entry = it->second;
+    writeValue(file, it->first);
+    writeValue(file, static_cast<boost::uint8_t>(entry.found_));
+    writeValue(file, static_cast<boost::uint32_t>(entry.indices_.size()));
+    if (not entry.indices_.empty())
+      file.write(reinterpret_cast<const char *>(&entry.indices_[0]), entry.indices_.size() * sizeof(int));
+    writeValue(file, static_cast<double>(entry.std_dev_));
+  }
+
+  modified_ = not file.good();
+  return file.good();
+}
+
+} /* namespace calibration */
@@ -26,41 +26,159 @@
  *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <omp.h>
+#include <opencv2/imgproc/imgproc.hpp>
+
 #include <rgbd_calibration/checkerboard_views_extractor.h>
+#include <rgbd_calibration/organized_plane_extraction.h>
 
 #include <calibration_common/algorithms/plane_extraction.h>
 #include <calibration_common/algorithms/interactive_checkerboard_finder.h>
 #include <calibration_common/algorithms/automatic_checkerboard_finder.h>
 
+// Consecutive frames of extractAll() that start from the corners of the previous one, whatever the number of threads
+#define LAST_CORNERS_CHUNK 8
+
 namespace calibration
 {
 
+bool CheckerboardViewsExtraction::findCorners(const std::vector<cv::Mat> & pyramid,
+                                              const cv::Mat & gray,
+                                              const Checkerboard & checkerboard,
+                                              const cv::Rect & roi,
+                                              Cloud2 & image_corners) const
+{
+  const cv::Mat & coarse = pyramid.back();
+  const Scalar scale = 1 << (pyramid.size() - 1);
+
+  AutomaticCheckerboardFinder finder;
+  bool found = false;
+
+  // 1. Search around the previous corners
+  if (roi.area() > 0)
+  {
+    cv::Rect coarse_roi(roi.x / scale - roi.width / (2 * scale), roi.y / scale - roi.height / (2 * scale),
+                        2 * roi.width / scale, 2 * roi.height / scale);
+    coarse_roi &= cv::Rect(0, 0, coarse.cols, coarse.rows);
+
+    if (coarse_roi.area() > 0)
+    {
+      finder.setImage(coarse(coarse_roi).clone());
+      found = finder.find(checkerboard, image_corners);
+      for (Size1 c = 0; found and c < image_corners.elements(); ++c)
+      {
+        image_corners[c].x() += coarse_roi.x;
+        image_corners[c].y() += coarse_roi.y;
+      }
+    }
+  }
+
+  // 2. Search the whole image
+  if (not found)
+  {
+    finder.setImage(coarse);
+    found = finder.find(checkerboard, image_corners);
+  }
+
+  if (not found)
+    return false;
+
+  if (pyramid.size() == 1)
+    return true;
+
+  // 3. Refine at full resolution, with a window smaller than half a cell
+  std::vector<cv::Point2f> corners(image_corners.elements());
+  for (Size1 c = 0; c < image_corners.elements(); ++c)
+    corners[c] = cv::Point2f((image_corners[c].x() + 0.5) * scale - 0.5, (image_corners[c].y() + 0.5) * scale - 0.5);
+
+  Scalar cell_size = std::min((image_corners[1] - image_corners[0]).norm(),
+                              (image_corners[image_corners.size().x()] - image_corners[0]).norm()) * scale;
+  int half_window = std::max(2, std::min(15, static_cast<int>(0.4 * cell_size)));
+
+  cv::cornerSubPix(gray, corners, cv::Size(half_window, half_window), cv::Size(-1, -1),
+                   cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::COUNT, 30, 0.01));
+
+  for (Size1 c = 0; c < image_corners.elements(); ++c)
+  {
+    image_corners[c].x() = corners[c].x;
+    image_corners[c].y() = corners[c].y;
+  }
+
+  return true;
+}
+
+bool CheckerboardViewsExtraction::extractPlane(const PCLCloud3::ConstPtr & cloud,
+                                               const Checkerboard & checkerboard,
+                                               const Point3 & center,
+                                               PlaneInfo & plane_info) const
+{
+  OrganizedPlaneExtraction plane_extractor;
+  plane_extractor.setInputCloud(cloud);
+  if (has_depth_intrinsics_)
+    plane_extractor.setIntrinsics(depth_intrinsics_[0], depth_intrinsics_[1], depth_intrinsics_[2], depth_intrinsics_[3]);
+  plane_extractor.setPoint(center);
+  plane_extractor.setRadius(std::min(checkerboard.width(), checkerboard.height()) / 1.5);
+  return plane_extractor.extract(plane_info);
+}
+
 Size1 CheckerboardViewsExtraction::extract(const RGBDData::ConstPtr & data,
                                            std::vector<CheckerboardViews::Ptr> & cb_views_vec,
                                            bool interactive,
-                                           bool force) const
+                                           bool force,
+                                           std::vector<cv::Rect> & last_rois) const
 {
-  Size1 added = 0;
+  // The image is only modified by the interactive tools
+  cv::Mat image = (interactive or force) ? data->colorData().clone() : data->colorData();
 
-  cv::Mat image = data->colorData().clone();
-  AutomaticCheckerboardFinder finder;
-  finder.setImage(image);
+  // Look up the cached corners first, the image is prepared for the detection only when needed
+  const bool use_cache = cache_ and not interactive;
+  std::vector<boost::uint64_t> corners_keys(cb_vec_.size());
+  std::vector<CheckerboardCache::CornersEntry> cached_corners(cb_vec_.size());
+  std::vector<bool> is_cached(cb_vec_.size(), false);
+  boost::uint64_t cloud_hash = 0;
+  bool detect = not use_cache;
+
+  if (use_cache)
+  {
+    boost::uint64_t image_hash = CheckerboardCache::imageHash(data->colorData());
+    for (Size1 c = 0; c < cb_vec_.size(); ++c)
+    {
+      corners_keys[c] = CheckerboardCache::cornersKey(image_hash, *cb_vec_[c], detection_max_size_,
+                                                       use_last_corners_);
+      is_cached[c] = cache_->findCorners(corners_keys[c], cached_corners[c]);
+      detect = detect or not is_cached[c];
+    }
+    if (not only_images_)
+      cloud_hash = CheckerboardCache::cloudHash(*data->depthData());
+  }
+
+  std::vector<cv::Mat> pyramid(1, image);
+  cv::Mat gray;
 
-  PointPlaneExtraction<PCLPoint3>::Ptr plane_extractor;
+  while (detect and std::max(pyramid.back().cols, pyramid.back().rows) > detection_max_size_)
+  {
+    cv::Mat level;
+    cv::pyrDown(pyramid.back(), level);
+    pyramid.push_back(level);
+  }
 
-  if (not interactive)
-    plane_extractor = boost::make_shared<PointPlaneExtraction<PCLPoint3> >();
-  else
-    plane_extractor = boost::make_shared<PointPlaneExtractionGUI<PCLPoint3> >();
+  if (pyramid.size() > 1)
+  {
+    if (image.channels() == 1)
+      gray = image;
+    else
+      cv::cvtColor(image, gray, CV_BGR2GRAY);
+  }
 
-  plane_extractor->setInputCloud(data->depthData());
+  last_rois.resize(cb_vec_.size());
+  std::vector<CheckerboardViews::Ptr> results(cb_vec_.size());
 
+  // Checkerboards are searched in parallel, unless the caller is already parallel (e.g. extractAll())
+#pragma omp parallel for schedule(dynamic, 1) if (not interactive and not omp_in_parallel())
   for (Size1 c = 0; c < cb_vec_.size(); ++c)
   {
     const Checkerboard::ConstPtr & cb = cb_vec_[c];
 
-    plane_extractor->setRadius(std::min(cb->width(), cb->height()) / 1.5);
-
     std::stringstream ss;
     ss << "rgbd_cb_" << data->id() << "_" << c;
     CheckerboardViews::Ptr cb_views(boost::make_shared<CheckerboardViews>(ss.str()));
@@ -70,19 +188,58 @@ Size1 CheckerboardViewsExtraction::extract(const RGBDData::ConstPtr & data,
     // 1. Extract corners
 
     Cloud2 image_corners(cb->corners().size());
-    if (not finder.find(*cb, image_corners))
+    bool found;
+
+    if (is_cached[c])
     {
-      if (force)
+      const CheckerboardCache::CornersEntry & entry = cached_corners[c];
+      found = entry.found_ and entry.corners_.size() == 2 * image_corners.elements();
+      for (Size1 i = 0; found and i < image_corners.elements(); ++i)
+      {
+        image_corners[i].x() = entry.corners_[2 * i];
+        image_corners[i].y() = entry.corners_[2 * i + 1];
+      }
+    }
+    else
+    {
+      found = findCorners(pyramid, gray, *cb, last_rois[c], image_corners);
+
+      if (use_cache)
+      {
+        CheckerboardCache::CornersEntry entry;
+        entry.found_ = found;
+        for (Size1 i = 0; found and i < image_corners.elements(); ++i)
+        {
+          entry.corners_.push_back(image_corners[i].x());
+          entry.corners_.push_back(image_corners[i].y());
+        }
+        cache_->addCorners(corners_keys[c], entry);
+      }
+    }
+
+    last_rois[c] = cv::Rect();
+
+    if (not found)
+    {
+      if (not force)
+        continue;
+
+#pragma omp critical (interactive_checkerboard_finder)
       {
         InteractiveCheckerboardFinder finder2;
         finder2.setImage(image);
-        if (not finder2.find(*cb, image_corners))
-          continue;
+        found = finder2.find(*cb, image_corners);
       }
-      else
+
+      if (not found)
         continue;
     }
 
+    std::vector<cv::Point2f> corners(image_corners.elements());
+    for (Size1 i = 0; i < image_corners.elements(); ++i)
+      corners[i] = cv::Point2f(image_corners[i].x(), image_corners[i].y());
+    last_rois[c] = cv::boundingRect(corners);
+
     cb_views->setImageCorners(image_corners);
 
     if (not cb_constraint_->isValid(*cb_views->colorCheckerboard()))
@@ -90,27 +247,54 @@ Size1 CheckerboardViewsExtraction::extract(const RGBDData::ConstPtr & data,
 
     // 2. Extract plane
 
-    if (not only_images_)
+    if (not only_images_ and use_cache)
+    {
+      // The cached inliers are valid only for the same corners, cloud and color sensor pose
+      const boost::uint64_t plane_key = CheckerboardCache::planeKey(corners_keys[c], cloud_hash, color_sensor_pose_);
+      CheckerboardCache::PlaneEntry entry;
+
+      if (not cache_->findPlane(plane_key, entry))
+      {
+        Point3 center = color_sensor_pose_ * cb_views->colorCheckerboard()->center();
+        PlaneInfo plane_info;
+        entry.found_ = extractPlane(data->depthData(), *cb, center, plane_info);
+        if (entry.found_)
+        {
+          entry.indices_ = *plane_info.indices_;
+          entry.std_dev_ = plane_info.std_dev_;
+        }
+        cache_->addPlane(plane_key, entry);
+      }
+
+      if (not entry.found_)
+        continue;
+
+      cb_views->setPlaneInliers(boost::make_shared<std::vector<int> >(entry.indices_), entry.std_dev_);
+
+      if (not plane_constraint_->isValid(*cb_views->depthPlane()))
+        continue;
+    }
+    else if (not only_images_)
     {
       PlaneInfo plane_info;
 
       if (interactive)
       {
+        PointPlaneExtractionGUI<PCLPoint3> plane_extractor;
+        plane_extractor.setInputCloud(data->depthData());
+        plane_extractor.setRadius(std::min(cb->width(), cb->height()) / 1.5);
         cb_views->draw(image);
+
+        if (not plane_extractor.extract(plane_info))
+          continue;
       }
       else
       {
         Point3 center = color_sensor_pose_ * cb_views->colorCheckerboard()->center();
-        PCLPoint3 p;
-        p.x = center[0];
-        p.y = center[1];
-        p.z = center[2];
-        plane_extractor->setPoint(p);
+        if (not extractPlane(data->depthData(), *cb, center, plane_info))
+          continue;
       }
 
-      if (not plane_extractor->extract(plane_info))
-        continue;
-
       cb_views->setPlaneInliers(plane_info.indices_, plane_info.std_dev_);
 
       if (not plane_constraint_->isValid(*cb_views->depthPlane()))
@@ -118,10 +302,19 @@ Size1 CheckerboardViewsExtraction::extract(const RGBDData::ConstPtr & data,
 
     }
 
-#pragma omp critical
-    cb_views_vec.push_back(cb_views);
+    results[c] = cb_views;
+  }
+
+  Size1 added = 0;
 
-    ++added;
+#pragma omp critical
+  for (Size1 c = 0; c < results.size(); ++c)
+  {
+    if (results[c])
+    {
+      cb_views_vec.push_back(results[c]);
+      ++added;
+    }
   }
 
   return added;
@@ -131,20 +324,38 @@ Size1 CheckerboardViewsExtraction::extract(const RGBDData::ConstPtr & data,
 Size1 CheckerboardViewsExtraction::extract(std::vector<CheckerboardViews::Ptr> & cb_views_vec,
                                             bool interactive) const
 {
-  return extract(data_, cb_views_vec, interactive, true);
+  std::vector<cv::Rect> last_rois;
+  return extract(data_, cb_views_vec, interactive, true, last_rois);
 }
 
 Size1 CheckerboardViewsExtraction::extractAll(std::vector<CheckerboardViews::Ptr> & cb_views_vec,
                                               bool interactive) const
 {
-  Size1 added = 0;
+  const Size1 size = data_vec_.size();
+  const Size1 chunks = (size + LAST_CORNERS_CHUNK - 1) / LAST_CORNERS_CHUNK;
+  std::vector<std::vector<CheckerboardViews::Ptr> > frame_views(size);
 
-#pragma omp parallel for
-  for (Size1 i = 0; i < data_vec_.size(); ++i)
+  // Each frame starts from the corners of the frame before it in its chunk, the first one of a chunk from none: the
+  // corners only depend on the data order, not on which thread gets which chunk.
+#pragma omp parallel for schedule(dynamic, 1)
+  for (Size1 k = 0; k < chunks; ++k)
+  {
+    std::vector<cv::Rect> last_rois;
+    const Size1 end = std::min<Size1>(size, (k + 1) * LAST_CORNERS_CHUNK);
+    for (Size1 i = k * LAST_CORNERS_CHUNK; i < end; ++i)
+    {
+      if (not use_last_corners_)
+        last_rois.clear();
+      extract(data_vec_[i], frame_views[i], interactive, force_, last_rois);
+    }
+  }
+
+  // Views are added in data order
+  Size1 added = 0;
+  for (Size1 i = 0; i < size; ++i)
   {
-    Size1 n = extract(data_vec_[i], cb_views_vec, interactive, force_);
-#pragma omp atomic
-    added += n;
+    cb_views_vec.insert(cb_views_vec.end(), frame_views[i].begin(), frame_views[i].end());
+    added += frame_views[i].size();
   }
 
   return added;
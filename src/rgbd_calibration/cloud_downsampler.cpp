@@ -0,0 +1,206 @@
+/*
+ *  Copyright (c) 2013-2014, Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *     3. Neither the name of the copyright holder(s) nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <limits>
+#include <pcl/common/point_tests.h>
+
+#include <rgbd_calibration/cloud_downsampler.h>
+
+namespace calibration
+{
+
+CloudDownsampler::CloudDownsampler()
+  : ratio_(1),
+    mode_(MEAN)
+{
+  // Do nothing
+}
+
+bool CloudDownsampler::parseMode(const std::string & name,
+                                 Mode & mode)
+{
+  if (name == "mean")
+    mode = MEAN;
+  else if (name == "median")
+    mode = MEDIAN;
+  else
+    return false;
+  return true;
+}
+
+bool CloudDownsampler::meanRow(const PCLCloud3 & cloud,
+                               int row,
+                               std::vector<float> & buffer,
+                               PCLPoint3 * sampled_row) const
+{
+  const int in_cols = cloud.width;
+  const int out_cols = in_cols / ratio_;
+  const int cols = out_cols * ratio_; // Trailing columns that do not fill a block are dropped
+
+  buffer.resize(4 * (cols + out_cols));
+  float * x = &buffer[0];
+  float * y = x + cols;
+  float * z = y + cols;
+  float * w = z + cols;
+  float * sum_x = w + cols;
+  float * sum_y = sum_x + out_cols;
+  float * sum_z = sum_y + out_cols;
+  float * sum_w = sum_z + out_cols;
+  std::fill(sum_x, sum_x + 4 * out_cols, 0.0f);
+
+  for (int di = 0; di < ratio_; ++di)
+  {
+    const PCLPoint3 * in = &cloud.points[(row * ratio_ + di) * in_cols];
+
+    // Invalid points become zeros with a zero weight, so that the sums below need no branches
+    for (int c = 0; c < cols; ++c)
+    {
+      const bool valid = pcl::isFinite(in[c]);
+      x[c] = valid ? in[c].x : 0.0f;
+      y[c] = valid ? in[c].y : 0.0f;
+      z[c] = valid ? in[c].z : 0.0f;
+      w[c] = valid ? 1.0f : 0.0f;
+    }
+
+    for (int j = 0; j < out_cols; ++j)
+    {
+      for (int dj = 0; dj < ratio_; ++dj)
+      {
+        const int c = j * ratio_ + dj;
+        sum_x[j] += x[c];
+        sum_y[j] += y[c];
+        sum_z[j] += z[c];
+        sum_w[j] += w[c];
+      }
+    }
+  }
+
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  bool dense = true;
+  for (int j = 0; j < out_cols; ++j)
+  {
+    PCLPoint3 & p = sampled_row[j];
+    if (sum_w[j] > 0.0f)
+    {
+      const float inv_w = 1.0f / sum_w[j];
+      p.x = sum_x[j] * inv_w;
+      p.y = sum_y[j] * inv_w;
+      p.z = sum_z[j] * inv_w;
+    }
+    else
+    {
+      p.x = p.y = p.z = nan;
+      dense = false;
+    }
+  }
+  return dense;
+}
+
+bool CloudDownsampler::medianRow(const PCLCloud3 & cloud,
+                                 int row,
+                                 std::vector<std::pair<float, int> > & buffer,
+                                 PCLPoint3 * sampled_row) const
+{
+  const int in_cols = cloud.width;
+  const int out_cols = in_cols / ratio_;
+
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  bool dense = true;
+  for (int j = 0; j < out_cols; ++j)
+  {
+    buffer.clear();
+    for (int di = 0; di < ratio_; ++di)
+    {
+      const int offset = (row * ratio_ + di) * in_cols + j * ratio_;
+      for (int dj = 0; dj < ratio_; ++dj)
+      {
+        const PCLPoint3 & p = cloud.points[offset + dj];
+        if (pcl::isFinite(p))
+          buffer.push_back(std::make_pair(p.z, offset + dj));
+      }
+    }
+
+    // The point with the median depth is kept as it is: it is a real measurement, not a blend across an edge
+    PCLPoint3 & p = sampled_row[j];
+    if (not buffer.empty())
+    {
+      std::vector<std::pair<float, int> >::iterator median = buffer.begin() + buffer.size() / 2;
+      std::nth_element(buffer.begin(), median, buffer.end());
+      p = cloud.points[median->second];
+    }
+    else
+    {
+      p.x = p.y = p.z = nan;
+      dense = false;
+    }
+  }
+  return dense;
+}
+
+void CloudDownsampler::apply(const PCLCloud3 & cloud,
+                             PCLCloud3 & sampled) const
+{
+  assert(&cloud != &sampled);
+
+  if (ratio_ == 1)
+  {
+    sampled = cloud;
+    return;
+  }
+
+  assert(cloud.isOrganized());
+
+  const int rows = cloud.height / ratio_;
+  const int cols = cloud.width / ratio_;
+
+  sampled.header = cloud.header;
+  sampled.points.resize(rows * cols);
+  sampled.width = cols;
+  sampled.height = rows;
+  sampled.sensor_origin_ = cloud.sensor_origin_;
+  sampled.sensor_orientation_ = cloud.sensor_orientation_;
+
+  bool dense = true;
+  if (mode_ == MEAN)
+  {
+    std::vector<float> buffer;
+    for (int i = 0; i < rows; ++i)
+      dense = meanRow(cloud, i, buffer, &sampled.points[i * cols]) and dense;
+  }
+  else
+  {
+    std::vector<std::pair<float, int> > buffer;
+    buffer.reserve(ratio_ * ratio_);
+    for (int i = 0; i < rows; ++i)
+      dense = medianRow(cloud, i, buffer, &sampled.points[i * cols]) and dense;
+  }
+  sampled.is_dense = dense;
+}
+
+} /* namespace calibration */
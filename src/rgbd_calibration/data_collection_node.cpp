@@ -1,6 +1,14 @@
+#include <deque>
+#include <fstream>
+
 #include <ros/ros.h>
 #include <ros/topic.h>
 
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
 #include <pcl/io/pcd_io.h>
 #include <image_transport/image_transport.h>
 #include <cv_bridge/cv_bridge.h>
@@ -23,6 +31,7 @@
 #include <calibration_msgs/CheckerboardMsg.h>
 
 #include <rgbd_calibration/Acquisition.h>
+#include <rgbd_calibration/dataset_io.h>
 
 using namespace camera_info_manager;
 using namespace calibration_msgs;
@@ -44,7 +53,8 @@ public:
     SAVE_POINT_CLOUD = 4,
     SAVE_IMAGE_CAMERA_INFO = 8,
     SAVE_DEPTH_CAMERA_INFO = 16,
-    SAVE_ALL = 31
+    SAVE_DATASET = 32,
+    SAVE_ALL = 63
   };
 
   enum DepthType
@@ -71,20 +81,57 @@ public:
 
 protected:
 
+  // What an acquisition needs: the messages are shared, not copied, so newer messages do not overwrite them.
+  struct Frame
+  {
+    int index_;
+    sensor_msgs::Image::ConstPtr image_msg_;
+    sensor_msgs::Image::ConstPtr depth_image_msg_;
+    sensor_msgs::PointCloud2::ConstPtr cloud_msg_;
+    sensor_msgs::CameraInfo::ConstPtr camera_info_msg_;
+    sensor_msgs::CameraInfo::ConstPtr depth_camera_info_msg_;
+  };
+
+  struct EncodedFrame
+  {
+    std::vector<uchar> image_;
+    cv::Mat depth_16_; // Millimeters
+  };
+
+  static std::string
+  toYAML(const sensor_msgs::CameraInfo::ConstPtr & camera_info);
+
   void
   save(const sensor_msgs::CameraInfo::ConstPtr & camera_info,
        const std::string & file_name);
 
+  void
+  saveToDataset(const Frame & frame,
+                const EncodedFrame & encoded);
+
+  void
+  writerLoop();
+
+  // Converts, encodes and writes the files of the frame. Runs in parallel in the writer threads.
+  bool
+  encode(const Frame & frame,
+         EncodedFrame & encoded);
+
+  // Writes what is shared by all the frames (info.yaml, dataset). Frames are committed in index order.
+  void
+  commit(const Frame & frame,
+         const EncodedFrame & encoded);
+
   void
   save(const pcl::PCLPointCloud2::ConstPtr & cloud,
        const std::string & file_name);
 
   void
-  save(const cv::Mat & image,
+  save(const std::vector<uchar> & encoded_image,
        const std::string & file_name);
 
   void
-  saveDepth(const cv::Mat & depth_image,
+  saveDepth(const cv::Mat & depth_image_16,
             const std::string & file_name);
 
   void
@@ -125,7 +172,7 @@ protected:
   ros::Subscriber omnicamera_info_sub_;
   ros::Subscriber action_sub_;
 
-  pcl::PCLPointCloud2::Ptr cloud_msg_;
+  sensor_msgs::PointCloud2::ConstPtr cloud_msg_;
   sensor_msgs::Image::ConstPtr image_msg_;
   sensor_msgs::Image::ConstPtr depth_image_msg_;
   sensor_msgs::CameraInfo::ConstPtr camera_info_msg_;
@@ -147,18 +194,47 @@ protected:
   std::string image_filename_;
   std::string depth_filename_;
   std::string cloud_filename_;
+  std::string dataset_filename_;
+
+  DatasetWriter dataset_writer_;
 
   bool search_checkerboard_;
 
   int save_flags_;
   DepthType depth_type_;
 
+  std::vector<int> png_params_;
+
+  // Writer threads and their bounded queue
+  boost::thread_group writer_threads_;
+  boost::mutex queue_mutex_;
+  boost::condition_variable queue_condition_;
+  std::deque<Frame> queue_;
+  int queue_size_;
+  bool stop_;
+
+  // Counters, protected by queue_mutex_
+  int saved_;
+  int failed_;
+  int dropped_;
+  int max_queue_depth_;
+
+  boost::mutex commit_mutex_;
+  boost::condition_variable commit_condition_;
+  int next_commit_index_;
+  std::ofstream info_file_;
+
 };
 
 DataCollectionNode::DataCollectionNode(ros::NodeHandle & node_handle)
   : node_handle_(node_handle),
     image_transport_(node_handle),
-    search_checkerboard_(false)
+    search_checkerboard_(false),
+    stop_(false),
+    saved_(0),
+    failed_(0),
+    dropped_(0),
+    max_queue_depth_(0)
 {
   checkerboards_sub_ = node_handle_.subscribe("checkerboard_array", 1, &DataCollectionNode::checkerboardArrayCallback, this);
 
@@ -172,11 +248,13 @@ DataCollectionNode::DataCollectionNode(ros::NodeHandle & node_handle)
     save_folder_.append("/");
 
   file_index_ = starting_index_;
+  next_commit_index_ = starting_index_;
 
   node_handle_.param("image_extension", image_extension_, std::string("png"));
   node_handle_.param("image_filename", image_filename_, std::string("image_"));
   node_handle_.param("depth_filename", depth_filename_, std::string("depth_"));
   node_handle_.param("cloud_filename", cloud_filename_, std::string("cloud_"));
+  node_handle_.param("dataset_filename", dataset_filename_, std::string("dataset.rgbd"));
 
   node_handle_.param("search_checkerboard", search_checkerboard_, false);
 
@@ -191,26 +269,31 @@ DataCollectionNode::DataCollectionNode(ros::NodeHandle & node_handle)
   bool save_point_cloud;
   node_handle_.param("save_point_cloud", save_point_cloud, false);
 
+  bool save_dataset;
+  node_handle_.param("save_dataset", save_dataset, false);
+
   save_flags_ = 0;
   save_flags_ |= save_image ? SAVE_IMAGE : 0;
   save_flags_ |= save_image_camera_info ? SAVE_IMAGE_CAMERA_INFO : 0;
   save_flags_ |= save_depth_image ? SAVE_DEPTH_IMAGE : 0;
   save_flags_ |= save_depth_camera_info ? SAVE_DEPTH_CAMERA_INFO : 0;
   save_flags_ |= save_point_cloud ? SAVE_POINT_CLOUD : 0;
+  save_flags_ |= save_dataset ? SAVE_DATASET : 0;
 
   if (save_flags_ & SAVE_POINT_CLOUD)
     cloud_sub_ = node_handle.subscribe("point_cloud", 1, &DataCollectionNode::pointCloudCallback, this);
 
-  if (save_flags_ & SAVE_IMAGE)
+  // The dataset holds images, depth images and camera infos
+  if (save_flags_ & (SAVE_IMAGE | SAVE_DATASET))
     image_sub_ = image_transport_.subscribe("image", 1, &DataCollectionNode::imageCallback, this);
 
-  if (save_flags_ & SAVE_DEPTH_IMAGE)
+  if (save_flags_ & (SAVE_DEPTH_IMAGE | SAVE_DATASET))
     depth_image_sub_ = image_transport_.subscribe("depth_image", 1, &DataCollectionNode::depthImageCallback, this);
 
-  if (save_flags_ & SAVE_IMAGE_CAMERA_INFO)
+  if (save_flags_ & (SAVE_IMAGE_CAMERA_INFO | SAVE_DATASET))
     camera_info_sub_ = node_handle.subscribe("camera_info", 1, &DataCollectionNode::cameraInfoCallback, this);
 
-  if (save_flags_ & SAVE_DEPTH_CAMERA_INFO)
+  if (save_flags_ & (SAVE_DEPTH_CAMERA_INFO | SAVE_DATASET))
     depth_camera_info_sub_ = node_handle.subscribe("depth_camera_info", 1, &DataCollectionNode::depthCameraInfoCallback, this);
 
   std::string depth_type_s;
@@ -222,11 +305,47 @@ DataCollectionNode::DataCollectionNode(ros::NodeHandle & node_handle)
   else
     ROS_FATAL_STREAM("[" << ros::this_node::getName() << "] Wrong \"depth_type\" parameter. Use \"float32\" or \"uint16\".");
 
+  int png_compression;
+  node_handle_.param("png_compression", png_compression, 3);
+  if (png_compression < 0 or png_compression > 9)
+  {
+    png_compression = 3;
+    ROS_WARN("\"png_compression\" must be in [0, 9]. Using 3.");
+  }
+  png_params_.push_back(CV_IMWRITE_PNG_COMPRESSION);
+  png_params_.push_back(png_compression);
+
+  // Acquisitions are queued and written by these threads: actionCallback never blocks, it drops frames when full
+  int writer_threads;
+  node_handle_.param("queue_size", queue_size_, 32);
+  node_handle_.param("writer_threads", writer_threads, 2);
+  if (queue_size_ < 1)
+  {
+    queue_size_ = 1;
+    ROS_WARN("\"queue_size\" cannot be < 1. Using 1.");
+  }
+  if (writer_threads < 1)
+  {
+    writer_threads = 1;
+    ROS_WARN("\"writer_threads\" cannot be < 1. Using 1.");
+  }
+
+  for (int i = 0; i < writer_threads; ++i)
+    writer_threads_.create_thread(boost::bind(&DataCollectionNode::writerLoop, this));
 }
 
 DataCollectionNode::~DataCollectionNode()
 {
-  // Do nothing
+  // Queued frames are written before returning
+  {
+    boost::mutex::scoped_lock lock(queue_mutex_);
+    stop_ = true;
+  }
+  queue_condition_.notify_all();
+  writer_threads_.join_all();
+
+  ROS_INFO_STREAM("[" << ros::this_node::getName() << "] " << saved_ << " frames saved, " << failed_ << " failed, "
+                  << dropped_ << " dropped (max queue depth " << max_queue_depth_ << "/" << queue_size_ << ")");
 }
 
 bool DataCollectionNode::initialize()
@@ -247,8 +366,7 @@ bool DataCollectionNode::initialize()
 
 void DataCollectionNode::pointCloudCallback(const sensor_msgs::PointCloud2::ConstPtr & msg)
 {
-  cloud_msg_ = pcl::PCLPointCloud2::Ptr(new pcl::PCLPointCloud2());
-  pcl_conversions::toPCL(*msg, *cloud_msg_);
+  cloud_msg_ = msg;
 }
 
 void DataCollectionNode::imageCallback(const sensor_msgs::Image::ConstPtr & msg)
@@ -273,108 +391,233 @@ void DataCollectionNode::depthCameraInfoCallback(const sensor_msgs::CameraInfo::
 
 void DataCollectionNode::actionCallback(const Acquisition::ConstPtr & msg)
 {
+  Frame frame;
+  frame.image_msg_ = image_msg_;
+  frame.depth_image_msg_ = depth_image_msg_;
+  frame.cloud_msg_ = cloud_msg_;
+  frame.camera_info_msg_ = camera_info_msg_;
+  frame.depth_camera_info_msg_ = depth_camera_info_msg_;
+
+  int queue_depth, dropped;
+  {
+    boost::mutex::scoped_lock lock(queue_mutex_);
+    if (queue_.size() < static_cast<size_t>(queue_size_))
+    {
+      frame.index_ = file_index_++;
+      queue_.push_back(frame);
+      max_queue_depth_ = std::max(max_queue_depth_, static_cast<int>(queue_.size()));
+    }
+    else
+    {
+      ++dropped_;
+    }
+    queue_depth = queue_.size();
+    dropped = dropped_;
+  }
+  queue_condition_.notify_one();
 
-  try
+  if (queue_depth == queue_size_)
+    ROS_WARN_STREAM_THROTTLE(1, "[" << ros::this_node::getName() << "] Writer queue full, " << dropped
+                             << " frames dropped so far");
+}
+
+void DataCollectionNode::writerLoop()
+{
+  while (true)
   {
-    std::stringstream info_file_name;
-    info_file_name << save_folder_ << "info.yaml";
-    std::stringstream file_index_ss;
-    file_index_ss << std::setw(4) << std::setfill('0') << file_index_;
-
-    std::ofstream file;
-    file.open(info_file_name.str().c_str(), file_index_ == 1 ? std::ios_base::out : std::ios_base::out | std::ios_base::app);
-    if (file_index_ == 1)
-      file << "data:" << std::endl;
-    file << "  - id: " << file_index_ss.str() << std::endl;
-    file << "    timestamp_image: " << std::setprecision(19) << image_msg_->header.stamp.toSec() << std::setprecision(6) << std::endl;
-    file << "    timestamp_depth: " << std::setprecision(19) << depth_image_msg_->header.stamp.toSec() << std::setprecision(6) << std::endl;
-    //file << "    distance: " << msg->distance << std::endl;
-    //file << "    info: \"" << msg->info << "\"" << std::endl;
-    file.close();
-
-    if (file_index_ == 1)
+    Frame frame;
+    {
+      boost::mutex::scoped_lock lock(queue_mutex_);
+      while (queue_.empty() and not stop_)
+        queue_condition_.wait(lock);
+      if (queue_.empty())
+        return;
+      frame = queue_.front();
+      queue_.pop_front();
+    }
+
+    EncodedFrame encoded;
+    const bool ok = encode(frame, encoded);
+
+    // Every index is committed, even if encoding failed, not to block the following frames
     {
-      if (save_flags_ & SAVE_IMAGE_CAMERA_INFO)
-      {
-        std::stringstream camera_info_file_name;
-        camera_info_file_name << save_folder_ << image_filename_ << "camera_info.yaml";
-        save(camera_info_msg_, camera_info_file_name.str());
-      }
-
-      if (save_flags_ & SAVE_DEPTH_CAMERA_INFO)
-      {
-        std::stringstream depth_camera_info_file_name;
-        depth_camera_info_file_name << save_folder_ << depth_filename_ << "camera_info.yaml";
-        save(depth_camera_info_msg_, depth_camera_info_file_name.str());
-      }
+      boost::mutex::scoped_lock lock(commit_mutex_);
+      while (next_commit_index_ != frame.index_)
+        commit_condition_.wait(lock);
+      if (ok)
+        commit(frame, encoded);
+      ++next_commit_index_;
     }
+    commit_condition_.notify_all();
+
+    int saved, queue_depth;
+    {
+      boost::mutex::scoped_lock lock(queue_mutex_);
+      if (ok)
+        ++saved_;
+      else
+        ++failed_;
+      saved = saved_;
+      queue_depth = queue_.size();
+    }
+
+    ROS_INFO_STREAM_THROTTLE(1, "[" << ros::this_node::getName() << "] " << frame.index_ << " saved (" << saved
+                             << " frames, queue depth " << queue_depth << ")");
+  }
+}
+
+bool DataCollectionNode::encode(const Frame & frame,
+                                EncodedFrame & encoded)
+{
+  try
+  {
+    std::stringstream file_index_ss;
+    file_index_ss << std::setw(4) << std::setfill('0') << frame.index_;
 
     if (save_flags_ & SAVE_POINT_CLOUD)
     {
+      pcl::PCLPointCloud2::Ptr cloud = boost::make_shared<pcl::PCLPointCloud2>();
+      pcl_conversions::toPCL(*frame.cloud_msg_, *cloud);
       std::stringstream cloud_file_name;
       cloud_file_name << save_folder_ << cloud_filename_ << file_index_ss.str() << ".pcd";
-      save(cloud_msg_, cloud_file_name.str());
+      save(cloud, cloud_file_name.str());
+    }
+
+    // Encoded once, for both the image file and the dataset
+    if (save_flags_ & (SAVE_IMAGE | SAVE_DATASET))
+    {
+      cv_bridge::CvImageConstPtr image_ptr = cv_bridge::toCvShare(frame.image_msg_);
+      cv::imencode("." + image_extension_, image_ptr->image, encoded.image_, png_params_);
     }
 
     if (save_flags_ & SAVE_IMAGE)
     {
-      cv_bridge::CvImage::Ptr image_ptr = cv_bridge::toCvCopy(image_msg_);
       std::stringstream image_file_name;
       image_file_name << save_folder_ << image_filename_ << file_index_ss.str() << "." << image_extension_;
-      save(image_ptr->image, image_file_name.str());
+      save(encoded.image_, image_file_name.str());
     }
 
-    if (save_flags_ & SAVE_DEPTH_IMAGE)
+    if (save_flags_ & (SAVE_DEPTH_IMAGE | SAVE_DATASET))
     {
-      cv_bridge::CvImage::Ptr depth_image_ptr;
       if (depth_type_ == DEPTH_FLOAT32)
-        depth_image_ptr = cv_bridge::toCvCopy(depth_image_msg_, sensor_msgs::image_encodings::TYPE_32FC1);
+        cv_bridge::toCvShare(frame.depth_image_msg_, sensor_msgs::image_encodings::TYPE_32FC1)->image.convertTo(
+          encoded.depth_16_, CV_16UC1, 1000);
       else if (depth_type_ == DEPTH_UINT16)
-        depth_image_ptr = cv_bridge::toCvCopy(depth_image_msg_, sensor_msgs::image_encodings::TYPE_16UC1);
+        encoded.depth_16_ = cv_bridge::toCvShare(frame.depth_image_msg_, sensor_msgs::image_encodings::TYPE_16UC1)->image;
+    }
+
+    if (save_flags_ & SAVE_DEPTH_IMAGE)
+    {
       std::stringstream depth_file_name;
       depth_file_name << save_folder_ << depth_filename_ << file_index_ss.str() << "." << image_extension_;
-      saveDepth(depth_image_ptr->image, depth_file_name.str());
+      saveDepth(encoded.depth_16_, depth_file_name.str());
     }
-
-    ROS_INFO_STREAM_THROTTLE(1, "[" << ros::this_node::getName() << "] " << file_index_ss.str() << " saved");
-    file_index_++;
-
   }
   catch (cv_bridge::Exception & ex)
   {
     ROS_ERROR_STREAM("[" << ros::this_node::getName() << "] cv_bridge exception: " << ex.what());
+    return false;
   }
+  catch (cv::Exception & ex)
+  {
+    ROS_ERROR_STREAM("[" << ros::this_node::getName() << "] OpenCV exception: " << ex.what());
+    return false;
+  }
+
+  return true;
+}
+
+void DataCollectionNode::commit(const Frame & frame,
+                                const EncodedFrame & encoded)
+{
+  std::stringstream file_index_ss;
+  file_index_ss << std::setw(4) << std::setfill('0') << frame.index_;
 
+  if (not info_file_.is_open())
+  {
+    std::stringstream info_file_name;
+    info_file_name << save_folder_ << "info.yaml";
+    info_file_.open(info_file_name.str().c_str(), frame.index_ == 1 ? std::ios_base::out : std::ios_base::out | std::ios_base::app);
+    if (frame.index_ == 1)
+      info_file_ << "data:" << std::endl;
+  }
+  info_file_ << "  - id: " << file_index_ss.str() << std::endl;
+  info_file_ << "    timestamp_image: " << std::setprecision(19) << frame.image_msg_->header.stamp.toSec() << std::setprecision(6) << std::endl;
+  info_file_ << "    timestamp_depth: " << std::setprecision(19) << frame.depth_image_msg_->header.stamp.toSec() << std::setprecision(6) << std::endl;
+  info_file_.flush();
 
+  if (frame.index_ == 1)
+  {
+    if (save_flags_ & SAVE_IMAGE_CAMERA_INFO)
+    {
+      std::stringstream camera_info_file_name;
+      camera_info_file_name << save_folder_ << image_filename_ << "camera_info.yaml";
+      save(frame.camera_info_msg_, camera_info_file_name.str());
+    }
+
+    if (save_flags_ & SAVE_DEPTH_CAMERA_INFO)
+    {
+      std::stringstream depth_camera_info_file_name;
+      depth_camera_info_file_name << save_folder_ << depth_filename_ << "camera_info.yaml";
+      save(frame.depth_camera_info_msg_, depth_camera_info_file_name.str());
+    }
+  }
+
+  if (save_flags_ & SAVE_DATASET)
+    saveToDataset(frame, encoded);
 }
 
-void DataCollectionNode::save(const sensor_msgs::CameraInfo::ConstPtr & camera_info,
-                              const std::string & file_name)
+std::string DataCollectionNode::toYAML(const sensor_msgs::CameraInfo::ConstPtr & camera_info)
 {
   image_geometry::PinholeCameraModel model;
   model.fromCameraInfo(camera_info);
 
+  std::stringstream ss;
+
+  ss << "frame_id: " << camera_info->header.frame_id << std::endl;
+  ss << "height: " << camera_info->height << std::endl;
+  ss << "width: " << camera_info->width << std::endl;
+  ss << "distortion_model: " << camera_info->distortion_model << std::endl;
+  ss << "D: " << model.distortionCoeffs() << std::endl;
+  ss << "K: " << model.intrinsicMatrix().reshape<1, 9>() << std::endl;
+  ss << "R: " << model.rotationMatrix().reshape<1, 9>() << std::endl;
+  ss << "P: " << model.projectionMatrix().reshape<1, 12>() << std::endl;
+  ss << "binning_x: " << camera_info->binning_x << std::endl;
+  ss << "binning_y: " << camera_info->binning_y << std::endl;
+  ss << "roi:" << std::endl;
+  ss << "  x_offset: " << camera_info->roi.x_offset << std::endl;
+  ss << "  y_offset: " << camera_info->roi.y_offset << std::endl;
+  ss << "  height: " << camera_info->roi.height << std::endl;
+  ss << "  width: " << camera_info->roi.width << std::endl;
+  ss << "  do_rectify: " << (camera_info->roi.do_rectify ? "True" : "False") << std::endl;
+
+  return ss.str();
+}
+
+void DataCollectionNode::save(const sensor_msgs::CameraInfo::ConstPtr & camera_info,
+                              const std::string & file_name)
+{
   std::ofstream file;
   file.open(file_name.c_str());
+  file << toYAML(camera_info);
+  file.close();
+}
 
-  file << "frame_id: " << camera_info_msg_->header.frame_id << std::endl;
-  file << "height: " << camera_info_msg_->height << std::endl;
-  file << "width: " << camera_info_msg_->width << std::endl;
-  file << "distortion_model: " << camera_info_msg_->distortion_model << std::endl;
-  file << "D: " << model.distortionCoeffs() << std::endl;
-  file << "K: " << model.intrinsicMatrix().reshape<1, 9>() << std::endl;
-  file << "R: " << model.rotationMatrix().reshape<1, 9>() << std::endl;
-  file << "P: " << model.projectionMatrix().reshape<1, 12>() << std::endl;
-  file << "binning_x: " << camera_info_msg_->binning_x << std::endl;
-  file << "binning_y: " << camera_info_msg_->binning_y << std::endl;
-  file << "roi:" << std::endl;
-  file << "  x_offset: " << camera_info_msg_->roi.x_offset << std::endl;
-  file << "  y_offset: " << camera_info_msg_->roi.y_offset << std::endl;
-  file << "  height: " << camera_info_msg_->roi.height << std::endl;
-  file << "  width: " << camera_info_msg_->roi.width << std::endl;
-  file << "  do_rectify: " << (camera_info_msg_->roi.do_rectify ? "True" : "False") << std::endl;
+void DataCollectionNode::saveToDataset(const Frame & frame,
+                                       const EncodedFrame & encoded)
+{
+  if (not dataset_writer_.isOpen())
+  {
+    if (not dataset_writer_.open(save_folder_ + dataset_filename_))
+      return;
+    dataset_writer_.writeCameraInfo(Dataset::COLOR_SENSOR, toYAML(frame.camera_info_msg_));
+    dataset_writer_.writeCameraInfo(Dataset::DEPTH_SENSOR, toYAML(frame.depth_camera_info_msg_));
+  }
 
-  file.close();
+  // Depth is stored as raw uint16 (millimeters)
+  if (not dataset_writer_.writeFrame(frame.index_, frame.image_msg_->header.stamp.toSec(),
+                                     frame.depth_image_msg_->header.stamp.toSec(), encoded.image_, encoded.depth_16_))
+    ROS_ERROR_STREAM("[" << ros::this_node::getName() << "] Cannot write frame " << frame.index_ << " to the dataset!");
 }
 
 void DataCollectionNode::checkerboardArrayCallback(const calibration_msgs::CheckerboardArray::ConstPtr & msg)
@@ -390,19 +633,19 @@ bool DataCollectionNode::waitForMessages()
   if (search_checkerboard_)
     ret = ret and ros::topic::waitForMessage<CheckerboardArray>("checkerboard_array", node_handle_);
 
-  if (save_flags_ & SAVE_IMAGE)
+  if (save_flags_ & (SAVE_IMAGE | SAVE_DATASET))
     ret = ret and ros::topic::waitForMessage<sensor_msgs::Image>("image", node_handle_);
 
   if (save_flags_ & SAVE_POINT_CLOUD)
     ret = ret and ros::topic::waitForMessage<sensor_msgs::PointCloud2>("point_cloud", node_handle_);
 
-  if (save_flags_ & SAVE_IMAGE_CAMERA_INFO)
+  if (save_flags_ & (SAVE_IMAGE_CAMERA_INFO | SAVE_DATASET))
     ret = ret and ros::topic::waitForMessage<sensor_msgs::CameraInfo>("camera_info", node_handle_);
 
-  if (save_flags_ & SAVE_DEPTH_IMAGE)
+  if (save_flags_ & (SAVE_DEPTH_IMAGE | SAVE_DATASET))
     ret = ret and ros::topic::waitForMessage<sensor_msgs::Image>("depth_image", node_handle_);
 
-  if (save_flags_ & SAVE_DEPTH_CAMERA_INFO)
+  if (save_flags_ & (SAVE_DEPTH_CAMERA_INFO | SAVE_DATASET))
     ret = ret and ros::topic::waitForMessage<sensor_msgs::CameraInfo>("depth_camera_info", node_handle_);
 
   if (ret)
@@ -420,29 +663,17 @@ void DataCollectionNode::save(const pcl::PCLPointCloud2::ConstPtr & cloud,
   pcd_writer.writeBinary(file_name, *cloud);
 }
 
-void DataCollectionNode::save(const cv::Mat & image,
+void DataCollectionNode::save(const std::vector<uchar> & encoded_image,
                               const std::string & file_name)
 {
-  cv::imwrite(file_name, image);
+  std::ofstream file(file_name.c_str(), std::ios_base::out | std::ios_base::binary);
+  file.write(reinterpret_cast<const char *>(encoded_image.data()), encoded_image.size());
 }
 
-void DataCollectionNode::saveDepth(const cv::Mat & depth_image,
+void DataCollectionNode::saveDepth(const cv::Mat & depth_image_16,
                                    const std::string & file_name)
 {
-  if (depth_type_ == DEPTH_FLOAT32)
-  {
-    cv::Mat depth_image_16;
-    depth_image.convertTo(depth_image_16, CV_16UC1, 1000);
-    cv::imwrite(file_name, depth_image_16);
-  }
-  else if (depth_type_ == DEPTH_UINT16)
-  {
-    cv::imwrite(file_name, depth_image);
-  }
-  else
-  {
-    // Do nothing
-  }
+  cv::imwrite(file_name, depth_image_16, png_params_);
 }
 
 Checkerboard::Ptr DataCollectionNode::createCheckerboard(const CheckerboardMsg::ConstPtr & msg,
@@ -0,0 +1,432 @@
+/*
+ *  Copyright (c) 2013-2014, Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *     3. Neither the name of the copyright holder(s) nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstring>
+#include <cmath>
+#include <limits>
+
+#include <ros/ros.h>
+#include <opencv2/highgui/highgui.hpp>
+
+#include <rgbd_calibration/dataset_io.h>
+
+namespace calibration
+{
+
+const char Dataset::MAGIC[8] = {'R', 'G', 'B', 'D', 'D', 'A', 'T', 'A'};
+
+namespace
+{
+
+// Whether a chunk header at offset fits in a file of file_size bytes. The checks cannot overflow.
+inline bool
+chunkHeaderFits(boost::uint64_t offset,
+                boost::uint64_t file_size)
+{
+  return offset <= file_size and file_size - offset >= sizeof(Dataset::ChunkHeader);
+}
+
+// Whether the payload of a chunk whose header fits at offset fits too.
+inline bool
+chunkPayloadFits(boost::uint64_t offset,
+                 boost::uint64_t payload_size,
+                 boost::uint64_t file_size)
+{
+  return payload_size <= file_size - offset - sizeof(Dataset::ChunkHeader);
+}
+
+} /* namespace */
+
+DatasetWriter::DatasetWriter()
+{
+  // Do nothing
+}
+
+DatasetWriter::~DatasetWriter()
+{
+  close();
+}
+
+bool DatasetWriter::open(const std::string & file_name)
+{
+  close();
+  index_.clear();
+
+  file_.open(file_name.c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+  if (not file_.is_open())
+  {
+    ROS_ERROR_STREAM("Cannot open " << file_name << " for writing!");
+    return false;
+  }
+
+  Dataset::FileHeader header;
+  std::memcpy(header.magic_, Dataset::MAGIC, sizeof(header.magic_));
+  header.version_ = Dataset::VERSION;
+  file_.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+  return file_.good();
+}
+
+bool DatasetWriter::writeChunk(Dataset::ChunkType type,
+                               const std::vector<const char *> & data,
+                               const std::vector<size_t> & sizes)
+{
+  if (not file_.is_open())
+    return false;
+
+  Dataset::ChunkHeader header;
+  header.type_ = type;
+  header.size_ = 0;
+  for (size_t i = 0; i < sizes.size(); ++i)
+    header.size_ += sizes[i];
+
+  if (type != Dataset::INDEX)
+    index_.push_back(static_cast<boost::uint64_t>(file_.tellp()));
+
+  file_.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  for (size_t i = 0; i < data.size(); ++i)
+    file_.write(data[i], sizes[i]);
+
+  // Keep the file readable (by scanning) even if the writer is not closed
+  file_.flush();
+
+  return file_.good();
+}
+
+bool DatasetWriter::writeCameraInfo(Dataset::Sensor sensor,
+                                    const std::string & camera_info)
+{
+  const char sensor_c = static_cast<char>(sensor);
+
+  std::vector<const char *> data;
+  std::vector<size_t> sizes;
+  data.push_back(&sensor_c);
+  sizes.push_back(1);
+  data.push_back(camera_info.data());
+  sizes.push_back(camera_info.size());
+
+  return writeChunk(Dataset::CAMERA_INFO, data, sizes);
+}
+
+bool DatasetWriter::writeFrame(int id,
+                               double image_timestamp,
+                               double depth_timestamp,
+                               const cv::Mat & image,
+                               const cv::Mat & depth,
+                               const std::string & image_extension)
+{
+  std::vector<uchar> encoded_image;
+  if (image.data and not cv::imencode("." + image_extension, image, encoded_image))
+  {
+    ROS_ERROR_STREAM("Cannot encode the image as " << image_extension << "!");
+    return false;
+  }
+
+  return writeFrame(id, image_timestamp, depth_timestamp, encoded_image, depth);
+}
+
+bool DatasetWriter::writeFrame(int id,
+                               double image_timestamp,
+                               double depth_timestamp,
+                               const std::vector<uchar> & encoded_image,
+                               const cv::Mat & depth)
+{
+  if (depth.type() != CV_16UC1 and depth.type() != CV_32FC1)
+  {
+    ROS_ERROR("Depth images must be CV_16UC1 or CV_32FC1!");
+    return false;
+  }
+
+  cv::Mat continuous_depth = depth.isContinuous() ? depth : depth.clone();
+
+  Dataset::FrameHeader header;
+  header.id_ = id;
+  header.image_timestamp_ = image_timestamp;
+  header.depth_timestamp_ = depth_timestamp;
+  header.depth_type_ = depth.type() == CV_16UC1 ? Dataset::DEPTH_UINT16 : Dataset::DEPTH_FLOAT32;
+  header.depth_cols_ = depth.cols;
+  header.depth_rows_ = depth.rows;
+  header.depth_size_ = continuous_depth.total() * continuous_depth.elemSize();
+  header.image_size_ = encoded_image.size();
+
+  std::vector<const char *> data;
+  std::vector<size_t> sizes;
+  data.push_back(reinterpret_cast<const char *>(&header));
+  sizes.push_back(sizeof(header));
+  data.push_back(reinterpret_cast<const char *>(continuous_depth.data));
+  sizes.push_back(header.depth_size_);
+  data.push_back(reinterpret_cast<const char *>(encoded_image.data()));
+  sizes.push_back(header.image_size_);
+
+  return writeChunk(Dataset::FRAME, data, sizes);
+}
+
+void DatasetWriter::close()
+{
+  if (not file_.is_open())
+    return;
+
+  const boost::uint64_t index_offset = file_.tellp();
+
+  std::vector<const char *> data;
+  std::vector<size_t> sizes;
+  data.push_back(reinterpret_cast<const char *>(index_.data()));
+  sizes.push_back(index_.size() * sizeof(boost::uint64_t));
+  writeChunk(Dataset::INDEX, data, sizes);
+
+  Dataset::FileFooter footer;
+  footer.index_offset_ = index_offset;
+  std::memcpy(footer.magic_, Dataset::MAGIC, sizeof(footer.magic_));
+  file_.write(reinterpret_cast<const char *>(&footer), sizeof(footer));
+
+  file_.close();
+}
+
+DatasetReader::DatasetReader()
+{
+  // Do nothing
+}
+
+bool DatasetReader::open(const std::string & file_name)
+{
+  frames_.clear();
+  frame_info_vec_.clear();
+
+  try
+  {
+    file_mapping_ = boost::interprocess::file_mapping(file_name.c_str(), boost::interprocess::read_only);
+    region_ = boost::interprocess::mapped_region(file_mapping_, boost::interprocess::read_only);
+  }
+  catch (const boost::interprocess::interprocess_exception & ex)
+  {
+    ROS_ERROR_STREAM("Cannot map " << file_name << ": " << ex.what());
+    return false;
+  }
+
+  const char * data = static_cast<const char *>(region_.get_address());
+  const size_t size = region_.get_size();
+
+  Dataset::FileHeader header;
+  if (size < sizeof(header))
+    return false;
+  std::memcpy(&header, data, sizeof(header));
+  if (std::memcmp(header.magic_, Dataset::MAGIC, sizeof(header.magic_)) != 0 or header.version_ != Dataset::VERSION)
+  {
+    ROS_ERROR_STREAM(file_name << " is not a valid dataset!");
+    return false;
+  }
+
+  Dataset::FileFooter footer;
+  if (size >= sizeof(header) + sizeof(footer))
+  {
+    std::memcpy(&footer, data + size - sizeof(footer), sizeof(footer));
+    if (std::memcmp(footer.magic_, Dataset::MAGIC, sizeof(footer.magic_)) == 0 and readIndex(footer.index_offset_))
+      return true;
+  }
+
+  ROS_WARN_STREAM(file_name << " has no valid index. Scanning...");
+  frames_.clear();
+  frame_info_vec_.clear();
+  return scanChunks();
+}
+
+bool DatasetReader::readIndex(boost::uint64_t index_offset)
+{
+  const char * data = static_cast<const char *>(region_.get_address());
+  const size_t size = region_.get_size();
+
+  Dataset::ChunkHeader chunk;
+  if (not chunkHeaderFits(index_offset, size))
+    return false;
+  std::memcpy(&chunk, data + index_offset, sizeof(chunk));
+  if (chunk.type_ != Dataset::INDEX or not chunkPayloadFits(index_offset, chunk.size_, size))
+    return false;
+
+  const size_t elements = chunk.size_ / sizeof(boost::uint64_t);
+  for (size_t i = 0; i < elements; ++i)
+  {
+    boost::uint64_t offset;
+    std::memcpy(&offset, data + index_offset + sizeof(chunk) + i * sizeof(offset), sizeof(offset));
+    if (not addChunk(offset))
+      return false;
+  }
+
+  return true;
+}
+
+bool DatasetReader::scanChunks()
+{
+  const char * data = static_cast<const char *>(region_.get_address());
+  const size_t size = region_.get_size();
+
+  boost::uint64_t offset = sizeof(Dataset::FileHeader);
+  Dataset::ChunkHeader chunk;
+  while (chunkHeaderFits(offset, size))
+  {
+    std::memcpy(&chunk, data + offset, sizeof(chunk));
+    if (not chunkPayloadFits(offset, chunk.size_, size))
+    {
+      ROS_WARN("Truncated chunk found. Skipping the rest of the file.");
+      break;
+    }
+    if (chunk.type_ != Dataset::INDEX and not addChunk(offset))
+      break;
+    offset += sizeof(chunk) + chunk.size_;
+  }
+
+  return true;
+}
+
+bool DatasetReader::addChunk(boost::uint64_t offset)
+{
+  const char * data = static_cast<const char *>(region_.get_address());
+  const size_t size = region_.get_size();
+
+  Dataset::ChunkHeader chunk;
+  if (not chunkHeaderFits(offset, size))
+    return false;
+  std::memcpy(&chunk, data + offset, sizeof(chunk));
+  if (not chunkPayloadFits(offset, chunk.size_, size))
+    return false;
+
+  const char * payload = data + offset + sizeof(chunk);
+
+  if (chunk.type_ == Dataset::CAMERA_INFO)
+  {
+    if (chunk.size_ < 1)
+      return false;
+    const int sensor = static_cast<unsigned char>(payload[0]);
+    if (sensor < Dataset::COLOR_SENSOR or sensor > Dataset::DEPTH_SENSOR)
+      return false;
+    camera_info_[sensor].assign(payload + 1, chunk.size_ - 1);
+  }
+  else if (chunk.type_ == Dataset::FRAME)
+  {
+    Dataset::FrameHeader header;
+    if (chunk.size_ < sizeof(header))
+      return false;
+    std::memcpy(&header, payload, sizeof(header));
+    const boost::uint64_t data_size = chunk.size_ - sizeof(header);
+    if (header.depth_size_ > data_size or header.image_size_ > data_size - header.depth_size_)
+      return false;
+
+    Dataset::FrameInfo info;
+    info.id_ = header.id_;
+    info.image_timestamp_ = header.image_timestamp_;
+    info.depth_timestamp_ = header.depth_timestamp_;
+
+    frames_.push_back(payload);
+    frame_info_vec_.push_back(info);
+  }
+
+  return true;
+}
+
+int DatasetReader::find(int id) const
+{
+  for (size_t i = 0; i < frame_info_vec_.size(); ++i)
+  {
+    if (frame_info_vec_[i].id_ == id)
+      return i;
+  }
+  return -1;
+}
+
+bool DatasetReader::readImage(size_t index,
+                              cv::Mat & image) const
+{
+  Dataset::FrameHeader header;
+  std::memcpy(&header, frames_[index], sizeof(header));
+  if (header.image_size_ == 0)
+    return false;
+
+  const cv::Mat encoded_image(1, header.image_size_, CV_8UC1,
+                              const_cast<char *>(frames_[index] + sizeof(header) + header.depth_size_));
+  image = cv::imdecode(encoded_image, cv::IMREAD_COLOR);
+
+  return image.data;
+}
+
+bool DatasetReader::readDepth(size_t index,
+                              cv::Mat & depth) const
+{
+  Dataset::FrameHeader header;
+  std::memcpy(&header, frames_[index], sizeof(header));
+  if (header.depth_size_ == 0)
+    return false;
+
+  // Checked before allocating: the sizes of a corrupt header can be anything
+  const int type = header.depth_type_ == Dataset::DEPTH_UINT16 ? CV_16UC1 : CV_32FC1;
+  const boost::uint64_t elem_size = type == CV_16UC1 ? 2 : 4;
+  if (header.depth_rows_ == 0 or header.depth_cols_ == 0
+      or header.depth_size_ % (elem_size * header.depth_cols_) != 0
+      or header.depth_size_ / (elem_size * header.depth_cols_) != header.depth_rows_)
+    return false;
+
+  depth.create(header.depth_rows_, header.depth_cols_, type);
+  std::memcpy(depth.data, frames_[index] + sizeof(header), header.depth_size_);
+
+  return true;
+}
+
+bool DatasetReader::readDepthCloud(size_t index,
+                                   PCLCloud3 & cloud) const
+{
+  cv::Mat depth;
+  if (not readDepth(index, depth))
+    return false;
+
+  cloud.resize(depth.total());
+  cloud.width = depth.cols;
+  cloud.height = depth.rows;
+  cloud.is_dense = false;
+
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+
+  for (int j = 0; j < depth.rows; ++j)
+  {
+    for (int k = 0; k < depth.cols; ++k)
+    {
+      float z = depth.type() == CV_16UC1 ? depth.at<uint16_t>(j, k) / 1000.0f : depth.at<float>(j, k);
+      PCLPoint3 & p = cloud.at(k, j);
+      if (z > 0 and not std::isnan(z))
+      {
+        p.x = p.y = 0.0f;
+        p.z = z;
+      }
+      else
+      {
+        p.x = p.y = p.z = nan;
+      }
+    }
+  }
+
+  return true;
+}
+
+} /* namespace calibration */
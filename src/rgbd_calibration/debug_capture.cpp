@@ -0,0 +1,164 @@
+/*
+ *  Copyright (c) 2013-2014, Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *     3. Neither the name of the copyright holder(s) nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <fstream>
+
+#include <boost/filesystem.hpp>
+
+#include <ros/ros.h>
+#include <pcl/io/pcd_io.h>
+
+#include <rgbd_calibration/debug_capture.h>
+
+namespace calibration
+{
+
+DebugCapture::DebugCapture(const std::string & directory,
+                           Size1 sampling_rate,
+                           Size1 max_queued)
+  : directory_(directory),
+    sampling_rate_(sampling_rate),
+    max_queued_(max_queued),
+    dropped_(0),
+    stop_(false)
+{
+  assert(sampling_rate_ > 0 and max_queued_ > 0);
+
+  boost::system::error_code error;
+  boost::filesystem::create_directories(directory_, error);
+  if (error)
+    ROS_WARN_STREAM("Cannot create debug capture directory " << directory_ << ": " << error.message());
+
+  if (not directory_.empty() and *directory_.rbegin() != '/')
+    directory_ += '/';
+
+  thread_ = boost::thread(&DebugCapture::writeLoop, this);
+}
+
+DebugCapture::~DebugCapture()
+{
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    stop_ = true;
+  }
+  condition_.notify_all();
+  thread_.join();
+
+  if (dropped_ > 0)
+    ROS_WARN_STREAM("Debug capture: " << dropped_ << " items dropped, the writer could not keep up.");
+}
+
+void DebugCapture::capture(const std::string & file_name,
+                           const PCLCloud3::ConstPtr & cloud)
+{
+  Item item;
+  item.file_name_ = file_name;
+  item.cloud_ = cloud;
+  push(item);
+}
+
+void DebugCapture::capture(const std::string & file_name,
+                           const PCLCloud3::ConstPtr & cloud,
+                           const pcl::IndicesConstPtr & indices)
+{
+  Item item;
+  item.file_name_ = file_name;
+  item.cloud_ = cloud;
+  item.indices_ = indices;
+  push(item);
+}
+
+void DebugCapture::captureText(const std::string & file_name,
+                               const std::string & text)
+{
+  Item item;
+  item.file_name_ = file_name;
+  item.text_ = text;
+  push(item);
+}
+
+void DebugCapture::push(const Item & item)
+{
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (queue_.size() >= max_queued_)
+    {
+      ++dropped_;
+      return;
+    }
+    queue_.push_back(item);
+  }
+  condition_.notify_one();
+}
+
+void DebugCapture::writeLoop()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  while (true)
+  {
+    while (queue_.empty() and not stop_)
+      condition_.wait(lock);
+
+    // The queue is drained before stopping
+    if (queue_.empty())
+      break;
+
+    Item item = queue_.front();
+    queue_.pop_front();
+
+    lock.unlock();
+    write(item);
+    lock.lock();
+  }
+}
+
+void DebugCapture::write(const Item & item) const
+{
+  const std::string file_name = directory_ + item.file_name_;
+
+  if (not item.cloud_)
+  {
+    std::ofstream file(file_name.c_str());
+    file << item.text_;
+    if (not file)
+      ROS_WARN_STREAM("Debug capture: cannot write " << file_name << ".");
+    return;
+  }
+
+  pcl::PCDWriter writer;
+  int result;
+  if (item.indices_)
+    result = writer.writeBinary(file_name, *item.cloud_, *item.indices_);
+  else
+    result = writer.writeBinary(file_name, *item.cloud_);
+
+  if (result != 0)
+    ROS_WARN_STREAM("Debug capture: cannot write " << file_name << ".");
+}
+
+} /* namespace calibration */
@@ -29,9 +29,13 @@
 #include <ros/ros.h>
 #include <omp.h>
 #include <algorithm>
+#include <sstream>
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
 
 #include <pcl/filters/extract_indices.h>
-#include <pcl/io/pcd_io.h>
 
 #include <calibration_common/ceres/polynomial_fit.h>
 #include <calibration_common/ceres/plane_fit.h>
@@ -40,383 +44,758 @@
 #include <rgbd_calibration/checkerboard_views.h>
 #include <calibration_common/algorithms/plane_extraction.h>
 #include <rgbd_calibration/depth_undistortion_estimation.h>
+#include <rgbd_calibration/organized_plane_extraction.h>
+#include <rgbd_calibration/profiler.h>
+#include <rgbd_calibration/residual_arena.h>
 
 #define RGBD_INFO(id, msg) ROS_INFO_STREAM("RGBD " << id << ": " << msg)
 #define RGBD_WARN(id, msg) ROS_WARN_STREAM("RGBD " << id << ": " << msg)
 
+// Farthest distance of a ray from the center reached by extractPlane(), in search radii
+#define REGION_RADIUS_FACTOR 1
+
 namespace calibration
 {
 
 bool DepthUndistortionEstimation::extractPlane(const Checkerboard & color_cb,
-                                               const PCLCloud3::ConstPtr & cloud,
+                                               const CloudRegion & region,
                                                const Point3 & center,
                                                PlaneInfo & plane_info)
 {
-  Scalar radius = std::min(color_cb.width(), color_cb.height()) / 1.5; // TODO Add parameter
-  PointPlaneExtraction<PCLPoint3> plane_extractor;
-  plane_extractor.setInputCloud(cloud);
-  plane_extractor.setRadius(radius);
+  // Nothing to search in a region of the border of the image
+  if (region.cloud_->width < 2 or region.cloud_->height < 2)
+  {
+    Profiler::instance().increment("extract_plane/failed");
+    return false;
+  }
+
+  OrganizedPlaneExtraction plane_extractor;
+  plane_extractor.setInputCloud(region.cloud_);
+  if (has_depth_intrinsics_)
+    plane_extractor.setIntrinsics(depth_intrinsics_[0], depth_intrinsics_[1], depth_intrinsics_[2] - region.x_,
+                                  depth_intrinsics_[3] - region.y_);
+  plane_extractor.setPoint(center);
+  plane_extractor.setRadius(searchRadius(color_cb));
+  plane_extractor.setDepthErrorFunction(depth_error_function_);
+
+  const bool plane_extracted = plane_extractor.extract(plane_info);
+  if (plane_extracted)
+  {
+    std::vector<int> & indices = *plane_info.indices_;
+    for (Size1 i = 0; i < indices.size(); ++i)
+      indices[i] = region.fullIndex(indices[i]);
+  }
+
+  Profiler & profiler = Profiler::instance();
+  profiler.increment(plane_extracted ? "extract_plane/extracted" : "extract_plane/failed");
+  profiler.addToHistogram("extract_plane/iterations", plane_extractor.iterations());
+
+  return plane_extracted;
+}
 
-  bool plane_extracted = false;
+Scalar DepthUndistortionEstimation::searchRadius(const Checkerboard & color_cb)
+{
+  return std::min(color_cb.width(), color_cb.height()) / 1.5; // TODO Add parameter
+}
 
-  int r[] = {0, 1, 2}; // TODO Add parameter
-  int k[] = {0, 1, -1, 2, -2}; // TODO Add parameter
-  for (Size1 i = 0; i < 5 and not plane_extracted; ++i)
+void DepthUndistortionEstimation::undistortRegion(const PCLCloud3 & cloud,
+                                                  const LocalModel::Ptr & local_model,
+                                                  const Point3 & center,
+                                                  Scalar radius,
+                                                  const PCLCloud3::Ptr & region_cloud,
+                                                  CloudRegion & region) const
+{
+  int min_x = 0, max_x = cloud.width, min_y = 0, max_y = cloud.height;
+  if (has_depth_intrinsics_)
+    OrganizedPlaneExtraction::boundingBox(depth_intrinsics_[0], depth_intrinsics_[1], depth_intrinsics_[2],
+                                          depth_intrinsics_[3], center, radius, cloud.width, cloud.height,
+                                          min_x, max_x, min_y, max_y);
+
+  // The buffer keeps its capacity
+  PCLCloud3 & und_cloud = *region_cloud;
+  und_cloud.resize((max_x - min_x) * (max_y - min_y));
+  und_cloud.width = max_x - min_x;
+  und_cloud.height = max_y - min_y;
+  und_cloud.header = cloud.header;
+  und_cloud.is_dense = false;
+
+  region.cloud_ = region_cloud;
+  region.x_ = min_x;
+  region.y_ = min_y;
+  region.width_ = cloud.width;
+  region.height_ = cloud.height;
+
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  const PCLPoint3 bad_point(nan, nan, nan);
+  const Scalar sq_radius = radius * radius;
+
+  for (int i = min_y; i < max_y; ++i)
   {
-    for (Size1 j = 0; j < 3 and not plane_extracted; ++j)
+    for (int j = min_x; j < max_x; ++j)
     {
-      plane_extractor.setRadius((1 + r[j]) * radius);
-      plane_extractor.setPoint(PCLPoint3(center.x(), center.y(), center.z() + (1 + r[j]) * radius * k[i]));
-      plane_extracted = plane_extractor.extract(plane_info);
+      const PCLPoint3 & p = cloud.at(j, i);
+      PCLPoint3 & und_p = und_cloud.at(j - min_x, i - min_y);
+      und_p = bad_point;
+
+      if (not pcl::isFinite(p) or p.z <= 0)
+        continue;
+
+      // Undistortion only moves points along their ray: skip rays that do not cross the region.
+      const Point3 point(p.x, p.y, p.z);
+      if (point.dot(center) <= 0 or point.cross(center).squaredNorm() > sq_radius * point.squaredNorm())
+        continue;
+
+      Scalar z = p.z;
+      local_model->undistort(j, i, z);
+      const Point3 und_point = point * (z / p.z);
+
+      if ((und_point - center).squaredNorm() > sq_radius)
+        continue;
+
+      und_p.x = und_point.x();
+      und_p.y = und_point.y();
+      und_p.z = und_point.z();
     }
   }
+}
 
-  return plane_extracted;
+void DepthUndistortionEstimation::undistortCloud(const PCLCloud3 & cloud,
+                                                 const LocalModel::Ptr & local_model,
+                                                 PCLCloud3 & und_cloud)
+{
+  und_cloud = cloud;
+  for (Size1 i = 0; i < cloud.height; ++i)
+  {
+    for (Size1 j = 0; j < cloud.width; ++j)
+    {
+      PCLPoint3 & und_p = und_cloud.at(j, i);
+      if (not pcl::isFinite(und_p) or und_p.z <= 0)
+        continue;
+
+      Scalar z = und_p.z;
+      local_model->undistort(j, i, z);
+      const Scalar scale = z / und_p.z;
+      und_p.x *= scale;
+      und_p.y *= scale;
+      und_p.z *= scale;
+    }
+  }
 }
 
-void DepthUndistortionEstimation::estimateLocalModel()
+void DepthUndistortionEstimation::centralIndices(const std::vector<int> & indices,
+                                                 int width,
+                                                 int height,
+                                                 std::vector<int> & central_indices)
 {
-  std::sort(data_vec_.begin(), data_vec_.end(), OrderByDistance());
+  central_indices.reserve(indices.size());
+  for (size_t j = 0; j < indices.size(); ++j)
+  {
+    int r = indices[j] / width;
+    int c = indices[j] % width;
+    if ((r - height/2)*(r - height/2) + (c - width/2)*(c - width/2) < (height/2)*(height/2))
+      central_indices.push_back(indices[j]);
+  }
+}
+
+void DepthUndistortionEstimation::accumulateLocalSamples(LocalMatrixFitPCL & shard,
+                                                         const PCLCloud3 & cloud,
+                                                         const PlaneInfo & plane_info,
+                                                         LocalFitResult & result)
+{
+  shard.accumulateCloud(cloud, *plane_info.indices_);
+  shard.addAccumulatedPoints(plane_info.plane_);
 
-  for (Size1 i = 0; i < data_vec_.size(); i += max_threads_)
+  const Size2 matrix_size = shard.model()->matrix()->size();
+  for (Size1 y_index = 0; y_index < matrix_size.y(); ++y_index)
   {
-#pragma omp parallel for schedule(static, 1)
-    for (Size1 th = 0; th < max_threads_; ++th)
+    for (Size1 x_index = 0; x_index < matrix_size.x(); ++x_index)
     {
-      if (i + th >= data_vec_.size())
-        continue;
+      const LocalMatrixFitPCL::DataBin & bin = shard.getSamples(x_index, y_index);
+      for (Size1 k = 0; k < bin.size(); ++k)
+        result.samples_.push_back(std::make_pair(x_index + matrix_size.x() * y_index, bin[k]));
+    }
+  }
 
-      const DepthData & data = *data_vec_[i + th];
-      const Checkerboard & gt_cb = *data.checkerboard_;
-      const PCLCloud3 & cloud = *data.cloud_;
+  shard.reset();
+}
 
-      // Estimate center
-      Point3 und_color_cb_center = gt_cb.center();
-#pragma omp critical
-      {
-        InverseGlobalMatrixEigen inverse_global(inverse_global_fit_->model());
-        inverse_global.undistort(0, 0, und_color_cb_center);
-      }
+void DepthUndistortionEstimation::mergeLocalSamples(LocalFitResult & result)
+{
+  // The samples are sorted by node: one bin lookup per node
+  const Size1 matrix_cols = local_fit_->model()->matrix()->size().x();
+  for (Size1 k = 0; k < result.samples_.size(); )
+  {
+    const Size1 node = result.samples_[k].first;
+    LocalMatrixFitPCL::DataBin & bin = local_fit_->getSamples(node % matrix_cols, node / matrix_cols);
+    for (; k < result.samples_.size() and result.samples_[k].first == node; ++k)
+      bin.push_back(result.samples_[k].second);
+  }
 
-//      RGBD_INFO(data.id_, "Transformed z: " << gt_cb.center().z() << " -> " << und_color_cb_center.z());
+  std::vector<std::pair<Size1, LocalMatrixFitPCL::Data> >().swap(result.samples_);
+}
 
-      // Undistort cloud
-      PCLCloud3::Ptr und_cloud = boost::make_shared<PCLCloud3>(cloud);
-#pragma omp critical
-      {
-        LocalMatrixPCL local(local_fit_->model());
-        local.undistort(*und_cloud);
-      }
+LocalMatrixFitPCL::Ptr DepthUndistortionEstimation::createLocalShard() const
+{
+  // Only the layout of the model is used by the shard, a copy of it is never modified
+  LocalMatrixFitPCL::Ptr shard = boost::make_shared<LocalMatrixFitPCL>(localModelSnapshot());
+  shard->setDepthErrorFunction(depth_error_function_);
+  return shard;
+}
 
-      // Extract plane from undistorted cloud
-      PlaneInfo plane_info;
-      if (extractPlane(gt_cb, und_cloud, und_color_cb_center, plane_info))
-      {
-//        RGBD_INFO(data.id_, "Plane extracted!!");
-        plane_info_map_[data_vec_[i + th]] = plane_info;
+LocalModel::Ptr DepthUndistortionEstimation::localModelSnapshot() const
+{
+  LocalModel::Ptr snapshot = boost::make_shared<LocalModel>(local_model_->imageSize());
+  snapshot->setMatrix(boost::make_shared<LocalModel::Data>(*local_fit_->model()->matrix()));
+  return snapshot;
+}
 
-        if ((i + th) % 10 == 0)
-        {
-          PCLCloud3::Ptr tmp_und_cloud = boost::make_shared<PCLCloud3>(*und_cloud, *plane_info.indices_);
-          PCLCloud3::Ptr tmp_cloud = boost::make_shared<PCLCloud3>(cloud, *plane_info.indices_);
-
-          std::stringstream ss;
-          pcl::PCDWriter writer;
-          ss <<  "/tmp/tmp_und_cloud_" << i + th <<  ".pcd";
-          writer.write(ss.str(), *und_cloud);
-
-          ss.str("");
-          ss <<  "/tmp/tmp_und_cloud_" << i + th <<  "_plane.pcd";
-          writer.write(ss.str(), *tmp_und_cloud);
-
-          ss.str("");
-          ss <<  "/tmp/tmp_cloud_" << i + th <<  ".pcd";
-          writer.write(ss.str(), cloud);
-
-          ss.str("");
-          ss <<  "/tmp/tmp_cloud_" << i + th <<  "_plane.pcd";
-          writer.write(ss.str(), *tmp_cloud);
-
-          PlaneInfo tmp_plane_info;
-          if (extractPlane(gt_cb, data.cloud_, und_color_cb_center, tmp_plane_info))
-          {
-            PCLCloud3::Ptr tmp_cloud_2 = boost::make_shared<PCLCloud3>(cloud, *tmp_plane_info.indices_);
-
-            ss.str("");
-            ss <<  "/tmp/tmp_cloud_" << i + th <<  "_plane_2.pcd";
-            writer.write(ss.str(), *tmp_cloud_2);
-            std::cout << plane_info.std_dev_ << " -- " << tmp_plane_info.std_dev_ << std::endl;
-          }
-        }
+InverseGlobalModel::Ptr DepthUndistortionEstimation::inverseGlobalModelSnapshot() const
+{
+  InverseGlobalModel::Ptr snapshot = boost::make_shared<InverseGlobalModel>(inverse_global_model_->imageSize());
+  snapshot->setMatrix(boost::make_shared<InverseGlobalModel::Data>(*inverse_global_fit_->model()->matrix()));
+  return snapshot;
+}
 
-//        Plane fitted_plane = PlaneFit<Scalar>::robustFit(PCLConversion<Scalar>::toPointMatrix(*und_cloud, *plane_info.indices_),
-//                                                         plane_info.std_dev_);
+bool DepthUndistortionEstimation::extractLocalPlane(const DepthData & data,
+                                                    const PCLCloud3 & cloud,
+                                                    const LocalModel::Ptr & local_model,
+                                                    const InverseGlobalModel::Ptr & inverse_global_model,
+                                                    const PCLCloud3::Ptr & region_cloud,
+                                                    CloudRegion & region,
+                                                    PlaneInfo & plane_info,
+                                                    Plane & fitted_plane)
+{
+  const Checkerboard & gt_cb = *data.checkerboard_;
 
-        std::vector<int> indices;// = *plane_info.indices_;
-        indices.reserve(plane_info.indices_->size());
-        int w = und_cloud->width;
-        int h = und_cloud->height;
-        for (size_t j = 0; j < plane_info.indices_->size(); ++j)
-        {
-          int r = (*plane_info.indices_)[j] / w;
-          int c = (*plane_info.indices_)[j] % w;
-          if ((r - h/2)*(r - h/2) + (c - w/2)*(c - w/2) < (h/2)*(h/2))
-            indices.push_back((*plane_info.indices_)[j]);
-        }
-        Plane fitted_plane = PlaneFit<Scalar>::fit(PCLConversion<Scalar>::toPointMatrix(cloud, indices)/*, plane_info.std_dev_*/);
+  // Estimate center
+  Point3 und_color_cb_center = gt_cb.center();
+  InverseGlobalMatrixEigen inverse_global(inverse_global_model);
+  inverse_global.undistort(0, 0, und_color_cb_center);
 
-        plane_info_map_[data_vec_[i + th]].plane_ = fitted_plane;
+//  RGBD_INFO(data.id_, "Transformed z: " << gt_cb.center().z() << " -> " << und_color_cb_center.z());
 
+  // Undistort the points extractPlane() can reach
+  undistortRegion(cloud, local_model, und_color_cb_center, REGION_RADIUS_FACTOR * searchRadius(gt_cb), region_cloud,
+                  region);
 
-#pragma omp critical
-        {
-          local_fit_->accumulateCloud(cloud, *plane_info.indices_);
-          local_fit_->addAccumulatedPoints(fitted_plane);
-          for (Size1 c = 0; c < gt_cb.corners().elements(); ++c)
-          {
-            const Point3 & corner = gt_cb.corners()[c];
-            inverse_global_fit_->addPoint(0, 0, corner, fitted_plane);
-          }
-          if (i + th > 20)
-            inverse_global_fit_->update();
+  // Extract plane from undistorted region
+  if (not extractPlane(gt_cb, region, und_color_cb_center, plane_info))
+  {
+    RGBD_WARN(data.id_, "Plane not extracted!!");
+    return false;
+  }
 
-        }
+//  Plane fitted_plane = PlaneFit<Scalar>::robustFit(PCLConversion<Scalar>::toPointMatrix(*und_cloud, *plane_info.indices_),
+//                                                   plane_info.std_dev_);
+
+  std::vector<int> indices;
+  centralIndices(*plane_info.indices_, cloud.width, cloud.height, indices);
+  fitted_plane = PlaneFit<Scalar>::fit(PCLConversion<Scalar>::toPointMatrix(cloud, indices)/*, plane_info.std_dev_*/);
+
+  Line line(Vector3::Zero(), gt_cb.center().normalized());
+  RGBD_INFO(data.id_, "Transformed z: " << gt_cb.center().z() << " -> " << und_color_cb_center.z()
+                                        << " (Real z: " << line.intersectionPoint(fitted_plane).z() << ")");
+
+//  Scalar angle = RAD2DEG(std::acos(plane_info.equation_.normal().dot(gt_cb.plane().normal())));
+//  RGBD_INFO(data.id(), "Angle: " << angle);
+
+  return true;
+}
+
+void DepthUndistortionEstimation::estimateLocalModel()
+{
+  Profiler::ScopedTimer timer("undistortion/local_model");
+
+  std::sort(data_vec_.begin(), data_vec_.end(), OrderByDistance());
+
+  const Size1 size = data_vec_.size();
+
+  LocalModelPipeline pipeline;
+  pipeline.results_.resize(size);
+  pipeline.processed_.resize(size, false);
+  pipeline.taken_.resize(size, false);
+  pipeline.next_ = 0;
+  pipeline.first_waiting_ = 0;
+  pipeline.published_ = 0;
+  pipeline.merging_ = false;
+  pipeline.new_samples_ = 0;
+  pipeline.total_samples_ = 0;
+
+  ModelSnapshot snapshot;
+  snapshot.merged_ = 0;
+  snapshot.local_model_ = localModelSnapshot();
+  snapshot.inverse_global_model_ = inverseGlobalModelSnapshot();
+  pipeline.snapshots_.push_back(snapshot);
+
+  boost::thread_group workers;
+  for (Size1 th = 0; th < max_threads_; ++th)
+    workers.create_thread(boost::bind(&DepthUndistortionEstimation::localModelWorker, this, boost::ref(pipeline)));
+  workers.join_all();
+}
 
-        Line line(Vector3::Zero(), gt_cb.center().normalized());
-        RGBD_INFO(data.id_, "Transformed z: " << gt_cb.center().z() << " -> " << und_color_cb_center.z()
-                                              << " (Real z: " << line.intersectionPoint(fitted_plane).z() << ")");
+void DepthUndistortionEstimation::localModelWorker(LocalModelPipeline & pipeline)
+{
+  const Size1 size = data_vec_.size();
+  const PCLCloud3::Ptr region_cloud = boost::make_shared<PCLCloud3>();
+  const LocalMatrixFitPCL::Ptr shard = createLocalShard();
 
-//      Scalar angle = RAD2DEG(std::acos(plane_info.equation_.normal().dot(gt_cb.plane().normal())));
-//      RGBD_INFO(data.id(), "Angle: " << angle);
+  boost::mutex::scoped_lock lock(pipeline.mutex_);
+  while (pipeline.next_ < size)
+  {
+    // Tickets are taken near to far: the frames waited for are always taken by a running worker
+    const Size1 i = pipeline.next_++;
+    const Size1 needed = i > pipeline_depth_ ? i - pipeline_depth_ : 0;
+    while (pipeline.published_ < needed)
+      pipeline.condition_.wait(lock);
+
+    std::deque<ModelSnapshot> & snapshots = pipeline.snapshots_;
+    Size1 s = 0;
+    while (s + 1 < snapshots.size() and snapshots[s + 1].merged_ <= needed)
+      ++s;
+    const LocalModel::Ptr local_model = snapshots[s].local_model_;
+    const InverseGlobalModel::Ptr inverse_global_model = snapshots[s].inverse_global_model_;
+
+    // The frames without a snapshot yet need one taken after the frames before first_waiting_ - pipeline_depth_
+    pipeline.taken_[i] = true;
+    while (pipeline.first_waiting_ < size and pipeline.taken_[pipeline.first_waiting_])
+      ++pipeline.first_waiting_;
+    const Size1 oldest_needed = pipeline.first_waiting_ > pipeline_depth_ ? pipeline.first_waiting_ - pipeline_depth_ : 0;
+    while (snapshots.size() > 1 and snapshots[1].merged_ <= oldest_needed)
+      snapshots.pop_front();
+
+    lock.unlock();
+
+    const DepthData & data = *data_vec_[i];
+    const PCLCloud3::ConstPtr cloud_ptr = data.cloud();
+    const PCLCloud3 & cloud = *cloud_ptr;
+    LocalFitResult & result = pipeline.results_[i];
+
+    PlaneInfo & plane_info = result.plane_info_;
+    CloudRegion region;
+    Plane fitted_plane;
+    if (extractLocalPlane(data, cloud, local_model, inverse_global_model, region_cloud, region, plane_info,
+                          fitted_plane))
+    {
+      result.plane_extracted_ = true;
 
+      // region_cloud is reused by the worker, only its plane is copied
+      if (debug_capture_ and debug_capture_->sample(i))
+      {
+        std::stringstream ss;
+        ss << "local_" << data.id_;
+        debug_capture_->capture(ss.str() + "_cloud.pcd", cloud_ptr);
+        debug_capture_->capture(ss.str() + "_plane.pcd", cloud_ptr, plane_info.indices_);
+
+        PCLCloud3::Ptr und_plane = boost::make_shared<PCLCloud3>();
+        for (Size1 k = 0; k < plane_info.indices_->size(); ++k)
+          und_plane->push_back(region.atFullIndex((*plane_info.indices_)[k]));
+        debug_capture_->capture(ss.str() + "_und_plane.pcd", und_plane);
       }
-      else
-        RGBD_WARN(data.id_, "Plane not extracted!!");
 
+      plane_info.plane_ = fitted_plane;
+      accumulateLocalSamples(*shard, cloud, plane_info, result);
     }
 
-    local_fit_->update();
+    lock.lock();
+    pipeline.processed_[i] = true;
+    if (not pipeline.merging_)
+      mergeLocalResults(pipeline, lock);
   }
-
 }
 
-void DepthUndistortionEstimation::estimateLocalModelReverse()
+void DepthUndistortionEstimation::mergeLocalResults(LocalModelPipeline & pipeline,
+                                                    boost::mutex::scoped_lock & lock)
 {
-  //std::reverse(data_vec_.begin(), data_vec_.end());
+  const Size1 size = data_vec_.size();
 
-  local_fit_->reset();
-
-  for (Size1 i = 0; i < data_vec_.size(); i += max_threads_)
+  // One worker at a time merges every result that is ready, in data order, so that the fit does not depend on
+  // thread scheduling. The fits are only touched by the merging worker: the others keep running meanwhile.
+  pipeline.merging_ = true;
+  while (pipeline.published_ < size and pipeline.processed_[pipeline.published_])
   {
-#pragma omp parallel for schedule(static, 1)
-    for (Size1 th = 0; th < max_threads_; ++th)
+    const Size1 merged = pipeline.published_;
+    lock.unlock();
+
+    LocalFitResult & result = pipeline.results_[merged];
+    if (result.plane_extracted_)
     {
-      if (i + th >= data_vec_.size())
-        continue;
+      const DepthData::Ptr & data = data_vec_[merged];
+      const Checkerboard & gt_cb = *data->checkerboard_;
+      const Plane & plane = result.plane_info_.plane_;
 
-      const DepthData & data = *data_vec_[i + th];
-      const Checkerboard & gt_cb = *data.checkerboard_;
-      const PCLCloud3 & cloud = *data.cloud_;
+      plane_info_map_[data] = result.plane_info_;
 
-      // Estimate center
-      Point3 und_color_cb_center = gt_cb.center();
-#pragma omp critical
+      const Size1 samples = result.plane_info_.indices_->size();
+      mergeLocalSamples(result);
+      for (Size1 c = 0; c < gt_cb.corners().elements(); ++c)
       {
-        InverseGlobalMatrixEigen inverse_global(inverse_global_fit_->model());
-        inverse_global.undistort(0, 0, und_color_cb_center);
+        const Point3 & corner = gt_cb.corners()[c];
+        inverse_global_fit_->addPoint(0, 0, corner, plane);
       }
+      if (merged > 20)
+        inverse_global_fit_->update();
+
+      pipeline.new_samples_ += samples;
+      pipeline.total_samples_ += samples;
+    }
+
+    // Update as soon as enough new samples are available (by default, about one frame per pipeline slot).
+    const Size1 slots = std::max<Size1>(pipeline_depth_, 1);
+    const Size1 update_samples = local_update_samples_ > 0 ? local_update_samples_
+                                                           : slots * pipeline.total_samples_ / (merged + 1);
+    ModelSnapshot snapshot;
+    snapshot.merged_ = merged + 1;
+    if (pipeline.new_samples_ > 0 and (pipeline.new_samples_ >= update_samples or merged + 1 == size))
+    {
+      local_fit_->update();
+      pipeline.new_samples_ = 0;
+
+      snapshot.local_model_ = localModelSnapshot();
+      snapshot.inverse_global_model_ = inverseGlobalModelSnapshot();
+    }
+
+    // Published with its snapshot, if any: the frames waiting for merged frames see both at once
+    lock.lock();
+    if (snapshot.local_model_)
+      pipeline.snapshots_.push_back(snapshot);
+    pipeline.published_ = merged + 1;
+    pipeline.condition_.notify_all();
+  }
+  pipeline.merging_ = false;
+}
+
+bool DepthUndistortionEstimation::addStreamingData(const DepthData::Ptr & data)
+{
+  Profiler::ScopedTimer timer("undistortion/streaming_data");
+
+  addDepthData(data);
+
+  const PCLCloud3::ConstPtr cloud = data->cloud();
+  if (not streaming_region_cloud_)
+    streaming_region_cloud_ = boost::make_shared<PCLCloud3>();
+
+  PlaneInfo plane_info;
+  CloudRegion region;
+  Plane fitted_plane;
+  if (not extractLocalPlane(*data, *cloud, local_fit_->model(), inverse_global_fit_->model(), streaming_region_cloud_,
+                            region, plane_info, fitted_plane))
+    return false;
+
+  plane_info.plane_ = fitted_plane;
+  plane_info_map_[data] = plane_info;
+
+  const Checkerboard & gt_cb = *data->checkerboard_;
+  local_fit_->accumulateCloud(*cloud, *plane_info.indices_);
+  local_fit_->addAccumulatedPoints(fitted_plane);
+  for (Size1 c = 0; c < gt_cb.corners().elements(); ++c)
+    inverse_global_fit_->addPoint(0, 0, gt_cb.corners()[c], fitted_plane);
+  if (++streaming_frames_ > 20)
+    inverse_global_fit_->update();
+
+  // Bins seen by this plane
+  const Size2 & bin_size = local_model_->binSize();
+  if (streaming_bin_frames_.empty())
+  {
+    streaming_bins_ = Size2((cloud->width + bin_size.x() - 1) / bin_size.x(),
+                            (cloud->height + bin_size.y() - 1) / bin_size.y());
+    streaming_bin_frames_.resize(streaming_bins_.x() * streaming_bins_.y(), 0);
+  }
+  std::vector<bool> seen(streaming_bin_frames_.size(), false);
+  const Indices & indices = *plane_info.indices_;
+  for (Size1 i = 0; i < indices.size(); ++i)
+  {
+    const Size1 bin_x = (indices[i] % cloud->width) / bin_size.x();
+    const Size1 bin_y = (indices[i] / cloud->width) / bin_size.y();
+    seen[bin_x + streaming_bins_.x() * bin_y] = true;
+  }
+  for (Size1 i = 0; i < seen.size(); ++i)
+    streaming_bin_frames_[i] += seen[i] ? 1 : 0;
+
+  streaming_new_samples_ += indices.size();
+  if (streaming_new_samples_ < local_update_samples_)
+    return true;
+
+  const LocalModel::Ptr previous = localModelSnapshot();
+  local_fit_->update();
+  streaming_new_samples_ = 0;
+  ++streaming_updates_;
 
-//      RGBD_INFO(data.id_, "Transformed z: " << gt_cb.center().z() << " -> " << und_color_cb_center.z());
+  const int MIN_DEGREE = MathTraits<LocalPolynomial>::MinDegree;
+  const int SIZE = MathTraits<LocalPolynomial>::Size;
 
-      // Undistort cloud
-      PCLCloud3::Ptr und_cloud = boost::make_shared<PCLCloud3>(cloud);
-#pragma omp critical
+  Scalar change = 0.0;
+  const Size2 matrix_size = local_model_->matrix()->size();
+  for (Size1 y_index = 0; y_index < matrix_size.y(); ++y_index)
+  {
+    for (Size1 x_index = 0; x_index < matrix_size.x(); ++x_index)
+    {
+      const Eigen::Matrix<Scalar, Eigen::Dynamic, 1> delta = local_model_->matrix()->at(x_index, y_index)
+                                                             - previous->matrix()->at(x_index, y_index);
+      for (int z = 1; z <= 4; ++z)
       {
-        LocalMatrixPCL local(local_fit_->model());
-        local.undistort(*und_cloud);
+        Scalar z_pow = 1.0;
+        for (int k = 0; k < MIN_DEGREE; ++k)
+          z_pow *= z;
+        Scalar correction = 0.0;
+        for (int k = 0; k < SIZE; ++k, z_pow *= z)
+          correction += delta[k] * z_pow;
+        change = std::max(change, std::abs(correction));
       }
+    }
+  }
+  last_streaming_change_ = change;
 
-      // Extract plane from undistorted cloud
-      PlaneInfo plane_info;
-      if (extractPlane(gt_cb, und_cloud, und_color_cb_center, plane_info))
-      {
-//        RGBD_INFO(data.id_, "Plane extracted!!");
+  return true;
+}
 
-//        Plane fitted_plane = PlaneFit<Scalar>::robustFit(PCLConversion<Scalar>::toPointMatrix(*und_cloud, *plane_info.indices_),
-//                                                         plane_info.std_dev_);
+Scalar DepthUndistortionEstimation::streamingCoverage(Size1 min_frames) const
+{
+  if (streaming_bin_frames_.empty())
+    return 0.0;
 
-        boost::shared_ptr<std::vector<int> > indices = boost::make_shared<std::vector<int> >();// = *plane_info.indices_;
-        indices->reserve(plane_info.indices_->size());
-        int w = und_cloud->width;
-        int h = und_cloud->height;
-        for (size_t j = 0; j < plane_info.indices_->size(); ++j)
-        {
-          int r = (*plane_info.indices_)[j] / w;
-          int c = (*plane_info.indices_)[j] % w;
-          if ((r - h/2)*(r - h/2) + (c - w/2)*(c - w/2) < (h/2)*(h/2))
-            indices->push_back((*plane_info.indices_)[j]);
-        }
-        Plane fitted_plane = PlaneFit<Scalar>::fit(PCLConversion<Scalar>::toPointMatrix(cloud, *indices)/*, plane_info.std_dev_*/);
+  Size1 covered = 0;
+  for (Size1 i = 0; i < streaming_bin_frames_.size(); ++i)
+    covered += streaming_bin_frames_[i] >= min_frames ? 1 : 0;
+  return Scalar(covered) / streaming_bin_frames_.size();
+}
 
+void DepthUndistortionEstimation::estimateLocalModelReverse()
+{
+  Profiler::ScopedTimer timer("undistortion/local_model_reverse");
 
-        boost::shared_ptr<std::vector<int> > old_indices;
-#pragma omp critical
-        {
-           old_indices = plane_info_map_[data_vec_[i + th]].indices_;
-        }
-        indices->clear();
-        std::set_union(old_indices->begin(), old_indices->end(), plane_info.indices_->begin(), plane_info.indices_->end(), std::back_inserter(*indices));
+  //std::reverse(data_vec_.begin(), data_vec_.end());
 
-#pragma omp critical
-        {
-          local_fit_->accumulateCloud(cloud, *indices);
-          local_fit_->addAccumulatedPoints(fitted_plane);
-          plane_info_map_[data_vec_[i + th]].indices_ = indices;
-        }
+  local_fit_->reset();
 
-        Line line(Vector3::Zero(), gt_cb.center().normalized());
-        RGBD_INFO(data.id_, "Transformed z: " << gt_cb.center().z() << " -> " << und_color_cb_center.z()
-                                              << " (Real z: " << line.intersectionPoint(fitted_plane).z() << ")");
+  const Size1 size = data_vec_.size();
+  std::vector<LocalFitResult> results(size);
 
-      }
-      else
-        RGBD_WARN(data.id_, "Plane not extracted!!");
+  // The local model is only updated at the end of the pass, the inverse global one is not updated at all.
+  const LocalModel::Ptr local_model = local_fit_->model();
+  const InverseGlobalModel::Ptr inverse_global_model = inverse_global_fit_->model();
 
-    }
+  std::vector<PCLCloud3::Ptr> region_clouds(max_threads_);
+  std::vector<LocalMatrixFitPCL::Ptr> shards(max_threads_);
+  for (Size1 th = 0; th < max_threads_; ++th)
+  {
+    region_clouds[th] = boost::make_shared<PCLCloud3>();
+    shards[th] = createLocalShard();
+  }
+
+#pragma omp parallel for schedule(dynamic, 1) num_threads(max_threads_)
+  for (Size1 i = 0; i < size; ++i)
+  {
+    const DepthData::Ptr & data = data_vec_[i];
+    LocalFitResult & result = results[i];
+
+    const PCLCloud3::Ptr & region_cloud = region_clouds[omp_get_thread_num()];
+    const PCLCloud3::ConstPtr cloud = data->cloud();
+    PlaneInfo plane_info;
+    CloudRegion region;
+    Plane fitted_plane;
+    if (not extractLocalPlane(*data, *cloud, local_model, inverse_global_model, region_cloud, region, plane_info,
+                              fitted_plane))
+      continue;
+
+    // No insertions into the map happen during the parallel section: lookups are safe
+    boost::shared_ptr<std::vector<int> > indices = boost::make_shared<std::vector<int> >();
+    std::map<DepthData::ConstPtr, PlaneInfo>::const_iterator old_it = plane_info_map_.find(data);
+    if (old_it != plane_info_map_.end() and old_it->second.indices_)
+      std::set_union(old_it->second.indices_->begin(), old_it->second.indices_->end(),
+                     plane_info.indices_->begin(), plane_info.indices_->end(), std::back_inserter(*indices));
+    else
+      *indices = *plane_info.indices_;
+
+    result.plane_info_ = plane_info;
+    result.plane_info_.plane_ = fitted_plane;
+    result.plane_info_.indices_ = indices;
+    result.plane_extracted_ = true;
+
+    accumulateLocalSamples(*shards[omp_get_thread_num()], *cloud, result.plane_info_, result);
+  }
+
+  // Merged in data order: the fit does not depend on which thread accumulated which frame
+  for (Size1 i = 0; i < size; ++i)
+  {
+    LocalFitResult & result = results[i];
+    if (not result.plane_extracted_)
+      continue;
 
+    mergeLocalSamples(result);
+    plane_info_map_[data_vec_[i]].indices_ = result.plane_info_.indices_;
   }
+
   local_fit_->update();
   //std::reverse(data_vec_.begin(), data_vec_.end());
 
 }
 
+// Residuals of the samples of one bin of one frame. The samples are columns of a LocalModelError::Arena, with
+// everything that does not depend on the polynomials: points, intersections with the plane (undistortion moves the
+// points along their ray) and lookup table weights.
 class LocalModelError
 {
 public:
 
-  LocalModelError(const PCLCloud3::ConstPtr & cloud,
-                  const Plane & plane,
-                  const LocalModel::Ptr & local_model,
-                  const Polynomial<double, 2> & depth_error_function)
-    : cloud_(cloud), plane_(plane), depth_error_function_(depth_error_function)
+  enum
   {
-    local_matrix_.setModel(local_model);
-  }
+    POINT = 0,
+    INTERSECTION = 3,
+    WEIGHTS = 6,
+    ROWS = 10
+  };
 
-  void addIndex(int x_index, int y_index)
+  typedef ResidualArena<double, ROWS> Arena;
+
+  LocalModelError(const Arena::Span & samples,
+                  const Polynomial<double, 2> & depth_error_function)
+    : samples_(samples.data()), size_(samples.cols()), depth_error_function_(depth_error_function)
   {
-    indices_.push_back(std::make_pair(x_index, y_index));
+    // Do nothing
   }
 
-  void createCloudWithIndices()
+  static void computeSample(const PCLPoint3 & p,
+                            const Plane & plane,
+                            const std::vector<LocalModel::LookupTableData> & lt_data,
+                            Arena::Span & samples,
+                            Size1 index)
   {
-    part_cloud_.height = 1;
-    part_cloud_.width = indices_.size();
-    part_cloud_.points.resize(indices_.size());
-    for (Size1 i = 0; i < indices_.size(); ++i)
-    {
-      int index = indices_[i].first + cloud_->width * indices_[i].second;
-      part_cloud_.points[i] = cloud_->points[index];
-    }
+    samples.col(index).segment<3>(POINT) << p.x, p.y, p.z;
+
+    Line line(Vector3::Zero(), samples.col(index).segment<3>(POINT).normalized());
+    samples.col(index).segment<3>(INTERSECTION) = line.intersectionPoint(plane);
+
+    samples.col(index).segment<4>(WEIGHTS).setZero();
+    for (Size1 j = 0; j < lt_data.size() and j < 4; ++j)
+      samples(WEIGHTS + j, index) = lt_data[j].weight_;
   }
 
   int size() const
   {
-    return indices_.size();
+    return size_;
   }
 
-  bool operator ()(const double * const local_poly_1_data,
-                   const double * const local_poly_2_data,
-                   const double * const local_poly_3_data,
-                   const double * const local_poly_4_data,
-                   double * residuals) const
-  {
-    PCLCloud3 tmp_cloud = part_cloud_;
-
-    Eigen::Map<Eigen::Matrix3Xd> residuals_map(residuals, 3, size());
-    Eigen::MatrixX4d polynomials(MathTraits<LocalPolynomial>::Size, 4);
-    polynomials.col(0) = Eigen::Map<const Eigen::Matrix<double, MathTraits<LocalPolynomial>::Size, 1> >(local_poly_1_data);
-    polynomials.col(1) = Eigen::Map<const Eigen::Matrix<double, MathTraits<LocalPolynomial>::Size, 1> >(local_poly_2_data);
-    polynomials.col(2) = Eigen::Map<const Eigen::Matrix<double, MathTraits<LocalPolynomial>::Size, 1> >(local_poly_3_data);
-    polynomials.col(3) = Eigen::Map<const Eigen::Matrix<double, MathTraits<LocalPolynomial>::Size, 1> >(local_poly_4_data);
-
-    for (Size1 i = 0; i < indices_.size(); ++i)
+  template <typename T>
+    bool operator ()(const T * const local_poly_1_data,
+                     const T * const local_poly_2_data,
+                     const T * const local_poly_3_data,
+                     const T * const local_poly_4_data,
+                     T * residuals) const
     {
-      const std::pair<int, int> & index = indices_[i];
+      const int MIN_DEGREE = MathTraits<LocalPolynomial>::MinDegree;
+      const int SIZE = MathTraits<LocalPolynomial>::Size;
+      const int ERROR_SIZE = MathTraits<Polynomial<double, 2> >::Size;
 
-      std::vector<LocalModel::LookupTableData> lt_data = local_matrix_.model()->lookupTable(index.first, index.second);
+      const T * const polynomials[4] = {local_poly_1_data, local_poly_2_data, local_poly_3_data, local_poly_4_data};
 
-      double tmp_depth = 0.0;
-      double depth = tmp_cloud.points[i].z;
-      for (Size1 j = 0; j < lt_data.size(); ++j)
-        tmp_depth += lt_data[j].weight_ * LocalPolynomial::evaluate(polynomials.col(j), depth);
-      depth = tmp_depth;
-      double k = depth / tmp_cloud.points[i].z;
+      Arena::ConstSpan samples(samples_, ROWS, size_);
+      Eigen::Map<Eigen::Matrix<T, 3, Eigen::Dynamic> > residuals_map(residuals, 3, size_);
+      for (int i = 0; i < size_; ++i)
+      {
+        const double z = samples(POINT + 2, i);
+
+        T depth(0.0);
+        double z_pow = 1.0;
+        for (int k = 0; k < MIN_DEGREE; ++k)
+          z_pow *= z;
+        for (int k = 0; k < SIZE; ++k, z_pow *= z)
+          for (int j = 0; j < 4; ++j)
+            depth += samples(WEIGHTS + j, i) * polynomials[j][k] * z_pow;
+
+        T depth_error(0.0);
+        for (int k = ERROR_SIZE - 1; k >= 0; --k)
+          depth_error = depth_error * depth + depth_error_function_.coefficients()[k];
+
+//        residuals[i] = (p - line.intersectionPoint(plane_)).norm() / ceres::poly_eval(depth_error_function_.coefficients(), p.z());
+        residuals_map.col(i) = (samples.col(i).segment<3>(POINT).cast<T>() * (depth / z)
+                                - samples.col(i).segment<3>(INTERSECTION).cast<T>()) / depth_error;
+      }
 
-      Point3 p(tmp_cloud.points[i].x * k, tmp_cloud.points[i].y * k, depth);
-      Line line(Vector3::Zero(), p.normalized());
-//      residuals[i] = (p - line.intersectionPoint(plane_)).norm() / ceres::poly_eval(depth_error_function_.coefficients(), p.z());
-      residuals_map.col(i) = (p - line.intersectionPoint(plane_)) / ceres::poly_eval(depth_error_function_.coefficients(), p.z());
+      return true;
     }
 
-    return true;
-  }
-
 private:
 
-  const PCLCloud3::ConstPtr cloud_;
-  const Plane plane_;
-  LocalMatrixPCL local_matrix_;
+  const double * samples_;
+  const int size_;
   const Polynomial<double, 2> depth_error_function_;
-  std::vector<std::pair<int, int> > indices_;
-  PCLCloud3 part_cloud_;
 
 };
 
-typedef ceres::NumericDiffCostFunction<LocalModelError, ceres::CENTRAL, ceres::DYNAMIC, MathTraits<LocalPolynomial>::Size,
+typedef ceres::AutoDiffCostFunction<LocalModelError, ceres::DYNAMIC, MathTraits<LocalPolynomial>::Size,
 MathTraits<LocalPolynomial>::Size, MathTraits<LocalPolynomial>::Size, MathTraits<LocalPolynomial>::Size> LocalCostFunction;
 
-void DepthUndistortionEstimation::optimizeLocalModel(const Polynomial<double, 2> & depth_error_function)
+void DepthUndistortionEstimation::optimizeLocalModel(const Polynomial<double, 2> & depth_error_function,
+                                                     int max_iterations)
 {
-  std::vector<LocalModelError *> all_errors_vec;
+  Profiler::ScopedTimer timer("undistortion/optimize_local_model");
+
+  // One sample per plane inlier, in a single allocation. The errors only point into it.
+  Size1 capacity = 0;
+  for (Size1 i = 0; i < data_vec_.size(); ++i)
+  {
+    std::map<DepthData::ConstPtr, PlaneInfo>::const_iterator it = plane_info_map_.find(data_vec_[i]);
+    if (it != plane_info_map_.end() and it->second.indices_)
+      capacity += it->second.indices_->size();
+  }
+  LocalModelError::Arena arena(capacity);
+
   ceres::Problem problem;
 
   for (Size1 i = 0; i < data_vec_.size(); ++i)
   {
     const DepthData::ConstPtr & data = data_vec_[i];
-    const std::vector<int> & indices = *plane_info_map_[data].indices_;
+    std::map<DepthData::ConstPtr, PlaneInfo>::const_iterator it = plane_info_map_.find(data);
+    if (it == plane_info_map_.end() or not it->second.indices_)
+      continue;
 
-    int delta_x = data->cloud_->width / local_model_->binSize().x();
-    int delta_y = data->cloud_->height / local_model_->binSize().y();
+    const PCLCloud3::ConstPtr cloud = data->cloud();
+    const PlaneInfo & plane_info = it->second;
+    const std::vector<int> & indices = *plane_info.indices_;
 
-    std::vector<LocalModelError *> error_vec;
+    const int delta_x = cloud->width / local_model_->binSize().x();
+    const int delta_y = cloud->height / local_model_->binSize().y();
 
-    for (Size1 j = 0; j < delta_y * delta_x; ++j)
+    // Counting sort of the inliers by bin, so that the samples of a bin are contiguous
+    std::vector<Size1> bin_begin(delta_x * delta_y + 1, 0);
+    std::vector<int> bins(indices.size());
+    for (Size1 j = 0; j < indices.size(); ++j)
     {
-      error_vec.push_back(new LocalModelError(data->cloud_, plane_info_map_[data].plane_, local_model_, depth_error_function));
-      all_errors_vec.push_back(error_vec.back());
+      const int bin_x = (indices[j] % cloud->width) / local_model_->binSize().x();
+      const int bin_y = (indices[j] / cloud->width) / local_model_->binSize().y();
+      bins[j] = bin_x + delta_x * bin_y;
+      ++bin_begin[bins[j] + 1];
     }
+    for (Size1 j = 1; j < bin_begin.size(); ++j)
+      bin_begin[j] += bin_begin[j - 1];
 
+    std::vector<int> sorted(indices.size());
+    std::vector<Size1> next(bin_begin.begin(), bin_begin.end() - 1);
     for (Size1 j = 0; j < indices.size(); ++j)
-    {
-      int x_index = indices[j] % data->cloud_->width;
-      int y_index = indices[j] / data->cloud_->width;
-      int bin_x = x_index / local_model_->binSize().x();
-      int bin_y = y_index / local_model_->binSize().y();
-      error_vec[bin_x + delta_x * bin_y]->addIndex(x_index, y_index);
-    }
+      sorted[next[bins[j]]++] = indices[j];
 
-    for (Size1 j = 0; j < error_vec.size(); ++j)
+    for (int j = 0; j < delta_x * delta_y; ++j)
     {
-      if (error_vec[j]->size() == 0)
+      const Size1 bin_size = bin_begin[j + 1] - bin_begin[j];
+      if (bin_size == 0)
         continue;
-      error_vec[j]->createCloudWithIndices();
+
+      LocalModelError::Arena::Span samples = arena.allocate(bin_size);
+      for (Size1 k = 0; k < bin_size; ++k)
+      {
+        const int index = sorted[bin_begin[j] + k];
+        const int x_index = index % cloud->width;
+        const int y_index = index / cloud->width;
+        LocalModelError::computeSample(cloud->at(x_index, y_index), plane_info.plane_,
+                                       local_model_->lookupTable(x_index, y_index), samples, k);
+      }
 
       int x_index = j % delta_x;
       int y_index = j / delta_x;
 
-//      ceres::CostFunction * cost_function = new LocalCostFunction(error_vec[j], ceres::DO_NOT_TAKE_OWNERSHIP, error_vec[j]->size());
-      ceres::CostFunction * cost_function = new LocalCostFunction(error_vec[j], ceres::DO_NOT_TAKE_OWNERSHIP, 3 * error_vec[j]->size());
+      // The cost function takes ownership of the error, the samples stay in the arena
+      ceres::CostFunction * cost_function = new LocalCostFunction(new LocalModelError(samples, depth_error_function),
+                                                                  3 * bin_size);
       problem.AddResidualBlock(cost_function, NULL,
                                local_model_->matrix()->at(x_index, y_index).data(),
                                local_model_->matrix()->at(x_index, y_index + 1).data(),
@@ -430,26 +809,102 @@ void DepthUndistortionEstimation::optimizeLocalModel(const Polynomial<double, 2>
 
   ceres::Solver::Options options;
   options.linear_solver_type = ceres::SPARSE_NORMAL_CHOLESKY;
-  options.max_num_iterations = 10;
+  options.max_num_iterations = max_iterations;
   options.minimizer_progress_to_stdout = true;
-  options.num_threads = 8;
+  options.num_threads = max_threads_;
 
   ceres::Solver::Summary summary;
   ceres::Solve(options, &problem, &summary);
+  Profiler::instance().addSolverSummary("undistortion/optimize_local_model", summary);
+
+}
+
+void DepthUndistortionEstimation::refineLocalModel(int max_iterations)
+{
+  Profiler::ScopedTimer timer("undistortion/refine_local_model");
+
+  extractPlanes();
+
+  // Same target as estimateLocalModel(): the plane fitted on the raw points at the center of the inliers
+  const Size1 size = data_vec_.size();
+  std::vector<PlaneInfo> plane_infos(size);
+
+#pragma omp parallel for schedule(dynamic, 1) num_threads(max_threads_)
+  for (Size1 i = 0; i < size; ++i)
+  {
+    const DepthData & data = *data_vec_[i];
+    if (not data.plane_extracted_)
+      continue;
+
+    const PCLCloud3::ConstPtr cloud = data.cloud();
+    std::vector<int> indices;
+    centralIndices(*data.estimated_plane_.indices_, cloud->width, cloud->height, indices);
 
-  for (Size1 i = 0; i < all_errors_vec.size(); ++i)
-    delete all_errors_vec[i];
+    plane_infos[i] = data.estimated_plane_;
+    plane_infos[i].plane_ = PlaneFit<Scalar>::fit(PCLConversion<Scalar>::toPointMatrix(*cloud, indices));
+  }
+
+  plane_info_map_.clear();
+  for (Size1 i = 0; i < size; ++i)
+    if (data_vec_[i]->plane_extracted_)
+      plane_info_map_[data_vec_[i]] = plane_infos[i];
 
+  optimizeLocalModel(depth_error_function_, max_iterations);
+
+  // extractPlanes() only sets the frames it finds a plane in
+  for (Size1 i = 0; i < size; ++i)
+  {
+    data_vec_[i]->plane_extracted_ = false;
+    data_vec_[i]->undistorted_region_ = CloudRegion();
+  }
+  extractPlanes();
 }
 
-void DepthUndistortionEstimation::estimateGlobalModel()
+PCLCloud3::ConstPtr DepthUndistortionEstimation::undistortedCloud(const DepthData & data) const
+{
+  if (not data.plane_extracted_)
+    return PCLCloud3::ConstPtr();
+
+  // Same model as extractPlanes(): the local model is not changed afterwards
+  PCLCloud3::Ptr und_cloud = boost::make_shared<PCLCloud3>();
+  undistortCloud(*data.cloud(), local_fit_->model(), *und_cloud);
+  return und_cloud;
+}
+
+void DepthUndistortionEstimation::extractPlanes()
+{
+  if (not evict_clouds_)
+  {
+    extractPlanes(0, data_vec_.size());
+    return;
+  }
+
+  const Size1 size = data_vec_.size();
+  const Size1 block_size = 4 * max_threads_;
+  for (Size1 begin = 0; begin < size; begin += block_size)
+  {
+    const Size1 end = std::min(begin + block_size, size);
+    extractPlanes(begin, end);
+    for (Size1 i = begin; i < end; ++i)
+      data_vec_[i]->undistorted_region_ = CloudRegion();
+  }
+}
+
+void DepthUndistortionEstimation::extractPlanes(Size1 begin,
+                                                Size1 end)
 {
-#pragma omp parallel for
-  for (size_t i = 0; i < data_vec_.size(); ++i)
+  Profiler::ScopedTimer timer("undistortion/extract_planes");
+
+  std::vector<PCLCloud3::Ptr> region_clouds(max_threads_);
+  for (Size1 th = 0; th < max_threads_; ++th)
+    region_clouds[th] = boost::make_shared<PCLCloud3>();
+
+#pragma omp parallel for schedule(dynamic, 1) num_threads(max_threads_)
+  for (size_t i = begin; i < end; ++i)
   {
     DepthData & data = *data_vec_[i];
     const Checkerboard & gt_cb = *data.checkerboard_;
-    const PCLCloud3 & cloud = *data.cloud_;
+    const PCLCloud3::ConstPtr cloud = data.cloud();
 
     Point3 und_color_cb_center = gt_cb.center();
     InverseGlobalMatrixEigen inverse_global(inverse_global_fit_->model());
@@ -457,30 +912,192 @@ void DepthUndistortionEstimation::estimateGlobalModel()
 
 //    RGBD_INFO(data.id_, " - Transformed z: " << gt_cb.center().z() << " -> " << und_color_cb_center.z());
 
-    PCLCloud3::Ptr und_cloud = boost::make_shared<PCLCloud3>(cloud);
-    LocalMatrixPCL local(local_fit_->model());
-    local.undistort(*und_cloud);
+    // The plane is searched among the points around the checkerboard only, undistorted in the thread buffer
+    const PCLCloud3::Ptr & region_cloud = region_clouds[omp_get_thread_num()];
+    CloudRegion region;
+    undistortRegion(*cloud, local_fit_->model(), und_color_cb_center, REGION_RADIUS_FACTOR * searchRadius(gt_cb),
+                    region_cloud, region);
 
     PlaneInfo plane_info;
 
-    if (extractPlane(gt_cb, und_cloud, und_color_cb_center, plane_info))
+    if (extractPlane(gt_cb, region, und_color_cb_center, plane_info))
     {
+      // Only the region is kept for the next passes
+      region.cloud_ = boost::make_shared<PCLCloud3>(*region_cloud);
+
       data.estimated_plane_ = plane_info;
-      data.undistorted_cloud_ = und_cloud;
+      data.undistorted_region_ = region;
       data.plane_extracted_ = true;
+    }
+    else
+      RGBD_WARN(data.id_, "Plane not extracted!!");
+
+  }
+}
+
+void DepthUndistortionEstimation::sampleInliers(const DepthData & data,
+                                                std::vector<CellSamples> & samples) const
+{
+  const Indices & inliers = *data.estimated_plane_.indices_;
+  const Size1 size = inliers.size();
+
+  samples.clear();
+  if (size <= global_sample_budget_)
+  {
+    samples.resize(1);
+    samples[0].indices_ = inliers;
+    samples[0].weight_ = 1.0;
+    return;
+  }
+
+  // Bucket the inliers by cell (counting sort)
+  const int GRID = 8;
+  const int width = data.undistorted_region_.width_;
+  const int height = data.undistorted_region_.height_;
+
+  std::vector<int> cell(size);
+  std::vector<Size1> cell_begin(GRID * GRID + 1, 0);
+  for (Size1 i = 0; i < size; ++i)
+  {
+    const int x = inliers[i] % width;
+    const int y = inliers[i] / width;
+    cell[i] = (y * GRID / height) * GRID + x * GRID / width;
+    ++cell_begin[cell[i] + 1];
+  }
+  for (int c = 0; c < GRID * GRID; ++c)
+    cell_begin[c + 1] += cell_begin[c];
+
+  Indices bucketed(size);
+  std::vector<Size1> next(cell_begin.begin(), cell_begin.end() - 1);
+  for (Size1 i = 0; i < size; ++i)
+    bucketed[next[cell[i]]++] = inliers[i];
+
+  // Balanced allocation: from the smallest cell up, each cell gets an even share of what is left, at most all its
+  // inliers. The quotas sum up to global_sample_budget_ since there are more inliers than that.
+  std::vector<std::pair<Size1, int> > cell_sizes;
+  for (int c = 0; c < GRID * GRID; ++c)
+  {
+    if (cell_begin[c + 1] > cell_begin[c])
+      cell_sizes.push_back(std::make_pair(cell_begin[c + 1] - cell_begin[c], c));
+  }
+  std::sort(cell_sizes.begin(), cell_sizes.end());
+
+  std::vector<Size1> quota(GRID * GRID, 0);
+  Size1 left = global_sample_budget_;
+  for (Size1 k = 0; k < cell_sizes.size(); ++k)
+  {
+    quota[cell_sizes[k].second] = std::min(cell_sizes[k].first, left / (cell_sizes.size() - k));
+    left -= quota[cell_sizes[k].second];
+  }
+
+  // Seeded per frame: the result does not depend on the thread, nor on the order the frames are visited
+  boost::random::mt19937 random_gen(sampling_seed_ + 2654435761u * data.id_);
+
+  for (int c = 0; c < GRID * GRID; ++c)
+  {
+    if (quota[c] == 0)
+      continue;
+
+    samples.push_back(CellSamples());
+    CellSamples & cell_samples = samples.back();
+    cell_samples.indices_.reserve(quota[c]);
+    cell_samples.weight_ = Scalar(cell_begin[c + 1] - cell_begin[c]) / quota[c];
+
+    // Partial Fisher-Yates shuffle of the cell
+    for (Size1 k = 0; k < quota[c]; ++k)
+    {
+      boost::random::uniform_int_distribution<Size1> random_index(cell_begin[c] + k, cell_begin[c + 1] - 1);
+      std::swap(bucketed[cell_begin[c] + k], bucketed[random_index(random_gen)]);
+      cell_samples.indices_.push_back(bucketed[cell_begin[c] + k]);
+    }
+  }
+}
+
+void DepthUndistortionEstimation::estimateGlobalModel()
+{
+  Profiler::ScopedTimer timer("undistortion/global_model");
+
+  // With evict_clouds_ only a few undistorted regions per thread are alive at once
+  const Size1 size = data_vec_.size();
+  const Size1 block_size = evict_clouds_ ? 4 * max_threads_ : size;
+
+  // Whole cloud that is NaN but at the samples of the frame being accumulated, copied from its region
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  const PCLPoint3 bad_point(nan, nan, nan);
+  PCLCloud3 und_cloud;
+  und_cloud.is_dense = false;
+
+  const Size2 matrix_size = global_fit_->model()->matrix()->size();
 
-#pragma omp critical
+  for (Size1 begin = 0; begin < size; begin += block_size)
+  {
+    const Size1 end = std::min(begin + block_size, size);
+    extractPlanes(begin, end);
+
+    std::vector<std::vector<CellSamples> > samples(end - begin);
+    if (global_sample_budget_ > 0)
+    {
+#pragma omp parallel for schedule(dynamic, 1) num_threads(max_threads_)
+      for (int i = begin; i < static_cast<int>(end); ++i)
       {
-        Indices reduced = *plane_info.indices_;
-        std::random_shuffle(reduced.begin(), reduced.end());
-        //reduced.resize(reduced.size() / 5);
-        global_fit_->accumulateCloud(*und_cloud, reduced);
-        global_fit_->addAccumulatedPoints(gt_cb.plane());
+        if (data_vec_[i]->plane_extracted_)
+          sampleInliers(*data_vec_[i], samples[i - begin]);
       }
     }
-    else
-      RGBD_WARN(data.id_, "Plane not extracted!!");
 
+    for (size_t i = begin; i < end; ++i)
+    {
+      DepthData & data = *data_vec_[i];
+      if (not data.plane_extracted_)
+        continue;
+
+      const CloudRegion & region = data.undistorted_region_;
+      if (static_cast<int>(und_cloud.width) != region.width_ or static_cast<int>(und_cloud.height) != region.height_)
+      {
+        und_cloud.points.assign(region.width_ * region.height_, bad_point);
+        und_cloud.width = region.width_;
+        und_cloud.height = region.height_;
+      }
+
+      // Without a budget all the inliers are a single cell of weight 1
+      const Size1 cells = global_sample_budget_ > 0 ? samples[i - begin].size() : 1;
+      Size1 frame_samples = 0;
+      for (Size1 c = 0; c < cells; ++c)
+      {
+        const Indices & indices = global_sample_budget_ > 0 ? samples[i - begin][c].indices_ : *data.estimated_plane_.indices_;
+        const Scalar weight = global_sample_budget_ > 0 ? samples[i - begin][c].weight_ : 1.0;
+        frame_samples += indices.size();
+
+        for (Size1 j = 0; j < indices.size(); ++j)
+          und_cloud.points[indices[j]] = region.atFullIndex(indices[j]);
+
+        std::vector<Size1> bin_sizes;
+        if (weight != 1.0)
+        {
+          for (Size1 node = 0; node < matrix_size.x() * matrix_size.y(); ++node)
+            bin_sizes.push_back(global_fit_->getSamples(node % matrix_size.x(), node / matrix_size.x()).size());
+        }
+
+        global_fit_->accumulateCloud(und_cloud, indices);
+        global_fit_->addAccumulatedPoints(data.checkerboard_->plane());
+
+        // The samples just added stand for weight inliers each
+        for (Size1 node = 0; node < bin_sizes.size(); ++node)
+        {
+          GlobalMatrixFitPCL::DataBin & bin = global_fit_->getSamples(node % matrix_size.x(), node / matrix_size.x());
+          for (Size1 k = bin_sizes[node]; k < bin.size(); ++k)
+            bin[k].weight_ *= weight;
+        }
+
+        for (Size1 j = 0; j < indices.size(); ++j)
+          und_cloud.points[indices[j]] = bad_point;
+      }
+      Profiler::instance().addToHistogram("undistortion/global_samples", frame_samples);
+      std::vector<CellSamples>().swap(samples[i - begin]);
+
+      if (evict_clouds_)
+        data.undistorted_region_ = CloudRegion();
+    }
   }
   global_fit_->update();
 
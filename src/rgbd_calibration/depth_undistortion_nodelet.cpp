@@ -0,0 +1,242 @@
+/*
+ *  Copyright (c) 2013-2014, Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *     3. Neither the name of the copyright holder(s) nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+
+#include <pluginlib/class_list_macros.h>
+
+#include <cv_bridge/cv_bridge.h>
+#include <pcl_ros/point_cloud.h>
+#include <pcl_conversions/pcl_conversions.h>
+
+#include <kinect/depth/polynomial_matrix_io.h>
+
+#include <rgbd_calibration/depth_undistortion_nodelet.h>
+
+namespace calibration
+{
+
+DepthUndistortionNodelet::DepthUndistortionNodelet()
+  : publish_cloud_(true),
+    stats_period_(10.0),
+    stats_frames_(0),
+    stats_processing_sum_(0.0),
+    stats_processing_max_(0.0),
+    stats_latency_sum_(0.0),
+    stats_latency_max_(0.0)
+{
+  // Do nothing
+}
+
+void DepthUndistortionNodelet::onInit()
+{
+  ros::NodeHandle & node_handle = getNodeHandle();
+  ros::NodeHandle & private_node_handle = getPrivateNodeHandle();
+
+  std::string model_file;
+  private_node_handle.param("model_file", model_file, std::string());
+  if (model_file.empty() and not private_node_handle.getParam("local_matrix_file", local_matrix_file_))
+    NODELET_FATAL("Missing \"model_file\" or \"local_matrix_file\" parameter!!");
+
+  private_node_handle.param("global_matrix_file", global_matrix_file_, std::string());
+  private_node_handle.param("publish_cloud", publish_cloud_, true);
+
+  private_node_handle.param("stats_period", stats_period_, 10.0);
+  if (stats_period_ < 0.0)
+  {
+    NODELET_WARN("Parameter \"stats_period\" < 0. Setting it to 0 (disabled).");
+    stats_period_ = 0.0;
+  }
+
+  if (not model_file.empty())
+  {
+    ModelFile::Ptr file = boost::make_shared<ModelFile>();
+    if (not file->open(model_file))
+    {
+      NODELET_FATAL_STREAM("Cannot read model " << model_file << "!!");
+      return;
+    }
+    local_data_ = file->localMatrix();
+    global_data_ = file->globalMatrix();
+    model_file_ = file;
+  }
+  else
+  {
+    PolynomialUndistortionMatrixIO<LocalPolynomial> local_io;
+    if (not local_io.read(local_data_, local_matrix_file_))
+    {
+      NODELET_FATAL_STREAM("File " << local_matrix_file_ << " not found!!");
+      return;
+    }
+  }
+
+  if (not model_file_ and not global_matrix_file_.empty())
+  {
+    PolynomialUndistortionMatrixIO<GlobalPolynomial> global_io;
+    if (not global_io.read(global_data_, global_matrix_file_))
+    {
+      NODELET_FATAL_STREAM("File " << global_matrix_file_ << " not found!!");
+      return;
+    }
+  }
+
+  image_transport_ = boost::make_shared<image_transport::ImageTransport>(node_handle);
+  depth_pub_ = image_transport_->advertise("depth_und/image_raw", 1);
+  if (publish_cloud_)
+    cloud_pub_ = node_handle.advertise<PCLCloud3>("depth_und/points", 1);
+
+  depth_sub_ = image_transport_->subscribeCamera("depth/image_raw", 1, &DepthUndistortionNodelet::depthCallback, this);
+
+  stats_start_ = ros::WallTime::now();
+}
+
+bool DepthUndistortionNodelet::updateKernel(const sensor_msgs::CameraInfo::ConstPtr & info_msg,
+                                            int cols,
+                                            int rows)
+{
+  if (not camera_model_ or info_msg->K != camera_info_msg_->K or info_msg->D != camera_info_msg_->D)
+  {
+    camera_info_msg_ = info_msg;
+    camera_model_ = boost::make_shared<KinectDepthCameraModel>(*info_msg);
+  }
+
+  if (publish_cloud_)
+    ray_table_.update(*camera_model_, cols, rows);
+
+  if (kernel_.cols() == cols and kernel_.rows() == rows)
+    return true;
+
+  // The kernel of the model file is used in place if it was baked for this resolution
+  if (model_file_ and model_file_->hasKernel() and static_cast<int>(model_file_->header().cols_) == cols
+      and static_cast<int>(model_file_->header().rows_) == rows and kernel_.load(model_file_))
+  {
+    NODELET_INFO_STREAM("Undistortion kernel mapped for " << cols << "x" << rows << " depth images (" << kernel_.profile()
+                        << " profile).");
+    return true;
+  }
+
+  LocalModel::Ptr local_model = boost::make_shared<LocalModel>(Size2(cols, rows));
+  local_model->setMatrix(local_data_);
+
+  GlobalModel::Ptr global_model;
+  if (global_data_)
+  {
+    global_model = boost::make_shared<GlobalModel>(Size2(cols, rows));
+    global_model->setMatrix(global_data_);
+  }
+
+  kernel_.build(local_model, global_model, cols, rows);
+  NODELET_INFO_STREAM("Undistortion kernel built for " << cols << "x" << rows << " depth images (" << kernel_.profile()
+                      << " profile).");
+
+  return true;
+}
+
+void DepthUndistortionNodelet::depthCallback(const sensor_msgs::Image::ConstPtr & depth_msg,
+                                             const sensor_msgs::CameraInfo::ConstPtr & info_msg)
+{
+  ros::WallTime start = ros::WallTime::now();
+
+  cv_bridge::CvImageConstPtr depth_ptr;
+  try
+  {
+    depth_ptr = cv_bridge::toCvShare(depth_msg);
+  }
+  catch (cv_bridge::Exception & ex)
+  {
+    NODELET_ERROR_STREAM_THROTTLE(5.0, "cv_bridge exception: " << ex.what());
+    return;
+  }
+
+  const cv::Mat & depth = depth_ptr->image;
+  if (depth.type() != CV_16UC1 and depth.type() != CV_32FC1)
+  {
+    NODELET_ERROR_STREAM_THROTTLE(5.0, "Unsupported depth encoding \"" << depth_msg->encoding << "\".");
+    return;
+  }
+
+  if (not updateKernel(info_msg, depth.cols, depth.rows))
+    return;
+
+  // Undistort directly into the buffer of the outgoing message.
+  sensor_msgs::ImagePtr und_msg = boost::make_shared<sensor_msgs::Image>();
+  und_msg->header = depth_msg->header;
+  und_msg->encoding = depth_msg->encoding;
+  und_msg->is_bigendian = depth_msg->is_bigendian;
+  und_msg->width = depth.cols;
+  und_msg->height = depth.rows;
+  und_msg->step = depth.cols * depth.elemSize();
+  und_msg->data.resize(und_msg->step * depth.rows);
+
+  cv::Mat und_depth(depth.rows, depth.cols, depth.type(), und_msg->data.data(), und_msg->step);
+  kernel_.apply(depth, und_depth);
+
+  if (publish_cloud_ and cloud_pub_.getNumSubscribers() > 0)
+  {
+    PCLCloud3::Ptr cloud = boost::make_shared<PCLCloud3>();
+    ray_table_.toCloud(und_depth, *cloud);
+    pcl_conversions::toPCL(depth_msg->header, cloud->header);
+    cloud_pub_.publish(cloud);
+  }
+
+  depth_pub_.publish(und_msg);
+
+  updateStats((ros::WallTime::now() - start).toSec(), (ros::Time::now() - depth_msg->header.stamp).toSec());
+}
+
+void DepthUndistortionNodelet::updateStats(double processing_time,
+                                           double latency)
+{
+  NODELET_DEBUG_STREAM("Frame processed in " << processing_time * 1000.0 << " ms (latency " << latency * 1000.0 << " ms).");
+
+  if (stats_period_ == 0.0)
+    return;
+
+  ++stats_frames_;
+  stats_processing_sum_ += processing_time;
+  stats_processing_max_ = std::max(stats_processing_max_, processing_time);
+  stats_latency_sum_ += latency;
+  stats_latency_max_ = std::max(stats_latency_max_, latency);
+
+  double elapsed = (ros::WallTime::now() - stats_start_).toSec();
+  if (elapsed < stats_period_)
+    return;
+
+  NODELET_INFO_STREAM(stats_frames_ / elapsed << " Hz, processing "
+                      << stats_processing_sum_ * 1000.0 / stats_frames_ << " ms (max " << stats_processing_max_ * 1000.0 << " ms), "
+                      << "latency " << stats_latency_sum_ * 1000.0 / stats_frames_ << " ms (max " << stats_latency_max_ * 1000.0 << " ms)");
+
+  stats_start_ = ros::WallTime::now();
+  stats_frames_ = 0;
+  stats_processing_sum_ = stats_processing_max_ = 0.0;
+  stats_latency_sum_ = stats_latency_max_ = 0.0;
+}
+
+} /* namespace calibration */
+
+PLUGINLIB_EXPORT_CLASS(calibration::DepthUndistortionNodelet, nodelet::Nodelet)
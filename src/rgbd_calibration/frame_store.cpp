@@ -0,0 +1,213 @@
+/*
+ *  Copyright (c) 2013-2014, Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *     3. Neither the name of the copyright holder(s) nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <ros/ros.h>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <rgbd_calibration/frame_store.h>
+
+namespace calibration
+{
+
+FrameStore::FrameStore()
+{
+  // Do nothing
+}
+
+FrameStore::~FrameStore()
+{
+  close();
+}
+
+bool FrameStore::open(const std::string & file_name)
+{
+  close();
+
+  file_.open(file_name.c_str(), std::ios::binary | std::ios::out | std::ios::trunc);
+  if (not file_.is_open())
+  {
+    ROS_ERROR_STREAM("Cannot open " << file_name << " for writing!");
+    return false;
+  }
+
+  try
+  {
+    file_mapping_ = boost::interprocess::file_mapping(file_name.c_str(), boost::interprocess::read_only);
+  }
+  catch (const boost::interprocess::interprocess_exception & ex)
+  {
+    ROS_ERROR_STREAM("Cannot map " << file_name << ": " << ex.what());
+    file_.close();
+    return false;
+  }
+
+  file_name_ = file_name;
+  return true;
+}
+
+void FrameStore::close()
+{
+  if (not file_.is_open())
+    return;
+
+  file_.close();
+  file_mapping_ = boost::interprocess::file_mapping();
+  std::remove(file_name_.c_str());
+  offsets_.clear();
+  sizes_.clear();
+}
+
+int FrameStore::add(const cv::Mat & image,
+                    const PCLCloud3 & cloud)
+{
+  assert(cloud.isOrganized());
+
+  // Everything is converted outside the critical section, only the write is serialized
+  const cv::Mat continuous_image = image.isContinuous() ? image : image.clone();
+
+  FrameHeader header;
+  header.image_rows_ = continuous_image.rows;
+  header.image_cols_ = continuous_image.cols;
+  header.image_type_ = continuous_image.type();
+  header.cloud_width_ = cloud.width;
+  header.cloud_height_ = cloud.height;
+
+  std::vector<float> xyz(3 * cloud.size());
+  for (size_t i = 0; i < cloud.size(); ++i)
+  {
+    xyz[3 * i + 0] = cloud.points[i].x;
+    xyz[3 * i + 1] = cloud.points[i].y;
+    xyz[3 * i + 2] = cloud.points[i].z;
+  }
+
+  const size_t image_size = continuous_image.total() * continuous_image.elemSize();
+  const size_t cloud_size = xyz.size() * sizeof(float);
+
+  int index = -1;
+#pragma omp critical (frame_store)
+  {
+    const boost::uint64_t offset = file_.tellp();
+    file_.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file_.write(reinterpret_cast<const char *>(continuous_image.data), image_size);
+    file_.write(reinterpret_cast<const char *>(xyz.data()), cloud_size);
+    file_.flush();
+
+    if (file_.good())
+    {
+      index = offsets_.size();
+      offsets_.push_back(offset);
+      sizes_.push_back(sizeof(header) + image_size + cloud_size);
+    }
+  }
+
+  if (index < 0)
+    ROS_ERROR_STREAM("Cannot write frame to " << file_name_ << "!");
+
+  return index;
+}
+
+const char * FrameStore::map(size_t index,
+                             boost::interprocess::mapped_region & region) const
+{
+  boost::uint64_t offset = 0, size = 0;
+#pragma omp critical (frame_store)
+  {
+    if (index < offsets_.size())
+    {
+      offset = offsets_[index];
+      size = sizes_[index];
+    }
+  }
+
+  if (size == 0)
+    return NULL;
+
+  try
+  {
+    region = boost::interprocess::mapped_region(file_mapping_, boost::interprocess::read_only, offset, size);
+  }
+  catch (const boost::interprocess::interprocess_exception & ex)
+  {
+    ROS_ERROR_STREAM("Cannot map frame " << index << " of " << file_name_ << ": " << ex.what());
+    return NULL;
+  }
+
+  return static_cast<const char *>(region.get_address());
+}
+
+bool FrameStore::readImage(size_t index,
+                           cv::Mat & image) const
+{
+  boost::interprocess::mapped_region region;
+  const char * data = map(index, region);
+  if (not data)
+    return false;
+
+  FrameHeader header;
+  std::memcpy(&header, data, sizeof(header));
+
+  // The mapping is released on return: copy the pixels
+  cv::Mat(header.image_rows_, header.image_cols_, header.image_type_,
+          const_cast<char *>(data + sizeof(header))).copyTo(image);
+  return true;
+}
+
+bool FrameStore::readCloud(size_t index,
+                           PCLCloud3 & cloud) const
+{
+  boost::interprocess::mapped_region region;
+  const char * data = map(index, region);
+  if (not data)
+    return false;
+
+  FrameHeader header;
+  std::memcpy(&header, data, sizeof(header));
+
+  const size_t image_size = size_t(header.image_rows_) * header.image_cols_ * CV_ELEM_SIZE(header.image_type_);
+  const char * xyz = data + sizeof(header) + image_size;
+
+  cloud.points.resize(header.cloud_width_ * header.cloud_height_);
+  cloud.width = header.cloud_width_;
+  cloud.height = header.cloud_height_;
+  cloud.is_dense = false;
+
+  // The floats are not aligned in the file
+  float point[3];
+  for (size_t i = 0; i < cloud.points.size(); ++i)
+  {
+    std::memcpy(point, xyz + i * sizeof(point), sizeof(point));
+    cloud.points[i].x = point[0];
+    cloud.points[i].y = point[1];
+    cloud.points[i].z = point[2];
+  }
+  return true;
+}
+
+} /* namespace calibration */
@@ -0,0 +1,295 @@
+/*
+ *  Copyright (c) 2013-2014, Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *     3. Neither the name of the copyright holder(s) nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include <ros/ros.h>
+
+#include <rgbd_calibration/undistortion_kernel.h>
+#include <rgbd_calibration/model_file.h>
+
+namespace calibration
+{
+
+const char ModelFile::MAGIC[8] = {'R', 'G', 'B', 'D', 'M', 'O', 'D', 'L'};
+
+namespace
+{
+
+// Pads file with zeros up to the next multiple of ModelFile::ALIGNMENT and returns the new position.
+boost::uint64_t
+align(std::ofstream & file)
+{
+  static const char ZEROS[ModelFile::ALIGNMENT] = {0};
+  const boost::uint64_t position = file.tellp();
+  const boost::uint64_t padding = (ModelFile::ALIGNMENT - position % ModelFile::ALIGNMENT) % ModelFile::ALIGNMENT;
+  file.write(ZEROS, padding);
+  return position + padding;
+}
+
+// True if count elements of element_size bytes at offset are within a file of file_size bytes, without overflows.
+bool
+arrayFits(boost::uint64_t offset,
+          boost::uint64_t count,
+          boost::uint64_t element_size,
+          boost::uint64_t file_size)
+{
+  return offset <= file_size and count <= (file_size - offset) / element_size;
+}
+
+template <typename ModelT>
+  boost::uint64_t
+  writeMatrix(std::ofstream & file,
+              const ModelT & model,
+              int size)
+  {
+    const typename ModelT::Data & matrix = *model.matrix();
+
+    ModelFile::MatrixHeader header;
+    header.matrix_cols_ = matrix.size().x();
+    header.matrix_rows_ = matrix.size().y();
+    header.bin_cols_ = model.binSize().x();
+    header.bin_rows_ = model.binSize().y();
+
+    const boost::uint64_t offset = align(file);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    header.data_offset_ = align(file);
+
+    std::vector<double> coefficients(size * matrix.size().x() * matrix.size().y());
+    for (int y = 0; y < matrix.size().y(); ++y)
+      for (int x = 0; x < matrix.size().x(); ++x)
+        for (int k = 0; k < size; ++k)
+          coefficients[size * (x + y * matrix.size().x()) + k] = matrix.at(x, y)[k];
+    file.write(reinterpret_cast<const char *>(coefficients.data()), coefficients.size() * sizeof(double));
+
+    // The data offset is known only now
+    const boost::uint64_t end = file.tellp();
+    file.seekp(offset);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.seekp(end);
+
+    return offset;
+  }
+
+} /* namespace */
+
+ModelFile::ModelFile()
+{
+  // Do nothing
+}
+
+bool ModelFile::write(const std::string & file_name,
+                      const LocalModel::ConstPtr & local_model,
+                      const GlobalModel::ConstPtr & global_model,
+                      int cols,
+                      int rows,
+                      bool write_kernel)
+{
+  // The models are rebuilt for the sensor resolution: bin sizes and kernel are those of cols x rows images
+  const Size2 resolution(cols, rows);
+  LocalModel::Ptr sensor_local_model = boost::make_shared<LocalModel>(resolution);
+  sensor_local_model->setMatrix(local_model->matrix());
+
+  GlobalModel::Ptr sensor_global_model = boost::make_shared<GlobalModel>(resolution);
+  if (global_model)
+    sensor_global_model->setMatrix(global_model->matrix());
+  else
+    sensor_global_model->setMatrix(boost::make_shared<GlobalModel::Data>(Size2(2, 2), GlobalPolynomial::IdentityCoefficients()));
+
+  std::ofstream file(file_name.c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+  if (not file.is_open())
+  {
+    ROS_ERROR_STREAM("Cannot open " << file_name << " for writing!");
+    return false;
+  }
+
+  FileHeader header;
+  std::memcpy(header.magic_, MAGIC, sizeof(header.magic_));
+  header.version_ = VERSION;
+  header.cols_ = cols;
+  header.rows_ = rows;
+  header.local_degree_ = MathTraits<LocalPolynomial>::Degree;
+  header.local_min_degree_ = MathTraits<LocalPolynomial>::MinDegree;
+  header.global_degree_ = MathTraits<GlobalPolynomial>::Degree;
+  header.global_min_degree_ = MathTraits<GlobalPolynomial>::MinDegree;
+  header.kernel_offset_ = 0;
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+  header.local_offset_ = writeMatrix(file, *sensor_local_model, MathTraits<LocalPolynomial>::Size);
+  header.global_offset_ = writeMatrix(file, *sensor_global_model, MathTraits<GlobalPolynomial>::Size);
+
+  if (write_kernel)
+  {
+    UndistortionKernel kernel;
+    kernel.build(sensor_local_model, sensor_global_model, cols, rows);
+
+    KernelHeader kernel_header;
+    kernel_header.local_size_ = UndistortionKernel::LOCAL_SIZE;
+    kernel_header.global_size_ = UndistortionKernel::GLOBAL_SIZE;
+    kernel_header.plane_stride_ = (cols * rows * sizeof(float) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+
+    header.kernel_offset_ = align(file);
+    file.write(reinterpret_cast<const char *>(&kernel_header), sizeof(kernel_header));
+    kernel_header.data_offset_ = align(file);
+
+    for (int k = 0; k < UndistortionKernel::LOCAL_SIZE; ++k)
+    {
+      file.write(reinterpret_cast<const char *>(kernel.localPlane(k)), cols * rows * sizeof(float));
+      align(file);
+    }
+    for (int k = 0; k < UndistortionKernel::GLOBAL_SIZE; ++k)
+    {
+      file.write(reinterpret_cast<const char *>(kernel.globalPlane(k)), cols * rows * sizeof(float));
+      align(file);
+    }
+
+    file.seekp(header.kernel_offset_);
+    file.write(reinterpret_cast<const char *>(&kernel_header), sizeof(kernel_header));
+  }
+
+  file.seekp(0);
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+  return file.good();
+}
+
+bool ModelFile::open(const std::string & file_name)
+{
+  try
+  {
+    file_mapping_ = boost::interprocess::file_mapping(file_name.c_str(), boost::interprocess::read_only);
+    region_ = boost::interprocess::mapped_region(file_mapping_, boost::interprocess::read_only);
+  }
+  catch (const boost::interprocess::interprocess_exception & ex)
+  {
+    ROS_ERROR_STREAM("Cannot map " << file_name << ": " << ex.what());
+    return false;
+  }
+
+  const boost::uint64_t size = region_.get_size();
+  if (size < sizeof(FileHeader) or std::memcmp(header().magic_, MAGIC, sizeof(MAGIC)) != 0
+      or header().version_ != VERSION)
+  {
+    ROS_ERROR_STREAM(file_name << " is not an undistortion model file (version " << VERSION << ")!");
+    region_ = boost::interprocess::mapped_region();
+    return false;
+  }
+
+  const FileHeader & file_header = header();
+  if (static_cast<int>(file_header.local_degree_) != MathTraits<LocalPolynomial>::Degree
+      or static_cast<int>(file_header.local_min_degree_) != MathTraits<LocalPolynomial>::MinDegree
+      or static_cast<int>(file_header.global_degree_) != MathTraits<GlobalPolynomial>::Degree
+      or static_cast<int>(file_header.global_min_degree_) != MathTraits<GlobalPolynomial>::MinDegree)
+  {
+    ROS_ERROR_STREAM(file_name << " has polynomials of other degrees than the ones in globals.h!");
+    region_ = boost::interprocess::mapped_region();
+    return false;
+  }
+
+  // Every section has to be within the file
+  bool valid = arrayFits(file_header.local_offset_, 1, sizeof(MatrixHeader), size)
+               and arrayFits(file_header.global_offset_, 1, sizeof(MatrixHeader), size);
+  for (int i = 0; valid and i < 2; ++i)
+  {
+    const boost::uint64_t offset = i == 0 ? file_header.local_offset_ : file_header.global_offset_;
+    const int coefficients = i == 0 ? MathTraits<LocalPolynomial>::Size : MathTraits<GlobalPolynomial>::Size;
+    const MatrixHeader & matrix_header = *reinterpret_cast<const MatrixHeader *>(at(offset));
+    const boost::uint64_t nodes = static_cast<boost::uint64_t>(matrix_header.matrix_cols_) * matrix_header.matrix_rows_;
+    valid = nodes > 0 and arrayFits(matrix_header.data_offset_, nodes, coefficients * sizeof(double), size);
+  }
+  if (valid and hasKernel())
+  {
+    valid = arrayFits(file_header.kernel_offset_, 1, sizeof(KernelHeader), size);
+  }
+  if (valid and hasKernel())
+  {
+    // The planes are those of this build, globalPlane() starts after local_size_ of them
+    const KernelHeader & kernel_header = *reinterpret_cast<const KernelHeader *>(at(file_header.kernel_offset_));
+    const boost::uint64_t plane_size = static_cast<boost::uint64_t>(file_header.cols_) * file_header.rows_ * sizeof(float);
+    const boost::uint64_t planes = static_cast<boost::uint64_t>(kernel_header.local_size_) + kernel_header.global_size_;
+    valid = kernel_header.local_size_ == static_cast<boost::uint32_t>(UndistortionKernel::LOCAL_SIZE)
+            and kernel_header.global_size_ == static_cast<boost::uint32_t>(UndistortionKernel::GLOBAL_SIZE)
+            and planes > 0 and plane_size > 0 and kernel_header.plane_stride_ >= plane_size
+            and kernel_header.data_offset_ % ALIGNMENT == 0 and kernel_header.plane_stride_ % ALIGNMENT == 0
+            and arrayFits(kernel_header.data_offset_, 1, plane_size, size)
+            and planes - 1 <= (size - kernel_header.data_offset_ - plane_size) / kernel_header.plane_stride_;
+  }
+
+  if (not valid)
+  {
+    ROS_ERROR_STREAM(file_name << " is truncated or corrupt!");
+    region_ = boost::interprocess::mapped_region();
+    return false;
+  }
+
+  return true;
+}
+
+template <typename MatrixT>
+  typename MatrixT::Ptr
+  ModelFile::readMatrix(boost::uint64_t offset,
+                        int size) const
+  {
+    const MatrixHeader & header = *reinterpret_cast<const MatrixHeader *>(at(offset));
+    const double * coefficients = reinterpret_cast<const double *>(at(header.data_offset_));
+
+    typename MatrixT::Ptr matrix = boost::make_shared<MatrixT>(Size2(header.matrix_cols_, header.matrix_rows_));
+    for (Size1 y = 0; y < header.matrix_rows_; ++y)
+      for (Size1 x = 0; x < header.matrix_cols_; ++x)
+        for (int k = 0; k < size; ++k)
+          matrix->at(x, y)[k] = coefficients[size * (x + y * header.matrix_cols_) + k];
+
+    return matrix;
+  }
+
+LocalModel::Data::Ptr ModelFile::localMatrix() const
+{
+  return readMatrix<LocalModel::Data>(header().local_offset_, MathTraits<LocalPolynomial>::Size);
+}
+
+GlobalModel::Data::Ptr ModelFile::globalMatrix() const
+{
+  return readMatrix<GlobalModel::Data>(header().global_offset_, MathTraits<GlobalPolynomial>::Size);
+}
+
+const float * ModelFile::localPlane(int index) const
+{
+  const KernelHeader & kernel_header = *reinterpret_cast<const KernelHeader *>(at(header().kernel_offset_));
+  return reinterpret_cast<const float *>(at(kernel_header.data_offset_ + index * kernel_header.plane_stride_));
+}
+
+const float * ModelFile::globalPlane(int index) const
+{
+  const KernelHeader & kernel_header = *reinterpret_cast<const KernelHeader *>(at(header().kernel_offset_));
+  return reinterpret_cast<const float *>(at(kernel_header.data_offset_
+                                            + (kernel_header.local_size_ + index) * kernel_header.plane_stride_));
+}
+
+} /* namespace calibration */
@@ -6,8 +6,11 @@
  */
 
 #include <boost/filesystem.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
 
 #include <ros/ros.h>
+#include <omp.h>
 
 #include <pcl/io/pcd_io.h>
 
@@ -18,6 +21,7 @@
 
 #include <kinect/depth/polynomial_matrix_io.h>
 #include <rgbd_calibration/offline_calibration_node.h>
+#include <rgbd_calibration/profiler.h>
 
 //#include <swissranger_camera/utility.h>
 #include <pcl/conversions.h>
@@ -46,6 +50,38 @@ OfflineCalibrationNode::OfflineCalibrationNode (ros::NodeHandle & node_handle)
   node_handle_.param("image_filename", image_filename_, std::string("image_"));
   node_handle_.param("cloud_filename", cloud_filename_, std::string("cloud_"));
 
+  node_handle_.param("loader_threads", loader_threads_, 4);
+  if (loader_threads_ < 1)
+  {
+    loader_threads_ = 1;
+    ROS_WARN("\"loader_threads\" cannot be < 1. Using 1.");
+  }
+
+  node_handle_.param("loader_queue_size", loader_queue_size_, 32);
+  if (loader_queue_size_ < loader_threads_)
+  {
+    loader_queue_size_ = loader_threads_;
+    ROS_WARN("\"loader_queue_size\" cannot be < \"loader_threads\". Using \"loader_threads\".");
+  }
+
+  // A dataset file replaces the image and cloud files in "path"
+  std::string dataset_file;
+  if (node_handle_.getParam("dataset_file", dataset_file))
+  {
+    dataset_reader_ = boost::make_shared<DatasetReader>();
+    if (not dataset_reader_->open(dataset_file))
+      ROS_FATAL_STREAM("Cannot read dataset " << dataset_file << "!!");
+  }
+
+  // Timings and counters of the run are written here, empty to disable
+  node_handle_.param("profile_file", profile_file_, path_ + "profile.json");
+
+  // Checkerboard corners are cached here between runs, empty to disable
+  node_handle_.param("checkerboard_cache", cb_cache_file_, path_ + "checkerboard_cache.bin");
+
+  // Out-of-core mode: frames are spooled to this (temporary) file instead of being kept in memory, empty to disable
+  node_handle_.param("frame_store", frame_store_file_, std::string(""));
+
   std::string depth_type_s;
   node_handle_.param("depth_type", depth_type_s, std::string("none"));
   if (depth_type_s == "kinect1_depth")
@@ -56,6 +92,145 @@ OfflineCalibrationNode::OfflineCalibrationNode (ros::NodeHandle & node_handle)
     ROS_FATAL("Missing \"depth_type\" parameter!! Use \"kinect1_depth\" or \"swiss_ranger_depth\"");
 }
 
+RayTable::ConstPtr
+OfflineCalibrationNode::rayTable (int cols,
+                                  int rows) const
+{
+  // Usually all the frames have the same size: the table is built by the first loader only.
+  boost::mutex::scoped_lock lock(ray_table_mutex_);
+  if (not ray_table_ or ray_table_->cols() != cols or ray_table_->rows() != rows)
+  {
+    RayTable::Ptr ray_table = boost::make_shared<RayTable>();
+    ray_table->update(*depth_sensor_->cameraModel(), cols, rows);
+    ray_table_ = ray_table;
+    ROS_DEBUG_STREAM("Ray table built (" << cols << "x" << rows << ").");
+  }
+  return ray_table_;
+}
+
+bool
+OfflineCalibrationNode::loadData (size_t index,
+                                  cv::Mat & image,
+                                  PCLCloud3::Ptr & cloud) const
+{
+  if (not dataset_reader_->readImage(index, image))
+  {
+    ROS_WARN_STREAM("Image " << dataset_reader_->frameInfo(index).id_ << " not valid!");
+    return false;
+  }
+
+  cv::Mat depth;
+  if (not dataset_reader_->readDepth(index, depth))
+  {
+    ROS_WARN_STREAM("Depth " << dataset_reader_->frameInfo(index).id_ << " not valid!");
+    return false;
+  }
+
+  const RayTable::ConstPtr ray_table = rayTable(depth.cols, depth.rows);
+  cloud = boost::make_shared<PCLCloud3>();
+  ray_table->toCloud(depth, *cloud);
+
+  return true;
+}
+
+bool
+OfflineCalibrationNode::loadData (const std::string & image_file,
+                                  const std::string & cloud_file,
+                                  cv::Mat & image,
+                                  PCLCloud3::Ptr & cloud) const
+{
+  image = cv::imread(image_file);
+
+  if (not image.data)
+  {
+    ROS_WARN_STREAM(image_file << " not valid!");
+    return false;
+  }
+
+  pcl::PCDReader pcd_reader;
+  if (depth_type_ == KINECT1_DEPTH)
+  {
+    cloud = boost::make_shared<PCLCloud3>();
+
+    if (pcd_reader.read(cloud_file, *cloud) < 0)
+    {
+      ROS_WARN_STREAM(cloud_file << " not valid!");
+      return false;
+    }
+
+    rayTable(cloud->width, cloud->height)->reproject(*cloud);
+
+    /*for (size_t v = 0; v < cloud->height; ++v)
+    {
+      for (size_t u = 0; u < cloud->width; ++u)
+      {
+        PCLPoint3 & pt = cloud->points[u + v * cloud->width];
+//            pt.x = (u - 314.5) * pt.z / 575.8157348632812;
+//            pt.y = (v - 235.5) * pt.z / 575.8157348632812;
+//            pt.x = (u - 309.7947658766498) * pt.z / 584.3333129882812;
+//            pt.y = (v - 245.9642466885198) * pt.z / 582.8702392578125;
+        pt.x = (u - depth_sensor_->cameraModel()->cx()) * pt.z / depth_sensor_->cameraModel()->fx();
+        pt.y = (v - depth_sensor_->cameraModel()->cy()) * pt.z / depth_sensor_->cameraModel()->fy();
+      }
+    }*/
+
+//        pcl::PCDWriter pcd_writer;
+//        pcd_writer.write(cloud_file + "_rev.pcd", *cloud);
+
+  }
+  else if (depth_type_ == SWISS_RANGER_DEPTH)
+  {
+//        pcl::PCLPointCloud2Ptr pcl_cloud = boost::make_shared<pcl::PCLPointCloud2>();
+//        sensor_msgs::PointCloud2Ptr ros_cloud = boost::make_shared<sensor_msgs::PointCloud2>();
+//        sr::Utility sr_utility;
+//        if (pcd_reader.read(cloud_file, *pcl_cloud) < 0)
+//        {
+//          ROS_WARN_STREAM(cloud_file << " not valid!");
+//          return false;
+//        }
+//        pcl_conversions::fromPCL(*pcl_cloud, *ros_cloud);
+//
+//        sr_utility.setConfidenceThreshold(0.90f);
+//        sr_utility.setInputCloud(ros_cloud);
+//        sr_utility.setIntensityType(sr::Utility::INTENSITY_8BIT);
+//        sr_utility.setConfidenceType(sr::Utility::CONFIDENCE_8BIT);
+//        sr_utility.setNormalizeIntensity(true);
+//        sr_utility.split(sr::Utility::CLOUD);
+//
+//        cloud = sr_utility.cloud();
+  }
+
+  return true;
+}
+
+void
+OfflineCalibrationNode::loaderLoop (FrameLoader & loader,
+                                    const FileVector & file_vec) const
+{
+  boost::mutex::scoped_lock lock(loader.mutex_);
+  while (true)
+  {
+    while (not loader.stop_ and loader.next_ < loader.size_ and loader.next_ >= loader.consumed_ + loader_queue_size_)
+      loader.space_condition_.wait(lock);
+
+    if (loader.stop_ or loader.next_ >= loader.size_)
+      return;
+
+    const Size1 index = loader.next_++;
+    lock.unlock();
+
+    LoadedFrame frame;
+    if (dataset_reader_)
+      frame.loaded_ = loadData(index, frame.image_, frame.cloud_);
+    else
+      frame.loaded_ = loadData(file_vec[index].first, file_vec[index].second, frame.image_, frame.cloud_);
+
+    lock.lock();
+    loader.frames_[index] = frame;
+    loader.ready_condition_.notify_all();
+  }
+}
+
 void
 OfflineCalibrationNode::spin ()
 {
@@ -65,7 +240,7 @@ OfflineCalibrationNode::spin ()
 
   std::map<std::string, std::string> cloud_file_map, image_file_map;
 
-  for (fs::directory_iterator it(path); it != end_it; ++it)
+  for (fs::directory_iterator it(path); not dataset_reader_ and it != end_it; ++it)
   {
     fs::path file = it->path();
     if (fs::is_regular_file(file))
@@ -87,150 +262,144 @@ OfflineCalibrationNode::spin ()
 
   typedef std::map<std::string, std::string>::const_iterator map_iterator;
 
-  int added = 0;
-
-  ROS_INFO("Getting data...");
-  for (map_iterator cloud_it = cloud_file_map.begin(); cloud_it != cloud_file_map.end() and added < instances_; ++cloud_it)
+  FileVector file_vec;
+  for (map_iterator cloud_it = cloud_file_map.begin(); cloud_it != cloud_file_map.end(); ++cloud_it)
   {
     map_iterator image_it = image_file_map.find(cloud_it->first);
     if (image_it != image_file_map.end())
-    {
-      cv::Mat image = cv::imread(image_it->second);
+      file_vec.push_back(std::make_pair(image_it->second, cloud_it->second));
+  }
 
-      if (not image.data)
-      {
-        ROS_WARN_STREAM(image_it->second << " not valid!");
-        continue;
-      }
+  const Size1 size = dataset_reader_ ? dataset_reader_->size() : file_vec.size();
 
-      PCLCloud3::Ptr cloud;
+  int added = 0;
 
-      pcl::PCDReader pcd_reader;
-      if (depth_type_ == KINECT1_DEPTH)
-      {
-        cloud = boost::make_shared<PCLCloud3>();
+  FrameStore::Ptr frame_store;
+  if (not frame_store_file_.empty())
+  {
+    frame_store = boost::make_shared<FrameStore>();
+    if (frame_store->open(frame_store_file_))
+      calibration_->setFrameStore(frame_store);
+    else
+      ROS_WARN_STREAM("Cannot open frame store " << frame_store_file_ << ". Keeping the frames in memory.");
+  }
 
-        if (pcd_reader.read(cloud_it->second, *cloud) < 0)
-        {
-          ROS_WARN_STREAM(cloud_it->second << " not valid!");
-          continue;
-        }
+  ROS_INFO("Getting data...");
+  Profiler & profiler = Profiler::instance();
+  profiler.reset();
+  ros::WallTime start = ros::WallTime::now();
+
+  // Loader threads read the files ahead, while this thread adds them in order as soon as they are ready. At most
+  // loader_queue_size_ files are read ahead, so that only a few unneeded files are loaded once "instances" is reached.
+  FrameLoader loader;
+  loader.size_ = size;
+  loader.next_ = 0;
+  loader.consumed_ = 0;
+  loader.stop_ = false;
+
+  boost::thread_group loader_threads;
+  for (int i = 0; i < loader_threads_; ++i)
+    loader_threads.create_thread(boost::bind(&OfflineCalibrationNode::loaderLoop, this, boost::ref(loader),
+                                             boost::cref(file_vec)));
+
+  while (added < instances_)
+  {
+    std::vector<cv::Mat> images;
+    std::vector<PCLCloud3::ConstPtr> clouds;
 
-        /*const Scalar & fx = depth_sensor_->cameraModel()->fx() * depth_sensor_->cameraModel()->binningX();
-        const Scalar & fy = depth_sensor_->cameraModel()->fy() * depth_sensor_->cameraModel()->binningY();
-        const Scalar & cx = depth_sensor_->cameraModel()->cx() * depth_sensor_->cameraModel()->binningX();
-        const Scalar & cy = depth_sensor_->cameraModel()->cy() * depth_sensor_->cameraModel()->binningY();*/
+    {
+      boost::mutex::scoped_lock lock(loader.mutex_);
+      if (loader.consumed_ >= size)
+        break;
 
-        cv::Matx33d K = /*static_cast<int>(depth_sensor_->cameraModel()->binningX()) **/ depth_sensor_->cameraModel()->fullIntrinsicMatrix();
+      while (loader.frames_.find(loader.consumed_) == loader.frames_.end())
+        loader.ready_condition_.wait(lock);
 
-        for (int j = 0; j < cloud->height; ++j)
+      // Take every frame that is already available in order
+      std::map<Size1, LoadedFrame>::iterator it;
+      while (added + static_cast<int>(images.size()) < instances_
+             and (it = loader.frames_.find(loader.consumed_)) != loader.frames_.end())
+      {
+        if (it->second.loaded_)
         {
-          for (int k = 0; k < cloud->width; ++k)
-          {
-            /*cloud->at(k, j).x = (k - cx) * cloud->at(k, j).z / fx;
-            cloud->at(k, j).y = (j - cy) * cloud->at(k, j).z / fy;*/
-            Scalar z = cloud->at(k, j).z;
-            Point2 normalized_pixel((k - K(0, 2)) / K(0, 0), (j - K(1, 2)) / K(1, 1));
-
-            Point3 p = z * depth_sensor_->cameraModel()->undistort2d_<Scalar>(normalized_pixel).homogeneous();
-
-            cloud->at(k, j).x = p.x();
-            cloud->at(k, j).y = p.y();
-          }
+          images.push_back(it->second.image_);
+          clouds.push_back(it->second.cloud_);
+          ROS_DEBUG_STREAM("Frame " << loader.consumed_ << " added.");
         }
-
-        /*for (size_t v = 0; v < cloud->height; ++v)
+        else
         {
-          for (size_t u = 0; u < cloud->width; ++u)
-          {
-            PCLPoint3 & pt = cloud->points[u + v * cloud->width];
-//            pt.x = (u - 314.5) * pt.z / 575.8157348632812;
-//            pt.y = (v - 235.5) * pt.z / 575.8157348632812;
-//            pt.x = (u - 309.7947658766498) * pt.z / 584.3333129882812;
-//            pt.y = (v - 245.9642466885198) * pt.z / 582.8702392578125;
-            pt.x = (u - depth_sensor_->cameraModel()->cx()) * pt.z / depth_sensor_->cameraModel()->fx();
-            pt.y = (v - depth_sensor_->cameraModel()->cy()) * pt.z / depth_sensor_->cameraModel()->fy();
-          }
-        }*/
-
-//        pcl::PCDWriter pcd_writer;
-//        pcd_writer.write(cloud_it->second + "_rev.pcd", *cloud);
-
-      }
-      else if (depth_type_ == SWISS_RANGER_DEPTH)
-      {
-//        pcl::PCLPointCloud2Ptr pcl_cloud = boost::make_shared<pcl::PCLPointCloud2>();
-//        sensor_msgs::PointCloud2Ptr ros_cloud = boost::make_shared<sensor_msgs::PointCloud2>();
-//        sr::Utility sr_utility;
-//        if (pcd_reader.read(cloud_it->second, *pcl_cloud) < 0)
-//        {
-//          ROS_WARN_STREAM(cloud_it->second << " not valid!");
-//          continue;
-//        }
-//        pcl_conversions::fromPCL(*pcl_cloud, *ros_cloud);
-//
-//        sr_utility.setConfidenceThreshold(0.90f);
-//        sr_utility.setInputCloud(ros_cloud);
-//        sr_utility.setIntensityType(sr::Utility::INTENSITY_8BIT);
-//        sr_utility.setConfidenceType(sr::Utility::CONFIDENCE_8BIT);
-//        sr_utility.setNormalizeIntensity(true);
-//        sr_utility.split(sr::Utility::CLOUD);
-//
-//        cloud = sr_utility.cloud();
+          profiler.increment("offline/frames_not_loaded");
+        }
+        loader.frames_.erase(it);
+        ++loader.consumed_;
       }
+      loader.space_condition_.notify_all();
+    }
 
-      calibration_->addData(image, cloud);
-      ++added;
-
-      if (added == instances_)
-        break;
+    // Downsampling is done for the available frames at once, in parallel, while the next files are loaded
+    if (not images.empty())
+      calibration_->addData(images, clouds);
+    added += images.size();
+  }
 
-      ROS_DEBUG_STREAM("(" << image_it->second << ", " << cloud_it->second << ") added.");
-    }
+  {
+    boost::mutex::scoped_lock lock(loader.mutex_);
+    loader.stop_ = true;
   }
+  loader.space_condition_.notify_all();
+  loader_threads.join_all();
 
+  profiler.addTime("offline/load_data", (ros::WallTime::now() - start).toSec());
+  profiler.increment("offline/frames_added", added);
   ROS_INFO_STREAM(added << " images + point clouds added.");
 
   geometry_msgs::Pose pose_msg;
   tf::poseEigenToMsg(color_sensor_->pose(), pose_msg);
   ROS_INFO_STREAM("Initial transform:\n" << pose_msg);
 
+  CheckerboardCache::Ptr cb_cache;
+  if (not cb_cache_file_.empty())
+  {
+    // A corrupt file is neither used nor overwritten
+    cb_cache = boost::make_shared<CheckerboardCache>();
+    if (cb_cache->load(cb_cache_file_))
+      calibration_->setCheckerboardCache(cb_cache);
+    else
+    {
+      ROS_WARN_STREAM("Invalid checkerboard cache " << cb_cache_file_ << ". Ignoring it.");
+      cb_cache.reset();
+    }
+  }
+
   calibration_->perform();
 
+  if (cb_cache and not cb_cache->save(cb_cache_file_))
+    ROS_WARN_STREAM("Cannot write checkerboard cache " << cb_cache_file_);
+
+  start = ros::WallTime::now();
   PolynomialUndistortionMatrixIO<LocalPolynomial> local_io;
   local_io.write(*calibration_->localModel(), path_ + "local_matrix.txt");
 
+  PolynomialUndistortionMatrixIO<InverseGlobalPolynomial> inverse_global_io;
+  inverse_global_io.write(*calibration_->inverseGlobalModel(), path_ + "inverse_global_matrix.txt");
+  profiler.addTime("offline/write_results", (ros::WallTime::now() - start).toSec());
+
   tf::poseEigenToMsg(color_sensor_->pose(), pose_msg);
   ROS_INFO_STREAM("Estimated transform:\n" << pose_msg);
 
   calibration_->optimize();
 
-  PolynomialUndistortionMatrixIO<GlobalPolynomial> global_io;
-  global_io.write(*calibration_->globalModel(), path_ + "global_matrix.txt");
+  start = ros::WallTime::now();
+  saveOptimizedResults(path_);
+  profiler.addTime("offline/write_results", (ros::WallTime::now() - start).toSec());
 
-  tf::poseEigenToMsg(color_sensor_->pose(), pose_msg);
-  ROS_INFO_STREAM("Optimized transform:\n" << pose_msg);
-
-  std::ofstream transform_file;
-  transform_file.open((path_ + "camera_pose.yaml").c_str());
-  transform_file << pose_msg;
-  transform_file.close();
-
-  const std::vector<double> & depth_intrinsics = calibration_->optimizedIntrinsics();
-
-  ROS_INFO_STREAM("fx = " << depth_sensor_->cameraModel()->binningX() * depth_intrinsics[0]);
-  ROS_INFO_STREAM("fy = " << depth_sensor_->cameraModel()->binningY() * depth_intrinsics[1]);
-  ROS_INFO_STREAM("cx = " << depth_sensor_->cameraModel()->binningX() * depth_intrinsics[2]);
-  ROS_INFO_STREAM("cy = " << depth_sensor_->cameraModel()->binningY() * depth_intrinsics[3]);
-
-  std::ofstream intrinsics_file;
-  intrinsics_file.open((path_ + "depth_intrinsics.yaml").c_str());
-  intrinsics_file << "intrinsics:" << std::endl;
-  intrinsics_file << "  fx: " << depth_sensor_->cameraModel()->binningX() * depth_intrinsics[0] << std::endl;
-  intrinsics_file << "  fy: " << depth_sensor_->cameraModel()->binningY() * depth_intrinsics[1] << std::endl;
-  intrinsics_file << "  cx: " << depth_sensor_->cameraModel()->binningX() * depth_intrinsics[2] << std::endl;
-  intrinsics_file << "  cy: " << depth_sensor_->cameraModel()->binningY() * depth_intrinsics[3] << std::endl;
-  intrinsics_file.close();
+  if (not profile_file_.empty())
+  {
+    if (profiler.writeJSON(profile_file_))
+      ROS_INFO_STREAM("Profile written to " << profile_file_);
+    else
+      ROS_WARN_STREAM("Cannot write profile to " << profile_file_);
+  }
 
 
 //  ros::Rate rate(1.0);
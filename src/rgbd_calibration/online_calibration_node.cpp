@@ -0,0 +1,303 @@
+/*
+ *  Copyright (C) 2013 - Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ros/ros.h>
+
+#include <cv_bridge/cv_bridge.h>
+#include <sensor_msgs/image_encodings.h>
+#include <pcl_conversions/pcl_conversions.h>
+
+#include <kinect/depth/polynomial_matrix_io.h>
+
+#include <rgbd_calibration/CalibrationProgress.h>
+#include <rgbd_calibration/online_calibration_node.h>
+
+using rgbd_calibration::Acquisition;
+using rgbd_calibration::CalibrationProgress;
+
+namespace calibration
+{
+
+OnlineCalibrationNode::OnlineCalibrationNode (ros::NodeHandle & node_handle)
+  : CalibrationNode(node_handle),
+    image_transport_(node_handle),
+    stop_(false),
+    acquisitions_(0),
+    dropped_(0),
+    converged_(false),
+    last_updates_(0),
+    stable_updates_(0)
+{
+  if (not node_handle_.getParam("path", path_))
+    ROS_FATAL("Missing \"path\" parameter!!");
+
+  if (path_[path_.size() - 1] != '/')
+    path_.append("/");
+
+  // The clouds are reprojected with the intrinsics of "depth_camera_calib_url", as offline with kinect1_depth
+  node_handle_.param("reproject_cloud", reproject_cloud_, true);
+  node_handle_.param("finish_on_convergence", finish_on_convergence_, false);
+
+  node_handle_.param("convergence/coverage_frames", coverage_frames_, 3);
+  node_handle_.param("convergence/min_coverage", min_coverage_, 0.8);
+  node_handle_.param("convergence/max_change", max_change_, 0.002);
+  node_handle_.param("convergence/updates", converged_updates_, 5);
+  if (coverage_frames_ < 1)
+  {
+    coverage_frames_ = 1;
+    ROS_WARN("\"convergence/coverage_frames\" cannot be < 1. Using 1.");
+  }
+  if (converged_updates_ < 1)
+  {
+    converged_updates_ = 1;
+    ROS_WARN("\"convergence/updates\" cannot be < 1. Using 1.");
+  }
+
+  // Acquisitions are processed by one worker thread: actionCallback never blocks, it drops frames when full
+  node_handle_.param("queue_size", queue_size_, 4);
+  if (queue_size_ < 1)
+  {
+    queue_size_ = 1;
+    ROS_WARN("\"queue_size\" cannot be < 1. Using 1.");
+  }
+}
+
+OnlineCalibrationNode::~OnlineCalibrationNode ()
+{
+  stopWorker();
+}
+
+bool
+OnlineCalibrationNode::initialize ()
+{
+  if (not CalibrationNode::initialize())
+    return false;
+
+  progress_pub_ = node_handle_.advertise<CalibrationProgress>("progress", 1, true);
+
+  image_sub_ = image_transport_.subscribe("image", 1, &OnlineCalibrationNode::imageCallback, this);
+  cloud_sub_ = node_handle_.subscribe("point_cloud", 1, &OnlineCalibrationNode::pointCloudCallback, this);
+  action_sub_ = node_handle_.subscribe("action", 1, &OnlineCalibrationNode::actionCallback, this);
+
+  worker_thread_ = boost::thread(&OnlineCalibrationNode::workerLoop, this);
+
+  return true;
+}
+
+void
+OnlineCalibrationNode::imageCallback (const sensor_msgs::Image::ConstPtr & msg)
+{
+  image_msg_ = msg;
+}
+
+void
+OnlineCalibrationNode::pointCloudCallback (const sensor_msgs::PointCloud2::ConstPtr & msg)
+{
+  cloud_msg_ = msg;
+}
+
+void
+OnlineCalibrationNode::actionCallback (const Acquisition::ConstPtr & msg)
+{
+  if (not image_msg_ or not cloud_msg_)
+  {
+    ROS_WARN("Acquisition ignored: no image or point cloud received yet.");
+    return;
+  }
+
+  Frame frame;
+  frame.image_msg_ = image_msg_;
+  frame.cloud_msg_ = cloud_msg_;
+
+  {
+    boost::mutex::scoped_lock lock(queue_mutex_);
+    if (stop_)
+      return;
+
+    ++acquisitions_;
+    if (queue_.size() >= static_cast<size_t>(queue_size_))
+    {
+      ++dropped_;
+      ROS_WARN_STREAM("Acquisition dropped: " << queue_.size() << " frames still to be processed.");
+      return;
+    }
+    queue_.push_back(frame);
+  }
+  queue_condition_.notify_one();
+}
+
+void
+OnlineCalibrationNode::workerLoop ()
+{
+  while (true)
+  {
+    Frame frame;
+    {
+      boost::mutex::scoped_lock lock(queue_mutex_);
+      while (queue_.empty() and not stop_)
+        queue_condition_.wait(lock);
+
+      // The queue is drained before stopping
+      if (queue_.empty())
+        return;
+
+      frame = queue_.front();
+      queue_.pop_front();
+    }
+
+    process(frame);
+  }
+}
+
+void
+OnlineCalibrationNode::stopWorker ()
+{
+  {
+    boost::mutex::scoped_lock lock(queue_mutex_);
+    stop_ = true;
+  }
+  queue_condition_.notify_all();
+  if (worker_thread_.joinable())
+    worker_thread_.join();
+}
+
+void
+OnlineCalibrationNode::process (const Frame & frame)
+{
+  cv::Mat image;
+  try
+  {
+    image = cv_bridge::toCvCopy(frame.image_msg_, sensor_msgs::image_encodings::BGR8)->image;
+  }
+  catch (const cv_bridge::Exception & error)
+  {
+    ROS_WARN_STREAM("Acquisition ignored, cannot convert the image: " << error.what());
+    return;
+  }
+
+  PCLCloud3::Ptr cloud = boost::make_shared<PCLCloud3>();
+  pcl::fromROSMsg(*frame.cloud_msg_, *cloud);
+  if (reproject_cloud_)
+  {
+    ray_table_.update(*depth_sensor_->cameraModel(), cloud->width, cloud->height);
+    ray_table_.reproject(*cloud);
+  }
+
+  const Size1 views = calibration_->addStreamingData(image, cloud);
+  ROS_DEBUG_STREAM(views << " views found.");
+
+  CalibrationProgress progress;
+  progress.views = calibration_->streamingViews();
+  progress.planes = 0;
+  progress.coverage = 0.0;
+  progress.max_change = -1.0;
+
+  const DepthUndistortionEstimation::ConstPtr estimation = calibration_->streamingEstimation();
+  if (estimation)
+  {
+    progress.planes = estimation->streamingPlanes();
+    progress.coverage = estimation->streamingCoverage(coverage_frames_);
+    progress.max_change = estimation->lastStreamingChange();
+
+    // Changes are counted once per update
+    if (estimation->streamingUpdates() > last_updates_)
+    {
+      last_updates_ = estimation->streamingUpdates();
+      if (progress.max_change >= 0.0 and progress.max_change < max_change_)
+        ++stable_updates_;
+      else
+        stable_updates_ = 0;
+    }
+  }
+
+  progress.converged = progress.coverage >= min_coverage_ and stable_updates_ >= converged_updates_;
+
+  {
+    boost::mutex::scoped_lock lock(queue_mutex_);
+    progress.acquisitions = acquisitions_;
+    progress.dropped = dropped_;
+    if (progress.converged and not converged_)
+      ROS_INFO_STREAM("Converged after " << acquisitions_ << " acquisitions (coverage " << progress.coverage
+                      << ", last change " << progress.max_change << " m). Capturing can be stopped.");
+    converged_ = progress.converged;
+  }
+
+  progress_pub_.publish(progress);
+}
+
+void
+OnlineCalibrationNode::spin ()
+{
+  ros::Rate rate(10.0);
+  while (ros::ok())
+  {
+    ros::spinOnce();
+    {
+      boost::mutex::scoped_lock lock(queue_mutex_);
+      if (finish_on_convergence_ and converged_)
+        break;
+    }
+    rate.sleep();
+  }
+
+  // Queued frames are processed first
+  stopWorker();
+
+  if (calibration_->streamingViews() == 0)
+  {
+    ROS_WARN("No checkerboard views collected. Nothing to calibrate.");
+    return;
+  }
+
+  ROS_INFO("Calibrating with the collected frames...");
+  calibration_->perform();
+
+  PolynomialUndistortionMatrixIO<LocalPolynomial> local_io;
+  local_io.write(*calibration_->localModel(), path_ + "local_matrix.txt");
+
+  PolynomialUndistortionMatrixIO<InverseGlobalPolynomial> inverse_global_io;
+  inverse_global_io.write(*calibration_->inverseGlobalModel(), path_ + "inverse_global_matrix.txt");
+
+  calibration_->optimize();
+
+  saveOptimizedResults(path_);
+}
+
+} /* namespace calibration */
+
+int
+main (int argc,
+      char ** argv)
+{
+  ros::init(argc, argv, "online_calibration");
+  ros::NodeHandle node_handle("~");
+
+  try
+  {
+    calibration::OnlineCalibrationNode calib_node(node_handle);
+    if (not calib_node.initialize())
+      return 0;
+    calib_node.spin();
+  }
+  catch (const std::runtime_error & error)
+  {
+    ROS_FATAL_STREAM("Calibration error: " << error.what());
+    return 1;
+  }
+
+  return 0;
+}
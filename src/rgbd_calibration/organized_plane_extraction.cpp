@@ -0,0 +1,268 @@
+/*
+ *  Copyright (c) 2013-2014, Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *     3. Neither the name of the copyright holder(s) nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cmath>
+#include <algorithm>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
+#include <Eigen/Eigenvalues>
+#include <pcl/common/point_tests.h>
+
+#include <rgbd_calibration/organized_plane_extraction.h>
+
+// Hypotheses are scored on at most this many candidates, in blocks of SCORE_BLOCK points
+#define MAX_SCORE_POINTS 1000
+#define SCORE_BLOCK 50
+
+namespace calibration
+{
+
+namespace
+{
+
+// Least squares plane of the given points, with the normal towards the sensor.
+Plane
+fitPlane(const std::vector<Point3> & points,
+         const std::vector<int> & indices)
+{
+  Point3 centroid(Point3::Zero());
+  for (size_t i = 0; i < indices.size(); ++i)
+    centroid += points[indices[i]];
+  centroid /= indices.size();
+
+  Eigen::Matrix<Scalar, 3, 3> covariance(Eigen::Matrix<Scalar, 3, 3>::Zero());
+  for (size_t i = 0; i < indices.size(); ++i)
+  {
+    const Point3 d = points[indices[i]] - centroid;
+    covariance += d * d.transpose();
+  }
+
+  Eigen::SelfAdjointEigenSolver<Eigen::Matrix<Scalar, 3, 3> > solver(covariance);
+  Point3 normal = solver.eigenvectors().col(0);
+  if (normal.dot(centroid) > 0)
+    normal = -normal;
+
+  return Plane(normal, -normal.dot(centroid));
+}
+
+} /* namespace */
+
+OrganizedPlaneExtraction::OrganizedPlaneExtraction()
+  : has_intrinsics_(false),
+    fx_(0),
+    fy_(0),
+    cx_(0),
+    cy_(0),
+    point_(Point3::Zero()),
+    radius_(0),
+    depth_error_function_(Vector3(0.0, 0.0, 0.0035)),
+    threshold_factor_(3.0),
+    depth_tolerance_factor_(3.0),
+    max_iterations_(200),
+    min_inliers_(50),
+    iterations_(0)
+{
+  // Do nothing
+}
+
+void OrganizedPlaneExtraction::boundingBox(Scalar fx,
+                                           Scalar fy,
+                                           Scalar cx,
+                                           Scalar cy,
+                                           const Point3 & point,
+                                           Scalar radius,
+                                           int width,
+                                           int height,
+                                           int & min_x,
+                                           int & max_x,
+                                           int & min_y,
+                                           int & max_y)
+{
+  min_x = 0;
+  max_x = width;
+  min_y = 0;
+  max_y = height;
+  if (point.z() <= radius)
+    return;
+
+  // Bounding box of the projection of the sphere, computed at its nearest depth
+  const Scalar z = point.z() - radius;
+  const Scalar u = fx * point.x() / point.z() + cx;
+  const Scalar v = fy * point.y() / point.z() + cy;
+  const Scalar du = fx * radius / z;
+  const Scalar dv = fy * radius / z;
+  min_x = std::max<int>(0, std::floor(u - du));
+  max_x = std::min<int>(width, std::ceil(u + du) + 1);
+  min_y = std::max<int>(0, std::floor(v - dv));
+  max_y = std::min<int>(height, std::ceil(v + dv) + 1);
+  max_x = std::max(min_x, max_x);
+  max_y = std::max(min_y, max_y);
+}
+
+void OrganizedPlaneExtraction::collectCandidates(std::vector<int> & candidates) const
+{
+  const PCLCloud3 & cloud = *cloud_;
+
+  int min_x = 0, max_x = cloud.width, min_y = 0, max_y = cloud.height;
+  if (has_intrinsics_)
+    boundingBox(fx_, fy_, cx_, cy_, point_, radius_, cloud.width, cloud.height, min_x, max_x, min_y, max_y);
+
+  const Scalar sq_radius = radius_ * radius_;
+
+  // Bounding sphere of the checkerboard, grown by the depth error expected at its depth
+  const Scalar max_distance = radius_ + depth_tolerance_factor_ * depth_error_function_.evaluate(point_.z());
+  const Scalar sq_max_distance = max_distance * max_distance;
+
+  for (int i = min_y; i < max_y; ++i)
+  {
+    for (int j = min_x; j < max_x; ++j)
+    {
+      const int index = i * cloud.width + j;
+      const PCLPoint3 & p = cloud.points[index];
+      if (not pcl::isFinite(p) or p.z <= 0)
+        continue;
+
+      // Distance of point_ from the ray of p, then from p itself
+      const Point3 q(p.x, p.y, p.z);
+      if (q.dot(point_) > 0 and q.cross(point_).squaredNorm() <= sq_radius * q.squaredNorm() and
+          (q - point_).squaredNorm() <= sq_max_distance)
+        candidates.push_back(index);
+    }
+  }
+}
+
+bool OrganizedPlaneExtraction::extract(PlaneInfo & plane_info)
+{
+  assert(cloud_ and cloud_->isOrganized());
+  iterations_ = 0;
+
+  std::vector<int> candidates;
+  collectCandidates(candidates);
+
+  const int size = candidates.size();
+  if (size < std::max(3, min_inliers_))
+    return false;
+
+  std::vector<Point3> points(size);
+  for (int i = 0; i < size; ++i)
+  {
+    const PCLPoint3 & p = cloud_->points[candidates[i]];
+    points[i] = Point3(p.x, p.y, p.z);
+  }
+
+  const Scalar threshold = threshold_factor_ * depth_error_function_.evaluate(point_.z());
+
+  // Hypotheses are scored on an evenly spaced subset
+  const int step = std::max(1, size / MAX_SCORE_POINTS);
+  std::vector<int> score_indices;
+  for (int i = 0; i < size; i += step)
+    score_indices.push_back(i);
+  const int score_size = score_indices.size();
+
+  // Fixed seed: the same cloud always gives the same plane
+  boost::random::mt19937 random_gen(42);
+  boost::random::uniform_int_distribution<int> random_index(0, size - 1);
+
+  const Scalar log_failure = std::log(1.0 - 0.99);
+  int required_iterations = max_iterations_;
+  int best_score = 0;
+  Plane best_plane;
+
+  while (iterations_ < required_iterations)
+  {
+    ++iterations_;
+
+    const Point3 & p0 = points[random_index(random_gen)];
+    const Point3 & p1 = points[random_index(random_gen)];
+    const Point3 & p2 = points[random_index(random_gen)];
+
+    Point3 normal = (p1 - p0).cross(p2 - p0);
+    const Scalar norm = normal.norm();
+    if (norm < 1e-9)
+      continue;
+    normal /= norm;
+    const Scalar offset = -normal.dot(p0);
+
+    // Stop scoring as soon as the hypothesis cannot beat the best one any more
+    int score = 0;
+    for (int k = 0; k < score_size; ++k)
+    {
+      if (std::abs(normal.dot(points[score_indices[k]]) + offset) < threshold)
+        ++score;
+      if ((k + 1) % SCORE_BLOCK == 0 and score + (score_size - k - 1) <= best_score)
+        break;
+    }
+
+    if (score > best_score)
+    {
+      best_score = score;
+      best_plane = Plane(normal, offset);
+
+      const Scalar inlier_ratio = Scalar(score) / score_size;
+      const Scalar no_outliers = inlier_ratio * inlier_ratio * inlier_ratio;
+      if (no_outliers >= 1.0)
+        break;
+      required_iterations = std::min<Scalar>(max_iterations_, std::ceil(log_failure / std::log(1.0 - no_outliers)));
+    }
+  }
+
+  if (best_score < 3)
+    return false;
+
+  // Refit on the inliers of the best hypothesis, then select the final inliers
+  Plane plane = best_plane;
+  std::vector<int> inliers;
+  for (int pass = 0; pass < 2; ++pass)
+  {
+    inliers.clear();
+    for (int i = 0; i < size; ++i)
+    {
+      if (std::abs(plane.signedDistance(points[i])) < threshold)
+        inliers.push_back(i);
+    }
+    if (static_cast<int>(inliers.size()) < min_inliers_)
+      return false;
+    plane = fitPlane(points, inliers);
+  }
+
+  plane_info.indices_ = boost::make_shared<std::vector<int> >();
+  plane_info.indices_->reserve(inliers.size());
+  Scalar sq_error = 0;
+  for (size_t i = 0; i < inliers.size(); ++i)
+  {
+    const Scalar d = plane.signedDistance(points[inliers[i]]);
+    sq_error += d * d;
+    plane_info.indices_->push_back(candidates[inliers[i]]);
+  }
+  plane_info.plane_ = plane;
+  plane_info.std_dev_ = std::sqrt(sq_error / inliers.size());
+
+  return true;
+}
+
+} /* namespace calibration */
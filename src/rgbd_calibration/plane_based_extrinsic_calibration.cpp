@@ -0,0 +1,302 @@
+/*
+ *  Copyright (C) 2013 - Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <omp.h>
+
+#include <ceres/ceres.h>
+#include <ceres/rotation.h>
+
+#include <rgbd_calibration/plane_based_extrinsic_calibration.h>
+#include <rgbd_calibration/profiler.h>
+
+namespace calibration
+{
+
+namespace
+{
+
+// Distance between a plane observed by a sensor and the plane of the view, moved to the sensor frame. The view plane is
+// parametrized by its point closest to the main sensor origin (checkerboards are never that close to it).
+class PlaneError
+{
+public:
+
+  explicit PlaneError(const Plane & plane)
+    : normal_(plane.normal()),
+      offset_(plane.offset())
+  {
+    // Do nothing
+  }
+
+  template <typename T>
+    bool operator ()(const T * const sensor_pose_q,
+                     const T * const sensor_pose_t,
+                     const T * const view_plane,
+                     T * residuals) const
+    {
+      typename Types<T>::Vector3 point(view_plane[0], view_plane[1], view_plane[2]);
+      const T distance = point.norm();
+      typename Types<T>::Vector3 normal = point / distance;
+
+      // x_world = R * x_sensor + t  =>  n_sensor = R^T * n, d_sensor = n . t - distance
+      const T inverse_q[4] = {sensor_pose_q[0], -sensor_pose_q[1], -sensor_pose_q[2], -sensor_pose_q[3]};
+      T sensor_normal[3];
+      ceres::QuaternionRotatePoint(inverse_q, normal.data(), sensor_normal);
+      const T sensor_offset = normal.dot(typename Types<T>::Vector3(sensor_pose_t[0], sensor_pose_t[1], sensor_pose_t[2])) - distance;
+
+      residuals[0] = sensor_normal[0] - T(normal_.x());
+      residuals[1] = sensor_normal[1] - T(normal_.y());
+      residuals[2] = sensor_normal[2] - T(normal_.z());
+      residuals[3] = sensor_offset - T(offset_);
+
+      return true;
+    }
+
+private:
+
+  const Vector3 normal_;
+  const Scalar offset_;
+
+};
+
+typedef ceres::AutoDiffCostFunction<PlaneError, 4, 4, 3, 3> PlaneCostFunction;
+
+} /* namespace */
+
+PlaneBasedExtrinsicCalibration::PlaneBasedExtrinsicCalibration()
+  : views_(0),
+    num_threads_(omp_get_max_threads())
+{
+  // Do nothing
+}
+
+int PlaneBasedExtrinsicCalibration::sensorIndex(const Sensor::Ptr & sensor)
+{
+  for (size_t s = 0; s < sensors_.size(); ++s)
+    if (sensors_[s] == sensor)
+      return s;
+
+  // New sensor: widen every view by one column
+  const size_t old_sensors = sensors_.size();
+  sensors_.push_back(sensor);
+
+  Eigen::Matrix<Scalar, 4, Eigen::Dynamic> planes(4, views_ * sensors_.size());
+  std::vector<unsigned char> valid(views_ * sensors_.size(), 0);
+  for (size_t v = 0; v < views_; ++v)
+  {
+    for (size_t s = 0; s < old_sensors; ++s)
+    {
+      planes.col(offset(v, s)) = planes_.col(v * old_sensors + s);
+      valid[offset(v, s)] = valid_[v * old_sensors + s];
+    }
+  }
+  planes_.swap(planes);
+  valid_.swap(valid);
+
+  return old_sensors;
+}
+
+void PlaneBasedExtrinsicCalibration::addData(size_t index,
+                                             const Sensor::Ptr & sensor,
+                                             const PlanarObject::ConstPtr & data)
+{
+  assert(index < views_);
+  const int s = sensorIndex(sensor);
+  planes_.col(offset(index, s)) = data->plane().coeffs() / data->plane().normal().norm();
+  valid_[offset(index, s)] = 1;
+}
+
+void PlaneBasedExtrinsicCalibration::setSize(size_t size)
+{
+  views_ = size;
+  planes_.conservativeResize(4, views_ * sensors_.size());
+  valid_.resize(views_ * sensors_.size(), 0);
+}
+
+size_t PlaneBasedExtrinsicCalibration::appendData(const std::map<Sensor::Ptr, PlanarObject::ConstPtr> & data)
+{
+  setSize(views_ + 1);
+  for (std::map<Sensor::Ptr, PlanarObject::ConstPtr>::const_iterator it = data.begin(); it != data.end(); ++it)
+    addData(views_ - 1, it->first, it->second);
+  return views_;
+}
+
+void PlaneBasedExtrinsicCalibration::setMainSensor(const Sensor::Ptr & world)
+{
+  world_ = world;
+  sensorIndex(world_);
+}
+
+void PlaneBasedExtrinsicCalibration::perform()
+{
+  Profiler::ScopedTimer timer("extrinsic_calibration/perform");
+
+  const int world = sensorIndex(world_);
+  const int sensors = sensors_.size();
+
+  std::vector<Pose, Eigen::aligned_allocator<Pose> > poses(sensors, Pose::Identity());
+  std::vector<int> pairs(sensors, 0);
+
+  // Sensors are independent given the main one
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int s = 0; s < sensors; ++s)
+  {
+    if (s == world)
+      continue;
+
+    PlaneToPlaneCalibration calib;
+    for (size_t v = 0; v < views_; ++v)
+    {
+      if (valid_[offset(v, world)] and valid_[offset(v, s)])
+        calib.addPair(plane(v, world), plane(v, s));
+    }
+
+    pairs[s] = calib.getPairNumber();
+    if (pairs[s] > 5)
+      poses[s] = calib.estimateTransform();
+  }
+
+  for (int s = 0; s < sensors; ++s)
+  {
+    if (s == world or pairs[s] == 0)
+      continue;
+
+    if (pairs[s] > 5)
+    {
+      sensors_[s]->setParent(world_);
+      sensors_[s]->setPose(poses[s]);
+    }
+    else
+      sensors_[s]->setParent(Sensor::ConstPtr());
+  }
+}
+
+void PlaneBasedExtrinsicCalibration::optimize()
+{
+  Profiler::ScopedTimer timer("extrinsic_calibration/optimize");
+
+  const int world = sensorIndex(world_);
+  const int sensors = sensors_.size();
+
+  // Only the main sensor and the ones calibrated by perform() take part
+  std::vector<unsigned char> included(sensors, 0);
+  for (int s = 0; s < sensors; ++s)
+    included[s] = s == world or sensors_[s]->parent() == world_;
+
+  Eigen::Matrix<Scalar, Eigen::Dynamic, 7, Eigen::DontAlign | Eigen::RowMajor> poses(sensors, 7);
+  for (int s = 0; s < sensors; ++s)
+  {
+    const Pose pose = s == world ? Pose::Identity() : sensors_[s]->pose();
+    const Quaternion rotation(pose.linear());
+    poses.row(s) << rotation.w(), rotation.x(), rotation.y(), rotation.z(), pose.translation().transpose();
+  }
+
+  Eigen::Matrix<Scalar, Eigen::Dynamic, 3, Eigen::DontAlign | Eigen::RowMajor> view_planes(views_, 3);
+  std::vector<unsigned char> used_views(views_, 0);
+
+  // One loss for all the observations, not owned by the problem
+  ceres::CauchyLoss loss(1.0);
+  ceres::Problem::Options problem_options;
+  problem_options.loss_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+  ceres::Problem problem(problem_options);
+
+  for (size_t v = 0; v < views_; ++v)
+  {
+    int observations = 0, first = -1;
+    for (int s = 0; s < sensors; ++s)
+    {
+      if (included[s] and valid_[offset(v, s)])
+      {
+        ++observations;
+        if (first < 0 or s == world)
+          first = s;
+      }
+    }
+    if (observations < 2)
+      continue;
+
+    // Initial view plane from the main sensor, or from the first sensor that sees it
+    const Pose pose = first == world ? Pose::Identity() : sensors_[first]->pose();
+    Plane view_plane = plane(v, first);
+    view_plane.transform(pose);
+    if (view_plane.offset() > 0)
+      view_plane.coeffs() *= -1.0;
+    view_planes.row(v) = -view_plane.offset() * view_plane.normal().transpose();
+    used_views[v] = 1;
+
+    for (int s = 0; s < sensors; ++s)
+    {
+      if (not included[s] or not valid_[offset(v, s)])
+        continue;
+
+      // Observed planes can have either orientation: match the one predicted by the initial estimate
+      const Pose sensor_pose = s == world ? Pose::Identity() : sensors_[s]->pose();
+      Plane observed = plane(v, s);
+      if ((sensor_pose.linear().transpose() * view_plane.normal()).dot(observed.normal()) < 0)
+        observed.coeffs() *= -1.0;
+
+      ceres::CostFunction * cost_function = new PlaneCostFunction(new PlaneError(observed));
+      problem.AddResidualBlock(cost_function, &loss,
+                               poses.row(s).data(), poses.row(s).data() + 4, view_planes.row(v).data());
+    }
+  }
+
+  if (problem.NumResidualBlocks() == 0)
+    return;
+
+  ceres::ParameterBlockOrdering * ordering = new ceres::ParameterBlockOrdering();
+  for (size_t v = 0; v < views_; ++v)
+    if (used_views[v])
+      ordering->AddElementToGroup(view_planes.row(v).data(), 0);
+
+  for (int s = 0; s < sensors; ++s)
+  {
+    if (not problem.HasParameterBlock(poses.row(s).data()))
+      continue;
+    problem.SetParameterization(poses.row(s).data(), new ceres::QuaternionParameterization());
+    if (s == world)
+    {
+      problem.SetParameterBlockConstant(poses.row(s).data());
+      problem.SetParameterBlockConstant(poses.row(s).data() + 4);
+    }
+    ordering->AddElementToGroup(poses.row(s).data(), 1);
+    ordering->AddElementToGroup(poses.row(s).data() + 4, 1);
+  }
+
+  // The view planes only interact through the sensor poses: eliminate them first
+  ceres::Solver::Options options;
+  options.linear_solver_type = ceres::SPARSE_SCHUR;
+  options.linear_solver_ordering.reset(ordering);
+  options.max_num_iterations = 50;
+  options.num_threads = num_threads_;
+
+  ceres::Solver::Summary summary;
+  ceres::Solve(options, &problem, &summary);
+  Profiler::instance().addSolverSummary("extrinsic_calibration/optimize", summary);
+
+  for (int s = 0; s < sensors; ++s)
+  {
+    if (s == world or not included[s])
+      continue;
+    const Quaternion rotation(poses(s, 0), poses(s, 1), poses(s, 2), poses(s, 3));
+    Translation3 translation;
+    translation.vector() = poses.row(s).tail<3>();
+    sensors_[s]->setPose(translation * rotation);
+  }
+}
+
+} /* namespace calibration */
@@ -0,0 +1,139 @@
+/*
+ *  Copyright (c) 2013-2014, Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *     3. Neither the name of the copyright holder(s) nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <fstream>
+#include <algorithm>
+
+#include <rgbd_calibration/profiler.h>
+
+namespace calibration
+{
+
+Profiler & Profiler::instance()
+{
+  static Profiler profiler;
+  return profiler;
+}
+
+void Profiler::addTime(const std::string & name,
+                       double seconds)
+{
+#pragma omp critical (profiler)
+  {
+    Timer & timer = timers_[name];
+    timer.min_ = timer.count_ > 0 ? std::min(timer.min_, seconds) : seconds;
+    timer.max_ = timer.count_ > 0 ? std::max(timer.max_, seconds) : seconds;
+    timer.total_ += seconds;
+    ++timer.count_;
+  }
+}
+
+void Profiler::increment(const std::string & name,
+                         long count)
+{
+#pragma omp critical (profiler)
+  counters_[name] += count;
+}
+
+void Profiler::setValue(const std::string & name,
+                        double value)
+{
+#pragma omp critical (profiler)
+  values_[name] = value;
+}
+
+void Profiler::addToHistogram(const std::string & name,
+                              int bin,
+                              long count)
+{
+#pragma omp critical (profiler)
+  histograms_[name][bin] += count;
+}
+
+void Profiler::reset()
+{
+#pragma omp critical (profiler)
+  {
+    timers_.clear();
+    counters_.clear();
+    values_.clear();
+    histograms_.clear();
+  }
+}
+
+bool Profiler::writeJSON(const std::string & file_name) const
+{
+  std::ofstream file(file_name.c_str());
+  if (not file.is_open())
+    return false;
+
+  file.precision(9);
+
+#pragma omp critical (profiler)
+  {
+    file << "{" << std::endl;
+
+    file << "  \"timers\": {";
+    for (std::map<std::string, Timer>::const_iterator it = timers_.begin(); it != timers_.end(); ++it)
+    {
+      const Timer & timer = it->second;
+      file << (it == timers_.begin() ? "" : ",") << std::endl;
+      file << "    \"" << it->first << "\": {\"count\": " << timer.count_ << ", \"total_s\": " << timer.total_
+           << ", \"mean_s\": " << timer.total_ / timer.count_ << ", \"min_s\": " << timer.min_
+           << ", \"max_s\": " << timer.max_ << "}";
+    }
+    file << std::endl << "  }," << std::endl;
+
+    file << "  \"counters\": {";
+    for (std::map<std::string, long>::const_iterator it = counters_.begin(); it != counters_.end(); ++it)
+      file << (it == counters_.begin() ? "" : ",") << std::endl << "    \"" << it->first << "\": " << it->second;
+    file << std::endl << "  }," << std::endl;
+
+    file << "  \"values\": {";
+    for (std::map<std::string, double>::const_iterator it = values_.begin(); it != values_.end(); ++it)
+      file << (it == values_.begin() ? "" : ",") << std::endl << "    \"" << it->first << "\": " << it->second;
+    file << std::endl << "  }," << std::endl;
+
+    file << "  \"histograms\": {";
+    typedef std::map<std::string, std::map<int, long> >::const_iterator HistogramIterator;
+    for (HistogramIterator it = histograms_.begin(); it != histograms_.end(); ++it)
+    {
+      file << (it == histograms_.begin() ? "" : ",") << std::endl << "    \"" << it->first << "\": {";
+      for (std::map<int, long>::const_iterator bin_it = it->second.begin(); bin_it != it->second.end(); ++bin_it)
+        file << (bin_it == it->second.begin() ? "" : ", ") << "\"" << bin_it->first << "\": " << bin_it->second;
+      file << "}";
+    }
+    file << std::endl << "  }" << std::endl;
+
+    file << "}" << std::endl;
+  }
+
+  return true;
+}
+
+} /* namespace calibration */
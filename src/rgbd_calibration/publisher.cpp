@@ -16,6 +16,7 @@
  */
 
 #include <pcl_ros/point_cloud.h>
+#include <pcl/common/point_tests.h>
 #include <visualization_msgs/MarkerArray.h>
 #include <eigen_conversions/eigen_msg.h>
 #include <cv_bridge/cv_bridge.h>
@@ -26,11 +27,122 @@ namespace calibration
 {
 
 Publisher::Publisher(const ros::NodeHandle & node_handle)
-  : node_handle_(node_handle)
+  : node_handle_(node_handle),
+    batched_(false),
+    batch_rate_(1.0),
+    decimation_(1),
+    stop_(false),
+    batch_changed_(false)
 {
   marker_pub_ = node_handle_.advertise<visualization_msgs::Marker>("rgbd_markers", 0);
 }
 
+Publisher::~Publisher()
+{
+  if (not batched_)
+    return;
+
+  {
+    boost::mutex::scoped_lock lock(batch_mutex_);
+    stop_ = true;
+  }
+  batch_condition_.notify_all();
+  batch_thread_.join();
+}
+
+void Publisher::startBatching(double rate,
+                              int decimation)
+{
+  assert(rate > 0 and decimation > 0);
+  if (batched_)
+    return;
+
+  batched_ = true;
+  batch_rate_ = rate;
+  decimation_ = decimation;
+
+  batch_marker_pub_ = node_handle_.advertise<visualization_msgs::MarkerArray>("batch/markers", 1, true);
+  batch_cloud_pub_ = node_handle_.advertise<PCLCloud3>("batch/cloud", 1, true);
+
+  batch_thread_ = boost::thread(&Publisher::batchLoop, this);
+}
+
+void Publisher::batchLoop()
+{
+  const boost::posix_time::milliseconds period(static_cast<long>(1000.0 / batch_rate_));
+
+  boost::mutex::scoped_lock lock(batch_mutex_);
+  while (not stop_)
+  {
+    // Woken up early only to stop
+    batch_condition_.timed_wait(lock, period);
+    if (stop_ or not batch_changed_)
+      continue;
+
+    // The topic is latched: the array always holds every checkerboard, for the late subscribers
+    visualization_msgs::MarkerArray markers;
+    bool markers_changed = false;
+    for (std::map<std::string, BatchedView>::iterator it = batched_views_.begin(); it != batched_views_.end(); ++it)
+    {
+      markers.markers.push_back(it->second.marker_);
+      markers_changed = markers_changed or it->second.changed_;
+      it->second.changed_ = false;
+    }
+    if (not markers_changed)
+      markers.markers.clear();
+
+    std::map<int, PCLCloud3::ConstPtr> changed_clouds;
+    for (std::map<int, BatchedData>::iterator it = batched_data_.begin(); it != batched_data_.end(); ++it)
+    {
+      if (it->second.changed_)
+      {
+        changed_clouds[it->first].swap(it->second.pending_);
+        it->second.changed_ = false;
+      }
+    }
+    batch_changed_ = false;
+
+    // The conversions do not block the callers of publish()
+    lock.unlock();
+    publishBatch(markers, changed_clouds);
+    lock.lock();
+  }
+}
+
+void Publisher::publishBatch(const visualization_msgs::MarkerArray & markers,
+                             const std::map<int, PCLCloud3::ConstPtr> & changed_clouds)
+{
+  if (not markers.markers.empty())
+    batch_marker_pub_.publish(markers);
+
+  if (changed_clouds.empty())
+    return;
+
+  for (std::map<int, PCLCloud3::ConstPtr>::const_iterator it = changed_clouds.begin(); it != changed_clouds.end(); ++it)
+  {
+    const PCLCloud3 & cloud = *it->second;
+    PCLCloud3 & decimated = decimated_clouds_[it->first];
+    decimated.clear();
+    decimated.header = cloud.header;
+    for (Size1 y = 0; y < cloud.height; y += decimation_)
+    {
+      for (Size1 x = 0; x < cloud.width; x += decimation_)
+      {
+        const PCLPoint3 & p = cloud.points[x + y * cloud.width];
+        if (pcl::isFinite(p))
+          decimated.push_back(p);
+      }
+    }
+  }
+
+  PCLCloud3 merged;
+  merged.header = decimated_clouds_.begin()->second.header;
+  for (std::map<int, PCLCloud3>::const_iterator it = decimated_clouds_.begin(); it != decimated_clouds_.end(); ++it)
+    merged += it->second;
+
+  batch_cloud_pub_.publish(merged);
+}
+
 void Publisher::publishTF(const BaseObject & object)
 {
   geometry_msgs::TransformStamped transform_msg;
@@ -67,6 +179,27 @@ void Publisher::publish(const CheckerboardViews & rgbd_checkerboard,
   ss << prefix << "checkerboard_" << rgbd_checkerboard.id();
   std::string ns = ss.str();
 
+  if (batched_)
+  {
+    const Checkerboard::ConstPtr & checkerboard = rgbd_checkerboard.colorCheckerboard();
+    if (not checkerboard)
+      return;
+
+    boost::mutex::scoped_lock lock(batch_mutex_);
+    BatchedView & view = batched_views_[ns];
+    if (view.checkerboard_ == checkerboard and view.pose_ == checkerboard->pose().matrix())
+      return;
+
+    view.checkerboard_ = checkerboard;
+    view.pose_ = checkerboard->pose().matrix();
+    checkerboard->toMarker(view.marker_);
+    view.marker_.ns = ns;
+    view.marker_.id = 0;
+    view.changed_ = true;
+    batch_changed_ = true;
+    return;
+  }
+
   if (c_pub_map_.find(ns) == c_pub_map_.end())
   {
     CheckerboardPublisherSet pub_set;
@@ -111,6 +244,20 @@ void Publisher::publish(const CheckerboardViews & rgbd_checkerboard,
 
 void Publisher::publish(const RGBDData & rgbd)
 {
+  if (batched_)
+  {
+    boost::mutex::scoped_lock lock(batch_mutex_);
+    BatchedData & data = batched_data_[rgbd.id()];
+    if (data.published_.lock() == rgbd.depthData())
+      return;
+
+    data.published_ = rgbd.depthData();
+    data.pending_ = rgbd.depthData();
+    data.changed_ = true;
+    batch_changed_ = true;
+    return;
+  }
+
   std::stringstream ss;
   ss << "rgbd_" << rgbd.id();
   std::string ns = ss.str();
@@ -0,0 +1,127 @@
+/*
+ *  Copyright (c) 2013-2014, Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *     3. Neither the name of the copyright holder(s) nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <limits>
+
+#include <rgbd_calibration/ray_table.h>
+
+namespace calibration
+{
+
+RayTable::RayTable()
+  : K_(cv::Matx33d::zeros()),
+    cols_(0),
+    rows_(0)
+{
+  delta_[0] = delta_[1] = 1.0;
+  delta_[2] = delta_[3] = 0.0;
+}
+
+bool RayTable::update(const KinectDepthCameraModel & camera_model,
+                      int cols,
+                      int rows,
+                      const double * delta)
+{
+  const double no_delta[4] = {1.0, 1.0, 0.0, 0.0};
+  if (delta == NULL)
+    delta = no_delta;
+
+  const cv::Matx33d K = camera_model.fullIntrinsicMatrix();
+
+  if (cols == cols_ and rows == rows_ and K == K_ and std::equal(delta, delta + 4, delta_))
+    return false;
+
+  K_ = K;
+  std::copy(delta, delta + 4, delta_);
+  cols_ = cols;
+  rows_ = rows;
+
+  x_.resize(cols_ * rows_);
+  y_.resize(cols_ * rows_);
+
+  for (int j = 0; j < rows_; ++j)
+  {
+    for (int k = 0; k < cols_; ++k)
+    {
+      Point2 normalized_pixel((k - (K_(0, 2) + delta_[2])) / (K_(0, 0) * delta_[0]),
+                              (j - (K_(1, 2) + delta_[3])) / (K_(1, 1) * delta_[1]));
+      Point2 ray = camera_model.undistort2d_<Scalar>(normalized_pixel);
+      x_[k + j * cols_] = ray.x();
+      y_[k + j * cols_] = ray.y();
+    }
+  }
+
+  return true;
+}
+
+void RayTable::toCloud(const float * z,
+                       PCLCloud3 & cloud) const
+{
+  cloud.resize(cols_ * rows_);
+  cloud.width = cols_;
+  cloud.height = rows_;
+  cloud.is_dense = false;
+
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  const int size = cols_ * rows_;
+
+  for (int i = 0; i < size; ++i)
+  {
+    PCLPoint3 & p = cloud.points[i];
+    const float z_i = z[i] > 0 ? z[i] : nan;
+    p.x = z_i * x_[i];
+    p.y = z_i * y_[i];
+    p.z = z_i;
+  }
+}
+
+void RayTable::toCloud(const cv::Mat & depth,
+                       PCLCloud3 & cloud) const
+{
+  cv::Mat z;
+  if (depth.type() == CV_16UC1)
+    depth.convertTo(z, CV_32FC1, 0.001);
+  else
+    z = depth.isContinuous() ? depth : depth.clone();
+
+  toCloud(z.ptr<float>(), cloud);
+}
+
+void RayTable::reproject(PCLCloud3 & cloud) const
+{
+  const int size = cols_ * rows_;
+  for (int i = 0; i < size; ++i)
+  {
+    PCLPoint3 & p = cloud.points[i];
+    p.x = p.z * x_[i];
+    p.y = p.z * y_[i];
+  }
+}
+
+} /* namespace calibration */
@@ -0,0 +1,103 @@
+/*
+ *  Copyright (c) 2013-2014, Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *     3. Neither the name of the copyright holder(s) nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <ros/console.h>
+
+#include <rgbd_calibration/sensor_profile.h>
+
+namespace calibration
+{
+
+namespace
+{
+
+struct ProfileEntry
+{
+  const char * name_;
+  int cols_;
+  int rows_;
+};
+
+#define RGBD_CALIBRATION_PROFILE_ENTRY(NAME, COLS, ROWS) {#NAME, COLS, ROWS},
+
+const ProfileEntry PROFILES[] = {RGBD_CALIBRATION_SENSOR_PROFILES(RGBD_CALIBRATION_PROFILE_ENTRY)};
+const int PROFILE_COUNT = sizeof(PROFILES) / sizeof(PROFILES[0]);
+
+#undef RGBD_CALIBRATION_PROFILE_ENTRY
+
+void
+toProfile(const ProfileEntry & entry,
+          SensorProfile & profile)
+{
+  profile.name_ = entry.name_;
+  profile.cols_ = entry.cols_;
+  profile.rows_ = entry.rows_;
+}
+
+} /* namespace */
+
+const char * const SensorProfile::DEFAULT_NAME = "kinect";
+
+bool SensorProfile::find(const std::string & name,
+                         SensorProfile & profile)
+{
+  for (int i = 0; i < PROFILE_COUNT; ++i)
+  {
+    if (name == PROFILES[i].name_)
+    {
+      toProfile(PROFILES[i], profile);
+      return true;
+    }
+  }
+  return false;
+}
+
+void SensorProfile::findOrDefault(const std::string & name,
+                                  SensorProfile & profile)
+{
+  if (find(name, profile))
+    return;
+
+  ROS_WARN_STREAM("Unknown \"sensor_profile\" " << name << " (known: " << names() << "). Using " << DEFAULT_NAME
+                  << ".");
+  find(DEFAULT_NAME, profile);
+}
+
+std::string SensorProfile::names()
+{
+  std::string names;
+  for (int i = 0; i < PROFILE_COUNT; ++i)
+  {
+    if (i > 0)
+      names += ", ";
+    names += PROFILES[i].name_;
+  }
+  return names;
+}
+
+} /* namespace calibration */
@@ -21,194 +21,359 @@
 #include <boost/random.hpp>
 #include <boost/random/normal_distribution.hpp>
 
+#include <opencv2/imgproc/imgproc.hpp>
+
 #include <eigen_conversions/eigen_msg.h>
 
-#include <pcl/visualization/pcl_visualizer.h>
+#include <rgbd_calibration/profiler.h>
+#include <rgbd_calibration/undistortion_kernel.h>
+
+// Ground truth global error: z = AA * z'^2 + BB * z' + CC
+#define AA -0.01
+#define BB 0.96
+#define CC 0.0
 
 namespace calibration
 {
 
-SimulationNode::SimulationNode(ros::NodeHandle & node_handle)
+SimulationNode::SimulationNode (ros::NodeHandle & node_handle)
   : CalibrationNode(node_handle)
 {
-
-  //  if (not node_handle_.getParam("instances", instances_))
-  //    ROS_FATAL("Missing \"instances\" parameter!!");
+  node_handle_.param("frames", frames_, 200);
+  node_handle_.param("eval_frames", eval_frames_, 20);
+  node_handle_.param("kernel_runs", kernel_runs_, 20);
+  node_handle_.param("seed", seed_, 42);
 
   node_handle_.param("depth_error", depth_error_, 0.0035);
-  node_handle_.param("image_error", image_error_, 0.5);
+  node_handle_.param("image_noise", image_noise_, 5.0);
+  node_handle_.param("local_distortion", local_distortion_, 0.02);
 
   node_handle_.param("min_distance", min_distance_, 1.0);
   node_handle_.param("max_distance", max_distance_, 4.0);
-  node_handle_.param("step", step_, 1.0);
+  node_handle_.param("max_angle", max_angle_, M_PI / 6);
+  node_handle_.param("max_offset", max_offset_, 0.15);
+  node_handle_.param("pose_noise", pose_noise_, 0.02);
 
+  node_handle_.param("report_file", report_file_, std::string("bench.json"));
+
+  if (frames_ < 1)
+  {
+    frames_ = 1;
+    ROS_WARN("\"frames\" cannot be < 1. Using 1.");
+  }
+
+  if (kernel_runs_ < 1)
+  {
+    kernel_runs_ = 1;
+    ROS_WARN("\"kernel_runs\" cannot be < 1. Using 1.");
+  }
+
+  // The data is generated with the given pose, the calibration starts from a perturbed one
+  if (not has_initial_transform_)
+  {
+    initial_transform_ = Translation3(0.025, 0.0, 0.0) * Quaternion::Identity();
+    has_initial_transform_ = true;
+  }
+
+  full_size_ = images_size_ * downsample_ratio_;
 }
 
-void SimulationNode::spin()
+bool
+SimulationNode::initialize ()
 {
-  ros::Rate rate(10.0);
+  if (not CalibrationNode::initialize())
+    return false;
+
+  true_pose_ = color_sensor_->pose();
+
+  color_size_ = color_sensor_->cameraModel()->fullResolution();
+  color_rays_.resize(color_size_.width * color_size_.height);
+  for (int v = 0; v < color_size_.height; ++v)
+    for (int u = 0; u < color_size_.width; ++u)
+      color_rays_[u + v * color_size_.width] = color_sensor_->cameraModel()->projectPixelTo3dRay(Point2(u, v));
+
+  depth_ray_table_.update(*depth_sensor_->cameraModel(), full_size_.x(), full_size_.y());
 
-  int added = 0;
+  return true;
+}
 
-  Scalar aa = -0.01, bb = 0.96, cc = 0.0;
-  GlobalPolynomial::Coefficients global_error_function_coeffs(cc, bb, aa);
-  GlobalPolynomial global_error_function(global_error_function_coeffs);
+bool
+SimulationNode::boardCoordinates (const Checkerboard & checkerboard,
+                                  const Point3 & point,
+                                  Scalar & a,
+                                  Scalar & b)
+{
+  const Cloud3 & corners = checkerboard.corners();
+  const Point3 origin = corners[0];
+  const Vector3 a_axis = corners[1] - origin;
+  const Vector3 b_axis = corners[corners.size().x()] - origin;
 
-  ROS_INFO_STREAM(global_error_function_coeffs.transpose());
+  a = (point - origin).dot(a_axis) / a_axis.squaredNorm();
+  b = (point - origin).dot(b_axis) / b_axis.squaredNorm();
 
-  ROS_INFO("Getting data...");
-  for (double z = min_distance_; z <= max_distance_ + 0.01; z += step_)
+  return a > -1 and a < corners.size().x() and b > -1 and b < corners.size().y();
+}
+
+void
+SimulationNode::generateFrame (unsigned int seed,
+                               Frame & frame) const
+{
+  boost::mt19937 random_gen(seed);
+
+  boost::uniform_real<> unit_range(0.0, 1.0);
+  boost::variate_generator<boost::mt19937 &, boost::uniform_real<> > uniform(random_gen, unit_range);
+
+  boost::normal_distribution<> unit_normal(0.0, 1.0);
+  boost::variate_generator<boost::mt19937 &, boost::normal_distribution<> > normal(random_gen, unit_normal);
+
+  // Checkerboard pose in the color sensor frame
+
+  const Scalar z = min_distance_ + (max_distance_ - min_distance_) * uniform();
+  Translation3 translation((2 * uniform() - 1) * max_offset_ * z, (2 * uniform() - 1) * max_offset_ * z, z);
+
+  Transform T = Transform::Identity();
+  T.prerotate(AngleAxis((2 * uniform() - 1) * max_angle_, Vector3::UnitX()));
+  T.prerotate(AngleAxis((2 * uniform() - 1) * max_angle_, Vector3::UnitY()));
+  T = translation * T * Translation3(-cb_vec_[0]->center());
+
+  Checkerboard color_cb(*cb_vec_[0]);
+  color_cb.transform(T);
+
+  Checkerboard depth_cb(color_cb);
+  depth_cb.transform(true_pose_);
+
+  // Create image: a white background with the checkerboard squares
+
+  const Plane color_plane = color_cb.plane();
+  frame.image_.create(color_size_.height, color_size_.width, CV_8UC3);
+
+  for (int v = 0; v < color_size_.height; ++v)
   {
-    Translation3 translation_cb_center(-cb_vec_[0]->center());
-    Translation3 translation_z(0, 0, z);
+    cv::Vec3b * image_row = frame.image_.ptr<cv::Vec3b>(v);
+    for (int u = 0; u < color_size_.width; ++u)
+    {
+      const Vector3 & ray = color_rays_[u + v * color_size_.width];
+      Scalar gray = 255;
+
+      Scalar den = color_plane.normal().dot(ray);
+      Scalar t = den != 0 ? -color_plane.offset() / den : -1;
+      Scalar a, b;
+      if (t > 0 and boardCoordinates(color_cb, ray * t, a, b))
+        gray = (static_cast<int>(std::floor(a)) + static_cast<int>(std::floor(b)) + 2) % 2 == 0 ? 0 : 255;
+
+      gray = std::min<Scalar>(std::max<Scalar>(gray + image_noise_ * normal(), 0), 255);
+      image_row[u] = cv::Vec3b(gray, gray, gray);
+    }
+  }
 
-    boost::mt19937 random_gen(time(0));
+  // Create depth: the checkerboard in front of a wall
 
-    boost::normal_distribution<> depth_error(0.0, depth_error_);
-    boost::variate_generator<boost::mt19937 &, boost::normal_distribution<> > depth_noise(random_gen, depth_error);
+  const Plane depth_plane = depth_cb.plane();
+  const Scalar background_z = max_distance_ + 1.0;
+  const std::vector<float> & ray_x = depth_ray_table_.x();
+  const std::vector<float> & ray_y = depth_ray_table_.y();
 
-    boost::normal_distribution<> image_error(0.0, image_error_);
-    boost::variate_generator<boost::mt19937 &, boost::normal_distribution<> > image_noise(random_gen, image_error);
+  frame.depth_.create(full_size_.y(), full_size_.x(), CV_32FC1);
+  frame.true_depth_.create(full_size_.y(), full_size_.x(), CV_32FC1);
+  frame.board_mask_.create(full_size_.y(), full_size_.x(), CV_8UC1);
 
-#pragma omp parallel for
-    for (int i = 0; i < 9; ++i)
+  for (int i = 0; i < full_size_.x() * full_size_.y(); ++i)
+  {
+    const Vector3 ray(ray_x[i], ray_y[i], 1.0);
+
+    Scalar true_z = background_z;
+    bool on_board = false;
+
+    Scalar den = depth_plane.normal().dot(ray);
+    Scalar t = den != 0 ? -depth_plane.offset() / den : -1;
+    Scalar a, b;
+    if (t > 0 and t < background_z and boardCoordinates(depth_cb, ray * t, a, b))
     {
-      Transform T = Transform::Identity();
-
-      if (i % 3 != 1)
-      {
-        AngleAxis r;
-        r.axis() = Vector3::UnitY();
-        r.angle() = (i % 3 == 2 ? M_PI / 6 : -M_PI / 6);
-        T.prerotate(r);
-      }
-      if (i / 3 != 1)
-      {
-        AngleAxis r;
-        r.axis() = Vector3::UnitX();
-        r.angle() = (i / 3 == 0 ? M_PI / 6 : -M_PI / 6);
-        T.prerotate(r);
-      }
-
-      T = translation_z * T * translation_cb_center;
-
-      Checkerboard::Ptr real_cb = boost::make_shared<Checkerboard>(*cb_vec_[0]);
-      real_cb->transform(T);
-
-      // Create image
-
-      cv::Mat image(480, 640, CV_8UC3, cv::Scalar(255, 255, 255));
-      Cloud2 image_corners = color_sensor_->cameraModel()->project3dToPixel(real_cb->corners());
-
-      std::vector<cv::Point2f> corners;
-      for (Size1 c = 0; c < image_corners.elements(); ++c)
-      {
-        if (image_corners[c].x() > 0 and image_corners[c].x() < image.cols and image_corners[c].y() > 0
-            and image_corners[c].y() < image.rows)
-          corners.push_back(cv::Point2f(image_corners[c].x(), image_corners[c].y()));
-
-        image_corners[c].x() += image_noise();
-        image_corners[c].y() += image_noise();
-
-      }
-      cv::drawChessboardCorners(image, cv::Size(image_corners.size().x(), image_corners.size().y()), corners,
-                                corners.size() == image_corners.elements());
-
-      //      cv::imshow("AAA", image);
-      //      cv::waitKey(100);
-
-      // Create point cloud
-
-      PCLCloud3::Ptr cloud = boost::make_shared<PCLCloud3>();
-      std::vector<int> inliers;
-
-      real_cb->transform(color_sensor_->pose());
-
-      for (int y = 0; y < 480; ++y)
-      {
-        for (int x = 0; x < 640; ++x)
-        {
-          Line line(Point3::Zero(),
-                    color_sensor_->cameraModel()->projectPixelTo3dRay(Point2(x, y)));
-          Point3 point = line.intersectionPoint(real_cb->plane());
-          Scalar new_z = (-bb + std::sqrt(bb * bb - 4 * aa * (cc - point.z()))) / (2 * aa);
-          new_z = new_z + depth_noise() * new_z * new_z;
-          point *= new_z / point.z();
-          PCLPoint3 pcl_point;
-          pcl_point.x = point.x();
-          pcl_point.y = point.y();
-          pcl_point.z = point.z();
-          cloud->points.push_back(pcl_point);
-          inliers.push_back(inliers.size());
-        }
-      }
-
-      cloud->width = 640;
-      cloud->height = 480;
-
-      //      pcl::visualization::PCLVisualizer vis;
-      //      vis.addPointCloud(cloud);
-      //      vis.spin();
-
-      RGBDData::Ptr data = boost::make_shared<RGBDData>(i + z * 3);
-      data->setColorSensor(color_sensor_);
-      data->setDepthSensor(depth_sensor_);
-      data->setColorData(image);
-      data->setDepthData(*cloud);
-
-      std::stringstream ss;
-      ss << "view_" << data->id() << "_" << i;
-
-      CheckerboardViews::Ptr cb_views = boost::make_shared<CheckerboardViews>(ss.str());
-      cb_views->setData(data);
-      cb_views->setCheckerboard(cb_vec_[0]);
-      cb_views->setImageCorners(image_corners);
-      //cb_views->setPlaneInliers(inliers, 0.01);
-
-#pragma omp critical
-      {
-        calibration_->addCheckerboardViews(cb_views);
-        ++added;
-      }
+      true_z = t;
+      on_board = true;
     }
 
-    //rate.sleep();
+    Scalar distorted_z = (-BB + std::sqrt(BB * BB - 4 * AA * (CC - true_z))) / (2 * AA);
+    distorted_z *= 1 + local_distortion_ * (ray_x[i] * ray_x[i] + ray_y[i] * ray_y[i]);
+    distorted_z += depth_error_ * normal() * distorted_z * distorted_z;
+
+    frame.true_depth_.at<float>(i) = true_z;
+    frame.depth_.at<float>(i) = distorted_z;
+    frame.board_mask_.at<uint8_t>(i) = on_board ? 255 : 0;
   }
+}
 
-  ROS_INFO_STREAM("Added " << added << " checkerboards.");
+void
+SimulationNode::spin ()
+{
+  Profiler & profiler = Profiler::instance();
+  profiler.reset();
+  srand(seed_);
+
+  ROS_INFO_STREAM("Generating " << frames_ << " frames of " << full_size_.x() << "x" << full_size_.y() << "...");
+
+  ros::WallTime start = ros::WallTime::now();
+
+  std::vector<cv::Mat> images(frames_);
+  std::vector<PCLCloud3::ConstPtr> clouds(frames_);
+
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int i = 0; i < frames_; ++i)
+  {
+    Frame frame;
+    generateFrame(seed_ + i, frame);
+
+    PCLCloud3::Ptr cloud = boost::make_shared<PCLCloud3>();
+    depth_ray_table_.toCloud(frame.depth_, *cloud);
+
+    images[i] = frame.image_;
+    clouds[i] = cloud;
+  }
+
+  profiler.addTime("bench/generate", (ros::WallTime::now() - start).toSec());
+
+  calibration_->addData(images, clouds);
+  profiler.setValue("bench/frames", frames_);
+  profiler.setValue("bench/cols", full_size_.x());
+  profiler.setValue("bench/rows", full_size_.y());
+  profiler.setValue("bench/cell_size_x", undistortion_matrix_cell_size_.x());
+  profiler.setValue("bench/cell_size_y", undistortion_matrix_cell_size_.y());
+  profiler.setValue("bench/downsample_ratio", downsample_ratio_);
+  profiler.setValue("bench/threads", omp_get_max_threads());
+
+  // Start from a perturbed pose
+  boost::mt19937 random_gen(seed_ - 1);
+  boost::normal_distribution<> pose_error(0.0, pose_noise_);
+  boost::variate_generator<boost::mt19937 &, boost::normal_distribution<> > pose_noise(random_gen, pose_error);
+
+  Transform initial_pose = true_pose_;
+  initial_pose.translate(Vector3(pose_noise(), pose_noise(), pose_noise()));
+  initial_pose.rotate(AngleAxis(pose_noise(), Vector3::UnitX()));
+  initial_pose.rotate(AngleAxis(pose_noise(), Vector3::UnitY()));
+  initial_pose.rotate(AngleAxis(pose_noise(), Vector3::UnitZ()));
+  color_sensor_->setPose(initial_pose);
 
   geometry_msgs::Pose pose_msg;
   tf::poseEigenToMsg(color_sensor_->pose(), pose_msg);
   ROS_INFO_STREAM("Initial transform:\n" << pose_msg);
 
-  calibration_->setEstimateDepthUndistortionModel(true);
-  //calibration_->setEstimateDepthUndistortionModel(false);
   calibration_->perform();
-
-  tf::poseEigenToMsg(color_sensor_->pose(), pose_msg);
-  ROS_INFO_STREAM("Estimated transform:\n" << pose_msg);
-
   calibration_->optimize();
 
   tf::poseEigenToMsg(color_sensor_->pose(), pose_msg);
   ROS_INFO_STREAM("Optimized transform:\n" << pose_msg);
 
-  rate = ros::Rate(1.0);
+  Transform pose_error_transform = true_pose_.inverse() * color_sensor_->pose();
+  profiler.setValue("accuracy/translation_error_m", pose_error_transform.translation().norm());
+  profiler.setValue("accuracy/rotation_error_rad", AngleAxis(pose_error_transform.rotation()).angle());
+
+  evaluate();
+
+  if (profiler.writeJSON(report_file_))
+    ROS_INFO_STREAM("Report written to " << report_file_);
+  else
+    ROS_ERROR_STREAM("Cannot write report to " << report_file_);
+}
+
+void
+SimulationNode::evaluate ()
+{
+  Profiler & profiler = Profiler::instance();
+
+  const int cols = images_size_.x();
+  const int rows = images_size_.y();
+  const Size1 pixels = cols * rows;
+
+  ros::WallTime start = ros::WallTime::now();
+  UndistortionKernel kernel;
+  kernel.build(calibration_->localModel(), calibration_->globalModel(), cols, rows);
+  profiler.addTime("bench/kernel_build", (ros::WallTime::now() - start).toSec());
 
-  while (ros::ok())
+  // Rays at the calibration resolution
+  const double binning_delta[4] = {1.0 / downsample_ratio_, 1.0 / downsample_ratio_,
+                                   depth_sensor_->cameraModel()->fullIntrinsicMatrix()(0, 2) * (1.0 / downsample_ratio_ - 1.0),
+                                   depth_sensor_->cameraModel()->fullIntrinsicMatrix()(1, 2) * (1.0 / downsample_ratio_ - 1.0)};
+  RayTable ray_table;
+  ray_table.update(*depth_sensor_->cameraModel(), cols, rows, binning_delta);
+
+  UndistortionPCL reference;
+  reference.setModel(depth_sensor_->undistortionModel());
+
+  double kernel_time = 0.0, reference_time = 0.0, cloud_time = 0.0;
+  double raw_sq_error = 0.0, und_sq_error = 0.0;
+  long error_count = 0;
+
+  for (int k = 0; k < eval_frames_; ++k)
+  {
+    Frame frame;
+    generateFrame(seed_ + frames_ + k, frame);
+
+    // Same block averages as Calibration::addData()
+    cv::Mat depth, true_depth, board_mask;
+    cv::resize(frame.depth_, depth, cv::Size(cols, rows), 0, 0, cv::INTER_AREA);
+    cv::resize(frame.true_depth_, true_depth, cv::Size(cols, rows), 0, 0, cv::INTER_AREA);
+    cv::resize(frame.board_mask_, board_mask, cv::Size(cols, rows), 0, 0, cv::INTER_AREA);
+
+    cv::Mat und_depth;
+    for (int r = 0; r < kernel_runs_; ++r)
+    {
+      start = ros::WallTime::now();
+      kernel.apply(depth, und_depth);
+      double elapsed = (ros::WallTime::now() - start).toSec();
+      profiler.addTime("bench/kernel_apply", elapsed);
+      kernel_time += elapsed;
+    }
+
+    PCLCloud3 cloud;
+    start = ros::WallTime::now();
+    ray_table.toCloud(depth, cloud);
+    double elapsed = (ros::WallTime::now() - start).toSec();
+    profiler.addTime("bench/ray_table_to_cloud", elapsed);
+    cloud_time += elapsed;
+
+    start = ros::WallTime::now();
+    reference.undistort(cloud);
+    elapsed = (ros::WallTime::now() - start).toSec();
+    profiler.addTime("bench/reference_undistort", elapsed);
+    reference_time += elapsed;
+
+    for (Size1 i = 0; i < pixels; ++i)
+    {
+      if (board_mask.at<uint8_t>(i) < 255)
+        continue;
+      double raw_error = depth.at<float>(i) - true_depth.at<float>(i);
+      double und_error = und_depth.at<float>(i) - true_depth.at<float>(i);
+      raw_sq_error += raw_error * raw_error;
+      und_sq_error += und_error * und_error;
+      ++error_count;
+    }
+  }
+
+  if (eval_frames_ > 0)
   {
-    calibration_->publishData();
-    rate.sleep();
+    profiler.setValue("throughput/kernel_mpixels_per_s", 1e-6 * pixels * eval_frames_ * kernel_runs_ / kernel_time);
+    profiler.setValue("throughput/ray_table_mpixels_per_s", 1e-6 * pixels * eval_frames_ / cloud_time);
+    profiler.setValue("throughput/reference_mpixels_per_s", 1e-6 * pixels * eval_frames_ / reference_time);
   }
 
+  if (error_count > 0)
+  {
+    profiler.setValue("accuracy/raw_depth_rms_m", std::sqrt(raw_sq_error / error_count));
+    profiler.setValue("accuracy/undistorted_depth_rms_m", std::sqrt(und_sq_error / error_count));
+    profiler.increment("accuracy/evaluated_pixels", error_count);
+
+    ROS_INFO_STREAM("Depth RMS error: " << std::sqrt(raw_sq_error / error_count) << " m -> "
+                    << std::sqrt(und_sq_error / error_count) << " m");
+  }
 }
 
 } /* namespace calibration */
 
-int main(int argc,
-         char ** argv)
+int
+main (int argc,
+      char ** argv)
 {
-  ros::init(argc, argv, "simulation");
+  ros::init(argc, argv, "rgbd_calibration_bench");
   ros::NodeHandle node_handle("~");
 
   try
@@ -217,15 +382,12 @@ int main(int argc,
     if (not sim_node.initialize())
       return 0;
     sim_node.spin();
-
-    ros::spin();
   }
-  catch (std::runtime_error & error)
+  catch (const std::runtime_error & error)
   {
-    ROS_FATAL("Calibration error: %s", error.what());
+    ROS_FATAL_STREAM("Calibration error: " << error.what());
     return 1;
   }
 
   return 0;
 }
-
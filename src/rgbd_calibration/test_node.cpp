@@ -10,6 +10,9 @@
 #include <kinect/depth/polynomial_matrix_io.h>
 
 #include <rgbd_calibration/test_node.h>
+#include <rgbd_calibration/undistortion_kernel.h>
+#include <rgbd_calibration/model_file.h>
+#include <rgbd_calibration/sensor_profile.h>
 
 //#include <swissranger_camera/utility.h>
 
@@ -39,6 +42,12 @@ TestNode::TestNode(ros::NodeHandle & node_handle)
     ROS_WARN("\"downsample_ratio\" cannot be < 1. Skipping.");
   }
 
+  std::string downsample_mode;
+  downsample_mode_ = CloudDownsampler::MEAN;
+  node_handle_.param("downsample_mode", downsample_mode, std::string("mean"));
+  if (not CloudDownsampler::parseMode(downsample_mode, downsample_mode_))
+    ROS_WARN("\"downsample_mode\" must be \"mean\" or \"median\". Using \"mean\".");
+
 #if (!defined(UNCALIBRATED)) || (defined(UNCALIBRATED) && defined(SKEW))
   if (node_handle_.hasParam("camera_pose"))
   {
@@ -66,14 +75,17 @@ TestNode::TestNode(ros::NodeHandle & node_handle)
 
 
 
+  // A binary model (see model_file.h) replaces the two matrices
+  node_handle_.param("model_file", model_file_, std::string());
+
   if (node_handle_.hasParam("local_und_matrix_file"))
     node_handle_.getParam("local_und_matrix_file", local_matrix_file_);
-  else
+  else if (model_file_.empty())
     ROS_FATAL("Missing \"local_und_matrix_file\" parameter!!");
 
   if (node_handle_.hasParam("global_und_matrix_file"))
     node_handle_.getParam("global_und_matrix_file", global_matrix_file_);
-  else
+  else if (model_file_.empty())
     ROS_FATAL("Missing \"global_und_matrix_file\" parameter!!");
 
   if (not node_handle_.getParam("path", path_))
@@ -106,9 +118,27 @@ TestNode::TestNode(ros::NodeHandle & node_handle)
 
   node_handle_.param("only_show", only_show_, false);
 
+  // A dataset file replaces the image and cloud files in "path"
+  std::string dataset_file;
+  if (node_handle_.getParam("dataset_file", dataset_file))
+  {
+    dataset_reader_ = boost::make_shared<DatasetReader>();
+    if (not dataset_reader_->open(dataset_file))
+      ROS_FATAL_STREAM("Cannot read dataset " << dataset_file << "!!");
+  }
+
+  // Checkerboard corners and planes are cached here between runs, empty to disable
+  node_handle_.param("checkerboard_cache", cb_cache_file_, path_ + "checkerboard_cache.bin");
+
+  // The sensor profile gives the default depth image size, "depth_image/cols" and "depth_image/rows" override it
+  SensorProfile profile;
+  std::string sensor_profile;
+  node_handle_.param("sensor_profile", sensor_profile, std::string(SensorProfile::DEFAULT_NAME));
+  SensorProfile::findOrDefault(sensor_profile, profile);
+
   int images_size_x, images_size_y;
-  node_handle_.param("depth_image/cols", images_size_x, 640);
-  node_handle_.param("depth_image/rows", images_size_y, 480);
+  node_handle_.param("depth_image/cols", images_size_x, profile.cols_);
+  node_handle_.param("depth_image/rows", images_size_y, profile.rows_);
   images_size_.x() = images_size_x / downsample_ratio_;
   images_size_.y() = images_size_y / downsample_ratio_;
 
@@ -175,16 +205,26 @@ bool TestNode::initialize()
   color_sensor_->transform(camera_pose_);
 
   LocalModel::Data::Ptr local_und_data;
-
-  PolynomialUndistortionMatrixIO<LocalPolynomial> local_io;
-  if (not local_io.read(local_und_data, local_matrix_file_))
-    ROS_FATAL_STREAM("File " << local_matrix_file_ << " not found!!");
-
   GlobalModel::Data::Ptr global_data;
 
-  PolynomialUndistortionMatrixIO<GlobalPolynomial> global_io;
-  if (not global_io.read(global_data, global_matrix_file_))
-    ROS_FATAL_STREAM("File " << global_matrix_file_ << " not found!!");
+  ModelFile model_file;
+  if (not model_file_.empty())
+  {
+    if (not model_file.open(model_file_))
+      ROS_FATAL_STREAM("Cannot read model " << model_file_ << "!!");
+    local_und_data = model_file.localMatrix();
+    global_data = model_file.globalMatrix();
+  }
+  else
+  {
+    PolynomialUndistortionMatrixIO<LocalPolynomial> local_io;
+    if (not local_io.read(local_und_data, local_matrix_file_))
+      ROS_FATAL_STREAM("File " << local_matrix_file_ << " not found!!");
+
+    PolynomialUndistortionMatrixIO<GlobalPolynomial> global_io;
+    if (not global_io.read(global_data, global_matrix_file_))
+      ROS_FATAL_STREAM("File " << global_matrix_file_ << " not found!!");
+  }
 
   LocalModel::Ptr local_model = boost::make_shared<LocalModel>(images_size_);
   local_model->setMatrix(local_und_data);
@@ -209,6 +249,21 @@ bool TestNode::initialize()
 
   publisher_ = boost::make_shared<Publisher>(node_handle_);
 
+  // Visualization merged and sent by a background thread, at most "publisher/rate" times per second
+  bool batch_publishing;
+  node_handle_.param("publisher/batched", batch_publishing, false);
+  if (batch_publishing)
+  {
+    double rate;
+    int decimation;
+    node_handle_.param("publisher/rate", rate, 1.0);
+    node_handle_.param("publisher/decimation", decimation, 4);
+    if (rate <= 0.0 or decimation < 1)
+      ROS_WARN("\"publisher/rate\" must be > 0 and \"publisher/decimation\" >= 1. Publishing every view.");
+    else
+      publisher_->startBatching(rate, decimation);
+  }
+
   test_ = boost::make_shared<CalibrationTest>();
 
   test_->setCheckerboards(cb_vec_);
@@ -218,6 +273,20 @@ bool TestNode::initialize()
   test_->setGlobalModel(global_model);
   test_->setPublisher(publisher_);
   test_->setDownSampleRatio(downsample_ratio_);
+  test_->setDownSampleMode(downsample_mode_);
+
+  if (not cb_cache_file_.empty())
+  {
+    // A corrupt file is neither used nor overwritten
+    cb_cache_ = boost::make_shared<CheckerboardCache>();
+    if (cb_cache_->load(cb_cache_file_))
+      test_->setCheckerboardCache(cb_cache_);
+    else
+    {
+      ROS_WARN_STREAM("Invalid checkerboard cache " << cb_cache_file_ << ". Ignoring it.");
+      cb_cache_.reset();
+    }
+  }
 
   return true;
 }
@@ -275,15 +344,32 @@ void TestNode::spin()
     cloud_file << path_ << cloud_filename_ << (i < 10 ? "000" : (i < 100 ? "00" : (i < 1000 ? "0" : ""))) << i << ".pcd";
     depth_file << path_ << "depth_" << (i < 10 ? "000" : (i < 100 ? "00" : (i < 1000 ? "0" : ""))) << i << ".png";
 
-    cv::Mat image = cv::imread(image_file.str());
+    cv::Mat image;
+    PCLCloud3::Ptr cloud;
+
+    if (dataset_reader_)
+    {
+      int index = dataset_reader_->find(i);
+      if (index < 0 or not dataset_reader_->readImage(index, image))
+        continue;
 
-    if (not image.data)
-      continue;
+      cloud = boost::make_shared<PCLCloud3>();
+      if (not dataset_reader_->readDepthCloud(index, *cloud))
+      {
+        ROS_WARN_STREAM("Depth " << i << " not valid!");
+        continue;
+      }
+    }
+    else
+    {
+      image = cv::imread(image_file.str());
 
-    PCLCloud3::Ptr cloud;
+      if (not image.data)
+        continue;
+    }
 
     pcl::PCDReader pcd_reader;
-    if (depth_type_ == KINECT1_DEPTH)
+    if (depth_type_ == KINECT1_DEPTH and not dataset_reader_)
     {
       cloud = boost::make_shared<PCLCloud3>();
 
@@ -384,6 +470,9 @@ void TestNode::spin()
     test_->testCube();
   }
 
+  if (cb_cache_ and not cb_cache_->save(cb_cache_file_))
+    ROS_WARN_STREAM("Cannot write checkerboard cache " << cb_cache_file_);
+
 
   rate = ros::Rate(1.0);
 
@@ -399,6 +488,8 @@ void TestNode::spin2()
 {
   ros::Rate rate(10.0);
 
+  UndistortionKernel kernel;
+
   ROS_INFO("Getting data...");
   for (int i = 1000; ros::ok() and i < 5000; ++i)
   {
@@ -411,20 +502,11 @@ void TestNode::spin2()
     if (not depth.data)
       continue;
 
-    for (int k = 0; k < depth.rows; ++k)
-    {
-      for (Size1 j = 0; j < depth.cols; ++j)
-      {
-        Scalar z = depth.at<uint16_t>(k, j) / Scalar(1000.0);
-        if (z == 0)
-          continue;
+    if (kernel.cols() != depth.cols or kernel.rows() != depth.rows)
+      kernel.build(depth_sensor_->undistortionModel()->localModel(), depth_sensor_->undistortionModel()->globalModel(),
+                   depth.cols, depth.rows);
 
-        depth_sensor_->undistortionModel()->localModel()->undistort(j, k, z);
-        depth_sensor_->undistortionModel()->globalModel()->undistort(j, k, z);
-
-        depth.at<uint16_t>(k, j) = cv::saturate_cast<uint16_t>(cvRound(z * 1000));
-      }
-    }
+    kernel.apply(depth, depth);
 
     cv::imwrite(depth_file_und.str(), depth);
 
@@ -444,6 +526,8 @@ void TestNode::spin3 ()
   Transform t_original = Eigen::Affine3d::Identity() * Translation3(-0.025, 0.0, 0.0);
   Transform t = color_sensor_->pose().inverse();
 
+  UndistortionKernel kernel;
+
   ROS_INFO("Getting data...");
   for (int i = 0; ros::ok() and i < 5000; ++i)
   {
@@ -460,6 +544,14 @@ void TestNode::spin3 ()
     cv::Mat_<uint16_t> depth_2 = cv::Mat(depth.size(), 0);
     cv::Mat_<uint16_t> depth_und = cv::Mat(depth.size(), 0);
 
+    if (kernel.cols() != depth.cols or kernel.rows() != depth.rows)
+      kernel.build(depth_sensor_->undistortionModel()->localModel(), depth_sensor_->undistortionModel()->globalModel(),
+                   depth.cols, depth.rows);
+
+    cv::Mat depth_m, und_depth_m;
+    depth.convertTo(depth_m, CV_32FC1, 0.001);
+    kernel.apply(depth_m, und_depth_m);
+
     for (int k = 0; k < depth.rows; ++k)
     {
       for (int j = 0; j < depth.cols; ++j)
@@ -488,8 +580,7 @@ void TestNode::spin3 ()
             depth_2.at<uint16_t>(y, x) = new_z_original;
 
 
-          depth_sensor_->undistortionModel()->localModel()->undistort(j, k, z);
-          depth_sensor_->undistortionModel()->globalModel()->undistort(j, k, z);
+          z = und_depth_m.at<float>(k, j);
           point_eigen.x() = (j - cx) * z / fx;
           point_eigen.y() = (k - cy) * z / fy;
           point_eigen.z() = z;
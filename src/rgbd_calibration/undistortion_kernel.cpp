@@ -0,0 +1,263 @@
+/*
+ *  Copyright (c) 2013-2014, Filippo Basso <bassofil@dei.unipd.it>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *     3. Neither the name of the copyright holder(s) nor the
+ *        names of its contributors may be used to endorse or promote products
+ *        derived from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ *  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ *  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <Eigen/LU>
+
+#include <rgbd_calibration/undistortion_kernel.h>
+
+namespace calibration
+{
+
+namespace
+{
+
+// Inverse of the Vandermonde matrix of x^min_degree ... x^(min_degree + size - 1) sampled at x = 1 ... size.
+Eigen::MatrixXd
+vandermondeInverse(int size,
+                   int min_degree)
+{
+  Eigen::MatrixXd A(size, size);
+  for (int i = 0; i < size; ++i)
+  {
+    const double x = i + 1;
+    double tmp = 1.0;
+    for (int j = 0; j < min_degree; ++j)
+      tmp *= x;
+    for (int j = 0; j < size; ++j)
+    {
+      A(i, j) = tmp;
+      tmp *= x;
+    }
+  }
+  return A.inverse();
+}
+
+} /* namespace */
+
+UndistortionKernel::UndistortionKernel()
+  : cols_(0),
+    rows_(0),
+    row_function_(NULL)
+{
+  std::fill(local_planes_, local_planes_ + LOCAL_SIZE, static_cast<const float *>(NULL));
+  std::fill(global_planes_, global_planes_ + GLOBAL_SIZE, static_cast<const float *>(NULL));
+}
+
+void UndistortionKernel::selectRowFunction()
+{
+  struct RowKernel
+  {
+    const char * profile_;
+    int cols_;
+    int rows_;
+    RowFunction function_;
+  };
+
+#define RGBD_CALIBRATION_ROW_KERNEL(NAME, COLS, ROWS) \
+  {#NAME, COLS, ROWS, &undistortRow<LOCAL_SIZE, LOCAL_MIN_DEGREE, GLOBAL_SIZE, GLOBAL_MIN_DEGREE, COLS>},
+
+  static const RowKernel ROW_KERNELS[] = {RGBD_CALIBRATION_SENSOR_PROFILES(RGBD_CALIBRATION_ROW_KERNEL)};
+
+#undef RGBD_CALIBRATION_ROW_KERNEL
+
+  profile_ = "generic";
+  row_function_ = &undistortRow<LOCAL_SIZE, LOCAL_MIN_DEGREE, GLOBAL_SIZE, GLOBAL_MIN_DEGREE, 0>;
+
+  for (size_t i = 0; i < sizeof(ROW_KERNELS) / sizeof(ROW_KERNELS[0]); ++i)
+  {
+    if (ROW_KERNELS[i].cols_ == cols_ and ROW_KERNELS[i].rows_ == rows_)
+    {
+      profile_ = ROW_KERNELS[i].profile_;
+      row_function_ = ROW_KERNELS[i].function_;
+      break;
+    }
+  }
+}
+
+void UndistortionKernel::build(const LocalModel::ConstPtr & local_model,
+                               const GlobalModel::ConstPtr & global_model,
+                               int cols,
+                               int rows)
+{
+  cols_ = cols;
+  rows_ = rows;
+  selectRowFunction();
+
+  const int size = cols_ * rows_;
+  for (int k = 0; k < LOCAL_SIZE; ++k)
+  {
+    local_coeffs_[k].resize(size);
+    local_planes_[k] = local_coeffs_[k].data();
+  }
+  for (int k = 0; k < GLOBAL_SIZE; ++k)
+  {
+    global_coeffs_[k].resize(size);
+    global_planes_[k] = global_coeffs_[k].data();
+  }
+  file_.reset();
+
+  // The undistortion of a pixel is a weighted sum of polynomials, i.e. a polynomial of the same degree:
+  // its coefficients are recovered by sampling the models and solving the Vandermonde system.
+  const Eigen::MatrixXd local_inverse = vandermondeInverse(LOCAL_SIZE, LOCAL_MIN_DEGREE);
+  const Eigen::MatrixXd global_inverse = vandermondeInverse(GLOBAL_SIZE, GLOBAL_MIN_DEGREE);
+
+#pragma omp parallel for
+  for (int j = 0; j < rows_; ++j)
+  {
+    Eigen::VectorXd local_samples(LOCAL_SIZE);
+    Eigen::VectorXd global_samples(GLOBAL_SIZE);
+
+    for (int i = 0; i < cols_; ++i)
+    {
+      const int index = i + j * cols_;
+
+      for (int k = 0; k < LOCAL_SIZE; ++k)
+      {
+        Scalar z = k + 1;
+        local_model->undistort(i, j, z);
+        local_samples[k] = z;
+      }
+      const Eigen::VectorXd local = local_inverse * local_samples;
+      for (int k = 0; k < LOCAL_SIZE; ++k)
+        local_coeffs_[k][index] = local[k];
+
+      for (int k = 0; k < GLOBAL_SIZE; ++k)
+      {
+        Scalar z = k + 1;
+        if (global_model)
+          global_model->undistort(i, j, z);
+        global_samples[k] = z;
+      }
+      const Eigen::VectorXd global = global_inverse * global_samples;
+      for (int k = 0; k < GLOBAL_SIZE; ++k)
+        global_coeffs_[k][index] = global[k];
+    }
+  }
+}
+
+bool UndistortionKernel::load(const ModelFile::ConstPtr & file)
+{
+  const ModelFile::FileHeader & header = file->header();
+  if (not file->hasKernel()
+      or static_cast<int>(header.local_degree_) != MathTraits<LocalPolynomial>::Degree
+      or static_cast<int>(header.local_min_degree_) != LOCAL_MIN_DEGREE
+      or static_cast<int>(header.global_degree_) != MathTraits<GlobalPolynomial>::Degree
+      or static_cast<int>(header.global_min_degree_) != GLOBAL_MIN_DEGREE)
+    return false;
+
+  cols_ = header.cols_;
+  rows_ = header.rows_;
+  selectRowFunction();
+
+  for (int k = 0; k < LOCAL_SIZE; ++k)
+  {
+    std::vector<float>().swap(local_coeffs_[k]);
+    local_planes_[k] = file->localPlane(k);
+  }
+  for (int k = 0; k < GLOBAL_SIZE; ++k)
+  {
+    std::vector<float>().swap(global_coeffs_[k]);
+    global_planes_[k] = file->globalPlane(k);
+  }
+  file_ = file;
+
+  return true;
+}
+
+template <int LocalSize, int LocalMinDegree, int GlobalSize, int GlobalMinDegree, int Cols>
+  void UndistortionKernel::undistortRow(const UndistortionKernel & kernel,
+                                        const float * z,
+                                        int row,
+                                        float * und_z)
+  {
+    const int cols = Cols > 0 ? Cols : kernel.cols_;
+    const int offset = row * cols;
+
+    const float * local_coeffs[LocalSize];
+    for (int k = 0; k < LocalSize; ++k)
+      local_coeffs[k] = kernel.local_planes_[k] + offset;
+    const float * global_coeffs[GlobalSize];
+    for (int k = 0; k < GlobalSize; ++k)
+      global_coeffs[k] = kernel.global_planes_[k] + offset;
+
+    // All the inner loops have compile-time bounds and are fully unrolled
+    for (int i = 0; i < cols; ++i)
+    {
+      const float z_i = z[i];
+
+      // Horner's scheme, then the minimum degree
+      float local = local_coeffs[LocalSize - 1][i];
+      for (int k = LocalSize - 2; k >= 0; --k)
+        local = local * z_i + local_coeffs[k][i];
+      for (int k = 0; k < LocalMinDegree; ++k)
+        local *= z_i;
+
+      float global = global_coeffs[GlobalSize - 1][i];
+      for (int k = GlobalSize - 2; k >= 0; --k)
+        global = global * local + global_coeffs[k][i];
+      for (int k = 0; k < GlobalMinDegree; ++k)
+        global *= local;
+
+      und_z[i] = z_i > 0 ? global : z_i;
+    }
+  }
+
+void UndistortionKernel::apply(const cv::Mat & depth,
+                               cv::Mat & und_depth) const
+{
+  assert(depth.cols == cols_ and depth.rows == rows_);
+  assert(depth.type() == CV_16UC1 or depth.type() == CV_32FC1);
+
+  und_depth.create(depth.rows, depth.cols, depth.type());
+
+  if (depth.type() == CV_32FC1)
+  {
+    for (int j = 0; j < rows_; ++j)
+      row_function_(*this, depth.ptr<float>(j), j, und_depth.ptr<float>(j));
+  }
+  else
+  {
+    std::vector<float> z(cols_);
+    std::vector<float> und_z(cols_);
+    for (int j = 0; j < rows_; ++j)
+    {
+      const uint16_t * depth_row = depth.ptr<uint16_t>(j);
+      for (int i = 0; i < cols_; ++i)
+        z[i] = depth_row[i] * 0.001f;
+
+      row_function_(*this, z.data(), j, und_z.data());
+
+      uint16_t * und_depth_row = und_depth.ptr<uint16_t>(j);
+      for (int i = 0; i < cols_; ++i)
+        und_depth_row[i] = static_cast<uint16_t>(std::min(std::max(und_z[i] * 1000.0f + 0.5f, 0.0f), 65535.0f));
+    }
+  }
+}
+
+} /* namespace calibration */
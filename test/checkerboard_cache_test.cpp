@@ -0,0 +1,185 @@
+#include <gtest/gtest.h>
+
+#include <boost/filesystem.hpp>
+
+#include <rgbd_calibration/checkerboard_cache.h>
+
+#include "test_utils.h"
+
+using namespace calibration;
+
+namespace
+{
+
+// Offset of the size of the first corners entry.
+const size_t FIRST_SIZE_OFFSET = sizeof(CheckerboardCache::MAGIC) + 3 * sizeof(boost::uint32_t)
+    + sizeof(boost::uint64_t) + sizeof(boost::uint8_t);
+
+void
+fillCache(CheckerboardCache & cache)
+{
+  CheckerboardCache::CornersEntry corners;
+  corners.found_ = true;
+  for (int i = 0; i < 12; ++i)
+    corners.corners_.push_back(0.5f * i);
+  cache.addCorners(1, corners);
+  cache.addCorners(2, CheckerboardCache::CornersEntry());
+
+  CheckerboardCache::PlaneEntry plane;
+  plane.found_ = true;
+  for (int i = 0; i < 20; ++i)
+    plane.indices_.push_back(3 * i);
+  plane.std_dev_ = 0.0025;
+  cache.addPlane(3, plane);
+  cache.addPlane(4, CheckerboardCache::PlaneEntry());
+}
+
+std::string
+writeCache(const test::TempFile & file)
+{
+  CheckerboardCache cache;
+  fillCache(cache);
+  EXPECT_TRUE(cache.save(file.path()));
+  return test::readFile(file.path());
+}
+
+} /* namespace */
+
+TEST(CheckerboardCache, roundTrip)
+{
+  test::TempFile file;
+  writeCache(file);
+
+  CheckerboardCache expected;
+  fillCache(expected);
+
+  CheckerboardCache cache;
+  ASSERT_TRUE(cache.load(file.path()));
+  EXPECT_EQ(4u, cache.size());
+
+  for (boost::uint64_t key = 1; key <= 2; ++key)
+  {
+    CheckerboardCache::CornersEntry entry, expected_entry;
+    ASSERT_TRUE(cache.findCorners(key, entry));
+    expected.findCorners(key, expected_entry);
+    EXPECT_EQ(expected_entry.found_, entry.found_);
+    EXPECT_EQ(expected_entry.corners_, entry.corners_);
+  }
+  for (boost::uint64_t key = 3; key <= 4; ++key)
+  {
+    CheckerboardCache::PlaneEntry entry, expected_entry;
+    ASSERT_TRUE(cache.findPlane(key, entry));
+    expected.findPlane(key, expected_entry);
+    EXPECT_EQ(expected_entry.found_, entry.found_);
+    EXPECT_EQ(expected_entry.indices_, entry.indices_);
+    EXPECT_EQ(expected_entry.std_dev_, entry.std_dev_);
+  }
+
+  CheckerboardCache::CornersEntry corners;
+  EXPECT_FALSE(cache.findCorners(3, corners));
+  CheckerboardCache::PlaneEntry plane;
+  EXPECT_FALSE(cache.findPlane(1, plane));
+}
+
+TEST(CheckerboardCache, missingFile)
+{
+  test::TempFile file;
+  CheckerboardCache cache;
+  EXPECT_TRUE(cache.load(file.path()));
+  EXPECT_EQ(0u, cache.size());
+}
+
+TEST(CheckerboardCache, saveOnlyWhenModified)
+{
+  test::TempFile file;
+  CheckerboardCache cache;
+  EXPECT_TRUE(cache.save(file.path()));
+  EXPECT_FALSE(boost::filesystem::exists(file.path()));
+
+  fillCache(cache);
+  EXPECT_TRUE(cache.save(file.path()));
+  EXPECT_TRUE(boost::filesystem::exists(file.path()));
+}
+
+TEST(CheckerboardCache, olderVersion)
+{
+  test::TempFile file;
+  std::string content = writeCache(file);
+  test::patch(content, sizeof(CheckerboardCache::MAGIC), boost::uint32_t(CheckerboardCache::VERSION - 1));
+  test::writeFile(file.path(), content);
+
+  CheckerboardCache cache;
+  EXPECT_TRUE(cache.load(file.path()));
+  EXPECT_EQ(0u, cache.size());
+}
+
+TEST(CheckerboardCache, truncated)
+{
+  test::TempFile file;
+  const std::string content = writeCache(file);
+
+  // Every cut drops something the counts at the start of the file promise
+  for (size_t size = 0; size < content.size(); ++size)
+  {
+    test::writeFile(file.path(), content.substr(0, size));
+    CheckerboardCache cache;
+    EXPECT_FALSE(cache.load(file.path())) << "Truncated at " << size << " of " << content.size() << " bytes";
+    EXPECT_EQ(0u, cache.size());
+  }
+}
+
+TEST(CheckerboardCache, corrupt)
+{
+  test::TempFile file;
+  const std::string content = writeCache(file);
+
+  std::string corrupt = content;
+  corrupt[0] = 'X';
+  test::writeFile(file.path(), corrupt);
+  CheckerboardCache cache;
+  EXPECT_FALSE(cache.load(file.path()));
+
+  corrupt = content;
+  test::patch(corrupt, sizeof(CheckerboardCache::MAGIC), boost::uint32_t(CheckerboardCache::VERSION + 1));
+  test::writeFile(file.path(), corrupt);
+  EXPECT_FALSE(cache.load(file.path()));
+
+  // Sizes larger than the file are rejected before anything is allocated
+  corrupt = content;
+  test::patch(corrupt, FIRST_SIZE_OFFSET, boost::uint32_t(-1));
+  test::writeFile(file.path(), corrupt);
+  EXPECT_FALSE(cache.load(file.path()));
+  EXPECT_EQ(0u, cache.size());
+
+  corrupt = content;
+  test::patch(corrupt, sizeof(CheckerboardCache::MAGIC) + 2 * sizeof(boost::uint32_t), boost::uint32_t(-1));
+  test::writeFile(file.path(), corrupt);
+  EXPECT_FALSE(cache.load(file.path()));
+  EXPECT_EQ(0u, cache.size());
+}
+
+TEST(CheckerboardCache, keys)
+{
+  cv::Mat image(4, 4, CV_8UC1, cv::Scalar(7));
+  const boost::uint64_t image_hash = CheckerboardCache::imageHash(image);
+  EXPECT_EQ(image_hash, CheckerboardCache::imageHash(image.clone()));
+
+  image.at<uchar>(3, 3) = 8;
+  EXPECT_NE(image_hash, CheckerboardCache::imageHash(image));
+
+  EXPECT_EQ(CheckerboardCache::hash("abc", 3), CheckerboardCache::hash("abc", 3));
+  EXPECT_NE(CheckerboardCache::hash("abc", 3), CheckerboardCache::hash("abd", 3));
+
+  const Pose pose = Pose::Identity();
+  Pose moved_pose = pose;
+  moved_pose.translation().x() = 0.1;
+  EXPECT_NE(CheckerboardCache::planeKey(1, 2, pose), CheckerboardCache::planeKey(1, 2, moved_pose));
+  EXPECT_NE(CheckerboardCache::planeKey(1, 2, pose), CheckerboardCache::planeKey(1, 3, pose));
+}
+
+int main(int argc,
+         char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
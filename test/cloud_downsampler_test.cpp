@@ -0,0 +1,166 @@
+#include <limits>
+#include <gtest/gtest.h>
+
+#include <pcl/common/point_tests.h>
+
+#include <rgbd_calibration/cloud_downsampler.h>
+
+using namespace calibration;
+
+namespace
+{
+
+// Organized cloud whose point (i, j) is (i, j, 1 + i + 10 * j).
+PCLCloud3
+createCloud(int cols,
+            int rows)
+{
+  PCLCloud3 cloud(cols, rows);
+  for (int j = 0; j < rows; ++j)
+  {
+    for (int i = 0; i < cols; ++i)
+    {
+      PCLPoint3 & p = cloud.at(i, j);
+      p.x = i;
+      p.y = j;
+      p.z = 1 + i + 10 * j;
+    }
+  }
+  cloud.is_dense = true;
+  return cloud;
+}
+
+void
+setInvalid(PCLCloud3 & cloud,
+           int i,
+           int j)
+{
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  cloud.at(i, j).x = cloud.at(i, j).y = cloud.at(i, j).z = nan;
+  cloud.is_dense = false;
+}
+
+} /* namespace */
+
+TEST(CloudDownsampler, parseMode)
+{
+  CloudDownsampler::Mode mode = CloudDownsampler::MEDIAN;
+  EXPECT_TRUE(CloudDownsampler::parseMode("mean", mode));
+  EXPECT_EQ(CloudDownsampler::MEAN, mode);
+  EXPECT_TRUE(CloudDownsampler::parseMode("median", mode));
+  EXPECT_EQ(CloudDownsampler::MEDIAN, mode);
+  EXPECT_FALSE(CloudDownsampler::parseMode("average", mode));
+  EXPECT_EQ(CloudDownsampler::MEDIAN, mode);
+}
+
+TEST(CloudDownsampler, ratioOne)
+{
+  const PCLCloud3 cloud = createCloud(5, 3);
+  PCLCloud3 sampled;
+
+  CloudDownsampler downsampler;
+  downsampler.apply(cloud, sampled);
+  ASSERT_EQ(cloud.width, sampled.width);
+  ASSERT_EQ(cloud.height, sampled.height);
+  for (size_t i = 0; i < cloud.points.size(); ++i)
+    EXPECT_EQ(cloud.points[i].z, sampled.points[i].z);
+}
+
+TEST(CloudDownsampler, mean)
+{
+  PCLCloud3 cloud = createCloud(8, 6);
+  setInvalid(cloud, 0, 0);
+
+  CloudDownsampler downsampler;
+  downsampler.setRatio(2);
+  PCLCloud3 sampled;
+  downsampler.apply(cloud, sampled);
+  ASSERT_EQ(4u, sampled.width);
+  ASSERT_EQ(3u, sampled.height);
+  EXPECT_TRUE(sampled.is_dense);
+
+  // Only the valid points of a block are averaged
+  EXPECT_FLOAT_EQ((1.0f + 0.0f + 1.0f) / 3.0f, sampled.at(0, 0).x);
+  EXPECT_FLOAT_EQ((0.0f + 1.0f + 1.0f) / 3.0f, sampled.at(0, 0).y);
+  EXPECT_FLOAT_EQ((2.0f + 11.0f + 12.0f) / 3.0f, sampled.at(0, 0).z);
+
+  for (int j = 0; j < 3; ++j)
+  {
+    for (int i = 0; i < 4; ++i)
+    {
+      if (i == 0 and j == 0)
+        continue;
+      EXPECT_FLOAT_EQ(2 * i + 0.5f, sampled.at(i, j).x);
+      EXPECT_FLOAT_EQ(2 * j + 0.5f, sampled.at(i, j).y);
+      EXPECT_FLOAT_EQ(1 + 2 * i + 0.5f + 10 * (2 * j + 0.5f), sampled.at(i, j).z);
+    }
+  }
+}
+
+TEST(CloudDownsampler, median)
+{
+  PCLCloud3 cloud = createCloud(8, 6);
+  setInvalid(cloud, 0, 0);
+  cloud.at(3, 1).z = 100.0f; // Not the median of its block
+
+  CloudDownsampler downsampler;
+  downsampler.setRatio(2);
+  downsampler.setMode(CloudDownsampler::MEDIAN);
+  PCLCloud3 sampled;
+  downsampler.apply(cloud, sampled);
+  ASSERT_EQ(4u, sampled.width);
+  ASSERT_EQ(3u, sampled.height);
+
+  // The kept point is a point of the block, as it is: the depths are {2, 11, 12} and {3, 4, 13, 100}
+  EXPECT_EQ(0.0f, sampled.at(0, 0).x);
+  EXPECT_EQ(1.0f, sampled.at(0, 0).y);
+  EXPECT_EQ(11.0f, sampled.at(0, 0).z);
+  EXPECT_EQ(2.0f, sampled.at(1, 0).x);
+  EXPECT_EQ(1.0f, sampled.at(1, 0).y);
+  EXPECT_EQ(13.0f, sampled.at(1, 0).z);
+}
+
+TEST(CloudDownsampler, invalidBlocks)
+{
+  PCLCloud3 cloud = createCloud(4, 4);
+  for (int j = 2; j < 4; ++j)
+    for (int i = 0; i < 2; ++i)
+      setInvalid(cloud, i, j);
+
+  for (int m = 0; m < 2; ++m)
+  {
+    CloudDownsampler downsampler;
+    downsampler.setRatio(2);
+    downsampler.setMode(m == 0 ? CloudDownsampler::MEAN : CloudDownsampler::MEDIAN);
+    PCLCloud3 sampled;
+    downsampler.apply(cloud, sampled);
+    ASSERT_EQ(2u, sampled.width);
+    ASSERT_EQ(2u, sampled.height);
+    EXPECT_FALSE(sampled.is_dense);
+    EXPECT_FALSE(pcl::isFinite(sampled.at(0, 1)));
+    EXPECT_TRUE(pcl::isFinite(sampled.at(1, 1)));
+    EXPECT_TRUE(pcl::isFinite(sampled.at(0, 0)));
+  }
+}
+
+TEST(CloudDownsampler, partialBlocks)
+{
+  // The trailing columns and rows that do not fill a block are dropped
+  const PCLCloud3 cloud = createCloud(7, 5);
+
+  CloudDownsampler downsampler;
+  downsampler.setRatio(3);
+  PCLCloud3 sampled;
+  downsampler.apply(cloud, sampled);
+  ASSERT_EQ(2u, sampled.width);
+  ASSERT_EQ(1u, sampled.height);
+  EXPECT_FLOAT_EQ(4.0f, sampled.at(1, 0).x);
+  EXPECT_FLOAT_EQ(1.0f, sampled.at(1, 0).y);
+}
+
+int main(int argc,
+         char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,273 @@
+#include <cmath>
+#include <cstddef>
+#include <gtest/gtest.h>
+
+#include <pcl/common/point_tests.h>
+
+#include <rgbd_calibration/dataset_io.h>
+
+#include "test_utils.h"
+
+using namespace calibration;
+
+namespace
+{
+
+const int COLS = 8;
+const int ROWS = 6;
+
+const std::string COLOR_INFO = "image_width: 16\nimage_height: 12\n";
+const std::string DEPTH_INFO = "image_width: 8\nimage_height: 6\n";
+
+cv::Mat
+createImage(int id)
+{
+  cv::Mat image(2 * ROWS, 2 * COLS, CV_8UC3);
+  for (int j = 0; j < image.rows; ++j)
+    for (int i = 0; i < image.cols; ++i)
+      image.at<cv::Vec3b>(j, i) = cv::Vec3b(i * 10 + id, j * 20, (i + j) * 5);
+  return image;
+}
+
+// Millimeters, with a few invalid (0) depths.
+cv::Mat
+createDepth(int id)
+{
+  cv::Mat depth(ROWS, COLS, CV_16UC1);
+  for (int j = 0; j < ROWS; ++j)
+    for (int i = 0; i < COLS; ++i)
+      depth.at<uint16_t>(j, i) = (i + j) % 5 == 0 ? 0 : 1000 + 100 * id + 10 * j + i;
+  return depth;
+}
+
+bool
+equal(const cv::Mat & a,
+      const cv::Mat & b)
+{
+  return a.size() == b.size() and a.type() == b.type()
+      and std::memcmp(a.data, b.data, a.total() * a.elemSize()) == 0;
+}
+
+// Color info, depth info, two frames with an image and one (in meters) without, as the collector writes them.
+std::string
+writeDataset(const test::TempFile & file)
+{
+  DatasetWriter writer;
+  EXPECT_TRUE(writer.open(file.path()));
+  EXPECT_TRUE(writer.writeCameraInfo(Dataset::COLOR_SENSOR, COLOR_INFO));
+  EXPECT_TRUE(writer.writeCameraInfo(Dataset::DEPTH_SENSOR, DEPTH_INFO));
+  EXPECT_TRUE(writer.writeFrame(10, 1.0, 1.01, createImage(10), createDepth(10)));
+  EXPECT_TRUE(writer.writeFrame(11, 2.0, 2.01, createImage(11), createDepth(11)));
+
+  cv::Mat depth;
+  createDepth(12).convertTo(depth, CV_32FC1, 0.001);
+  EXPECT_TRUE(writer.writeFrame(12, 3.0, 3.01, std::vector<uchar>(), depth));
+
+  writer.close();
+  return test::readFile(file.path());
+}
+
+// Offset of the first FRAME chunk.
+size_t
+firstFrameOffset()
+{
+  return sizeof(Dataset::FileHeader) + 2 * sizeof(Dataset::ChunkHeader) + 2 + COLOR_INFO.size() + DEPTH_INFO.size();
+}
+
+void
+expectFrames(const DatasetReader & reader,
+             size_t frames)
+{
+  ASSERT_EQ(frames, reader.size());
+  for (size_t i = 0; i < frames; ++i)
+  {
+    const int id = 10 + i;
+    EXPECT_EQ(id, reader.frameInfo(i).id_);
+    EXPECT_EQ(1.0 + i, reader.frameInfo(i).image_timestamp_);
+    EXPECT_EQ(1.01 + i, reader.frameInfo(i).depth_timestamp_);
+    EXPECT_EQ(static_cast<int>(i), reader.find(id));
+
+    cv::Mat depth;
+    ASSERT_TRUE(reader.readDepth(i, depth));
+    cv::Mat image;
+    if (i < 2)
+    {
+      EXPECT_TRUE(equal(createDepth(id), depth));
+      ASSERT_TRUE(reader.readImage(i, image));
+      EXPECT_TRUE(equal(createImage(id), image));
+    }
+    else
+    {
+      cv::Mat expected_depth;
+      createDepth(id).convertTo(expected_depth, CV_32FC1, 0.001);
+      EXPECT_TRUE(equal(expected_depth, depth));
+      EXPECT_FALSE(reader.readImage(i, image));
+    }
+  }
+}
+
+} /* namespace */
+
+TEST(DatasetIO, roundTrip)
+{
+  test::TempFile file;
+  writeDataset(file);
+
+  DatasetReader reader;
+  ASSERT_TRUE(reader.open(file.path()));
+  EXPECT_EQ(COLOR_INFO, reader.cameraInfo(Dataset::COLOR_SENSOR));
+  EXPECT_EQ(DEPTH_INFO, reader.cameraInfo(Dataset::DEPTH_SENSOR));
+  expectFrames(reader, 3);
+  EXPECT_EQ(-1, reader.find(13));
+}
+
+TEST(DatasetIO, depthCloud)
+{
+  test::TempFile file;
+  writeDataset(file);
+
+  DatasetReader reader;
+  ASSERT_TRUE(reader.open(file.path()));
+
+  const cv::Mat depth = createDepth(10);
+  PCLCloud3 cloud;
+  ASSERT_TRUE(reader.readDepthCloud(0, cloud));
+  ASSERT_EQ(COLS, static_cast<int>(cloud.width));
+  ASSERT_EQ(ROWS, static_cast<int>(cloud.height));
+  for (int j = 0; j < ROWS; ++j)
+  {
+    for (int i = 0; i < COLS; ++i)
+    {
+      const PCLPoint3 & p = cloud.at(i, j);
+      if (depth.at<uint16_t>(j, i) == 0)
+        EXPECT_FALSE(pcl::isFinite(p));
+      else
+        EXPECT_FLOAT_EQ(depth.at<uint16_t>(j, i) / 1000.0f, p.z);
+    }
+  }
+}
+
+TEST(DatasetIO, withoutIndex)
+{
+  test::TempFile file;
+  const std::string content = writeDataset(file);
+
+  // Collector killed before close(): no index chunk and no footer
+  const size_t index_size = sizeof(Dataset::ChunkHeader) + (2 + 3) * sizeof(boost::uint64_t);
+  test::writeFile(file.path(), content.substr(0, content.size() - sizeof(Dataset::FileFooter) - index_size));
+
+  DatasetReader reader;
+  ASSERT_TRUE(reader.open(file.path()));
+  EXPECT_EQ(DEPTH_INFO, reader.cameraInfo(Dataset::DEPTH_SENSOR));
+  expectFrames(reader, 3);
+
+  // Index chunk but no footer
+  test::writeFile(file.path(), content.substr(0, content.size() - 1));
+  ASSERT_TRUE(reader.open(file.path()));
+  expectFrames(reader, 3);
+}
+
+TEST(DatasetIO, truncatedFrame)
+{
+  test::TempFile file;
+  const std::string content = writeDataset(file);
+
+  // Every cut within the last frame leaves the first two
+  const size_t last_frame_end = content.size() - sizeof(Dataset::FileFooter) - sizeof(Dataset::ChunkHeader)
+      - (2 + 3) * sizeof(boost::uint64_t);
+  const size_t last_frame_size = sizeof(Dataset::ChunkHeader) + sizeof(Dataset::FrameHeader) + COLS * ROWS * sizeof(float);
+  for (size_t size = last_frame_end - last_frame_size; size < last_frame_end; size += 7)
+  {
+    test::writeFile(file.path(), content.substr(0, size));
+    DatasetReader reader;
+    ASSERT_TRUE(reader.open(file.path()));
+    expectFrames(reader, 2);
+  }
+}
+
+TEST(DatasetIO, corruptHeader)
+{
+  test::TempFile file;
+  const std::string content = writeDataset(file);
+
+  DatasetReader reader;
+  test::writeFile(file.path(), content.substr(0, sizeof(Dataset::FileHeader) - 1));
+  EXPECT_FALSE(reader.open(file.path()));
+
+  std::string corrupt = content;
+  corrupt[0] = 'X';
+  test::writeFile(file.path(), corrupt);
+  EXPECT_FALSE(reader.open(file.path()));
+
+  corrupt = content;
+  test::patch(corrupt, offsetof(Dataset::FileHeader, version_), Dataset::VERSION + 1);
+  test::writeFile(file.path(), corrupt);
+  EXPECT_FALSE(reader.open(file.path()));
+}
+
+TEST(DatasetIO, corruptChunks)
+{
+  test::TempFile file;
+  const std::string content = writeDataset(file);
+
+  // A sensor out of range stops the reading at that chunk: nothing after it is trusted
+  std::string corrupt = content;
+  corrupt[sizeof(Dataset::FileHeader) + sizeof(Dataset::ChunkHeader)] = static_cast<char>(200);
+  test::writeFile(file.path(), corrupt);
+  DatasetReader reader;
+  ASSERT_TRUE(reader.open(file.path()));
+  EXPECT_EQ(0u, reader.size());
+
+  // Chunk size beyond the end of the file, then sizes whose sums overflow
+  const size_t frame = firstFrameOffset();
+  corrupt = content;
+  test::patch(corrupt, frame + offsetof(Dataset::ChunkHeader, size_), boost::uint64_t(-1));
+  test::writeFile(file.path(), corrupt);
+  ASSERT_TRUE(reader.open(file.path()));
+  EXPECT_EQ(0u, reader.size());
+
+  corrupt = content;
+  const size_t frame_header = frame + sizeof(Dataset::ChunkHeader);
+  test::patch(corrupt, frame_header + offsetof(Dataset::FrameHeader, depth_size_), boost::uint64_t(16));
+  test::patch(corrupt, frame_header + offsetof(Dataset::FrameHeader, image_size_), boost::uint64_t(-8));
+  test::writeFile(file.path(), corrupt);
+  ASSERT_TRUE(reader.open(file.path()));
+  EXPECT_EQ(0u, reader.size());
+
+  // Depth sizes that do not match the depth data: the frame is listed, its depth is not read
+  corrupt = content;
+  test::patch(corrupt, frame_header + offsetof(Dataset::FrameHeader, depth_rows_), boost::uint32_t(-1));
+  test::writeFile(file.path(), corrupt);
+  ASSERT_TRUE(reader.open(file.path()));
+  ASSERT_EQ(3u, reader.size());
+  cv::Mat depth;
+  EXPECT_FALSE(reader.readDepth(0, depth));
+  EXPECT_TRUE(reader.readDepth(1, depth));
+}
+
+TEST(DatasetIO, corruptIndex)
+{
+  test::TempFile file;
+  const std::string content = writeDataset(file);
+
+  // An index pointing out of the file falls back to scanning
+  std::string corrupt = content;
+  test::patch(corrupt, content.size() - sizeof(Dataset::FileFooter) - sizeof(boost::uint64_t), boost::uint64_t(-1));
+  test::writeFile(file.path(), corrupt);
+  DatasetReader reader;
+  ASSERT_TRUE(reader.open(file.path()));
+  expectFrames(reader, 3);
+
+  corrupt = content;
+  test::patch(corrupt, content.size() - sizeof(Dataset::FileFooter), boost::uint64_t(-1));
+  test::writeFile(file.path(), corrupt);
+  ASSERT_TRUE(reader.open(file.path()));
+  expectFrames(reader, 3);
+}
+
+int main(int argc,
+         char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,214 @@
+#include <cstddef>
+#include <gtest/gtest.h>
+
+#include <rgbd_calibration/model_file.h>
+#include <rgbd_calibration/undistortion_kernel.h>
+
+#include "test_utils.h"
+
+using namespace calibration;
+
+namespace
+{
+
+const int COLS = 64;
+const int ROWS = 48;
+
+// Writes the test models to file and returns the content of the file.
+std::string
+writeModelFile(const test::TempFile & file,
+               bool write_kernel = true)
+{
+  LocalModel::Ptr local_model;
+  GlobalModel::Ptr global_model;
+  test::createModels(COLS, ROWS, local_model, global_model);
+  EXPECT_TRUE(ModelFile::write(file.path(), local_model, global_model, COLS, ROWS, write_kernel));
+  return test::readFile(file.path());
+}
+
+// Offset of the kernel header in a model file.
+size_t
+kernelOffset(const std::string & content)
+{
+  ModelFile::FileHeader header;
+  std::memcpy(&header, content.data(), sizeof(header));
+  return header.kernel_offset_;
+}
+
+} /* namespace */
+
+TEST(ModelFile, roundTrip)
+{
+  test::TempFile file;
+  writeModelFile(file);
+
+  LocalModel::Ptr local_model;
+  GlobalModel::Ptr global_model;
+  test::createModels(COLS, ROWS, local_model, global_model);
+
+  ModelFile model_file;
+  ASSERT_TRUE(model_file.open(file.path()));
+  EXPECT_EQ(COLS, static_cast<int>(model_file.header().cols_));
+  EXPECT_EQ(ROWS, static_cast<int>(model_file.header().rows_));
+  ASSERT_TRUE(model_file.hasKernel());
+
+  const LocalModel::Data::Ptr local_matrix = model_file.localMatrix();
+  ASSERT_EQ(local_model->matrix()->size(), local_matrix->size());
+  for (Size1 y = 0; y < local_matrix->size().y(); ++y)
+    for (Size1 x = 0; x < local_matrix->size().x(); ++x)
+      for (int k = 0; k < MathTraits<LocalPolynomial>::Size; ++k)
+        EXPECT_EQ(local_model->matrix()->at(x, y)[k], local_matrix->at(x, y)[k]);
+
+  const GlobalModel::Data::Ptr global_matrix = model_file.globalMatrix();
+  ASSERT_EQ(global_model->matrix()->size(), global_matrix->size());
+  for (Size1 y = 0; y < global_matrix->size().y(); ++y)
+    for (Size1 x = 0; x < global_matrix->size().x(); ++x)
+      for (int k = 0; k < MathTraits<GlobalPolynomial>::Size; ++k)
+        EXPECT_EQ(global_model->matrix()->at(x, y)[k], global_matrix->at(x, y)[k]);
+
+  // The baked planes are those of a kernel built from the same models
+  UndistortionKernel kernel;
+  kernel.build(local_model, global_model, COLS, ROWS);
+  for (int k = 0; k < UndistortionKernel::LOCAL_SIZE; ++k)
+    EXPECT_EQ(0, std::memcmp(kernel.localPlane(k), model_file.localPlane(k), COLS * ROWS * sizeof(float)));
+  for (int k = 0; k < UndistortionKernel::GLOBAL_SIZE; ++k)
+    EXPECT_EQ(0, std::memcmp(kernel.globalPlane(k), model_file.globalPlane(k), COLS * ROWS * sizeof(float)));
+}
+
+TEST(ModelFile, withoutKernel)
+{
+  test::TempFile file;
+  writeModelFile(file, false);
+
+  ModelFile model_file;
+  ASSERT_TRUE(model_file.open(file.path()));
+  EXPECT_FALSE(model_file.hasKernel());
+}
+
+TEST(ModelFile, missingFile)
+{
+  test::TempFile file;
+  ModelFile model_file;
+  EXPECT_FALSE(model_file.open(file.path()));
+}
+
+TEST(ModelFile, truncated)
+{
+  test::TempFile file;
+  const std::string content = writeModelFile(file);
+
+  const size_t sizes[] = {0, sizeof(ModelFile::FileHeader) - 1, sizeof(ModelFile::FileHeader), kernelOffset(content),
+                          kernelOffset(content) + sizeof(ModelFile::KernelHeader), content.size() / 2, content.size() - 1};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+  {
+    test::writeFile(file.path(), content.substr(0, sizes[i]));
+    ModelFile model_file;
+    EXPECT_FALSE(model_file.open(file.path())) << "Truncated at " << sizes[i] << " of " << content.size() << " bytes";
+  }
+}
+
+TEST(ModelFile, corruptHeader)
+{
+  test::TempFile file;
+  const std::string content = writeModelFile(file);
+
+  std::string corrupt = content;
+  corrupt[0] = 'X';
+  test::writeFile(file.path(), corrupt);
+  ModelFile model_file;
+  EXPECT_FALSE(model_file.open(file.path()));
+
+  corrupt = content;
+  test::patch(corrupt, offsetof(ModelFile::FileHeader, version_), ModelFile::VERSION + 1);
+  test::writeFile(file.path(), corrupt);
+  EXPECT_FALSE(model_file.open(file.path()));
+
+  corrupt = content;
+  test::patch(corrupt, offsetof(ModelFile::FileHeader, local_degree_), boost::uint32_t(MathTraits<LocalPolynomial>::Degree + 1));
+  test::writeFile(file.path(), corrupt);
+  EXPECT_FALSE(model_file.open(file.path()));
+
+  corrupt = content;
+  test::patch(corrupt, offsetof(ModelFile::FileHeader, kernel_offset_), boost::uint64_t(-8));
+  test::writeFile(file.path(), corrupt);
+  EXPECT_FALSE(model_file.open(file.path()));
+
+  corrupt = content;
+  test::patch(corrupt, offsetof(ModelFile::FileHeader, local_offset_), boost::uint64_t(content.size()));
+  test::writeFile(file.path(), corrupt);
+  EXPECT_FALSE(model_file.open(file.path()));
+}
+
+TEST(ModelFile, corruptMatrixHeader)
+{
+  test::TempFile file;
+  const std::string content = writeModelFile(file);
+
+  ModelFile::FileHeader header;
+  std::memcpy(&header, content.data(), sizeof(header));
+
+  // Sizes whose products overflow
+  std::string corrupt = content;
+  test::patch(corrupt, header.local_offset_ + offsetof(ModelFile::MatrixHeader, matrix_cols_), boost::uint32_t(-1));
+  test::patch(corrupt, header.local_offset_ + offsetof(ModelFile::MatrixHeader, matrix_rows_), boost::uint32_t(-1));
+  test::writeFile(file.path(), corrupt);
+  ModelFile model_file;
+  EXPECT_FALSE(model_file.open(file.path()));
+
+  corrupt = content;
+  test::patch(corrupt, header.global_offset_ + offsetof(ModelFile::MatrixHeader, matrix_cols_), boost::uint32_t(0));
+  test::writeFile(file.path(), corrupt);
+  EXPECT_FALSE(model_file.open(file.path()));
+
+  corrupt = content;
+  test::patch(corrupt, header.global_offset_ + offsetof(ModelFile::MatrixHeader, data_offset_), boost::uint64_t(-8));
+  test::writeFile(file.path(), corrupt);
+  EXPECT_FALSE(model_file.open(file.path()));
+}
+
+TEST(ModelFile, corruptKernelHeader)
+{
+  test::TempFile file;
+  const std::string content = writeModelFile(file);
+  const size_t offset = kernelOffset(content);
+
+  // Plane counts other than the ones of UndistortionKernel, including none at all
+  std::string corrupt = content;
+  test::patch(corrupt, offset + offsetof(ModelFile::KernelHeader, local_size_), boost::uint32_t(UndistortionKernel::LOCAL_SIZE - 1));
+  test::writeFile(file.path(), corrupt);
+  ModelFile model_file;
+  EXPECT_FALSE(model_file.open(file.path()));
+
+  corrupt = content;
+  test::patch(corrupt, offset + offsetof(ModelFile::KernelHeader, local_size_), boost::uint32_t(0));
+  test::patch(corrupt, offset + offsetof(ModelFile::KernelHeader, global_size_), boost::uint32_t(0));
+  test::writeFile(file.path(), corrupt);
+  EXPECT_FALSE(model_file.open(file.path()));
+
+  corrupt = content;
+  test::patch(corrupt, offset + offsetof(ModelFile::KernelHeader, global_size_), boost::uint32_t(-1));
+  test::writeFile(file.path(), corrupt);
+  EXPECT_FALSE(model_file.open(file.path()));
+
+  corrupt = content;
+  test::patch(corrupt, offset + offsetof(ModelFile::KernelHeader, plane_stride_), boost::uint64_t(-ModelFile::ALIGNMENT));
+  test::writeFile(file.path(), corrupt);
+  EXPECT_FALSE(model_file.open(file.path()));
+
+  corrupt = content;
+  test::patch(corrupt, offset + offsetof(ModelFile::KernelHeader, plane_stride_), boost::uint64_t(0));
+  test::writeFile(file.path(), corrupt);
+  EXPECT_FALSE(model_file.open(file.path()));
+
+  corrupt = content;
+  test::patch(corrupt, offset + offsetof(ModelFile::KernelHeader, data_offset_), boost::uint64_t(-ModelFile::ALIGNMENT));
+  test::writeFile(file.path(), corrupt);
+  EXPECT_FALSE(model_file.open(file.path()));
+}
+
+int main(int argc,
+         char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,171 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <gtest/gtest.h>
+
+#include <pcl/common/point_tests.h>
+#include <boost/make_shared.hpp>
+#include <sensor_msgs/CameraInfo.h>
+
+#include <rgbd_calibration/ray_table.h>
+
+using namespace calibration;
+
+namespace
+{
+
+const int COLS = 64;
+const int ROWS = 48;
+const double FX = 57.5;
+const double FY = 58.0;
+const double CX = 31.5;
+const double CY = 23.5;
+
+// Pinhole camera without distortion: the rays are known in closed form.
+KinectDepthCameraModel::ConstPtr
+createCameraModel()
+{
+  sensor_msgs::CameraInfo camera_info;
+  camera_info.width = COLS;
+  camera_info.height = ROWS;
+  camera_info.distortion_model = "plumb_bob";
+  camera_info.D.assign(5, 0.0);
+
+  const double K[9] = {FX, 0.0, CX, 0.0, FY, CY, 0.0, 0.0, 1.0};
+  const double R[9] = {1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 1.0};
+  const double P[12] = {FX, 0.0, CX, 0.0, 0.0, FY, CY, 0.0, 0.0, 0.0, 1.0, 0.0};
+  std::copy(K, K + 9, camera_info.K.begin());
+  std::copy(R, R + 9, camera_info.R.begin());
+  std::copy(P, P + 12, camera_info.P.begin());
+
+  return boost::make_shared<KinectDepthCameraModel>(camera_info);
+}
+
+} /* namespace */
+
+TEST(RayTable, rays)
+{
+  RayTable table;
+  ASSERT_TRUE(table.update(*createCameraModel(), COLS, ROWS));
+  EXPECT_EQ(COLS, table.cols());
+  EXPECT_EQ(ROWS, table.rows());
+  ASSERT_EQ(static_cast<size_t>(COLS * ROWS), table.x().size());
+  ASSERT_EQ(static_cast<size_t>(COLS * ROWS), table.y().size());
+
+  for (int j = 0; j < ROWS; ++j)
+  {
+    for (int i = 0; i < COLS; ++i)
+    {
+      EXPECT_NEAR((i - CX) / FX, table.x()[i + j * COLS], 1e-6);
+      EXPECT_NEAR((j - CY) / FY, table.y()[i + j * COLS], 1e-6);
+    }
+  }
+}
+
+TEST(RayTable, delta)
+{
+  const double delta[4] = {1.1, 0.9, 2.0, -1.0};
+
+  RayTable table;
+  ASSERT_TRUE(table.update(*createCameraModel(), COLS, ROWS, delta));
+
+  for (int j = 0; j < ROWS; ++j)
+  {
+    for (int i = 0; i < COLS; ++i)
+    {
+      EXPECT_NEAR((i - (CX + delta[2])) / (FX * delta[0]), table.x()[i + j * COLS], 1e-6);
+      EXPECT_NEAR((j - (CY + delta[3])) / (FY * delta[1]), table.y()[i + j * COLS], 1e-6);
+    }
+  }
+}
+
+TEST(RayTable, updateOnlyOnChange)
+{
+  const KinectDepthCameraModel::ConstPtr camera_model = createCameraModel();
+  const double delta[4] = {1.0, 1.0, 0.5, 0.0};
+
+  RayTable table;
+  EXPECT_TRUE(table.update(*camera_model, COLS, ROWS));
+  EXPECT_FALSE(table.update(*camera_model, COLS, ROWS));
+  EXPECT_TRUE(table.update(*camera_model, COLS, ROWS, delta));
+  EXPECT_FALSE(table.update(*camera_model, COLS, ROWS, delta));
+  EXPECT_TRUE(table.update(*camera_model, COLS / 2, ROWS / 2, delta));
+  EXPECT_EQ(COLS / 2, table.cols());
+  EXPECT_EQ(static_cast<size_t>(COLS / 2 * ROWS / 2), table.x().size());
+}
+
+TEST(RayTable, toCloud)
+{
+  RayTable table;
+  table.update(*createCameraModel(), COLS, ROWS);
+
+  cv::Mat depth(ROWS, COLS, CV_16UC1);
+  for (int j = 0; j < ROWS; ++j)
+    for (int i = 0; i < COLS; ++i)
+      depth.at<uint16_t>(j, i) = (i + j) % 7 == 0 ? 0 : 500 + 10 * i + j;
+
+  PCLCloud3 cloud;
+  table.toCloud(depth, cloud);
+  ASSERT_EQ(COLS, static_cast<int>(cloud.width));
+  ASSERT_EQ(ROWS, static_cast<int>(cloud.height));
+  EXPECT_FALSE(cloud.is_dense);
+
+  for (int j = 0; j < ROWS; ++j)
+  {
+    for (int i = 0; i < COLS; ++i)
+    {
+      const PCLPoint3 & p = cloud.at(i, j);
+      if (depth.at<uint16_t>(j, i) == 0)
+      {
+        EXPECT_FALSE(pcl::isFinite(p));
+        continue;
+      }
+      const float z = depth.at<uint16_t>(j, i) * 0.001f;
+      EXPECT_FLOAT_EQ(z, p.z);
+      EXPECT_FLOAT_EQ(z * table.x()[i + j * COLS], p.x);
+      EXPECT_FLOAT_EQ(z * table.y()[i + j * COLS], p.y);
+    }
+  }
+
+  // Meters, with non-positive and NaN depths
+  cv::Mat depth_m;
+  depth.convertTo(depth_m, CV_32FC1, 0.001);
+  depth_m.at<float>(0, 1) = -1.0f;
+  depth_m.at<float>(0, 2) = std::numeric_limits<float>::quiet_NaN();
+  PCLCloud3 cloud_m;
+  table.toCloud(depth_m, cloud_m);
+  EXPECT_FALSE(pcl::isFinite(cloud_m.at(1, 0)));
+  EXPECT_FALSE(pcl::isFinite(cloud_m.at(2, 0)));
+  EXPECT_FLOAT_EQ(cloud.at(3, 0).x, cloud_m.at(3, 0).x);
+  EXPECT_FLOAT_EQ(cloud.at(3, 0).z, cloud_m.at(3, 0).z);
+}
+
+TEST(RayTable, reproject)
+{
+  RayTable table;
+  table.update(*createCameraModel(), COLS, ROWS);
+
+  cv::Mat depth(ROWS, COLS, CV_32FC1, cv::Scalar(1.0));
+  PCLCloud3 cloud;
+  table.toCloud(depth, cloud);
+
+  for (size_t i = 0; i < cloud.points.size(); ++i)
+    cloud.points[i].z = 2.0f;
+
+  table.reproject(cloud);
+  for (int j = 0; j < ROWS; ++j)
+  {
+    for (int i = 0; i < COLS; ++i)
+    {
+      EXPECT_FLOAT_EQ(2.0f * table.x()[i + j * COLS], cloud.at(i, j).x);
+      EXPECT_FLOAT_EQ(2.0f * table.y()[i + j * COLS], cloud.at(i, j).y);
+    }
+  }
+}
+
+int main(int argc,
+         char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,110 @@
+#ifndef RGBD_CALIBRATION_TEST_UTILS_H_
+#define RGBD_CALIBRATION_TEST_UTILS_H_
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+#include <boost/filesystem.hpp>
+#include <boost/make_shared.hpp>
+
+#include <rgbd_calibration/globals.h>
+
+namespace calibration
+{
+namespace test
+{
+
+// Name of a file that does not exist yet, removed when the object is destroyed.
+class TempFile
+{
+public:
+
+  TempFile()
+    : path_((boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("rgbd_calibration_%%%%-%%%%-%%%%")).string())
+  {
+    // Do nothing
+  }
+
+  ~TempFile()
+  {
+    boost::system::error_code error;
+    boost::filesystem::remove(path_, error);
+  }
+
+  inline const std::string &
+  path() const
+  {
+    return path_;
+  }
+
+private:
+
+  std::string path_;
+
+};
+
+inline std::string
+readFile(const std::string & file_name)
+{
+  std::ifstream file(file_name.c_str(), std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+inline void
+writeFile(const std::string & file_name,
+          const std::string & content)
+{
+  std::ofstream file(file_name.c_str(), std::ios::binary | std::ios::trunc);
+  file.write(content.data(), content.size());
+}
+
+// Overwrites sizeof(T) bytes of content at offset with value.
+template <typename T>
+  inline void
+  patch(std::string & content,
+        size_t offset,
+        const T & value)
+  {
+    std::memcpy(&content[offset], &value, sizeof(T));
+  }
+
+// Local and global models of a cols x rows sensor whose polynomials change from node to node.
+inline void
+createModels(int cols,
+             int rows,
+             LocalModel::Ptr & local_model,
+             GlobalModel::Ptr & global_model)
+{
+  local_model = boost::make_shared<LocalModel>(Size2(cols, rows));
+  LocalModel::Data::Ptr local_matrix = local_model->createMatrix(Size2(cols / 4, rows / 4),
+                                                                 LocalPolynomial::IdentityCoefficients());
+  for (Size1 y = 0; y < local_matrix->size().y(); ++y)
+  {
+    for (Size1 x = 0; x < local_matrix->size().x(); ++x)
+    {
+      local_matrix->at(x, y)[0] = 0.01 * x - 0.005 * y;
+      local_matrix->at(x, y)[1] = 1.0 + 0.002 * (x + y);
+      local_matrix->at(x, y)[2] = 0.001 * (x - y);
+    }
+  }
+  local_model->setMatrix(local_matrix);
+
+  global_model = boost::make_shared<GlobalModel>(Size2(cols, rows));
+  GlobalModel::Data::Ptr global_matrix = boost::make_shared<GlobalModel::Data>(Size2(2, 2),
+                                                                               GlobalPolynomial::IdentityCoefficients());
+  for (Size1 y = 0; y < 2; ++y)
+  {
+    for (Size1 x = 0; x < 2; ++x)
+    {
+      global_matrix->at(x, y)[0] = 1.0 + 0.01 * (x + 2 * y);
+      global_matrix->at(x, y)[1] = 0.002 * (x - y);
+    }
+  }
+  global_model->setMatrix(global_matrix);
+}
+
+} /* namespace test */
+} /* namespace calibration */
+#endif /* RGBD_CALIBRATION_TEST_UTILS_H_ */
@@ -0,0 +1,199 @@
+#include <cmath>
+#include <limits>
+#include <gtest/gtest.h>
+
+#include <rgbd_calibration/undistortion_kernel.h>
+
+#include "test_utils.h"
+
+using namespace calibration;
+
+namespace
+{
+
+// Depths from 0.5 to 4.5 meters, changing along both axes.
+cv::Mat
+createDepth(int cols,
+            int rows)
+{
+  cv::Mat depth(rows, cols, CV_32FC1);
+  for (int j = 0; j < rows; ++j)
+    for (int i = 0; i < cols; ++i)
+      depth.at<float>(j, i) = 0.5f + 4.0f * ((i * 7 + j * 13) % 101) / 100.0f;
+  return depth;
+}
+
+// Undistortion of a pixel with the models, as UndistortionModel does it.
+Scalar
+undistort(const LocalModel & local_model,
+          const GlobalModel & global_model,
+          int x,
+          int y,
+          Scalar z)
+{
+  local_model.undistort(x, y, z);
+  global_model.undistort(x, y, z);
+  return z;
+}
+
+void
+expectMatchesModels(int cols,
+                    int rows,
+                    const std::string & profile)
+{
+  LocalModel::Ptr local_model;
+  GlobalModel::Ptr global_model;
+  test::createModels(cols, rows, local_model, global_model);
+
+  UndistortionKernel kernel;
+  kernel.build(local_model, global_model, cols, rows);
+  EXPECT_EQ(profile, kernel.profile());
+
+  const cv::Mat depth = createDepth(cols, rows);
+  cv::Mat und_depth;
+  kernel.apply(depth, und_depth);
+  ASSERT_EQ(CV_32FC1, und_depth.type());
+
+  for (int j = 0; j < rows; ++j)
+  {
+    for (int i = 0; i < cols; ++i)
+    {
+      const Scalar expected = undistort(*local_model, *global_model, i, j, depth.at<float>(j, i));
+      ASSERT_NEAR(expected, und_depth.at<float>(j, i), 1e-4 * expected) << "Pixel (" << i << ", " << j << ")";
+    }
+  }
+}
+
+} /* namespace */
+
+TEST(UndistortionKernel, matchesModels)
+{
+  expectMatchesModels(64, 48, "generic");
+}
+
+TEST(UndistortionKernel, matchesModelsFixedSize)
+{
+  expectMatchesModels(320, 240, "pepper");
+}
+
+TEST(UndistortionKernel, withoutGlobalModel)
+{
+  LocalModel::Ptr local_model;
+  GlobalModel::Ptr global_model;
+  test::createModels(64, 48, local_model, global_model);
+
+  UndistortionKernel kernel;
+  kernel.build(local_model, GlobalModel::ConstPtr(), 64, 48);
+
+  const cv::Mat depth = createDepth(64, 48);
+  cv::Mat und_depth;
+  kernel.apply(depth, und_depth);
+
+  for (int j = 0; j < depth.rows; ++j)
+  {
+    for (int i = 0; i < depth.cols; ++i)
+    {
+      Scalar expected = depth.at<float>(j, i);
+      local_model->undistort(i, j, expected);
+      ASSERT_NEAR(expected, und_depth.at<float>(j, i), 1e-4 * expected);
+    }
+  }
+}
+
+TEST(UndistortionKernel, invalidDepths)
+{
+  LocalModel::Ptr local_model;
+  GlobalModel::Ptr global_model;
+  test::createModels(64, 48, local_model, global_model);
+
+  UndistortionKernel kernel;
+  kernel.build(local_model, global_model, 64, 48);
+
+  cv::Mat depth = createDepth(64, 48);
+  depth.at<float>(0, 0) = 0.0f;
+  depth.at<float>(1, 2) = -1.0f;
+  depth.at<float>(3, 4) = std::numeric_limits<float>::quiet_NaN();
+
+  // In place
+  kernel.apply(depth, depth);
+  EXPECT_EQ(0.0f, depth.at<float>(0, 0));
+  EXPECT_EQ(-1.0f, depth.at<float>(1, 2));
+  EXPECT_TRUE(std::isnan(depth.at<float>(3, 4)));
+}
+
+TEST(UndistortionKernel, millimeters)
+{
+  LocalModel::Ptr local_model;
+  GlobalModel::Ptr global_model;
+  test::createModels(64, 48, local_model, global_model);
+
+  UndistortionKernel kernel;
+  kernel.build(local_model, global_model, 64, 48);
+
+  cv::Mat depth;
+  createDepth(64, 48).convertTo(depth, CV_16UC1, 1000.0);
+  depth.at<uint16_t>(0, 0) = 0;
+
+  cv::Mat und_depth;
+  kernel.apply(depth, und_depth);
+  ASSERT_EQ(CV_16UC1, und_depth.type());
+  EXPECT_EQ(0, und_depth.at<uint16_t>(0, 0));
+
+  for (int j = 0; j < depth.rows; ++j)
+  {
+    for (int i = 0; i < depth.cols; ++i)
+    {
+      if (depth.at<uint16_t>(j, i) == 0)
+        continue;
+      const Scalar expected = undistort(*local_model, *global_model, i, j, depth.at<uint16_t>(j, i) * 0.001);
+      ASSERT_NEAR(expected * 1000.0, und_depth.at<uint16_t>(j, i), 1.0);
+    }
+  }
+}
+
+TEST(UndistortionKernel, loadMatchesBuild)
+{
+  LocalModel::Ptr local_model;
+  GlobalModel::Ptr global_model;
+  test::createModels(64, 48, local_model, global_model);
+
+  test::TempFile file;
+  ASSERT_TRUE(ModelFile::write(file.path(), local_model, global_model, 64, 48));
+  ModelFile::Ptr model_file = boost::make_shared<ModelFile>();
+  ASSERT_TRUE(model_file->open(file.path()));
+
+  UndistortionKernel built_kernel;
+  built_kernel.build(local_model, global_model, 64, 48);
+  UndistortionKernel loaded_kernel;
+  ASSERT_TRUE(loaded_kernel.load(model_file));
+  EXPECT_EQ(64, loaded_kernel.cols());
+  EXPECT_EQ(48, loaded_kernel.rows());
+
+  const cv::Mat depth = createDepth(64, 48);
+  cv::Mat built_und_depth, loaded_und_depth;
+  built_kernel.apply(depth, built_und_depth);
+  loaded_kernel.apply(depth, loaded_und_depth);
+  EXPECT_EQ(0, std::memcmp(built_und_depth.data, loaded_und_depth.data, depth.total() * sizeof(float)));
+}
+
+TEST(UndistortionKernel, loadWithoutKernel)
+{
+  LocalModel::Ptr local_model;
+  GlobalModel::Ptr global_model;
+  test::createModels(64, 48, local_model, global_model);
+
+  test::TempFile file;
+  ASSERT_TRUE(ModelFile::write(file.path(), local_model, global_model, 64, 48, false));
+  ModelFile::Ptr model_file = boost::make_shared<ModelFile>();
+  ASSERT_TRUE(model_file->open(file.path()));
+
+  UndistortionKernel kernel;
+  EXPECT_FALSE(kernel.load(model_file));
+}
+
+int main(int argc,
+         char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}